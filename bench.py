@@ -0,0 +1,207 @@
+#!/usr/bin/env python3
+"""Scaling benchmark for lame_pthread.
+
+Runs the encoder over a fixed corpus of WAV files at a sweep of thread counts, repeats every configuration and
+reports the median wall time with a distribution-free confidence interval, speedup and parallel efficiency. The
+MP3 files of every run are hashed and must be byte-identical to those of the first run. Results are written as
+CSV and JSON; with --compare, the medians are checked against an earlier JSON result to catch regressions.
+
+   python3 bench.py CORPUS [-b ./lame_pthread] [-t 1,2,4,8] [-r 5] [--csv FILE] [--json FILE] [--compare FILE]
+"""
+
+import argparse
+import hashlib
+import json
+import math
+import os
+import platform
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def default_thread_counts():
+   """1..2x cores: powers of two plus the core count and twice the core count."""
+   cores = os.cpu_count() or 1
+   counts = set([cores, 2 * cores])
+   n = 1
+   while n <= 2 * cores:
+      counts.add(n)
+      n *= 2
+   return sorted(counts)
+
+
+def hash_outputs(corpus):
+   """Returns {file name: sha256} of all MP3 files in the corpus directory."""
+   hashes = {}
+   for name in sorted(os.listdir(corpus)):
+      if name.lower().endswith(".mp3"):
+         with open(os.path.join(corpus, name), "rb") as f:
+            hashes[name] = hashlib.sha256(f.read()).hexdigest()
+   return hashes
+
+
+def remove_outputs(corpus):
+   for name in os.listdir(corpus):
+      if name.lower().endswith(".mp3"):
+         os.remove(os.path.join(corpus, name))
+
+
+def run_once(binary, corpus, threads, extra_args, log):
+   """Runs the encoder once and returns (wall seconds, run report of the binary)."""
+   remove_outputs(corpus)
+   fd, report_file = tempfile.mkstemp(suffix=".json")
+   os.close(fd)
+   try:
+      cmd = [binary, corpus, "-n%d" % threads, "-j" + report_file] + extra_args
+      start = time.monotonic()
+      ret = subprocess.call(cmd, stdout=log, stderr=log)
+      wall = time.monotonic() - start
+      if ret != 0:
+         raise RuntimeError("%s exited with %d" % (" ".join(cmd), ret))
+      with open(report_file) as f:
+         return wall, json.load(f)
+   finally:
+      os.remove(report_file)
+
+
+def median(values):
+   s = sorted(values)
+   n = len(s)
+   return s[n // 2] if n % 2 else 0.5 * (s[n // 2 - 1] + s[n // 2])
+
+
+def median_ci(values, confidence=0.95):
+   """Distribution-free confidence interval of the median from order statistics (binomial with p = 0.5).
+
+   Returns (low, high, achieved confidence). With few repetitions the interval widens to [min, max] and the achieved
+   confidence drops below the requested one (e.g. 93.75% for 5 runs)."""
+   s = sorted(values)
+   n = len(s)
+   cdf = [0.0] * (n + 1) # cdf[k] = P(X < k) for X ~ Binomial(n, 0.5)
+   for k in range(1, n + 1):
+      cdf[k] = cdf[k - 1] + math.comb(n, k - 1) * 0.5 ** n
+   k = 1
+   while k + 1 <= n // 2 and 1.0 - 2.0 * cdf[k + 1] >= confidence:
+      k += 1
+   return s[k - 1], s[n - k], 1.0 - 2.0 * cdf[k]
+
+
+def compare(results, baseline_file, tolerance):
+   """Returns the thread counts whose median is more than tolerance slower than in the baseline."""
+   with open(baseline_file) as f:
+      baseline = dict((r["threads"], r) for r in json.load(f)["results"])
+   regressions = []
+   for r in results:
+      b = baseline.get(r["threads"])
+      if b is None:
+         continue
+      ratio = r["median_seconds"] / b["median_seconds"]
+      status = "REGRESSION" if ratio > 1.0 + tolerance else "ok"
+      print("  %3d threads: %.3fs vs %.3fs (%+.1f%%) %s" % (r["threads"], r["median_seconds"], b["median_seconds"],
+         100.0 * (ratio - 1.0), status))
+      if status != "ok":
+         regressions.append(r["threads"])
+   return regressions
+
+
+def main():
+   parser = argparse.ArgumentParser(description="Scaling benchmark for lame_pthread.")
+   parser.add_argument("corpus", help="directory with the WAV files (MP3 files in it are overwritten)")
+   parser.add_argument("-b", "--binary", default="./lame_pthread")
+   parser.add_argument("-t", "--threads", help="comma separated thread counts (default: 1..2x cores)")
+   parser.add_argument("-r", "--repeat", type=int, default=5, help="measured runs per thread count")
+   parser.add_argument("-w", "--warmup", type=int, default=1, help="unmeasured runs before the sweep")
+   parser.add_argument("-a", "--args", default="", help="extra arguments for the encoder, e.g. \"-p -sspt\"")
+   parser.add_argument("--csv", default="bench.csv")
+   parser.add_argument("--json", default="bench.json")
+   parser.add_argument("--compare", help="JSON result of an earlier run to check for regressions")
+   parser.add_argument("--tolerance", type=float, default=0.05, help="allowed slowdown for --compare")
+   parser.add_argument("--log", default="bench.log", help="output of the encoder runs")
+   opts = parser.parse_args()
+
+   threads = [int(t) for t in opts.threads.split(",")] if opts.threads else default_thread_counts()
+   extra_args = opts.args.split()
+   if opts.repeat < 1:
+      parser.error("--repeat must be at least 1")
+
+   with open(opts.log, "w") as log:
+      for i in range(opts.warmup):
+         run_once(opts.binary, opts.corpus, threads[0], extra_args, log)
+
+      reference = None
+      mismatches = []
+      results = []
+      for n in threads:
+         walls, reports = [], []
+         for i in range(opts.repeat):
+            wall, report = run_once(opts.binary, opts.corpus, n, extra_args, log)
+            hashes = hash_outputs(opts.corpus)
+            if reference is None:
+               reference = hashes
+            elif hashes != reference:
+               differing = sorted(k for k in set(hashes) | set(reference) if hashes.get(k) != reference.get(k))
+               mismatches.append((n, differing))
+               print("Output of %d threads differs: %s" % (n, ", ".join(differing[:5])))
+            walls.append(wall)
+            reports.append(report)
+         low, high, conf = median_ci(walls)
+         results.append({
+            "threads": n,
+            "runs": walls,
+            "median_seconds": median(walls),
+            "ci_low_seconds": low,
+            "ci_high_seconds": high,
+            "ci_confidence": conf,
+            "median_report_seconds": median([r["wall_seconds"] for r in reports]),
+            "files": reports[0]["files"],
+            "audio_seconds_per_second": median([r["audio_seconds_per_second"] for r in reports]),
+         })
+         print("%3d threads: median %.3fs [%.3f, %.3f]" % (n, median(walls), low, high))
+
+   # relative to the first thread count (normally 1)
+   base = results[0]
+   for r in results:
+      r["speedup"] = base["median_seconds"] / r["median_seconds"]
+      r["efficiency"] = r["speedup"] * base["threads"] / r["threads"]
+
+   print()
+   print("threads  median[s]   ci low   ci high  speedup  efficiency")
+   for r in results:
+      print("%7d %10.3f %8.3f %9.3f %8.2f %10.1f%%" % (r["threads"], r["median_seconds"], r["ci_low_seconds"],
+         r["ci_high_seconds"], r["speedup"], 100.0 * r["efficiency"]))
+
+   columns = ["threads", "median_seconds", "ci_low_seconds", "ci_high_seconds", "ci_confidence", "speedup",
+      "efficiency", "median_report_seconds", "audio_seconds_per_second", "files"]
+   with open(opts.csv, "w") as f:
+      f.write(",".join(columns) + "\n")
+      for r in results:
+         f.write(",".join(str(r[c]) for c in columns) + "\n")
+   with open(opts.json, "w") as f:
+      json.dump({
+         "binary": opts.binary,
+         "corpus": opts.corpus,
+         "args": extra_args,
+         "repeat": opts.repeat,
+         "cores": os.cpu_count(),
+         "host": platform.node(),
+         "date": time.strftime("%Y-%m-%dT%H:%M:%S"),
+         "outputs_identical": not mismatches,
+         "results": results,
+      }, f, indent=2)
+   print("Wrote %s and %s." % (opts.csv, opts.json))
+
+   failed = False
+   if mismatches:
+      print("FAIL: output differs between thread counts.")
+      failed = True
+   if opts.compare:
+      print("Comparison with %s:" % opts.compare)
+      if compare(results, opts.compare, opts.tolerance):
+         failed = True
+   return 1 if failed else 0
+
+
+if __name__ == "__main__":
+   sys.exit(main())
@@ -0,0 +1,140 @@
+#!/bin/bash
+# Output consistency check for lame_pthread.
+#
+# Encodes a synthetic corpus (wavgen, fixed seed) once with a reference configuration and then with other modes and
+# options, each into a separate output tree (--out). Options which must not change the MP3 data have to produce
+# byte-identical files. Two modes do change it: whole-file mode (-w) hands 16-bit samples to LAME, and segmented
+# encoding (-c) disables the bit reservoir, so their runs are compared with a single-threaded run of the same mode.
+# Reused encoders (-r) carry state from file to file, so they are only compared with a run in the same job order.
+# Pipe mode (PATH '-') converts the files one by one from standard input to standard output.
+#
+# With POOLCHECK (microbench/poolcheck.cpp), the corpus is also converted through the embedding API of
+# encoder_pool.h, with every kind of input and output, and compared with the reference.
+#
+#    ./check.sh [BINARY [WAVGEN [POOLCHECK]]]      (defaults ./lame_pthread and ./wavgen, see make check)
+
+BIN=${1:-./lame_pthread}
+WAVGEN=${2:-./wavgen}
+POOLCHECK=$3
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+CORPUS=$WORK/corpus
+FAILED=0
+
+# short files of all formats, a few of them malformed
+"$WAVGEN" "$CORPUS" -s7 -n40 -d2,1,20 > /dev/null || exit 1
+
+# writes "md5  path" of all MP3 files below $1, sorted by path
+hash_tree() {
+   (cd "$1" && find . -name '*.mp3' | sort | xargs -r md5sum)
+}
+
+# encode NAME [OPTIONS...]: converts the corpus into $WORK/NAME, the log goes to $WORK/NAME.log
+encode() {
+   local name=$1
+   shift
+   rm -rf "$WORK/$name"
+   "$BIN" "$CORPUS" --out "$WORK/$name" "$@" > "$WORK/$name.log" 2>&1
+}
+
+# compare REFERENCE NAME [OPTIONS...]: compares the outputs of run NAME with those of REFERENCE
+compare() {
+   local ref=$1 name=$2
+   shift 2
+   if [ ! -d "$WORK/$name" ] || ! diff <(hash_tree "$WORK/$ref") <(hash_tree "$WORK/$name") > "$WORK/$name.diff"; then
+      echo "FAIL $name ($*): $(grep -c '^>' "$WORK/$name.diff" 2>/dev/null) file(s) differ, log:"
+      tail -5 "$WORK/$name.log"
+      FAILED=1
+   else
+      echo "ok   $name ($*)"
+   fi
+}
+
+# check REFERENCE NAME [OPTIONS...]: encodes with OPTIONS and compares the outputs with those of REFERENCE
+check() {
+   local ref=$1 name=$2
+   shift 2
+   encode "$name" "$@"
+   compare "$ref" "$name" "$@"
+}
+
+# check_watch REFERENCE NAME [OPTIONS...]: copies the corpus into a watched directory and stops watching (SIGINT)
+# once all outputs exist, which converts what is still queued
+check_watch() {
+   local ref=$1 name=$2
+   shift 2
+   rm -rf "$WORK/$name" "$WORK/$name.in"
+   mkdir "$WORK/$name.in"
+   "$BIN" "$WORK/$name.in" --out "$WORK/$name" --watch "$@" > "$WORK/$name.log" 2>&1 &
+   local pid=$! expected i
+   expected=$(hash_tree "$WORK/$ref" | wc -l)
+   sleep 0.5
+   cp "$CORPUS"/*.wav "$WORK/$name.in/"
+   for i in $(seq 600); do
+      [ "$(find "$WORK/$name" -name '*.mp3' 2>/dev/null | wc -l)" -ge "$expected" ] && break
+      sleep 0.1
+   done
+   kill -INT $pid
+   wait $pid
+   compare "$ref" "$name" --watch "$@"
+}
+
+# check_pipe REFERENCE NAME: converts every file through a pipe (PATH '-') and compares the outputs with those of
+# REFERENCE. Inputs which REFERENCE rejected are left out, since a stream can't check the RIFF size against the file.
+check_pipe() {
+   local ref=$1 name=$2 f base
+   rm -rf "$WORK/$name"
+   mkdir "$WORK/$name"
+   : > "$WORK/$name.log"
+   for f in "$CORPUS"/*.wav; do
+      base=$(basename "$f" .wav)
+      [ -f "$WORK/$ref/$base.mp3" ] || continue
+      cat "$f" | "$BIN" - > "$WORK/$name/$base.mp3" 2>> "$WORK/$name.log" || rm -f "$WORK/$name/$base.mp3"
+   done
+   compare "$ref" "$name" -
+}
+
+encode ref -n1
+if [ "$(hash_tree "$WORK/ref" | wc -l)" -eq 0 ]; then
+   echo "FAIL reference run produced no MP3 files, log:"
+   tail -5 "$WORK/ref.log"
+   exit 1
+fi
+check ref threads -n3
+check ref auto
+check ref adaptive --adapt
+check ref pipelined -p -n2
+check ref pipelined-pools -p2,2 -n1
+check ref spt -sspt -n3
+check ref fifo -sfifo -n2
+check ref mmap -immap
+check ref uring -iuring -ouring -n3
+check ref uring-pipelined -iuring -ouring -p -n2
+check ref stdio -istdio -ostdio
+check ref sync -dgroup4
+check ref cache-miss --cache "$WORK/cache" -n2
+check ref cache-hit --cache "$WORK/cache" -n3
+check ref cache-fifo --cache "$WORK/cache" -sfifo --manifest "$WORK/manifest"
+check_watch ref watch --debounce 50 -n2
+check_pipe ref pipe
+if [ -n "$POOLCHECK" ]; then
+   "$POOLCHECK" "$CORPUS" "$WORK/pool" -n3 > "$WORK/pool.log" 2>&1
+   compare ref pool pool_check -n3
+fi
+
+encode whole-ref -w -n1
+check whole-ref whole-threads -w -n3
+check whole-ref whole-mmap -w -n2 -immap
+check whole-ref whole-uring -w -n2 -iuring -ouring
+
+encode seg-ref -c1 -n1
+check seg-ref seg-threads -c1 -n3
+check seg-ref seg-mmap -c1 -n2 -immap
+check seg-ref seg-uring -c1 -n2 -iuring -ouring
+check seg-ref seg-cache -c1 -n2 -immap --cache "$WORK/cache"
+
+encode reuse-ref -r -n1
+check reuse-ref reuse-again -r -n1 -immap
+
+[ $FAILED = 0 ] && echo "All outputs match."
+exit $FAILED
@@ -0,0 +1,463 @@
+/* Per-stage microbenchmarks (make microbench).
+ *
+ * Measures the parser (read_wave_header), the whole-file PCM reader (get_pcm_channels_from_wave) and the conversion
+ * kernels for every sample format and channel layout, encode_to_file on PCM already in memory and the output write
+ * path of every backend, each in isolation. Every benchmark runs once to warm up caches (page cache, branch
+ * predictors, allocator) and is then repeated for several rounds of at least MB_DEFAULT_SECONDS; the fastest round
+ * is reported, which is the least disturbed by other activity on the host.
+ *
+ *   ./lame_microbench [FILTER...] [-tSECONDS] [-dDIR]
+ *
+ * Only benchmarks whose name contains one of the FILTER strings are run. Test files are written to a temporary
+ * directory in DIR (default /tmp), which determines the file system the write benchmarks measure.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "lame_interface.h"
+#include "pcm_convert.h"
+
+using namespace std;
+
+#define MB_DEFAULT_SECONDS 0.2 // minimum duration of one round
+#define MB_ROUNDS 5
+#define MB_WAV_SAMPLES (1 << 20) // samples per channel of the files read by get_pcm_channels_from_wave
+#define MB_ENCODE_SAMPLES (1 << 18) // samples per channel encoded by encode_to_file (about 6s at 44.1 kHz)
+#define MB_WRITE_BYTES (8 << 20) // size of the files written by the output benchmarks
+#define MB_WRITE_CHUNK 4096 // bytes per output_write call (about 10 frames of 320 kbps)
+
+/* A single benchmark. run is timed, setup and teardown (optional) are not. */
+typedef struct {
+	string name;
+	void (*setup)(void *ctx);
+	void (*run)(void *ctx);
+	void (*teardown)(void *ctx);
+	void *ctx;
+	double dSamples; // samples (per channel) processed by one run, 0 if not applicable
+	double dBytes; // bytes processed by one run, 0 if not applicable
+} MICROBENCH;
+
+static double dMinSeconds = MB_DEFAULT_SECONDS;
+static string sDir;
+
+/////////////////////
+// test data
+/////////////////////
+
+/* deterministic pseudo-random noise, so that every run processes the same data */
+static unsigned int uSeed = 12345;
+static unsigned int next_random()
+{
+	uSeed = uSeed * 1664525u + 1013904223u;
+	return uSeed;
+}
+
+static void put16(unsigned char *p, unsigned int v) { p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF; }
+static void put32(unsigned char *p, unsigned int v) { put16(p, v & 0xFFFF); put16(p + 2, v >> 16); }
+
+/* Fills pData with numSamples frames of noise in the given format (float samples stay within [-1, 1]). */
+static void fill_pcm(unsigned char *pData, int iBits, bool bFloat, int iChannels, int numSamples)
+{
+	const int iBytes = iBits / 8;
+	for (int i = 0; i < numSamples * iChannels; i++) {
+		unsigned int r = next_random();
+		unsigned char *p = pData + (size_t)i * iBytes;
+		if (bFloat) {
+			float f = ((int)(r >> 8) - (1 << 23)) / (float)(1 << 23) * 0.9f;
+			memcpy(p, &f, 4);
+		} else {
+			for (int b = 0; b < iBytes; b++) p[b] = (r >> (8 * b)) & 0xFF;
+		}
+	}
+}
+
+/* Writes a WAV file. With bExtensible, a WAVE_FORMAT_EXTENSIBLE 'fmt ' chunk is written, with bListChunk a 'LIST'
+ * chunk of a few hundred bytes is put in front of 'data', as many tagging tools do.
+ */
+static string write_wav(const char *name, int iBits, bool bFloat, int iChannels, int numSamples, bool bExtensible,
+	bool bListChunk)
+{
+	const int iBlockAlign = iChannels * iBits / 8;
+	const unsigned int uDataSize = (unsigned int)numSamples * iBlockAlign;
+	const unsigned int uFmtSize = bExtensible ? WAVE_FORMAT_EXTENSIBLE_SIZE : 16;
+	const unsigned int uListSize = bListChunk ? 300 : 0;
+	vector<unsigned char> file(12 + 8 + uFmtSize + (bListChunk ? 8 + uListSize : 0) + 8 + uDataSize, 0);
+
+	unsigned char *p = &file[0];
+	memcpy(p, "RIFF", 4); put32(p + 4, (unsigned int)file.size() - 8); memcpy(p + 8, "WAVE", 4);
+	p += 12;
+	const unsigned short wTag = bFloat ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+	memcpy(p, "fmt ", 4); put32(p + 4, uFmtSize);
+	put16(p + 8, bExtensible ? WAVE_FORMAT_EXTENSIBLE : wTag);
+	put16(p + 10, iChannels);
+	put32(p + 12, 44100);
+	put32(p + 16, 44100 * iBlockAlign);
+	put16(p + 20, iBlockAlign);
+	put16(p + 22, iBits);
+	if (bExtensible) {
+		put16(p + 24, 22); // cbSize
+		put16(p + 26, iBits); // valid bits
+		put32(p + 28, iChannels == 2 ? 3 : 4); // channel mask
+		static const unsigned char guidTail[14] = { 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA,
+			0x00, 0x38, 0x9B, 0x71 };
+		put16(p + WAVE_FORMAT_SUBFORMAT_OFFSET, wTag);
+		memcpy(p + WAVE_FORMAT_SUBFORMAT_OFFSET + 2, guidTail, sizeof(guidTail));
+	}
+	p += 8 + uFmtSize;
+	if (bListChunk) {
+		memcpy(p, "LIST", 4); put32(p + 4, uListSize);
+		p += 8 + uListSize;
+	}
+	memcpy(p, "data", 4); put32(p + 4, uDataSize);
+	fill_pcm(p + 8, iBits, bFloat, iChannels, numSamples);
+
+	string sPath = sDir + "/" + name;
+	FILE *f = fopen(sPath.c_str(), "wb");
+	if (f == NULL || fwrite(&file[0], 1, file.size(), f) != file.size()) {
+		cerr << "FATAL: Unable to write " << sPath << endl;
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+	return sPath;
+}
+
+/////////////////////
+// read_wave_header
+/////////////////////
+
+typedef struct {
+	string sPath;
+	WAV_INPUT in;
+} HEADER_CTX;
+
+static void header_setup(void *ctx)
+{
+	HEADER_CTX *c = (HEADER_CTX*)ctx;
+	if (EXIT_SUCCESS != input_open(&c->in, c->sPath.c_str(), NULL)) {
+		cerr << "FATAL: Unable to open " << c->sPath << endl;
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void header_run(void *ctx)
+{
+	HEADER_CTX *c = (HEADER_CTX*)ctx;
+	FMT_DATA *hdr = NULL;
+	unsigned int iDataSize = 0;
+	int iDataOffset = 0;
+	if (EXIT_SUCCESS != read_wave_header(&c->in, hdr, iDataSize, iDataOffset)) exit(EXIT_FAILURE);
+	delete hdr;
+}
+
+static void header_teardown(void *ctx)
+{
+	input_close(&((HEADER_CTX*)ctx)->in);
+}
+
+/////////////////////
+// get_pcm_channels_from_wave
+/////////////////////
+
+typedef struct {
+	string sPath;
+	WAV_INPUT in;
+	FMT_DATA *hdr;
+	unsigned int iDataSize;
+	int iDataOffset;
+} PCM_CTX;
+
+static void pcm_setup(void *ctx)
+{
+	PCM_CTX *c = (PCM_CTX*)ctx;
+	c->hdr = NULL;
+	if (EXIT_SUCCESS != input_open(&c->in, c->sPath.c_str(), NULL) ||
+		EXIT_SUCCESS != read_wave_header(&c->in, c->hdr, c->iDataSize, c->iDataOffset)) {
+		cerr << "FATAL: Unable to open " << c->sPath << endl;
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void pcm_run(void *ctx)
+{
+	PCM_CTX *c = (PCM_CTX*)ctx;
+	short *leftPcm = NULL, *rightPcm = NULL;
+	get_pcm_channels_from_wave(&c->in, c->hdr, leftPcm, rightPcm, c->iDataSize, c->iDataOffset);
+	delete[] leftPcm;
+	delete[] rightPcm;
+}
+
+static void pcm_teardown(void *ctx)
+{
+	PCM_CTX *c = (PCM_CTX*)ctx;
+	input_close(&c->in);
+	delete c->hdr;
+}
+
+/////////////////////
+// conversion kernels (in memory, one block)
+/////////////////////
+
+typedef struct {
+	PCM_KERNEL kernel;
+	vector<unsigned char> raw;
+	vector<unsigned char> left, right;
+} CONVERT_CTX;
+
+static void convert_run(void *ctx)
+{
+	CONVERT_CTX *c = (CONVERT_CTX*)ctx;
+	c->kernel(&c->raw[0], &c->left[0], &c->right[0], PCM_BLOCK_SAMPLES);
+}
+
+/////////////////////
+// encode_to_file (PCM in memory)
+/////////////////////
+
+typedef struct {
+	FMT_DATA hdr;
+	vector<short> left, right;
+	unsigned int iDataSize;
+	string sOut;
+	WORKER_ARENA arena;
+	lame_global_flags *gfp;
+} ENCODE_CTX;
+
+static void encode_setup(void *ctx)
+{
+	ENCODE_CTX *c = (ENCODE_CTX*)ctx;
+	c->gfp = create_encoder(&c->hdr, c->iDataSize, false, NULL);
+	if (c->gfp == NULL) exit(EXIT_FAILURE);
+}
+
+static void encode_run(void *ctx)
+{
+	ENCODE_CTX *c = (ENCODE_CTX*)ctx;
+	if (EXIT_SUCCESS != encode_to_file(c->gfp, &c->hdr, &c->left[0], c->hdr.wChannels == 2 ? &c->right[0] : NULL,
+		c->iDataSize, c->sOut.c_str(), &c->arena, NULL, NULL)) exit(EXIT_FAILURE);
+}
+
+static void encode_teardown(void *ctx)
+{
+	ENCODE_CTX *c = (ENCODE_CTX*)ctx;
+	lame_close(c->gfp);
+}
+
+/////////////////////
+// output write path
+/////////////////////
+
+typedef struct {
+	OUTPUT_CFG cfg;
+	string sOut;
+	vector<unsigned char> data;
+} WRITE_CTX;
+
+static void write_run(void *ctx)
+{
+	WRITE_CTX *c = (WRITE_CTX*)ctx;
+	MP3_OUTPUT out;
+	if (EXIT_SUCCESS != output_open(&out, c->sOut.c_str(), &c->cfg, c->data.size())) exit(EXIT_FAILURE);
+	for (size_t uPos = 0; uPos < c->data.size(); uPos += MB_WRITE_CHUNK)
+		output_write(&out, &c->data[uPos], MB_WRITE_CHUNK);
+	if (EXIT_SUCCESS != output_close(&out)) exit(EXIT_FAILURE);
+}
+
+/////////////////////
+// runner
+/////////////////////
+
+/* times one round of at least dMinSeconds and returns the seconds per run */
+static double run_round(const MICROBENCH *b)
+{
+	double dTimed = 0.0, dStart = report_now();
+	long long llRuns = 0;
+	do {
+		if (b->setup != NULL) b->setup(b->ctx);
+		double t = report_now();
+		b->run(b->ctx);
+		dTimed += report_now() - t;
+		if (b->teardown != NULL) b->teardown(b->ctx);
+		llRuns++;
+	} while (report_now() - dStart < dMinSeconds);
+	return dTimed / llRuns;
+}
+
+static void run_benchmark(const MICROBENCH *b)
+{
+	// warm-up run, then keep the fastest round
+	if (b->setup != NULL) b->setup(b->ctx);
+	b->run(b->ctx);
+	if (b->teardown != NULL) b->teardown(b->ctx);
+	double dBest = 0.0;
+	for (int r = 0; r < MB_ROUNDS; r++) {
+		double d = run_round(b);
+		if (r == 0 || d < dBest) dBest = d;
+	}
+
+	printf("%-36s %12.0f", b->name.c_str(), dBest * 1e9);
+	if (b->dSamples > 0) printf(" %12.3f", dBest * 1e9 / b->dSamples); else printf(" %12s", "-");
+	if (b->dBytes > 0) printf(" %10.3f", b->dBytes / dBest / 1e9); else printf(" %10s", "-");
+	printf("\n");
+	fflush(stdout);
+}
+
+static bool selected(const string &name, const vector<string> &filters)
+{
+	if (filters.empty()) return true;
+	for (size_t i = 0; i < filters.size(); i++)
+		if (name.find(filters[i]) != string::npos) return true;
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	vector<string> filters;
+	string sParent = "/tmp";
+	for (int i = 1; i < argc; i++) {
+		if (0 == strncmp(argv[i], "-t", 2) && atof(&argv[i][2]) > 0)
+			dMinSeconds = atof(&argv[i][2]);
+		else if (0 == strncmp(argv[i], "-d", 2) && argv[i][2] != '\0')
+			sParent = &argv[i][2];
+		else if (argv[i][0] == '-') {
+			cerr << "Usage: " << argv[0] << " [FILTER...] [-tSECONDS] [-dDIR]" << endl;
+			return EXIT_FAILURE;
+		} else
+			filters.push_back(argv[i]);
+	}
+	string sTemplate = sParent + "/lame_microbench.XXXXXX";
+	vector<char> dirName(sTemplate.begin(), sTemplate.end());
+	dirName.push_back('\0');
+	if (mkdtemp(&dirName[0]) == NULL) {
+		cerr << "FATAL: Unable to create a temporary directory in " << sParent << endl;
+		return EXIT_FAILURE;
+	}
+	sDir = &dirName[0];
+
+	vector<MICROBENCH> benches;
+	vector<string> files; // removed at the end
+	static const struct { const char *name; int iBits; bool bFloat; } formats[] = {
+		{ "u8", 8, false }, { "s16", 16, false }, { "s24", 24, false }, { "s32", 32, false }, { "f32", 32, true }
+	};
+
+	// parser: plain PCM, WAVE_FORMAT_EXTENSIBLE and an extra chunk in front of 'data'
+	static const struct { const char *name; int iBits; bool bExtensible, bList; } headers[] = {
+		{ "pcm16", 16, false, false }, { "extensible24", 24, true, false }, { "pcm16+list", 16, false, true }
+	};
+	for (size_t h = 0; h < sizeof(headers) / sizeof(headers[0]); h++) {
+		MICROBENCH b;
+		b.name = string("read_wave_header/") + headers[h].name;
+		if (!selected(b.name, filters)) continue;
+		HEADER_CTX *c = new HEADER_CTX;
+		c->sPath = write_wav((string("header_") + headers[h].name + ".wav").c_str(), headers[h].iBits, false, 2,
+			1024, headers[h].bExtensible, headers[h].bList);
+		files.push_back(c->sPath);
+		b.setup = header_setup; b.run = header_run; b.teardown = header_teardown; b.ctx = c;
+		b.dSamples = 0; b.dBytes = 0;
+		benches.push_back(b);
+	}
+
+	// whole-file reader and conversion kernels for every format and channel layout
+	for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+		for (int iChannels = 1; iChannels <= 2; iChannels++) {
+			string sLayout = string(formats[f].name) + (iChannels == 2 ? "/stereo" : "/mono");
+			MICROBENCH b;
+			b.name = "get_pcm_channels_from_wave/" + sLayout;
+			if (selected(b.name, filters)) {
+				PCM_CTX *c = new PCM_CTX;
+				c->sPath = write_wav(("pcm_" + string(formats[f].name) + (iChannels == 2 ? "_2" : "_1") +
+					".wav").c_str(), formats[f].iBits, formats[f].bFloat, iChannels, MB_WAV_SAMPLES, false, false);
+				files.push_back(c->sPath);
+				b.setup = pcm_setup; b.run = pcm_run; b.teardown = pcm_teardown; b.ctx = c;
+				b.dSamples = MB_WAV_SAMPLES;
+				b.dBytes = (double)MB_WAV_SAMPLES * iChannels * formats[f].iBits / 8;
+				benches.push_back(b);
+			}
+
+			FMT_DATA hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.wFmtTag = formats[f].bFloat ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+			hdr.wChannels = iChannels;
+			hdr.dwSamplesPerSec = 44100;
+			hdr.wBitsPerSample = formats[f].iBits;
+			hdr.wBlockAlign = iChannels * formats[f].iBits / 8;
+			hdr.dwBytesPerSec = 44100 * hdr.wBlockAlign;
+			for (int isa = PCM_ISA_SCALAR; isa <= pcm_cpu_isa(); isa++) {
+				PCM_CONVERTER conv;
+				if (EXIT_SUCCESS != pcm_get_converter(&hdr, (PCM_ISA)isa, &conv) || conv.isa != isa) continue;
+				for (int k = 0; k < 2; k++) {
+					PCM_KERNEL kernel = k == 0 ? conv.toS16Planar : conv.convert;
+					if (kernel == NULL) continue;
+					MICROBENCH cb;
+					cb.name = string(k == 0 ? "convert_s16/" : "convert/") + sLayout + "/" + pcm_isa_name((PCM_ISA)isa);
+					if (!selected(cb.name, filters)) continue;
+					CONVERT_CTX *c = new CONVERT_CTX;
+					c->kernel = kernel;
+					c->raw.resize((size_t)PCM_BLOCK_SAMPLES * hdr.wBlockAlign);
+					fill_pcm(&c->raw[0], formats[f].iBits, formats[f].bFloat, iChannels, PCM_BLOCK_SAMPLES);
+					c->left.resize((size_t)PCM_BLOCK_SAMPLES * 8); // enough for interleaved float stereo
+					c->right.resize((size_t)PCM_BLOCK_SAMPLES * 8);
+					cb.setup = NULL; cb.run = convert_run; cb.teardown = NULL; cb.ctx = c;
+					cb.dSamples = PCM_BLOCK_SAMPLES;
+					cb.dBytes = (double)c->raw.size();
+					benches.push_back(cb);
+				}
+			}
+		}
+	}
+
+	// encoder on PCM in memory (includes writing the MP3 file, see write/ for that part alone)
+	for (int iChannels = 1; iChannels <= 2; iChannels++) {
+		MICROBENCH b;
+		b.name = string("encode_to_file/") + (iChannels == 2 ? "stereo" : "mono");
+		if (!selected(b.name, filters)) continue;
+		ENCODE_CTX *c = new ENCODE_CTX;
+		memset(&c->hdr, 0, sizeof(FMT_DATA));
+		c->hdr.wFmtTag = WAVE_FORMAT_PCM;
+		c->hdr.wChannels = iChannels;
+		c->hdr.dwSamplesPerSec = 44100;
+		c->hdr.wBitsPerSample = 16;
+		c->hdr.wBlockAlign = iChannels * 2;
+		c->hdr.dwBytesPerSec = 44100 * c->hdr.wBlockAlign;
+		c->iDataSize = MB_ENCODE_SAMPLES * c->hdr.wBlockAlign;
+		c->left.resize(MB_ENCODE_SAMPLES);
+		c->right.resize(MB_ENCODE_SAMPLES);
+		fill_pcm((unsigned char*)&c->left[0], 16, false, 1, MB_ENCODE_SAMPLES);
+		fill_pcm((unsigned char*)&c->right[0], 16, false, 1, MB_ENCODE_SAMPLES);
+		c->sOut = sDir + "/encode.mp3";
+		files.push_back(c->sOut);
+		b.setup = encode_setup; b.run = encode_run; b.teardown = encode_teardown; b.ctx = c;
+		b.dSamples = MB_ENCODE_SAMPLES;
+		b.dBytes = c->iDataSize;
+		benches.push_back(b);
+	}
+
+	// output write path of every backend
+	for (int backend = OUTPUT_STDIO; backend <= OUTPUT_URING; backend++) {
+		MICROBENCH b;
+		b.name = string("write/") + output_backend_name((OUTPUT_BACKEND)backend);
+		if (!selected(b.name, filters)) continue;
+		WRITE_CTX *c = new WRITE_CTX;
+		output_default_cfg(&c->cfg);
+		c->cfg.backend = (OUTPUT_BACKEND)backend;
+		c->sOut = sDir + "/write.mp3";
+		files.push_back(c->sOut);
+		c->data.resize(MB_WRITE_BYTES);
+		fill_pcm(&c->data[0], 8, false, 1, MB_WRITE_BYTES);
+		b.setup = NULL; b.run = write_run; b.teardown = NULL; b.ctx = c;
+		b.dSamples = 0;
+		b.dBytes = MB_WRITE_BYTES;
+		benches.push_back(b);
+	}
+
+	printf("%-36s %12s %12s %10s\n", "benchmark", "ns/run", "ns/sample", "GB/s");
+	for (size_t i = 0; i < benches.size(); i++) run_benchmark(&benches[i]);
+
+	for (size_t i = 0; i < files.size(); i++) unlink(files[i].c_str());
+	rmdir(sDir.c_str());
+	return EXIT_SUCCESS;
+}
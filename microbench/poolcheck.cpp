@@ -0,0 +1,248 @@
+/* Encoder pool client (make poolcheck).
+ *
+ * Converts the WAV files of a directory through the embedding API of encoder_pool.h, linked against
+ * liblame_pthread.a like any other program which embeds the encoder. The files are spread round-robin over every
+ * combination of input and output a job can have:
+ *
+ *   file  -> file      pool_submit on a pool of the C interface, completion counted by pfnDone
+ *   file  -> callback  the same pool, the callback writes the MP3 file
+ *   WAV   -> buffer    EncoderPool, the whole WAV file in memory, the buffer is written once the future is ready
+ *   PCM   -> callback  EncoderPool, the PCM frames of the 'data' chunk in memory with their format
+ *
+ * Every MP3 file is written to OUTDIR under the name of its WAV file, so check.sh can compare the outputs with
+ * those of the command line tool, which must be identical. Inputs which fail leave no output.
+ *
+ *   ./pool_check INDIR OUTDIR [-nTHREADS]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <dirent.h>
+
+#include "encoder_pool.h"
+#include "dir_scan.h"
+
+using namespace std;
+
+typedef enum {
+	PC_FILE_TO_FILE = 0,
+	PC_FILE_TO_CALLBACK,
+	PC_WAV_TO_BUFFER,
+	PC_PCM_TO_CALLBACK,
+	PC_MODE_COUNT
+} PC_MODE;
+
+/* State of one input. */
+typedef struct {
+	string sIn, sOut;
+	PC_MODE mode;
+	vector<unsigned char> data; // PC_WAV_TO_BUFFER, PC_PCM_TO_CALLBACK: the whole WAV file
+	vector<unsigned char> mp3; // PC_WAV_TO_BUFFER: output buffer
+	FILE *pOut; // callback outputs, opened by the first write
+	bool bWriteFailed;
+	future<POOL_RESULT> result; // EncoderPool jobs
+} PC_FILE;
+
+static std::atomic<int> iDone(0), iFailed(0);
+
+/* MP3_SINK callback: appends to the output file of the PC_FILE in pCtx */
+static int write_mp3(const void *pData, size_t n, void *pCtx)
+{
+	PC_FILE *file = (PC_FILE*)pCtx;
+	if (file->pOut == NULL) file->pOut = fopen(file->sOut.c_str(), "wb");
+	if (file->pOut == NULL || fwrite(pData, 1, n, file->pOut) != n) {
+		file->bWriteFailed = true;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* closes the output of a callback job, removing it if the job failed */
+static bool finish_callback_output(PC_FILE *file, bool bOk)
+{
+	if (file->pOut != NULL && 0 != fclose(file->pOut)) bOk = false;
+	file->pOut = NULL;
+	bOk = bOk && !file->bWriteFailed;
+	if (!bOk) remove(file->sOut.c_str());
+	return bOk;
+}
+
+/* pfnDone of the jobs on the C pool */
+static void job_done(const POOL_RESULT *result, void *pCtx)
+{
+	PC_FILE *file = (PC_FILE*)pCtx;
+	bool bOk = result->iStatus == EXIT_SUCCESS;
+	if (file->mode == PC_FILE_TO_CALLBACK) bOk = finish_callback_output(file, bOk);
+	if (!bOk) {
+		printf("[failed] %s: %s\n", file->sIn.c_str(), result->pcError != NULL ? result->pcError : "output");
+		iFailed++;
+	}
+	iDone++;
+}
+
+static bool load_file(const char *pcName, vector<unsigned char> &data)
+{
+	FILE *pFile = fopen(pcName, "rb");
+	if (pFile == NULL) return false;
+	unsigned char buffer[65536];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), pFile)) > 0)
+		data.insert(data.end(), buffer, buffer + n);
+	bool bOk = !ferror(pFile);
+	fclose(pFile);
+	return bOk;
+}
+
+/* Fills job for an input which is held in memory. Returns false if the WAV header is invalid, which is reported
+ * like a failed job.
+ */
+static bool prepare_memory_job(PC_FILE *file, POOL_JOB *job)
+{
+	WAV_INPUT in;
+	input_open_memory(&in, &file->data[0], file->data.size());
+	FMT_DATA *hdr = NULL;
+	unsigned int iDataSize = 0;
+	bool bOk = EXIT_SUCCESS == parse_wave(&in, hdr, iDataSize);
+	if (bOk && file->mode == PC_WAV_TO_BUFFER) {
+		file->mp3.resize(predict_mp3_size(hdr, iDataSize, &job->params) + 65536);
+		job->input = POOL_INPUT_WAV;
+		job->pInData = &file->data[0];
+		job->uInSize = file->data.size();
+		job->sink.pBuffer = &file->mp3[0];
+		job->sink.uCapacity = file->mp3.size();
+	} else if (bOk) {
+		// only the frames which are present, like the streaming reader of a truncated 'data' chunk
+		unsigned long long llAvailable = in.llFileSize - in.llPos;
+		job->input = POOL_INPUT_PCM;
+		job->pInData = &file->data[in.llPos];
+		job->uInSize = iDataSize < llAvailable ? iDataSize : llAvailable;
+		job->pcm = *hdr;
+		job->sink.pfnWrite = write_mp3;
+		job->sink.pCtx = file;
+	}
+	delete hdr;
+	input_close(&in);
+	job->output = POOL_OUTPUT_SINK;
+	return bOk;
+}
+
+static void usage(const char *argv0)
+{
+	cerr << "Usage: " << argv0 << " INDIR OUTDIR [-nTHREADS]" << endl;
+	cerr << "   INDIR  required. Directory with the WAV files (not recursive)." << endl;
+	cerr << "   OUTDIR required. Directory for the MP3 files (created if missing)." << endl;
+	cerr << "   [-nTHREADS] optional. Encoder threads per pool (default: pool_default_cfg)." << endl;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3 || argv[1][0] == '-' || argv[2][0] == '-') {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	POOL_CFG cfg;
+	pool_default_cfg(&cfg);
+	for (int iArg = 3; iArg < argc; iArg++) {
+		if (0 == strncmp(argv[iArg], "-n", 2) && atoi(&argv[iArg][2]) > 0) {
+			cfg.iThreads = atoi(&argv[iArg][2]);
+		} else {
+			cerr << "Invalid argument " << argv[iArg] << endl;
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (EXIT_SUCCESS != make_directories(argv[2])) {
+		cerr << "FATAL: Unable to create " << argv[2] << endl;
+		return EXIT_FAILURE;
+	}
+
+	DIR *dir = opendir(argv[1]);
+	if (dir == NULL) {
+		cerr << "FATAL: Unable to open " << argv[1] << endl;
+		return EXIT_FAILURE;
+	}
+	vector<string> names;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (is_wav_name(entry->d_name, strlen(entry->d_name))) names.push_back(entry->d_name);
+	}
+	closedir(dir);
+	sort(names.begin(), names.end()); // the same mode for a file in every run
+
+	vector<PC_FILE> files(names.size());
+	for (size_t i = 0; i < names.size(); i++) {
+		PC_FILE *file = &files[i];
+		file->sIn = string(argv[1]) + "/" + names[i];
+		file->sOut = string(argv[2]) + "/" + names[i].substr(0, names[i].size() - 4) + ".mp3";
+		file->mode = (PC_MODE)(i % PC_MODE_COUNT);
+		file->pOut = NULL;
+		file->bWriteFailed = false;
+	}
+
+	ENCODER_POOL *pool = pool_create(&cfg);
+	EncoderPool cppPool(&cfg);
+	if (pool == NULL || !cppPool.ok()) {
+		cerr << "FATAL: Unable to start the encoder pools." << endl;
+		return EXIT_FAILURE;
+	}
+	int iSubmitted = 0;
+	for (size_t i = 0; i < files.size(); i++) {
+		PC_FILE *file = &files[i];
+		POOL_JOB job;
+		pool_default_job(&job);
+		if (file->mode == PC_FILE_TO_FILE || file->mode == PC_FILE_TO_CALLBACK) {
+			job.pcInFile = file->sIn.c_str();
+			if (file->mode == PC_FILE_TO_FILE) {
+				job.pcOutFile = file->sOut.c_str();
+			} else {
+				job.output = POOL_OUTPUT_SINK;
+				job.sink.pfnWrite = write_mp3;
+				job.sink.pCtx = file;
+			}
+			job.pfnDone = job_done;
+			job.pDoneCtx = file;
+			if (EXIT_SUCCESS == pool_submit(pool, &job)) iSubmitted++; else iFailed++;
+		} else if (!load_file(file->sIn.c_str(), file->data) || file->data.empty() ||
+			!prepare_memory_job(file, &job)) {
+			printf("[failed] %s: invalid WAV file\n", file->sIn.c_str());
+			iFailed++;
+		} else {
+			file->result = cppPool.submit(job);
+		}
+	}
+
+	for (size_t i = 0; i < files.size(); i++) {
+		PC_FILE *file = &files[i];
+		if (!file->result.valid()) continue;
+		POOL_RESULT result = file->result.get();
+		bool bOk = result.iStatus == EXIT_SUCCESS;
+		if (bOk && file->mode == PC_WAV_TO_BUFFER) {
+			FILE *pOut = fopen(file->sOut.c_str(), "wb");
+			bOk = pOut != NULL && fwrite(&file->mp3[0], 1, result.llOutBytes, pOut) == result.llOutBytes;
+			if (pOut != NULL && 0 != fclose(pOut)) bOk = false;
+			if (!bOk) remove(file->sOut.c_str());
+		} else if (file->mode == PC_PCM_TO_CALLBACK) {
+			bOk = finish_callback_output(file, bOk);
+		}
+		if (!bOk) {
+			printf("[failed] %s: %s\n", file->sIn.c_str(), result.pcError != NULL ? result.pcError : "output");
+			iFailed++;
+		}
+	}
+	pool_drain(pool);
+	pool_destroy(pool);
+	if (iDone != iSubmitted) {
+		cerr << "FATAL: " << iSubmitted - iDone << " job(s) of the C pool didn't complete." << endl;
+		return EXIT_FAILURE;
+	}
+
+	printf("%d of %d files converted with %d threads per pool.\n", (int)files.size() - iFailed, (int)files.size(),
+		cfg.iThreads);
+	return EXIT_SUCCESS;
+}
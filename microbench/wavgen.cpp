@@ -0,0 +1,539 @@
+/* Deterministic synthetic WAV corpus generator (make wavgen).
+ *
+ * Writes a corpus of WAV files which only depends on the seed and the options, so that benchmark numbers taken on
+ * different hosts or versions are comparable and no real audio is needed. Every file gets its parameters (duration,
+ * sample rate, bit depth, channels, signal) drawn from a PRNG seeded by the corpus seed and its index. Durations
+ * follow a log-normal distribution. Header layouts and malformed variants are assigned round-robin, so a corpus with
+ * enough files exercises every branch of read_wave_header and check_format_data:
+ *
+ *   layouts    plain, WAVE_FORMAT_EXTENSIBLE, LIST/bext/JUNK chunks before and after 'fmt ', a 'data' chunk beyond
+ *              the header prefix, an unusual 'fmt ' size and an odd 'data' size with a pad byte and trailing chunk
+ *   malformed  truncated RIFF header, bad RIFF/WAVE ids, zero RIFF length, no or truncated 'fmt ', unsupported
+ *              format tags and SubFormats, bad channels, bits, float depth or block align, no 'data', and a 'data'
+ *              chunk which is longer than the file
+ *
+ *   ./wavgen DIR [-sSEED] [-nFILES] [-dMEDIAN[,SIGMA[,MAX]]] [-rRATES] [-bDEPTHS] [-cCHANNELS] [-tSIGNALS] [-mFRACTION]
+ *
+ * Lists are comma separated, entries are drawn uniformly (repeat an entry to weight it). DIR/corpus.csv lists the
+ * parameters of every file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sys/stat.h>
+
+#include "wave.h"
+
+using namespace std;
+
+#define GEN_DEFAULT_SEED 1
+#define GEN_DEFAULT_FILES 64
+#define GEN_DEFAULT_MEDIAN 10.0 // seconds
+#define GEN_DEFAULT_SIGMA 0.8 // of the log-normal duration distribution
+#define GEN_DEFAULT_MAX 300.0 // seconds
+#define GEN_DEFAULT_MALFORMED 0.1
+#define GEN_BLOCK_FRAMES 4096 // frames synthesized and written at once
+#define GEN_PI 3.14159265358979323846
+
+/////////////////////
+// deterministic random numbers
+/////////////////////
+
+typedef struct {
+	unsigned long long llState;
+} GEN_RNG;
+
+/* splitmix64, which is fully specified and therefore identical on every platform */
+static unsigned long long rng_next(GEN_RNG *rng)
+{
+	unsigned long long z = (rng->llState += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/* uniform in [0, 1) */
+static double rng_uniform(GEN_RNG *rng)
+{
+	return (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double rng_normal(GEN_RNG *rng)
+{
+	double u1 = rng_uniform(rng), u2 = rng_uniform(rng);
+	return sqrt(-2.0 * log(1.0 - u1)) * cos(2.0 * GEN_PI * u2);
+}
+
+template <typename T> static const T &rng_pick(GEN_RNG *rng, const vector<T> &v)
+{
+	return v[rng_next(rng) % v.size()];
+}
+
+/////////////////////
+// signals
+/////////////////////
+
+typedef enum {
+	SIGNAL_SILENCE = 0,
+	SIGNAL_TONE, // a few steady sine tones
+	SIGNAL_NOISE, // white noise
+	SIGNAL_MUSIC, // notes with harmonics and envelopes over pink noise
+	SIGNAL_COUNT
+} GEN_SIGNAL;
+
+static const char *signalNames[SIGNAL_COUNT] = { "silence", "tone", "noise", "music" };
+
+#define GEN_VOICES 3
+#define GEN_HARMONICS 6
+
+/* Synthesizer state of one file. */
+typedef struct {
+	GEN_SIGNAL signal;
+	GEN_RNG rng;
+	double dRate;
+	long long llFrame;
+	double freq[GEN_VOICES], phase[GEN_VOICES];
+	double dNoteSeconds; // music: length of a note
+	double pink[2][3]; // music: pink noise filter state per channel (Paul Kellet's economy filter)
+} GEN_SYNTH;
+
+static void synth_init(GEN_SYNTH *s, GEN_SIGNAL signal, double dRate, unsigned long long llSeed)
+{
+	memset(s, 0, sizeof(GEN_SYNTH));
+	s->signal = signal;
+	s->rng.llState = llSeed;
+	s->dRate = dRate;
+	for (int v = 0; v < GEN_VOICES; v++) s->freq[v] = 110.0 * pow(2.0, 4.0 * rng_uniform(&s->rng));
+	s->dNoteSeconds = 0.15 + 0.5 * rng_uniform(&s->rng);
+}
+
+/* picks new notes of a pentatonic scale */
+static void synth_new_notes(GEN_SYNTH *s)
+{
+	static const int scale[5] = { 0, 2, 4, 7, 9 };
+	for (int v = 0; v < GEN_VOICES; v++) {
+		int iStep = (int)(rng_next(&s->rng) % 15);
+		s->freq[v] = 110.0 * pow(2.0, (12 * (iStep / 5) + scale[iStep % 5]) / 12.0);
+	}
+}
+
+/* renders numFrames frames of iChannels channels into out, values in [-1, 1] */
+static void synth_render(GEN_SYNTH *s, float *out, int numFrames, int iChannels)
+{
+	for (int i = 0; i < numFrames; i++, s->llFrame++) {
+		double dTime = s->llFrame / s->dRate;
+		double x = 0.0;
+		switch (s->signal) {
+		case SIGNAL_SILENCE:
+			break;
+		case SIGNAL_TONE:
+			for (int v = 0; v < GEN_VOICES; v++) {
+				x += 0.25 * sin(s->phase[v]);
+				s->phase[v] = fmod(s->phase[v] + 2.0 * GEN_PI * s->freq[v] / s->dRate, 2.0 * GEN_PI);
+			}
+			break;
+		case SIGNAL_NOISE:
+			break; // per channel below
+		case SIGNAL_MUSIC: {
+			double dNotePos = fmod(dTime, s->dNoteSeconds);
+			if (dNotePos < 1.0 / s->dRate && s->llFrame > 0) synth_new_notes(s);
+			double dEnvelope = fmin(1.0, dNotePos * 200.0) * exp(-3.0 * dNotePos / s->dNoteSeconds);
+			for (int v = 0; v < GEN_VOICES; v++) {
+				for (int h = 1; h <= GEN_HARMONICS; h++)
+					x += 0.18 * dEnvelope * sin(h * s->phase[v]) / h;
+				s->phase[v] = fmod(s->phase[v] + 2.0 * GEN_PI * s->freq[v] / s->dRate, 2.0 * GEN_PI);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+		for (int c = 0; c < iChannels; c++) {
+			double y = x;
+			if (s->signal == SIGNAL_NOISE) {
+				y = 0.8 * (2.0 * rng_uniform(&s->rng) - 1.0);
+			} else if (s->signal == SIGNAL_MUSIC) {
+				double w = 2.0 * rng_uniform(&s->rng) - 1.0;
+				double *b = s->pink[c];
+				b[0] = 0.99765 * b[0] + w * 0.0990460;
+				b[1] = 0.96300 * b[1] + w * 0.2965164;
+				b[2] = 0.57000 * b[2] + w * 1.0526913;
+				y += 0.03 * (b[0] + b[1] + b[2] + w * 0.1848);
+			}
+			out[i * iChannels + c] = (float)fmax(-1.0, fmin(1.0, y));
+		}
+	}
+}
+
+/////////////////////
+// file layouts
+/////////////////////
+
+typedef enum {
+	LAYOUT_PLAIN = 0, // 'fmt ' (16, or 18 for float) and 'data'
+	LAYOUT_EXTENSIBLE, // WAVE_FORMAT_EXTENSIBLE 'fmt ' with SubFormat
+	LAYOUT_LIST, // LIST chunk between 'fmt ' and 'data'
+	LAYOUT_BEXT, // broadcast wave: bext and LIST chunks between 'fmt ' and 'data'
+	LAYOUT_JUNK_FIRST, // odd-sized JUNK chunk (with pad byte) in front of 'fmt '
+	LAYOUT_FAR_DATA, // 'data' beyond the header prefix read by read_wave_header
+	LAYOUT_FMT20, // unusual 'fmt ' size (only warned about)
+	LAYOUT_ODD_DATA, // odd 'data' size with pad byte, followed by a LIST chunk
+	LAYOUT_COUNT
+} GEN_LAYOUT;
+
+static const char *layoutNames[LAYOUT_COUNT] = { "plain", "extensible", "list", "bext", "junk-first", "far-data",
+	"fmt20", "odd-data" };
+
+typedef enum {
+	BAD_NONE = -1,
+	BAD_SHORT_RIFF = 0, // file shorter than the RIFF header
+	BAD_RIFF_ID,
+	BAD_WAVE_ID,
+	BAD_RIFF_LENGTH, // zero RIFF length
+	BAD_NO_FMT,
+	BAD_SHORT_FMT, // file ends within the 'fmt ' chunk
+	BAD_FORMAT_TAG, // ADPCM
+	BAD_SHORT_EXTENSIBLE, // WAVE_FORMAT_EXTENSIBLE without room for a SubFormat
+	BAD_SUBFORMAT, // WAVE_FORMAT_EXTENSIBLE with ADPCM SubFormat
+	BAD_CHANNELS,
+	BAD_BITS,
+	BAD_FLOAT_BITS, // 16 bit float
+	BAD_BLOCK_ALIGN,
+	BAD_NO_DATA,
+	BAD_SHORT_DATA, // 'data' chunk size larger than the file
+	BAD_COUNT
+} GEN_MALFORMED;
+
+static const char *malformedNames[BAD_COUNT] = { "short-riff", "riff-id", "wave-id", "riff-length", "no-fmt",
+	"short-fmt", "format-tag", "short-extensible", "subformat", "channels", "bits", "float-bits", "block-align",
+	"no-data", "short-data" };
+
+/* Parameters of one file. */
+typedef struct {
+	double dSeconds;
+	int iRate;
+	int iBits;
+	bool bFloat;
+	int iChannels;
+	GEN_SIGNAL signal;
+	GEN_LAYOUT layout;
+	int iMalformed; // GEN_MALFORMED
+} GEN_FILE;
+
+static void put16(vector<unsigned char> &v, unsigned int x) { v.push_back(x & 0xFF); v.push_back((x >> 8) & 0xFF); }
+static void put32(vector<unsigned char> &v, unsigned int x) { put16(v, x & 0xFFFF); put16(v, x >> 16); }
+static void put_id(vector<unsigned char> &v, const char *id) { v.insert(v.end(), id, id + 4); }
+
+/* appends a chunk of uSize filler bytes (plus pad byte if odd) */
+static void put_chunk(vector<unsigned char> &v, const char *id, unsigned int uSize, GEN_RNG *rng)
+{
+	put_id(v, id);
+	put32(v, uSize);
+	for (unsigned int i = 0; i < uSize; i++) v.push_back(0x20 + rng_next(rng) % 0x5F); // printable text
+	if (uSize & 1) v.push_back(0);
+}
+
+/* appends the 'fmt ' chunk of f */
+static void put_fmt(vector<unsigned char> &v, const GEN_FILE *f)
+{
+	const int iBad = f->iMalformed;
+	unsigned short wTag = f->bFloat ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+	unsigned short wChannels = iBad == BAD_CHANNELS ? 6 : f->iChannels;
+	unsigned short wBits = iBad == BAD_BITS ? 12 : iBad == BAD_FLOAT_BITS ? 16 : f->iBits;
+	if (iBad == BAD_FLOAT_BITS) wTag = WAVE_FORMAT_IEEE_FLOAT;
+	unsigned short wBlockAlign = wChannels * wBits / 8 + (iBad == BAD_BLOCK_ALIGN ? 1 : 0);
+	bool bExtensible = f->layout == LAYOUT_EXTENSIBLE || iBad == BAD_SHORT_EXTENSIBLE || iBad == BAD_SUBFORMAT;
+	unsigned int uSize = bExtensible && iBad != BAD_SHORT_EXTENSIBLE ? WAVE_FORMAT_EXTENSIBLE_SIZE :
+		f->layout == LAYOUT_FMT20 ? 20 : (f->bFloat || iBad == BAD_SHORT_EXTENSIBLE) ? 18 : 16;
+
+	put_id(v, "fmt ");
+	put32(v, uSize);
+	put16(v, bExtensible ? WAVE_FORMAT_EXTENSIBLE : iBad == BAD_FORMAT_TAG ? 0x0002 : wTag);
+	put16(v, wChannels);
+	put32(v, f->iRate);
+	put32(v, f->iRate * wBlockAlign);
+	put16(v, wBlockAlign);
+	put16(v, wBits);
+	if (uSize >= 18) put16(v, uSize - 18); // cbSize
+	if (uSize == WAVE_FORMAT_EXTENSIBLE_SIZE) {
+		static const unsigned char guidTail[14] = { 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA,
+			0x00, 0x38, 0x9B, 0x71 };
+		put16(v, wBits); // valid bits
+		put32(v, wChannels == 1 ? 0x4 : 0x3); // channel mask
+		put16(v, iBad == BAD_SUBFORMAT ? 0x0002 : wTag);
+		v.insert(v.end(), guidTail, guidTail + sizeof(guidTail));
+	} else if (uSize == 20) {
+		put16(v, 0); // bytes covered by chunkSize but not by cbSize
+	}
+}
+
+/* converts numFrames frames in [-1, 1] into the sample format of f */
+static void encode_samples(const GEN_FILE *f, const float *in, int numFrames, vector<unsigned char> &out)
+{
+	out.clear();
+	for (int i = 0; i < numFrames * f->iChannels; i++) {
+		double x = in[i];
+		if (f->bFloat) {
+			float y = (float)x;
+			unsigned int u;
+			memcpy(&u, &y, 4);
+			put32(out, u);
+		} else if (f->iBits == 8) {
+			out.push_back((unsigned char)lrint(x * 127.0 + 128.0));
+		} else {
+			long long llMax = (1LL << (f->iBits - 1)) - 1;
+			long long s = (long long)llrint(x * llMax);
+			for (int b = 0; b < f->iBits / 8; b++) out.push_back((unsigned char)((unsigned long long)s >> (8 * b)));
+		}
+	}
+}
+
+/* writes one file, returns false on I/O errors */
+static bool write_file(const string &sPath, const GEN_FILE *f, unsigned long long llSeed)
+{
+	GEN_RNG rng;
+	rng.llState = llSeed ^ 0xA5A5A5A5A5A5A5A5ULL;
+	const int iBad = f->iMalformed;
+	const int iBlockAlign = f->iChannels * f->iBits / 8;
+	long long llFrames = (long long)(f->dSeconds * f->iRate);
+	if (f->layout == LAYOUT_ODD_DATA && (iBlockAlign & 1) && (llFrames & 1) == 0)
+		llFrames++; // an odd data size needs an odd number of frames of an odd size (8 or 24 bit mono)
+	unsigned long long llDataSize = (unsigned long long)llFrames * iBlockAlign;
+	bool bOddPad = f->layout == LAYOUT_ODD_DATA && (llDataSize & 1);
+
+	// everything in front of the samples
+	vector<unsigned char> head;
+	put_id(head, iBad == BAD_RIFF_ID ? "RIFX" : "RIFF");
+	put32(head, 0); // RIFF length, patched below
+	put_id(head, iBad == BAD_WAVE_ID ? "AVI " : "WAVE");
+	if (f->layout == LAYOUT_JUNK_FIRST) put_chunk(head, "JUNK", 27, &rng);
+	if (iBad != BAD_NO_FMT) put_fmt(head, f);
+	if (f->layout == LAYOUT_LIST) put_chunk(head, "LIST", 120, &rng);
+	if (f->layout == LAYOUT_BEXT) {
+		put_chunk(head, "bext", 602, &rng);
+		put_chunk(head, "LIST", 64, &rng);
+	}
+	if (f->layout == LAYOUT_FAR_DATA) put_chunk(head, "JUNK", 3 * WAVE_HEADER_PREFIX, &rng);
+	if (iBad == BAD_NO_DATA) {
+		put_chunk(head, "LIST", 32, &rng);
+		llDataSize = 0;
+		llFrames = 0;
+	} else {
+		put_id(head, "data");
+		put32(head, (unsigned int)(iBad == BAD_SHORT_DATA ? llDataSize * 2 + 4096 : llDataSize));
+	}
+
+	// trailing chunks
+	vector<unsigned char> tail;
+	if (bOddPad) tail.push_back(0);
+	if (f->layout == LAYOUT_ODD_DATA) put_chunk(tail, "LIST", 40, &rng);
+
+	unsigned long long llRiffLen = head.size() - 8 + llDataSize + tail.size();
+	unsigned int uRiffLen = iBad == BAD_RIFF_LENGTH ? 0 : (unsigned int)llRiffLen;
+	for (int b = 0; b < 4; b++) head[4 + b] = (uRiffLen >> (8 * b)) & 0xFF;
+	if (iBad == BAD_SHORT_RIFF) head.resize(8);
+	if (iBad == BAD_SHORT_FMT) {
+		// cut the file within the 'fmt ' chunk
+		head.resize(12 + 8 + 6);
+		llFrames = 0;
+		tail.clear();
+	}
+
+	FILE *file = fopen(sPath.c_str(), "wb");
+	if (file == NULL) return false;
+	bool bOk = fwrite(&head[0], 1, head.size(), file) == head.size();
+	if (iBad != BAD_SHORT_RIFF && iBad != BAD_SHORT_FMT) {
+		GEN_SYNTH synth;
+		synth_init(&synth, f->signal, f->iRate, llSeed);
+		vector<float> block((size_t)GEN_BLOCK_FRAMES * f->iChannels);
+		vector<unsigned char> raw;
+		for (long long llDone = 0; bOk && llDone < llFrames; llDone += GEN_BLOCK_FRAMES) {
+			int n = (int)min((long long)GEN_BLOCK_FRAMES, llFrames - llDone);
+			synth_render(&synth, &block[0], n, f->iChannels);
+			encode_samples(f, &block[0], n, raw);
+			bOk = fwrite(&raw[0], 1, raw.size(), file) == raw.size();
+		}
+	}
+	if (bOk && !tail.empty()) bOk = fwrite(&tail[0], 1, tail.size(), file) == tail.size();
+	bOk = 0 == fclose(file) && bOk;
+	return bOk;
+}
+
+/////////////////////
+// options
+/////////////////////
+
+/* splits a comma separated list */
+static vector<string> split_list(const char *s)
+{
+	vector<string> items;
+	string item;
+	for (; ; s++) {
+		if (*s == ',' || *s == '\0') {
+			if (!item.empty()) items.push_back(item);
+			item.clear();
+			if (*s == '\0') break;
+		} else {
+			item += *s;
+		}
+	}
+	return items;
+}
+
+static bool parse_ints(const char *s, vector<int> &values)
+{
+	vector<string> items = split_list(s);
+	values.clear();
+	for (size_t i = 0; i < items.size(); i++) {
+		int x = atoi(items[i].c_str());
+		if (x <= 0) return false;
+		values.push_back(x);
+	}
+	return !values.empty();
+}
+
+static void usage(const char *argv0)
+{
+	cerr << "Usage: " << argv0 << " DIR [-sSEED] [-nFILES] [-dMEDIAN[,SIGMA[,MAX]]] [-rRATES] [-bDEPTHS]" <<
+		" [-cCHANNELS] [-tSIGNALS] [-mFRACTION]" << endl;
+	cerr << "   DIR    required. Directory for the corpus (created if missing)." << endl;
+	cerr << "   [-sSEED] optional. Corpus seed (default " << GEN_DEFAULT_SEED << ")." << endl;
+	cerr << "   [-nFILES] optional. Number of files (default " << GEN_DEFAULT_FILES << ")." << endl;
+	cerr << "   [-dMEDIAN[,SIGMA[,MAX]]] optional. Log-normal durations with MEDIAN seconds and shape SIGMA, at most" <<
+		endl;
+	cerr << "          MAX seconds (default " << GEN_DEFAULT_MEDIAN << "," << GEN_DEFAULT_SIGMA << "," <<
+		GEN_DEFAULT_MAX << ")." << endl;
+	cerr << "   [-rRATES] optional. Sample rates (default 44100,44100,48000,32000,22050)." << endl;
+	cerr << "   [-bDEPTHS] optional. Sample formats out of 8, 16, 24, 32 and f32 (default 16,16,16,24,8,32,f32)." <<
+		endl;
+	cerr << "   [-cCHANNELS] optional. Channel counts (default 2,2,1)." << endl;
+	cerr << "   [-tSIGNALS] optional. Signals out of silence, tone, noise and music (default" <<
+		" silence,tone,noise,music,music)." << endl;
+	cerr << "   [-mFRACTION] optional. Fraction of malformed files (default " << GEN_DEFAULT_MALFORMED << ")." <<
+		endl;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argv[1][0] == '-') {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	const string sDir = argv[1];
+	unsigned long long llSeed = GEN_DEFAULT_SEED;
+	int iFiles = GEN_DEFAULT_FILES;
+	double dMedian = GEN_DEFAULT_MEDIAN, dSigma = GEN_DEFAULT_SIGMA, dMax = GEN_DEFAULT_MAX;
+	double dMalformed = GEN_DEFAULT_MALFORMED;
+	vector<int> rates, channels;
+	parse_ints("44100,44100,48000,32000,22050", rates);
+	parse_ints("2,2,1", channels);
+	vector<string> depths = split_list("16,16,16,24,8,32,f32");
+	vector<GEN_SIGNAL> signals;
+	signals.push_back(SIGNAL_SILENCE);
+	signals.push_back(SIGNAL_TONE);
+	signals.push_back(SIGNAL_NOISE);
+	signals.push_back(SIGNAL_MUSIC);
+	signals.push_back(SIGNAL_MUSIC);
+
+	for (int iArg = 2; iArg < argc; iArg++) {
+		const char *arg = argv[iArg];
+		bool bOk = true;
+		if (0 == strncmp(arg, "-s", 2)) {
+			llSeed = strtoull(&arg[2], NULL, 10);
+		} else if (0 == strncmp(arg, "-n", 2)) {
+			iFiles = atoi(&arg[2]);
+			bOk = iFiles > 0;
+		} else if (0 == strncmp(arg, "-d", 2)) {
+			bOk = sscanf(&arg[2], "%lf,%lf,%lf", &dMedian, &dSigma, &dMax) >= 1 && dMedian > 0 && dSigma >= 0 &&
+				dMax > 0;
+		} else if (0 == strncmp(arg, "-r", 2)) {
+			bOk = parse_ints(&arg[2], rates);
+		} else if (0 == strncmp(arg, "-b", 2)) {
+			depths = split_list(&arg[2]);
+			for (size_t i = 0; i < depths.size(); i++)
+				bOk = bOk && (depths[i] == "8" || depths[i] == "16" || depths[i] == "24" || depths[i] == "32" ||
+					depths[i] == "f32");
+			bOk = bOk && !depths.empty();
+		} else if (0 == strncmp(arg, "-c", 2)) {
+			bOk = parse_ints(&arg[2], channels);
+			for (size_t i = 0; bOk && i < channels.size(); i++) bOk = channels[i] <= 2;
+		} else if (0 == strncmp(arg, "-t", 2)) {
+			vector<string> names = split_list(&arg[2]);
+			signals.clear();
+			for (size_t i = 0; i < names.size(); i++) {
+				int s = 0;
+				while (s < SIGNAL_COUNT && names[i] != signalNames[s]) s++;
+				if (s == SIGNAL_COUNT) bOk = false; else signals.push_back((GEN_SIGNAL)s);
+			}
+			bOk = bOk && !signals.empty();
+		} else if (0 == strncmp(arg, "-m", 2)) {
+			dMalformed = atof(&arg[2]);
+			bOk = dMalformed >= 0 && dMalformed <= 1;
+		} else {
+			bOk = false;
+		}
+		if (!bOk) {
+			cerr << "Invalid argument " << arg << endl;
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	mkdir(sDir.c_str(), 0755);
+	FILE *csv = fopen((sDir + "/corpus.csv").c_str(), "w");
+	if (csv == NULL) {
+		cerr << "FATAL: Unable to write to " << sDir << endl;
+		return EXIT_FAILURE;
+	}
+	fprintf(csv, "file,seconds,rate,format,channels,signal,layout,malformed\n");
+
+	int iValid = 0, iMalformed = 0;
+	double dAudio = 0.0;
+	for (int i = 0; i < iFiles; i++) {
+		// every file only depends on the corpus seed and its index
+		GEN_RNG rng;
+		rng.llState = llSeed * 0x100000001B3ULL + i;
+		unsigned long long llFileSeed = rng_next(&rng);
+
+		GEN_FILE f;
+		f.dSeconds = fmin(dMax, dMedian * exp(dSigma * rng_normal(&rng)));
+		f.iRate = rng_pick(&rng, rates);
+		const string &sDepth = rng_pick(&rng, depths);
+		f.bFloat = sDepth == "f32";
+		f.iBits = f.bFloat ? 32 : atoi(sDepth.c_str());
+		f.iChannels = rng_pick(&rng, channels);
+		f.signal = rng_pick(&rng, signals);
+		bool bMalformed = rng_uniform(&rng) < dMalformed;
+		f.layout = (GEN_LAYOUT)(iValid % LAYOUT_COUNT);
+		f.iMalformed = bMalformed ? iMalformed % BAD_COUNT : BAD_NONE;
+		if (bMalformed) {
+			f.layout = LAYOUT_PLAIN;
+			f.dSeconds = fmin(f.dSeconds, 1.0); // malformed files don't need much data
+			iMalformed++;
+		} else {
+			iValid++;
+		}
+
+		char name[128];
+		snprintf(name, sizeof(name), "gen%05d_%s_%dk_%s%s_%s.wav", i, signalNames[f.signal], f.iRate / 1000,
+			sDepth.c_str(), f.iChannels == 2 ? "st" : "mo",
+			bMalformed ? malformedNames[f.iMalformed] : layoutNames[f.layout]);
+		if (!write_file(sDir + "/" + name, &f, llFileSeed)) {
+			cerr << "FATAL: Unable to write " << name << endl;
+			fclose(csv);
+			return EXIT_FAILURE;
+		}
+		fprintf(csv, "%s,%.3f,%d,%s,%d,%s,%s,%s\n", name, f.dSeconds, f.iRate, sDepth.c_str(), f.iChannels,
+			signalNames[f.signal], layoutNames[f.layout], bMalformed ? malformedNames[f.iMalformed] : "");
+		if (!bMalformed) dAudio += f.dSeconds;
+	}
+	fclose(csv);
+
+	printf("Wrote %d files (%d malformed, %.1f s of audio) to %s.\n", iFiles, iMalformed, dAudio, sDir.c_str());
+	return EXIT_SUCCESS;
+}
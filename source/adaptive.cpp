@@ -0,0 +1,325 @@
+#include "adaptive.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <atomic>
+#include "pthread.h"
+
+#ifdef __linux__
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+
+/* CPU time and run queue wait of the process's threads */
+typedef struct {
+	map<int, pair<unsigned long long, unsigned long long> > tasks; // thread id -> ns on a CPU, ns waiting for one
+	double dTime;
+	double dAudio; // seconds encoded
+} ADAPT_SAMPLE;
+
+/* Measurements of one interval. */
+typedef struct {
+	double dRate, dCpus, dRunQueue, dBlocked;
+} ADAPT_INTERVAL;
+
+struct ADAPT_CTRL {
+	int iWorkers;
+	double dCpus; // CPUs available to the process
+	std::atomic<int> iActive; // workers 0 .. iActive - 1 are active
+	pthread_mutex_t mutex; // protects the rest, the gate waits on cond
+	pthread_cond_t cond;
+	bool bReleased; // no more work, nothing to adapt
+	bool bStop;
+	pthread_t thread;
+
+	// hill climbing
+	int iStepFrom; // active workers before the step still to be judged, 0 if there is none
+	double dRateBefore; // throughput before that step
+	int iHold; // intervals to wait after a step has been taken back
+
+	// run report
+	double tStart, tChange;
+	double dWorkerSeconds; // active workers integrated over time up to tChange
+	int iMinActive, iMaxActive;
+	vector<ADAPT_STEP> steps;
+};
+
+bool adapt_available()
+{
+	DIR *dir = opendir("/proc/self/task");
+	if (dir == NULL) return false;
+	closedir(dir);
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", (int)getpid());
+	FILE *f = fopen(path, "r");
+	if (f == NULL) return false; // kernel without CONFIG_SCHED_INFO
+	fclose(f);
+	return true;
+}
+
+/* sums up /proc/self/task/N/schedstat: time on a CPU, time waiting on a run queue and time slices (ns, ns, #) */
+static void take_sample(ADAPT_SAMPLE *sample)
+{
+	sample->tasks.clear();
+	sample->dTime = report_now();
+	sample->dAudio = metrics_total(METRIC_AUDIO_US_ENCODED) / 1e6;
+	DIR *dir = opendir("/proc/self/task");
+	if (dir == NULL) return;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] < '0' || entry->d_name[0] > '9') continue;
+		char path[sizeof(entry->d_name) + 32];
+		snprintf(path, sizeof(path), "/proc/self/task/%s/schedstat", entry->d_name);
+		FILE *f = fopen(path, "r");
+		if (f == NULL) continue; // thread has exited
+		unsigned long long llCpu, llWait;
+		if (2 == fscanf(f, "%llu %llu", &llCpu, &llWait))
+			sample->tasks[atoi(entry->d_name)] = make_pair(llCpu, llWait);
+		fclose(f);
+	}
+	closedir(dir);
+}
+
+/* measurements between two samples, only threads present in both count (the scanner threads come and go) */
+static void measure(const ADAPT_SAMPLE *prev, const ADAPT_SAMPLE *cur, int iActive, ADAPT_INTERVAL *interval)
+{
+	double dSeconds = cur->dTime - prev->dTime;
+	if (dSeconds <= 0.0) dSeconds = 1e-3;
+	unsigned long long llCpu = 0, llWait = 0;
+	map<int, pair<unsigned long long, unsigned long long> >::const_iterator it, old;
+	for (it = cur->tasks.begin(); it != cur->tasks.end(); ++it) {
+		old = prev->tasks.find(it->first);
+		if (old == prev->tasks.end()) continue;
+		llCpu += it->second.first - old->second.first;
+		llWait += it->second.second - old->second.second;
+	}
+	interval->dRate = (cur->dAudio - prev->dAudio) / dSeconds;
+	interval->dCpus = llCpu / 1e9 / dSeconds;
+	interval->dRunQueue = llWait / 1e9 / dSeconds;
+	// neither on a CPU nor waiting for one: blocked, mostly in reads and writes
+	interval->dBlocked = 1.0 - (interval->dCpus + interval->dRunQueue) / iActive;
+	if (interval->dBlocked < 0.0) interval->dBlocked = 0.0;
+}
+
+/* changes the number of active workers and records the decision, called with the mutex held */
+static void set_active(ADAPT_CTRL *ctrl, int iTo, const ADAPT_INTERVAL *interval, const char *pcReason)
+{
+	int iFrom = ctrl->iActive.load();
+	double tNow = report_now();
+	ctrl->dWorkerSeconds += iFrom * (tNow - ctrl->tChange);
+	ctrl->tChange = tNow;
+	ctrl->iActive = iTo;
+	if (iTo > iFrom) pthread_cond_broadcast(&ctrl->cond);
+	if (iTo < ctrl->iMinActive) ctrl->iMinActive = iTo;
+	if (iTo > ctrl->iMaxActive) ctrl->iMaxActive = iTo;
+
+	ADAPT_STEP step;
+	step.dTime = tNow - ctrl->tStart;
+	step.iFrom = iFrom;
+	step.iTo = iTo;
+	step.dRate = interval->dRate;
+	step.dCpus = interval->dCpus;
+	step.dRunQueue = interval->dRunQueue;
+	step.dBlocked = interval->dBlocked;
+	step.sReason = pcReason;
+	ctrl->steps.push_back(step);
+	fprintf(stderr, "[adapt] %i -> %i workers: %s (%.1f audio-s/s, %.2f CPUs, run queue %.2f, %.0f%% blocked)\n",
+		iFrom, iTo, pcReason, interval->dRate, interval->dCpus, interval->dRunQueue, 100.0 * interval->dBlocked);
+}
+
+/* one control step, called with the mutex held */
+static void adapt(ADAPT_CTRL *ctrl, const ADAPT_INTERVAL *interval)
+{
+	char reason[128];
+	const int iActive = ctrl->iActive.load();
+	if (interval->dRate <= 0.0) {
+		ctrl->iStepFrom = 0; // nothing to compare with
+		return;
+	}
+
+	// judge the previous step
+	if (ctrl->iStepFrom > 0) {
+		const int iStepFrom = ctrl->iStepFrom;
+		const double dChange = interval->dRate / ctrl->dRateBefore - 1.0;
+		ctrl->iStepFrom = 0;
+		if (dChange < -ADAPT_TOLERANCE || (iStepFrom < iActive && dChange <= ADAPT_TOLERANCE)) {
+			if (dChange < -ADAPT_TOLERANCE)
+				snprintf(reason, sizeof(reason), "throughput fell %.0f%%, taking the step back", -100.0 * dChange);
+			else
+				snprintf(reason, sizeof(reason), "throughput changed only %+.0f%% with the added worker, "
+					"taking it back", 100.0 * dChange);
+			set_active(ctrl, iStepFrom, interval, reason);
+			ctrl->iHold = ADAPT_HOLD_INTERVALS;
+			return;
+		}
+	}
+
+	if (ctrl->iHold > 0) {
+		ctrl->iHold--;
+		return;
+	}
+	int iTo = iActive;
+	const bool bSaturated = interval->dCpus >= ADAPT_SATURATED * ctrl->dCpus;
+	if (bSaturated && interval->dRunQueue > ADAPT_QUEUE_LIMIT * ctrl->dCpus) {
+		// multiplicative decrease
+		iTo = iActive - (iActive / 4 > 1 ? iActive / 4 : 1);
+		if (iTo < 1) iTo = 1;
+		snprintf(reason, sizeof(reason), "%.2f runnable workers per CPU wait for one",
+			interval->dRunQueue / ctrl->dCpus);
+	} else if (!bSaturated && interval->dBlocked >= ADAPT_BLOCKED_MIN) {
+		// additive increase, only if the idle CPUs are due to workers waiting for I/O
+		iTo = iActive + 1;
+		snprintf(reason, sizeof(reason), "%.0f%% of the CPUs idle, %.0f%% of the workers blocked",
+			100.0 * (1.0 - interval->dCpus / ctrl->dCpus), 100.0 * interval->dBlocked);
+	}
+	if (iTo > ctrl->iWorkers) iTo = ctrl->iWorkers;
+	if (iTo == iActive) return;
+	ctrl->iStepFrom = iActive;
+	ctrl->dRateBefore = interval->dRate;
+	set_active(ctrl, iTo, interval, reason);
+}
+
+static void *controller_thread(void *arg)
+{
+	ADAPT_CTRL *ctrl = (ADAPT_CTRL*)arg;
+	ADAPT_SAMPLE samples[2];
+	int iCur = 0;
+	take_sample(&samples[iCur]);
+	pthread_mutex_lock(&ctrl->mutex);
+	while (!ctrl->bStop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += ADAPT_INTERVAL_MS / 1000;
+		ts.tv_nsec += (ADAPT_INTERVAL_MS % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while (!ctrl->bStop && 0 == pthread_cond_timedwait(&ctrl->cond, &ctrl->mutex, &ts)) {}
+		if (ctrl->bStop || ctrl->bReleased) continue;
+
+		// sample without holding the mutex, the workers may want to pass the gate
+		pthread_mutex_unlock(&ctrl->mutex);
+		take_sample(&samples[1 - iCur]);
+		ADAPT_INTERVAL interval;
+		measure(&samples[iCur], &samples[1 - iCur], ctrl->iActive.load(), &interval);
+		iCur = 1 - iCur;
+		pthread_mutex_lock(&ctrl->mutex);
+		if (!ctrl->bReleased) adapt(ctrl, &interval);
+	}
+	pthread_mutex_unlock(&ctrl->mutex);
+	return NULL;
+}
+
+ADAPT_CTRL *adapt_start(int iWorkers, int iActive, double dCpus)
+{
+	if (!adapt_available()) return NULL;
+	metrics_enable();
+	ADAPT_CTRL *ctrl = new ADAPT_CTRL;
+	ctrl->iWorkers = iWorkers;
+	ctrl->dCpus = dCpus > 0.0 ? dCpus : 1.0;
+	ctrl->iActive = iActive < iWorkers ? iActive : iWorkers;
+	pthread_mutex_init(&ctrl->mutex, NULL);
+	pthread_cond_init(&ctrl->cond, NULL);
+	ctrl->bReleased = false;
+	ctrl->bStop = false;
+	ctrl->iStepFrom = 0;
+	ctrl->dRateBefore = 0.0;
+	ctrl->iHold = 0;
+	ctrl->tStart = ctrl->tChange = report_now();
+	ctrl->dWorkerSeconds = 0.0;
+	ctrl->iMinActive = ctrl->iMaxActive = ctrl->iActive.load();
+	if (0 != pthread_create(&ctrl->thread, NULL, controller_thread, ctrl)) {
+		pthread_cond_destroy(&ctrl->cond);
+		pthread_mutex_destroy(&ctrl->mutex);
+		delete ctrl;
+		return NULL;
+	}
+	return ctrl;
+}
+
+bool adapt_gate(ADAPT_CTRL *ctrl, int iWorker)
+{
+	if (iWorker < ctrl->iActive.load()) return false;
+	pthread_mutex_lock(&ctrl->mutex);
+	bool bParked = false;
+	while (iWorker >= ctrl->iActive.load() && !ctrl->bReleased) {
+		bParked = true;
+		pthread_cond_wait(&ctrl->cond, &ctrl->mutex);
+	}
+	pthread_mutex_unlock(&ctrl->mutex);
+	return bParked;
+}
+
+void adapt_release(ADAPT_CTRL *ctrl)
+{
+	pthread_mutex_lock(&ctrl->mutex);
+	if (!ctrl->bReleased) {
+		ctrl->bReleased = true;
+		pthread_cond_broadcast(&ctrl->cond);
+	}
+	pthread_mutex_unlock(&ctrl->mutex);
+}
+
+void adapt_stop(ADAPT_CTRL *ctrl)
+{
+	pthread_mutex_lock(&ctrl->mutex);
+	ctrl->bStop = true;
+	pthread_cond_broadcast(&ctrl->cond);
+	pthread_mutex_unlock(&ctrl->mutex);
+	pthread_join(ctrl->thread, NULL);
+	double tNow = report_now();
+	ctrl->dWorkerSeconds += ctrl->iActive.load() * (tNow - ctrl->tChange);
+	ctrl->tChange = tNow;
+}
+
+void adapt_finish(ADAPT_CTRL *ctrl, RUN_REPORT *report)
+{
+	report->bAdaptive = true;
+	report->iMinWorkers = ctrl->iMinActive;
+	report->iMaxWorkers = ctrl->iMaxActive;
+	report->iFinalWorkers = ctrl->iActive.load();
+	double dSeconds = ctrl->tChange - ctrl->tStart;
+	report->dMeanWorkers = dSeconds > 0.0 ? ctrl->dWorkerSeconds / dSeconds : ctrl->iActive.load();
+	report->adaptSteps = ctrl->steps;
+	pthread_cond_destroy(&ctrl->cond);
+	pthread_mutex_destroy(&ctrl->mutex);
+	delete ctrl;
+}
+
+#else // __linux__
+
+struct ADAPT_CTRL {
+	int iUnused;
+};
+
+bool adapt_available()
+{
+	return false;
+}
+
+ADAPT_CTRL *adapt_start(int iWorkers, int iActive, double dCpus)
+{
+	return NULL;
+}
+
+bool adapt_gate(ADAPT_CTRL *ctrl, int iWorker)
+{
+	return false;
+}
+
+void adapt_release(ADAPT_CTRL *ctrl)
+{
+}
+
+void adapt_stop(ADAPT_CTRL *ctrl)
+{
+}
+
+void adapt_finish(ADAPT_CTRL *ctrl, RUN_REPORT *report)
+{
+}
+
+#endif // __linux__
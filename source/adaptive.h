@@ -0,0 +1,90 @@
+#ifndef __ADAPTIVE_H_
+#define __ADAPTIVE_H_
+
+#include "report.h"
+
+using namespace std;
+
+/////////////////////
+// adaptive number of active workers
+/////////////////////
+
+/*
+ * Whether more workers help depends on the batch: files on a network share keep workers blocked in reads, so
+ * more of them than CPUs raise the throughput, while files on a local disk are CPU-bound and extra workers only
+ * queue for the CPUs. With --adapt, the program therefore starts ADAPT_MAX_FACTOR times the default number of
+ * workers (topology_default_threads), of which only the default number is active at first; the others are parked
+ * in adapt_gate between two jobs. A controller thread samples the run every ADAPT_INTERVAL_MS:
+ *   throughput  audio seconds encoded per second (METRIC_AUDIO_US_ENCODED, counted per block)
+ *   CPUs        CPU time used by the process per second
+ *   run queue   time the process's threads waited for a CPU per second, i.e. the average number of runnable
+ *               threads which didn't get one
+ *   blocked     share of the active workers neither running nor runnable, which is mostly I/O wait
+ * (the last three from /proc/self/task/N/schedstat, so they only see this process, also in a container). It
+ * adjusts the active workers by AIMD with a hill-climbing check:
+ *   - while the CPUs are saturated (ADAPT_SATURATED), a run queue of more than ADAPT_QUEUE_LIMIT per CPU removes a
+ *     quarter of the workers
+ *   - while they aren't and at least ADAPT_BLOCKED_MIN of the workers are blocked, one worker is added per interval
+ *     (idle CPUs with workers which aren't blocked mean that more workers would only idle as well)
+ *   - every step is judged in the following interval: a step which cost more than ADAPT_TOLERANCE of the
+ *     throughput, or an added worker which didn't gain more than that, is taken back, and the controller then holds
+ *     still for ADAPT_HOLD_INTERVALS
+ * Nothing changes while nothing is encoded (watch mode between arrivals) or after the job list has run dry.
+ * Removed workers finish their current job first. Every change is printed to stderr and recorded for the run
+ * report.
+ * Linux only, elsewhere the default number of workers stays active.
+ */
+
+#define ADAPT_INTERVAL_MS 1000
+#define ADAPT_MAX_FACTOR 4 // workers started per default worker
+#define ADAPT_QUEUE_LIMIT 0.5 // run queue per CPU above which saturated CPUs are oversubscribed
+#define ADAPT_SATURATED 0.9 // share of the CPUs in use at which adding workers can't help CPU-bound jobs
+#define ADAPT_BLOCKED_MIN 0.1 // share of blocked workers below which adding workers can't help either
+#define ADAPT_TOLERANCE 0.05 // relative throughput change regarded as noise
+#define ADAPT_HOLD_INTERVALS 5
+
+typedef struct ADAPT_CTRL ADAPT_CTRL;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* adapt_available
+ *  Returns whether the controller can sample the process on this platform.
+ */
+bool adapt_available();
+
+/* adapt_start
+ *  Starts the controller for iWorkers workers of which the first iActive are active, on a machine which gives the
+ *  process dCpus CPUs. Enables metrics counting (metrics_enable), so it must be called before the workers start.
+ *
+ *  Return value:
+ *    controller or NULL if it can't be started (all workers are active then)
+ */
+ADAPT_CTRL *adapt_start(int iWorkers, int iActive, double dCpus);
+
+/* adapt_gate
+ *  Called by worker iWorker before it claims its next job, blocks while the worker is parked.
+ *
+ *  Return value:
+ *    true if the worker has been parked
+ */
+bool adapt_gate(ADAPT_CTRL *ctrl, int iWorker);
+
+/* adapt_release
+ *  Called when a worker finds no more work: releases all parked workers (which then find none either) and stops
+ *  adapting.
+ */
+void adapt_release(ADAPT_CTRL *ctrl);
+
+/* adapt_stop
+ *  Stops the controller thread (after all workers have finished).
+ */
+void adapt_stop(ADAPT_CTRL *ctrl);
+
+/* adapt_finish
+ *  Adds the decisions of the stopped controller to report and frees it.
+ */
+void adapt_finish(ADAPT_CTRL *ctrl, RUN_REPORT *report);
+
+#endif // __ADAPTIVE_H_
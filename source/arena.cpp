@@ -0,0 +1,123 @@
+#include "arena.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#ifdef WIN32
+#define ARENA_THREAD_LOCAL __declspec(thread)
+#else
+#define ARENA_THREAD_LOCAL __thread
+#endif
+
+#define ARENA_NODE_MASK_WORDS 4 // nodes 0..255 can be bound to
+
+static bool bHugePages = false;
+static ARENA_THREAD_LOCAL int iThreadNode = -1; // NUMA node of the calling thread's buffers, -1: any
+
+void arena_set_huge_pages(bool bEnable)
+{
+	bHugePages = bEnable;
+}
+
+void arena_set_thread_node(int iNode)
+{
+	iThreadNode = iNode;
+}
+
+#ifndef WIN32
+/* Asks for the pages of a fresh mapping to come from the thread's NUMA node, before they are touched. */
+static void bind_to_thread_node(void *p, size_t uLen)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	const int iBits = (int)(sizeof(unsigned long) * 8);
+	if (iThreadNode < 0 || iThreadNode >= ARENA_NODE_MASK_WORDS * iBits) return;
+	unsigned long mask[ARENA_NODE_MASK_WORDS] = { 0 };
+	mask[iThreadNode / iBits] = 1UL << (iThreadNode % iBits);
+	// preferred rather than bound, so a full node falls back to the others instead of failing
+	syscall(SYS_mbind, p, uLen, MPOL_PREFERRED, mask, (unsigned long)(ARENA_NODE_MASK_WORDS * iBits), 0);
+#endif
+}
+#endif
+
+ARENA_BUFFER::~ARENA_BUFFER()
+{
+	arena_release(this);
+}
+
+/* Allocates uBytes, using huge pages if enabled. uMapped receives the length of the mapping or 0 for new[].
+ * Buffers of threads bound to a NUMA node are always mapped, so that they can be placed on that node.
+ */
+static unsigned char *arena_alloc(size_t uBytes, size_t &uMapped)
+{
+	uMapped = 0;
+#ifndef WIN32
+	const bool bHuge = bHugePages && uBytes >= ARENA_HUGE_PAGE_SIZE;
+	if (bHuge || iThreadNode >= 0) {
+		// uBytes is a multiple of ARENA_GRANULARITY and thus of the page size
+		size_t uLen = uBytes;
+		if (bHuge) uLen = (uBytes + ARENA_HUGE_PAGE_SIZE - 1) / ARENA_HUGE_PAGE_SIZE * ARENA_HUGE_PAGE_SIZE;
+		void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		if (bHuge) p = mmap(NULL, uLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+		if (p == MAP_FAILED) {
+			// no reserved huge pages, ask for transparent ones instead
+			p = mmap(NULL, uLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+			if (bHuge && p != MAP_FAILED) madvise(p, uLen, MADV_HUGEPAGE);
+#endif
+		}
+		if (p != MAP_FAILED) {
+			bind_to_thread_node(p, uLen);
+			uMapped = uLen;
+			return (unsigned char*)p;
+		}
+	}
+#endif
+	return new unsigned char[uBytes];
+}
+
+unsigned char *arena_reserve(ARENA_BUFFER *buf, size_t uBytes)
+{
+	if (uBytes <= buf->uCapacity) return buf->pData;
+
+	arena_release(buf);
+	size_t uCapacity = (uBytes + ARENA_GRANULARITY - 1) / ARENA_GRANULARITY * ARENA_GRANULARITY;
+	buf->pData = arena_alloc(uCapacity, buf->uMapped);
+	buf->uCapacity = buf->uMapped > 0 ? buf->uMapped : uCapacity;
+	buf->uAllocations++;
+	return buf->pData;
+}
+
+void arena_release(ARENA_BUFFER *buf)
+{
+	if (buf->pData != NULL) {
+#ifndef WIN32
+		if (buf->uMapped > 0)
+			munmap(buf->pData, buf->uMapped);
+		else
+#endif
+			delete[] buf->pData;
+	}
+	buf->pData = NULL;
+	buf->uCapacity = 0;
+	buf->uMapped = 0;
+}
+
+unsigned int arena_allocations(const WORKER_ARENA *arena)
+{
+	return arena->input.uAllocations + arena->raw.uAllocations + arena->left.uAllocations +
+		arena->right.uAllocations + arena->mp3.uAllocations + arena->output.uAllocations;
+}
+
+size_t arena_bytes(const WORKER_ARENA *arena)
+{
+	return arena->input.uCapacity + arena->raw.uCapacity + arena->left.uCapacity + arena->right.uCapacity +
+		arena->mp3.uCapacity + arena->output.uCapacity;
+}
@@ -0,0 +1,81 @@
+#ifndef __ARENA_H_
+#define __ARENA_H_
+
+#include <stddef.h>
+
+/////////////////////
+// per-thread reusable work buffers
+/////////////////////
+
+#define ARENA_GRANULARITY (64 * 1024) // buffers grow in multiples of this
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024) // buffers of at least this size may be backed by huge pages
+
+/*
+ * Buffer which only ever grows. It is reserved for the largest request seen so far and recycled for all following
+ * jobs, so once a worker has seen its largest file no further allocations take place. The destructor releases the
+ * memory, which makes the owning struct responsible for it on every path.
+ */
+struct ARENA_BUFFER {
+	unsigned char *pData;
+	size_t uCapacity;
+	size_t uMapped; // length of the mapping if allocated with mmap, 0 if allocated with new[]
+	unsigned int uAllocations; // number of times the buffer had to grow
+
+	ARENA_BUFFER() : pData(NULL), uCapacity(0), uMapped(0), uAllocations(0) {}
+	~ARENA_BUFFER();
+
+private:
+	ARENA_BUFFER(const ARENA_BUFFER&); // not copyable
+	ARENA_BUFFER &operator=(const ARENA_BUFFER&);
+};
+
+/* All buffers a worker thread needs for converting a file. */
+struct WORKER_ARENA {
+	ARENA_BUFFER input; // block buffer of the pread input backend
+	ARENA_BUFFER raw; // raw PCM frames as read from the file
+	ARENA_BUFFER left, right; // converted PCM samples (one block, or the whole file in whole-file mode)
+	ARENA_BUFFER mp3; // encoded frames
+	ARENA_BUFFER output; // write blocks of the output backend
+};
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* arena_set_huge_pages
+ *  Enables or disables huge page backing for buffers allocated from now on. Buffers of at least
+ *  ARENA_HUGE_PAGE_SIZE bytes are then mapped with MAP_HUGETLB, or with transparent huge pages if no huge pages
+ *  are reserved. Has no effect on Windows.
+ */
+void arena_set_huge_pages(bool bEnable);
+
+/* arena_set_thread_node
+ *  Places buffers which the calling thread allocates from now on on NUMA node iNode (-1: no preference, the
+ *  default). Used by workers pinned to a CPU of that node (see topology.h). Linux only.
+ */
+void arena_set_thread_node(int iNode);
+
+/* arena_reserve
+ *  Makes sure buf holds at least uBytes bytes. The contents are not preserved when the buffer has to grow.
+ *
+ *  Return value:
+ *    pointer to the buffer
+ */
+unsigned char *arena_reserve(ARENA_BUFFER *buf, size_t uBytes);
+
+/* arena_release
+ *  Releases the memory of buf. Called by the destructor.
+ */
+void arena_release(ARENA_BUFFER *buf);
+
+/* arena_allocations
+ *  Returns the total number of allocations made for the buffers of arena.
+ */
+unsigned int arena_allocations(const WORKER_ARENA *arena);
+
+/* arena_bytes
+ *  Returns the total capacity of the buffers of arena.
+ */
+size_t arena_bytes(const WORKER_ARENA *arena);
+
+#endif // __ARENA_H_
@@ -0,0 +1,379 @@
+#include "dir_scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "dirent.h"
+#include "trace.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef WIN32
+#include <direct.h>
+#define PATHSEP "\\"
+#define PATHSEP_CHARS "\\/"
+#define MAKE_DIR(path) _mkdir(path)
+#else
+#define PATHSEP "/"
+#define PATHSEP_CHARS "/"
+#define MAKE_DIR(path) mkdir(path, 0777)
+#endif
+
+struct DIR_SCAN {
+	string sRoot;
+	string sOutDir; // empty: no output tree
+	bool bRecursive;
+	bool bKeepOpen;
+	bool (*pfnSkip)(const char *pcPath, void *pCtx);
+	void *pSkipCtx;
+	FILE_FEED *feed;
+	pthread_mutex_t mutex; // protects all following members
+	pthread_cond_t cond; // signalled when a directory is pushed and when the scan is complete
+	vector<string> pending; // directories still to be listed, relative to sRoot ("" is the root itself)
+	int iBusy; // scanners currently listing a directory
+	int iErrors;
+	int iNextId; // for naming the scanner threads
+	pthread_t *threads;
+	int iThreads;
+};
+
+/////////////////////
+// file feed
+/////////////////////
+
+void feed_init(FILE_FEED *feed)
+{
+	feed->pppChunks = (const char***)calloc(FEED_MAX_CHUNKS, sizeof(const char**));
+	feed->iCount = 0;
+	feed->bClosed = false;
+	pthread_mutex_init(&feed->mutex, NULL);
+	pthread_cond_init(&feed->cond, NULL);
+	feed->uBlockFill = 0;
+}
+
+void feed_destroy(FILE_FEED *feed)
+{
+	for (int c = 0; c < FEED_MAX_CHUNKS && feed->pppChunks[c] != NULL; c++) delete[] feed->pppChunks[c];
+	free(feed->pppChunks);
+	feed->pppChunks = NULL;
+	for (size_t i = 0; i < feed->blocks.size(); i++) delete[] feed->blocks[i];
+	feed->blocks.clear();
+	pthread_mutex_destroy(&feed->mutex);
+	pthread_cond_destroy(&feed->cond);
+}
+
+void feed_append(FILE_FEED *feed, const char *pNames, int iCount)
+{
+	pthread_mutex_lock(&feed->mutex);
+	int n = feed->iCount.load(std::memory_order_relaxed);
+	for (int i = 0; i < iCount; i++) {
+		size_t uLen = strlen(pNames) + 1;
+		if ((n >> FEED_CHUNK_SHIFT) >= FEED_MAX_CHUNKS) {
+			printf("Too many files. Skipping %s.\n", pNames);
+			pNames += uLen;
+			continue;
+		}
+		if (feed->blocks.empty() || feed->uBlockFill + uLen > FEED_BLOCK_BYTES) {
+			feed->blocks.push_back(new char[uLen > FEED_BLOCK_BYTES ? uLen : FEED_BLOCK_BYTES]);
+			feed->uBlockFill = 0;
+		}
+		char *pName = feed->blocks.back() + feed->uBlockFill;
+		memcpy(pName, pNames, uLen);
+		feed->uBlockFill += uLen;
+		const char **&ppChunk = feed->pppChunks[n >> FEED_CHUNK_SHIFT];
+		if (ppChunk == NULL) ppChunk = new const char*[1 << FEED_CHUNK_SHIFT];
+		ppChunk[n & ((1 << FEED_CHUNK_SHIFT) - 1)] = pName;
+		n++;
+		pNames += uLen;
+	}
+	feed->iCount.store(n, std::memory_order_release); // publishes the names written above
+	pthread_cond_broadcast(&feed->cond);
+	pthread_mutex_unlock(&feed->mutex);
+}
+
+void feed_close(FILE_FEED *feed)
+{
+	pthread_mutex_lock(&feed->mutex);
+	feed->bClosed = true;
+	pthread_cond_broadcast(&feed->cond);
+	pthread_mutex_unlock(&feed->mutex);
+}
+
+bool feed_wait(FILE_FEED *feed, int iIndex)
+{
+	if (iIndex < feed->iCount.load(std::memory_order_acquire)) return true; // no lock for published entries
+	TRACE_SCOPE("wait for scan");
+	pthread_mutex_lock(&feed->mutex);
+	while (iIndex >= feed->iCount.load(std::memory_order_relaxed) && !feed->bClosed)
+		pthread_cond_wait(&feed->cond, &feed->mutex);
+	bool bAvailable = iIndex < feed->iCount.load(std::memory_order_relaxed);
+	pthread_mutex_unlock(&feed->mutex);
+	return bAvailable;
+}
+
+int feed_count(const FILE_FEED *feed)
+{
+	return feed->iCount.load(std::memory_order_acquire);
+}
+
+const char *feed_name(const FILE_FEED *feed, int iIndex)
+{
+	return feed->pppChunks[iIndex >> FEED_CHUNK_SHIFT][iIndex & ((1 << FEED_CHUNK_SHIFT) - 1)];
+}
+
+/////////////////////
+// directory scanner
+/////////////////////
+
+bool is_wav_name(const char *name, size_t len)
+{
+	return len >= 4 && name[len - 4] == '.' && (name[len - 3] | 0x20) == 'w' && (name[len - 2] | 0x20) == 'a' &&
+		(name[len - 1] | 0x20) == 'v';
+}
+
+int make_directories(const char *pcPath)
+{
+	if (0 == MAKE_DIR(pcPath) || errno == EEXIST) return EXIT_SUCCESS;
+	if (errno != ENOENT) return EXIT_FAILURE;
+	// create the parent first
+	string sParent(pcPath);
+	size_t uSep = sParent.find_last_of(PATHSEP_CHARS);
+	if (uSep == string::npos || uSep == 0) return EXIT_FAILURE;
+	sParent.resize(uSep);
+	if (EXIT_SUCCESS != make_directories(sParent.c_str())) return EXIT_FAILURE;
+	return (0 == MAKE_DIR(pcPath) || errno == EEXIST) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void scan_error(DIR_SCAN *scan)
+{
+	pthread_mutex_lock(&scan->mutex);
+	scan->iErrors++;
+	pthread_mutex_unlock(&scan->mutex);
+}
+
+static void push_directory(DIR_SCAN *scan, const string &sRel)
+{
+	pthread_mutex_lock(&scan->mutex);
+	scan->pending.push_back(sRel);
+	pthread_cond_signal(&scan->cond);
+	pthread_mutex_unlock(&scan->mutex);
+}
+
+/* Paths found in one directory which haven't been published yet. */
+typedef struct {
+	vector<char> names; // NUL-terminated paths back to back
+	int iCount;
+	bool bOutDirMade; // the output directory of the current input directory exists
+	string sPath; // for pfnSkip
+} SCAN_BATCH;
+
+static void flush_batch(DIR_SCAN *scan, const string &sRel, SCAN_BATCH *batch)
+{
+	if (batch->iCount == 0) return;
+	if (!batch->bOutDirMade && !scan->sOutDir.empty()) {
+		// only directories which contain WAV files show up in the output tree
+		string sOut = sRel.empty() ? scan->sOutDir : scan->sOutDir + PATHSEP + sRel;
+		if (EXIT_SUCCESS != make_directories(sOut.c_str())) {
+			printf("Unable to create directory %s.\n", sOut.c_str());
+			scan_error(scan);
+		}
+		batch->bOutDirMade = true;
+	}
+	feed_append(scan->feed, batch->names.data(), batch->iCount);
+	batch->names.clear();
+	batch->iCount = 0;
+}
+
+/* Handles one directory entry whose type is known to be a directory, a regular file or neither. */
+static void add_entry(DIR_SCAN *scan, const string &sRel, const string &sPrefix, const char *name, size_t len,
+	bool bDir, bool bFile, SCAN_BATCH *batch)
+{
+	if (bDir) {
+		if (scan->bRecursive) push_directory(scan, sRel.empty() ? string(name) : sRel + PATHSEP + name);
+	} else if (bFile) {
+		if (scan->pfnSkip != NULL) {
+			batch->sPath.assign(sPrefix);
+			batch->sPath.append(name, len);
+			if (scan->pfnSkip(batch->sPath.c_str(), scan->pSkipCtx)) return;
+		}
+		batch->names.insert(batch->names.end(), sPrefix.begin(), sPrefix.end());
+		batch->names.insert(batch->names.end(), name, name + len + 1);
+		batch->iCount++;
+		if (batch->names.size() >= SCAN_BATCH_BYTES) flush_batch(scan, sRel, batch);
+	}
+}
+
+static bool is_dot_entry(const char *name)
+{
+	return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+#ifdef __linux__
+
+/* layout of the records returned by getdents64 */
+struct LINUX_DIRENT64 {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+static void scan_directory(DIR_SCAN *scan, const string &sRel, char *pBuffer, SCAN_BATCH *batch)
+{
+	const string sPrefix = sRel.empty() ? scan->sRoot + PATHSEP : scan->sRoot + PATHSEP + sRel + PATHSEP;
+	int fd = open(sPrefix.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		printf("Unable to read directory %s. Skipping.\n", sPrefix.c_str());
+		scan_error(scan);
+		return;
+	}
+	long n;
+	while ((n = syscall(SYS_getdents64, fd, pBuffer, SCAN_READ_BUFFER)) > 0) {
+		for (long lPos = 0; lPos < n;) {
+			const LINUX_DIRENT64 *ent = (const LINUX_DIRENT64*)(pBuffer + lPos);
+			lPos += ent->d_reclen;
+			const char *name = ent->d_name;
+			if (is_dot_entry(name)) continue;
+			size_t len = strlen(name);
+			bool bWav = is_wav_name(name, len);
+			unsigned char type = ent->d_type;
+			struct stat st;
+			if (type == DT_UNKNOWN) {
+				// the file system doesn't report types
+				if (0 != fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW)) continue;
+				type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG :
+					S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+			}
+			if (type == DT_LNK && bWav) {
+				// links to WAV files are followed, links to directories aren't (they might form cycles)
+				if (0 != fstatat(fd, name, &st, 0)) continue;
+				type = S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+			}
+			add_entry(scan, sRel, sPrefix, name, len, type == DT_DIR, type == DT_REG && bWav, batch);
+		}
+	}
+	if (n < 0) {
+		printf("Unable to read directory %s (%s).\n", sPrefix.c_str(), strerror(errno));
+		scan_error(scan);
+	}
+	close(fd);
+}
+
+#else
+
+static void scan_directory(DIR_SCAN *scan, const string &sRel, char *pBuffer, SCAN_BATCH *batch)
+{
+	const string sPrefix = sRel.empty() ? scan->sRoot + PATHSEP : scan->sRoot + PATHSEP + sRel + PATHSEP;
+	DIR *dir = opendir(sPrefix.c_str());
+	if (dir == NULL) {
+		printf("Unable to read directory %s. Skipping.\n", sPrefix.c_str());
+		scan_error(scan);
+		return;
+	}
+	dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		const char *name = ent->d_name;
+		if (is_dot_entry(name)) continue;
+		size_t len = strlen(name);
+		bool bWav = is_wav_name(name, len);
+		bool bDir = ent->d_type == DT_DIR, bFile = ent->d_type == DT_REG;
+		if (ent->d_type != DT_DIR && ent->d_type != DT_REG) {
+			struct stat st;
+			if (0 != stat((sPrefix + name).c_str(), &st)) continue;
+			bDir = S_ISDIR(st.st_mode) && ent->d_type != DT_LNK;
+			bFile = S_ISREG(st.st_mode);
+		}
+		add_entry(scan, sRel, sPrefix, name, len, bDir, bFile && bWav, batch);
+	}
+	closedir(dir);
+}
+
+#endif // __linux__
+
+static void *scan_thread(void *arg)
+{
+	DIR_SCAN *scan = (DIR_SCAN*)arg;
+	char *pBuffer = new char[SCAN_READ_BUFFER];
+	SCAN_BATCH batch;
+	batch.names.reserve(2 * SCAN_BATCH_BYTES);
+	batch.iCount = 0;
+	string sRel;
+
+	pthread_mutex_lock(&scan->mutex);
+	TRACE_THREAD_NAME("scanner", scan->iNextId);
+	scan->iNextId++;
+	while (true) {
+		// the scan is complete once no directory is pending and nobody can push any more
+		while (scan->pending.empty() && scan->iBusy > 0) pthread_cond_wait(&scan->cond, &scan->mutex);
+		if (scan->pending.empty()) break;
+		sRel.swap(scan->pending.back());
+		scan->pending.pop_back();
+		scan->iBusy++;
+		pthread_mutex_unlock(&scan->mutex);
+
+		{
+			TRACE_SCOPE_DETAIL("scan", sRel.c_str());
+			batch.bOutDirMade = false;
+			scan_directory(scan, sRel, pBuffer, &batch);
+			flush_batch(scan, sRel, &batch);
+		}
+
+		pthread_mutex_lock(&scan->mutex);
+		if (--scan->iBusy == 0 && scan->pending.empty()) pthread_cond_broadcast(&scan->cond);
+	}
+	pthread_mutex_unlock(&scan->mutex);
+
+	if (!scan->bKeepOpen) feed_close(scan->feed);
+	delete[] pBuffer;
+	return NULL;
+}
+
+DIR_SCAN *scan_start(const char *pcRoot, const SCAN_CFG *cfg, FILE_FEED *feed)
+{
+	// an unreadable root is reported right away instead of as an empty scan
+	DIR *dir = opendir(pcRoot);
+	if (dir == NULL) return NULL;
+	closedir(dir);
+
+	DIR_SCAN *scan = new DIR_SCAN;
+	scan->sRoot = pcRoot;
+	if (cfg->pcOutDir != NULL) scan->sOutDir = cfg->pcOutDir;
+	scan->bRecursive = cfg->bRecursive;
+	scan->bKeepOpen = cfg->bKeepOpen;
+	scan->pfnSkip = cfg->pfnSkip;
+	scan->pSkipCtx = cfg->pSkipCtx;
+	scan->feed = feed;
+	pthread_mutex_init(&scan->mutex, NULL);
+	pthread_cond_init(&scan->cond, NULL);
+	scan->pending.push_back(string());
+	scan->iBusy = 0;
+	scan->iErrors = 0;
+	scan->iNextId = 0;
+
+	// a single directory is listed by a single thread
+	int iThreads = cfg->bRecursive && cfg->iThreads > 1 ? cfg->iThreads : 1;
+	scan->threads = new pthread_t[iThreads];
+	scan->iThreads = 0;
+	for (int i = 0; i < iThreads; i++) {
+		if (0 == pthread_create(&scan->threads[scan->iThreads], NULL, scan_thread, (void*)scan)) scan->iThreads++;
+	}
+	if (scan->iThreads == 0) scan_thread((void*)scan); // scan synchronously
+	return scan;
+}
+
+int scan_finish(DIR_SCAN *scan)
+{
+	for (int i = 0; i < scan->iThreads; i++) pthread_join(scan->threads[i], NULL);
+	int iErrors = scan->iErrors;
+	pthread_mutex_destroy(&scan->mutex);
+	pthread_cond_destroy(&scan->cond);
+	delete[] scan->threads;
+	delete scan;
+	return iErrors;
+}
@@ -0,0 +1,130 @@
+#ifndef __DIR_SCAN_H_
+#define __DIR_SCAN_H_
+
+#include <atomic>
+#include <vector>
+#include <string>
+#include "pthread.h"
+
+using namespace std;
+
+/////////////////////
+// parallel directory discovery
+/////////////////////
+
+/*
+ * Scanner threads share a stack of directories which are still to be listed. Every directory is read with large
+ * getdents64 calls and the entry types are taken from d_type, so no entry is stat'ed unless the file system doesn't
+ * report its type (or it is a symbolic link to a .wav file). Subdirectories go back onto the stack as soon as they
+ * are seen, which keeps all scanners busy on wide as well as deep trees. WAV files are appended to a FILE_FEED in
+ * batches while the scan is still running, so workers can start encoding the first files right away.
+ */
+
+#define SCAN_READ_BUFFER (64 * 1024) // bytes per getdents64 call
+#define SCAN_BATCH_BYTES (16 * 1024) // paths collected by a scanner before they are published
+#define FEED_CHUNK_SHIFT 12 // file names per chunk: 4096
+#define FEED_MAX_CHUNKS (1 << 16) // up to 268M files
+#define FEED_BLOCK_BYTES (1024 * 1024) // path storage is allocated in blocks of this size
+
+/* Scanner configuration. */
+typedef struct {
+	int iThreads; // scanner threads (at least 1)
+	bool bRecursive; // descend into subdirectories
+	const char *pcOutDir; // create the directories of the mirrored output tree below pcOutDir, NULL: none
+	bool bKeepOpen; // leave the feed open when the scan is complete, so that more names can be appended (watch.h)
+	// optional filter, called by all scanner threads concurrently: WAV files for which it returns true are left out
+	bool (*pfnSkip)(const char *pcPath, void *pCtx);
+	void *pSkipCtx;
+} SCAN_CFG;
+
+/*
+ * Append-only list of file names which grows while it is being consumed. Names are stored in large blocks and
+ * addressed through a fixed table of chunks, so entries never move and readers don't take a lock for entries
+ * which have already been published. A reader waiting for an entry beyond the end sleeps until more names are
+ * published or the feed is closed.
+ */
+typedef struct {
+	const char ***pppChunks; // FEED_MAX_CHUNKS chunks of 1 << FEED_CHUNK_SHIFT names each
+	std::atomic<int> iCount; // published names
+	std::atomic<bool> bClosed; // no more names will be appended
+	pthread_mutex_t mutex; // serializes appends, protects the following members
+	pthread_cond_t cond; // signalled on appends and when the feed is closed
+	vector<char*> blocks; // path storage
+	size_t uBlockFill; // bytes used in the last block
+} FILE_FEED;
+
+/* Opaque scanner state (see dir_scan.cpp) */
+struct DIR_SCAN;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* feed_init, feed_destroy
+ *  Initialize an empty feed and release all its memory. The feed must not be used concurrently with
+ *  feed_destroy.
+ */
+void feed_init(FILE_FEED *feed);
+void feed_destroy(FILE_FEED *feed);
+
+/* feed_append
+ *  Publishes iCount NUL-terminated names which are stored back to back in pNames.
+ */
+void feed_append(FILE_FEED *feed, const char *pNames, int iCount);
+
+/* feed_close
+ *  Marks the end of the feed and wakes up all waiting readers.
+ */
+void feed_close(FILE_FEED *feed);
+
+/* feed_wait
+ *  Waits until the feed has an entry iIndex or has been closed.
+ *
+ *  Return value:
+ *    true if the entry exists, false if the feed has been closed with fewer entries
+ */
+bool feed_wait(FILE_FEED *feed, int iIndex);
+
+/* feed_count
+ *  Returns the number of names published so far.
+ */
+int feed_count(const FILE_FEED *feed);
+
+/* feed_name
+ *  Returns the name with index iIndex, which must have been published.
+ */
+const char *feed_name(const FILE_FEED *feed, int iIndex);
+
+/* is_wav_name
+ *  Returns true if the file name of len characters ends with ".wav" in any case. Doesn't allocate.
+ */
+bool is_wav_name(const char *name, size_t len);
+
+/* make_directories
+ *  Creates directory pcPath including all missing parents (like mkdir -p). An existing directory is fine.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int make_directories(const char *pcPath);
+
+/* scan_start
+ *  Starts cfg->iThreads scanner threads which append the paths of all WAV files below pcRoot (pcRoot, a path
+ *  separator and the path relative to pcRoot) to feed and close it when they are done (unless cfg->bKeepOpen
+ *  is set). With cfg->pcOutDir, the directories of the output tree are created before the files of the
+ *  corresponding input directory are published.
+ *
+ *  Return value:
+ *    scanner handle to be passed to scan_finish, NULL if pcRoot can't be read
+ */
+DIR_SCAN *scan_start(const char *pcRoot, const SCAN_CFG *cfg, FILE_FEED *feed);
+
+/* scan_finish
+ *  Waits until the scan is complete and releases the scanner.
+ *
+ *  Return value:
+ *    number of directories (or output directories) which couldn't be read (or created)
+ */
+int scan_finish(DIR_SCAN *scan);
+
+#endif // __DIR_SCAN_H_
@@ -0,0 +1,101 @@
+#include "encoder_cache.h"
+#include "lame_interface.h"
+#include <chrono>
+
+ENCODER_CACHE::ENCODER_CACHE() : iEntries(0), llClock(0)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+ENCODER_CACHE::~ENCODER_CACHE()
+{
+	for (int i = 0; i < iEntries; i++)
+		lame_close(entries[i].gfp);
+	iEntries = 0;
+}
+
+static void make_key(const FMT_DATA *hdr, const ENCODE_PARAMS *params, ENC_KEY *key)
+{
+	ENCODE_PARAMS defaultParams;
+	if (params == NULL) {
+		encode_default_params(&defaultParams);
+		params = &defaultParams;
+	}
+	key->iSampleRate = hdr->dwSamplesPerSec;
+	key->iChannels = hdr->wChannels;
+	key->iBitrate = params->iBitrate;
+	key->iQuality = params->iQuality;
+}
+
+static bool key_equals(const ENC_KEY *a, const ENC_KEY *b)
+{
+	return a->iSampleRate == b->iSampleRate && a->iChannels == b->iChannels && a->iBitrate == b->iBitrate &&
+		a->iQuality == b->iQuality;
+}
+
+lame_global_flags *enc_cache_acquire(ENCODER_CACHE *cache, const FMT_DATA *hdr, const unsigned int iDataSize,
+	const ENCODE_PARAMS *params)
+{
+	ENC_KEY key;
+	make_key(hdr, params, &key);
+	for (int i = 0; i < cache->iEntries; i++) {
+		if (!key_equals(&cache->entries[i].key, &key)) continue;
+
+		// take the encoder out of the cache and start a new stream
+		lame_global_flags *gfp = cache->entries[i].gfp;
+		cache->entries[i] = cache->entries[--cache->iEntries];
+		std::chrono::steady_clock::time_point tBegin = std::chrono::steady_clock::now();
+		if (lame_init_bitstream(gfp) != 0) {
+			lame_close(gfp);
+			break;
+		}
+		std::chrono::duration<double> tReset = std::chrono::steady_clock::now() - tBegin;
+		lame_set_num_samples(gfp, iDataSize / hdr->wBlockAlign);
+		cache->stats.uHits++;
+		// the average initialization of a miss minus the reset, which may cost as much for tiny tables
+		double dSaved = cache->stats.uMisses > 0 ? cache->stats.dInitSeconds / cache->stats.uMisses : 0.0;
+		if (dSaved > tReset.count()) cache->stats.dSavedSeconds += dSaved - tReset.count();
+		return gfp;
+	}
+
+	std::chrono::steady_clock::time_point tBegin = std::chrono::steady_clock::now();
+	lame_global_flags *gfp = create_encoder(hdr, iDataSize, false, params);
+	std::chrono::duration<double> tInit = std::chrono::steady_clock::now() - tBegin;
+	cache->stats.uMisses++;
+	cache->stats.dInitSeconds += tInit.count();
+	return gfp;
+}
+
+void enc_cache_release(ENCODER_CACHE *cache, const FMT_DATA *hdr, const ENCODE_PARAMS *params,
+	lame_global_flags *gfp, bool bReusable)
+{
+	if (gfp == NULL) return;
+	if (!bReusable) {
+		lame_close(gfp);
+		return;
+	}
+
+	int iSlot = cache->iEntries;
+	if (iSlot == ENC_CACHE_SIZE) {
+		// evict the least recently used encoder
+		iSlot = 0;
+		for (int i = 1; i < cache->iEntries; i++) {
+			if (cache->entries[i].llLastUse < cache->entries[iSlot].llLastUse) iSlot = i;
+		}
+		lame_close(cache->entries[iSlot].gfp);
+	} else {
+		cache->iEntries++;
+	}
+	ENC_CACHE_ENTRY *entry = &cache->entries[iSlot];
+	make_key(hdr, params, &entry->key);
+	entry->gfp = gfp;
+	entry->llLastUse = ++cache->llClock;
+}
+
+void enc_cache_add_stats(ENC_CACHE_STATS *dst, const ENC_CACHE_STATS *src)
+{
+	dst->uHits += src->uHits;
+	dst->uMisses += src->uMisses;
+	dst->dInitSeconds += src->dInitSeconds;
+	dst->dSavedSeconds += src->dSavedSeconds;
+}
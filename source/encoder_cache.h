@@ -0,0 +1,94 @@
+#ifndef __ENCODER_CACHE_H_
+#define __ENCODER_CACHE_H_
+
+#include "lame.h"
+#include "wave.h"
+
+/////////////////////
+// per-thread cache of initialized LAME encoders
+/////////////////////
+
+/*
+ * lame_init_params builds LAME's psychoacoustic, quantization and ATH tables for the given parameters, which
+ * costs more than encoding a sub-second file. A worker therefore keeps the encoders of its last few jobs and hands
+ * them out again for jobs with the same parameters. lame_init_params is called only once per encoder (LAME 3.100
+ * rejects a second call, older versions leak the tables); a cached encoder, which lame_encode_flush has emptied,
+ * only starts a new bitstream with lame_init_bitstream.
+ *
+ * The output of a reused encoder differs from that of a new one: LAME doesn't insert the initial encoder delay
+ * again, and the psychoacoustic state carries over from the previous file, so the MP3 data of a file depends on
+ * the files its thread encoded before. Runs with reuse are only reproducible with the same job order and thread
+ * count, which is why the manifest and the output cache keep their results apart (see main.cpp).
+ */
+
+#define ENC_CACHE_SIZE 4 // encoders kept per thread
+
+/* Encoding parameters (lame_interface.h) */
+struct ENCODE_PARAMS;
+
+/* Parameters which determine LAME's tables. Encoders are only shared between jobs with equal keys. */
+typedef struct {
+	int iSampleRate;
+	int iChannels;
+	int iBitrate;
+	int iQuality;
+} ENC_KEY;
+
+typedef struct {
+	ENC_KEY key;
+	lame_global_flags *gfp;
+	unsigned long long llLastUse; // for evicting the least recently used encoder
+} ENC_CACHE_ENTRY;
+
+/* Cache statistics, can be summed up over several threads. */
+typedef struct {
+	unsigned int uHits;
+	unsigned int uMisses;
+	double dInitSeconds; // time spent in lame_init_params on misses
+	double dSavedSeconds; // estimated initialization time saved by hits (never negative)
+} ENC_CACHE_STATS;
+
+/* Encoders owned by a single thread. All of them are closed by the destructor. */
+struct ENCODER_CACHE {
+	ENC_CACHE_ENTRY entries[ENC_CACHE_SIZE];
+	int iEntries;
+	unsigned long long llClock;
+	ENC_CACHE_STATS stats;
+
+	ENCODER_CACHE();
+	~ENCODER_CACHE();
+
+private:
+	ENCODER_CACHE(const ENCODER_CACHE&); // not copyable
+	ENCODER_CACHE &operator=(const ENCODER_CACHE&);
+};
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* enc_cache_acquire
+ *  Returns an encoder with the encoding parameters params (the program's if NULL) for the input described by hdr
+ *  and iDataSize: a cached one with matching parameters which is reset for a new stream, or a new one created by
+ *  create_encoder.
+ *
+ *  Return value:
+ *    encoder ready for encoding (hand back with enc_cache_release), NULL if the parameters are invalid
+ */
+lame_global_flags *enc_cache_acquire(ENCODER_CACHE *cache, const FMT_DATA *hdr, const unsigned int iDataSize,
+	const ENCODE_PARAMS *params);
+
+/* enc_cache_release
+ *  Hands an encoder obtained by enc_cache_acquire for the input described by hdr and params back. If bReusable is
+ *  set, the encoder must have been flushed completely by lame_encode_flush; it is kept for later jobs (evicting the
+ *  least recently used one if the cache is full). Otherwise it is closed.
+ */
+void enc_cache_release(ENCODER_CACHE *cache, const FMT_DATA *hdr, const ENCODE_PARAMS *params,
+	lame_global_flags *gfp, bool bReusable);
+
+/* enc_cache_add_stats
+ *  Adds the statistics of src to dst.
+ */
+void enc_cache_add_stats(ENC_CACHE_STATS *dst, const ENC_CACHE_STATS *src);
+
+#endif // __ENCODER_CACHE_H_
@@ -0,0 +1,323 @@
+#include "encoder_pool.h"
+#include <deque>
+#include "trace.h"
+#include "topology.h"
+
+/* A queued job with its own copies of the file names. */
+struct POOL_TASK {
+	POOL_JOB job;
+	string sInFile, sOutFile;
+	double tSubmit;
+};
+
+struct ENCODER_POOL {
+	INPUT_CFG inputCfg;
+	OUTPUT_CFG outputCfg;
+	int iQueueDepth;
+	vector<pthread_t> threads;
+	pthread_mutex_t mutex; // protects the following members
+	pthread_cond_t notEmpty; // signalled when a task is queued or the pool is stopped
+	pthread_cond_t notFull; // signalled when a task is taken from the queue
+	pthread_cond_t idle; // signalled when the last submitted task is complete
+	deque<POOL_TASK*> queue;
+	int iUnfinished; // tasks queued or running
+	bool bStopping;
+};
+
+void pool_default_cfg(POOL_CFG *cfg)
+{
+	// the CPUs this process may use (affinity mask and cgroup quota), like the command line workers
+	CPU_TOPOLOGY topology;
+	topology_detect(&topology);
+	cfg->iThreads = topology_default_threads(&topology, PIN_NONE);
+	cfg->iQueueDepth = POOL_DEFAULT_QUEUE_DEPTH;
+	cfg->pInputCfg = NULL;
+	cfg->pOutputCfg = NULL;
+}
+
+void pool_default_job(POOL_JOB *job)
+{
+	memset(job, 0, sizeof(POOL_JOB));
+	job->input = POOL_INPUT_FILE;
+	job->output = POOL_OUTPUT_FILE;
+	encode_default_params(&job->params);
+}
+
+/* opens the input of job and parses its format, sets pcError on failure */
+static int open_job_input(const POOL_TASK *task, const INPUT_CFG *inputCfg, JOB_RESOURCES &res,
+	unsigned int &iDataSize, const char* &pcError)
+{
+	const POOL_JOB *job = &task->job;
+	switch (job->input) {
+	case POOL_INPUT_FILE:
+		if (EXIT_SUCCESS != open_wave(task->sInFile.c_str(), inputCfg, &res.in, res.hdr, iDataSize)) {
+			pcError = "unable to open or parse the WAV file";
+			return EXIT_FAILURE;
+		}
+		res.bInputOpen = true;
+		return EXIT_SUCCESS;
+	case POOL_INPUT_WAV:
+		input_open_memory(&res.in, job->pInData, job->uInSize);
+		res.bInputOpen = true;
+		if (EXIT_SUCCESS != parse_wave(&res.in, res.hdr, iDataSize)) {
+			pcError = "invalid WAV data";
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	case POOL_INPUT_PCM:
+		*res.hdr = job->pcm;
+		memcpy(res.hdr->ID, "fmt ", 4);
+		res.hdr->chunkSize = 16;
+		res.hdr->wBlockAlign = res.hdr->wChannels * (res.hdr->wBitsPerSample / 8);
+		res.hdr->dwBytesPerSec = res.hdr->dwSamplesPerSec * res.hdr->wBlockAlign;
+		if (EXIT_SUCCESS != check_format_data(res.hdr) || job->uInSize > 0xFFFFFFFFULL) {
+			pcError = "unsupported PCM format";
+			return EXIT_FAILURE;
+		}
+		input_open_memory(&res.in, job->pInData, job->uInSize);
+		res.bInputOpen = true;
+		iDataSize = (unsigned int)(job->uInSize - job->uInSize % res.hdr->wBlockAlign); // whole frames only
+		return EXIT_SUCCESS;
+	}
+	pcError = "unknown input type";
+	return EXIT_FAILURE;
+}
+
+/* converts the input of task into its output */
+static void run_task(const POOL_TASK *task, const INPUT_CFG *inputCfg, const OUTPUT_CFG *outputCfg,
+	WORKER_ARENA *arena, POOL_RESULT *result)
+{
+	TRACE_SCOPE("pool job");
+	const POOL_JOB *job = &task->job;
+	result->iStatus = EXIT_FAILURE;
+	result->pcError = NULL;
+
+	JOB_RESOURCES res;
+	unsigned int iDataSize = 0;
+	if (EXIT_SUCCESS != open_job_input(task, inputCfg, res, iDataSize, result->pcError))
+		return;
+	result->dAudioSeconds = (double)(iDataSize / res.hdr->wBlockAlign) / res.hdr->dwSamplesPerSec;
+
+	res.gfp = create_encoder(res.hdr, iDataSize, false, &job->params);
+	if (res.gfp == NULL) {
+		result->pcError = "invalid encoding parameters";
+		return;
+	}
+
+	FILE_TIMING timing;
+	memset(&timing, 0, sizeof(timing));
+	int ret;
+	if (job->output == POOL_OUTPUT_FILE) {
+		ret = encode_stream_to_file(res.gfp, res.hdr, &res.in, iDataSize, task->sOutFile.c_str(), arena, outputCfg,
+			&timing, NULL);
+	} else {
+		MP3_OUTPUT out;
+		output_open_sink(&out, &job->sink);
+		ret = encode_stream(res.gfp, res.hdr, &res.in, iDataSize, &out, arena, &timing, NULL);
+		timing.llOutBytes = output_size(&out);
+		if (EXIT_SUCCESS != output_close(&out) && ret == EXIT_SUCCESS) {
+			result->pcError = job->sink.pfnWrite != NULL ? "write callback failed" : "output buffer too small";
+			ret = EXIT_FAILURE;
+		}
+	}
+	result->llOutBytes = timing.llOutBytes;
+	if (ret != EXIT_SUCCESS && result->pcError == NULL) result->pcError = "encoding failed";
+	result->iStatus = ret;
+}
+
+static void *pool_thread(void *arg)
+{
+	ENCODER_POOL *pool = (ENCODER_POOL*)arg;
+
+	// buffers of this thread, recycled for all of its jobs
+	WORKER_ARENA arena;
+	INPUT_RING inputRing;
+	INPUT_CFG inputCfg;
+	init_thread_input_cfg(&pool->inputCfg, &arena.input, &inputRing, &inputCfg);
+	OUTPUT_RING outputRing;
+	OUTPUT_CFG outputCfg;
+	init_thread_output_cfg(&pool->outputCfg, &arena.output, &outputRing, &outputCfg);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (true) {
+		while (pool->queue.empty() && !pool->bStopping)
+			pthread_cond_wait(&pool->notEmpty, &pool->mutex);
+		if (pool->queue.empty()) break; // stopping and nothing left
+		POOL_TASK *task = pool->queue.front();
+		pool->queue.pop_front();
+		pthread_cond_signal(&pool->notFull);
+		pthread_mutex_unlock(&pool->mutex);
+
+		POOL_RESULT result;
+		memset(&result, 0, sizeof(result));
+		run_task(task, &inputCfg, &outputCfg, &arena, &result);
+		result.dLatency = report_now() - task->tSubmit;
+		if (task->job.pfnDone != NULL) task->job.pfnDone(&result, task->job.pDoneCtx);
+		delete task;
+
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->iUnfinished == 0) pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+ENCODER_POOL *pool_create(const POOL_CFG *cfg)
+{
+	POOL_CFG defaultCfg;
+	if (cfg == NULL) {
+		pool_default_cfg(&defaultCfg);
+		cfg = &defaultCfg;
+	}
+	ENCODER_POOL *pool = new ENCODER_POOL;
+	if (cfg->pInputCfg != NULL)
+		pool->inputCfg = *cfg->pInputCfg;
+	else
+		input_default_cfg(&pool->inputCfg);
+	pool->inputCfg.pBlockBuffer = NULL; // every thread has its own
+	pool->inputCfg.pRing = NULL;
+	if (cfg->pOutputCfg != NULL)
+		pool->outputCfg = *cfg->pOutputCfg;
+	else
+		output_default_cfg(&pool->outputCfg);
+	pool->outputCfg.pBuffers = NULL;
+	pool->outputCfg.pRing = NULL;
+	pool->iQueueDepth = cfg->iQueueDepth > 0 ? cfg->iQueueDepth : 1;
+	pool->iUnfinished = 0;
+	pool->bStopping = false;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->notEmpty, NULL);
+	pthread_cond_init(&pool->notFull, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+
+	int iThreads = cfg->iThreads > 0 ? cfg->iThreads : 1;
+	for (int i = 0; i < iThreads; i++) {
+		pthread_t thread;
+		if (0 == pthread_create(&thread, NULL, pool_thread, (void*)pool)) pool->threads.push_back(thread);
+	}
+	if (pool->threads.empty()) {
+		pool_destroy(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+static int submit_task(ENCODER_POOL *pool, const POOL_JOB *job, bool bWait)
+{
+	if ((job->input == POOL_INPUT_FILE && job->pcInFile == NULL) ||
+		(job->input != POOL_INPUT_FILE && job->pInData == NULL && job->uInSize > 0) ||
+		(job->output == POOL_OUTPUT_FILE && job->pcOutFile == NULL) ||
+		(job->output == POOL_OUTPUT_SINK && job->sink.pfnWrite == NULL && job->sink.pBuffer == NULL))
+		return EXIT_FAILURE;
+
+	POOL_TASK *task = new POOL_TASK;
+	task->job = *job;
+	if (job->input == POOL_INPUT_FILE) task->sInFile = job->pcInFile;
+	if (job->output == POOL_OUTPUT_FILE) task->sOutFile = job->pcOutFile;
+	task->job.pcInFile = NULL; // the copies are used
+	task->job.pcOutFile = NULL;
+	task->tSubmit = report_now();
+
+	pthread_mutex_lock(&pool->mutex);
+	while (bWait && !pool->bStopping && (int)pool->queue.size() >= pool->iQueueDepth)
+		pthread_cond_wait(&pool->notFull, &pool->mutex);
+	if (pool->bStopping || (int)pool->queue.size() >= pool->iQueueDepth) {
+		pthread_mutex_unlock(&pool->mutex);
+		delete task;
+		return EXIT_FAILURE;
+	}
+	pool->queue.push_back(task);
+	pool->iUnfinished++;
+	pthread_cond_signal(&pool->notEmpty);
+	pthread_mutex_unlock(&pool->mutex);
+	return EXIT_SUCCESS;
+}
+
+int pool_submit(ENCODER_POOL *pool, const POOL_JOB *job)
+{
+	return submit_task(pool, job, true);
+}
+
+int pool_try_submit(ENCODER_POOL *pool, const POOL_JOB *job)
+{
+	return submit_task(pool, job, false);
+}
+
+void pool_drain(ENCODER_POOL *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->iUnfinished > 0)
+		pthread_cond_wait(&pool->idle, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_destroy(ENCODER_POOL *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->bStopping = true;
+	pthread_cond_broadcast(&pool->notEmpty);
+	pthread_cond_broadcast(&pool->notFull); // fails submitters which are waiting for room
+	pthread_mutex_unlock(&pool->mutex);
+	for (size_t i = 0; i < pool->threads.size(); i++) pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->notFull);
+	pthread_cond_destroy(&pool->notEmpty);
+	pthread_mutex_destroy(&pool->mutex);
+	delete pool;
+}
+
+/////////////////////
+// C++ interface
+/////////////////////
+
+/* completion context of a job submitted through EncoderPool */
+struct POOL_PROMISE {
+	promise<POOL_RESULT> result;
+	void (*pfnDone)(const POOL_RESULT *result, void *pCtx); // the caller's callback
+	void *pDoneCtx;
+};
+
+static void fulfil_promise(const POOL_RESULT *result, void *pCtx)
+{
+	POOL_PROMISE *p = (POOL_PROMISE*)pCtx;
+	if (p->pfnDone != NULL) p->pfnDone(result, p->pDoneCtx);
+	p->result.set_value(*result);
+	delete p;
+}
+
+EncoderPool::EncoderPool(const POOL_CFG *cfg)
+{
+	pPool = pool_create(cfg);
+}
+
+EncoderPool::~EncoderPool()
+{
+	if (pPool != NULL) pool_destroy(pPool);
+}
+
+future<POOL_RESULT> EncoderPool::submit(const POOL_JOB &job)
+{
+	POOL_PROMISE *p = new POOL_PROMISE;
+	p->pfnDone = job.pfnDone;
+	p->pDoneCtx = job.pDoneCtx;
+	future<POOL_RESULT> f = p->result.get_future();
+
+	POOL_JOB wrapped = job;
+	wrapped.pfnDone = fulfil_promise;
+	wrapped.pDoneCtx = p;
+	if (pPool == NULL || EXIT_SUCCESS != pool_submit(pPool, &wrapped)) {
+		POOL_RESULT failed;
+		memset(&failed, 0, sizeof(failed));
+		failed.iStatus = EXIT_FAILURE;
+		failed.pcError = pPool == NULL ? "pool not running" : "job not accepted";
+		p->result.set_value(failed);
+		delete p;
+	}
+	return f;
+}
+
+void EncoderPool::drain()
+{
+	if (pPool != NULL) pool_drain(pPool);
+}
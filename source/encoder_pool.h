@@ -0,0 +1,157 @@
+#ifndef __ENCODER_POOL_H_
+#define __ENCODER_POOL_H_
+
+#include <future>
+#include "lame_interface.h"
+
+using namespace std;
+
+/////////////////////
+// embeddable encoder pool
+/////////////////////
+
+/*
+ * A pool of encoder threads for programs which link the encoder as a library (make lib) instead of running the
+ * command line tool. Jobs are submitted one by one and wait in a bounded queue until a thread is free; each job
+ * names its input, its output and its encoding parameters:
+ *   input   a WAV file, a complete WAV file in memory, or interleaved PCM frames in memory in a given format
+ *   output  an MP3 file, a caller-supplied memory buffer, or a write callback (MP3_SINK)
+ * Completion is reported through a callback on the encoder thread, or through a future with the EncoderPool
+ * wrapper. The threads use the same building blocks as the command line workers (input and output backends,
+ * worker arenas, streaming encode), and several pools may run in the same process. The command line tool doesn't
+ * run on a pool yet: its workers (complete_encode_worker) also handle the manifest, the output cache, encoder reuse
+ * and the adaptive thread count, which the pool has no counterpart for.
+ */
+
+#define POOL_DEFAULT_QUEUE_DEPTH 64 // jobs waiting for a thread before pool_submit blocks
+
+/* Sources of a job's PCM data. */
+typedef enum {
+	POOL_INPUT_FILE = 0, // WAV file pcInFile
+	POOL_INPUT_WAV, // complete WAV file of uInSize bytes at pInData
+	POOL_INPUT_PCM // uInSize bytes of interleaved PCM frames at pInData in the format given by pcm
+} POOL_INPUT;
+
+/* Destinations of a job's MP3 data. */
+typedef enum {
+	POOL_OUTPUT_FILE = 0, // MP3 file pcOutFile
+	POOL_OUTPUT_SINK // memory buffer or write callback given by sink
+} POOL_OUTPUT;
+
+/* Outcome of a job. */
+typedef struct {
+	int iStatus; // EXIT_SUCCESS or EXIT_FAILURE
+	const char *pcError; // static description of the failure, NULL on success
+	unsigned long long llOutBytes; // MP3 bytes written
+	double dAudioSeconds; // length of the input
+	double dLatency; // seconds from pool_submit until the job was complete
+} POOL_RESULT;
+
+/* A job. File names are copied by pool_submit, memory buffers (pInData, sink.pBuffer) must stay valid until the
+ * job is complete. A sink's write callback is called on the encoder thread.
+ */
+typedef struct {
+	POOL_INPUT input;
+	const char *pcInFile; // POOL_INPUT_FILE
+	const void *pInData; // POOL_INPUT_WAV, POOL_INPUT_PCM
+	size_t uInSize;
+	FMT_DATA pcm; // POOL_INPUT_PCM: wFmtTag, wChannels, dwSamplesPerSec and wBitsPerSample of the frames (the
+	              // remaining fields are derived from these)
+	POOL_OUTPUT output;
+	const char *pcOutFile; // POOL_OUTPUT_FILE
+	MP3_SINK sink; // POOL_OUTPUT_SINK
+	ENCODE_PARAMS params;
+	void (*pfnDone)(const POOL_RESULT *result, void *pCtx); // called on the encoder thread when the job is
+	void *pDoneCtx;                                         // complete (optional)
+} POOL_JOB;
+
+/* Pool configuration. */
+typedef struct {
+	int iThreads; // encoder threads (at least 1)
+	int iQueueDepth; // jobs which may wait for a thread before pool_submit blocks (at least 1)
+	const INPUT_CFG *pInputCfg; // input backend for POOL_INPUT_FILE jobs (defaults if NULL)
+	const OUTPUT_CFG *pOutputCfg; // output backend for POOL_OUTPUT_FILE jobs (defaults if NULL)
+} POOL_CFG;
+
+/* Opaque pool state (see encoder_pool.cpp) */
+struct ENCODER_POOL;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* pool_default_cfg
+ *  Fills cfg with one thread per CPU the process may use (topology_default_threads), POOL_DEFAULT_QUEUE_DEPTH
+ *  and the default backends.
+ */
+void pool_default_cfg(POOL_CFG *cfg);
+
+/* pool_default_job
+ *  Fills job with a file to file job with the program's encoding parameters (encode_default_params), which the
+ *  caller completes with the input and output.
+ */
+void pool_default_job(POOL_JOB *job);
+
+/* pool_create
+ *  Starts a pool configured by cfg (defaults if NULL). The configurations pointed to by cfg are copied.
+ *
+ *  Return value:
+ *    pool handle to be passed to pool_destroy, NULL if no thread could be started
+ */
+ENCODER_POOL *pool_create(const POOL_CFG *cfg);
+
+/* pool_submit
+ *  Queues job, waiting while the queue is full. Thread-safe.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS, or EXIT_FAILURE if the job is invalid or the pool is being destroyed (job->pfnDone is not
+ *    called then)
+ */
+int pool_submit(ENCODER_POOL *pool, const POOL_JOB *job);
+
+/* pool_try_submit
+ *  Like pool_submit, but fails right away instead of waiting while the queue is full.
+ */
+int pool_try_submit(ENCODER_POOL *pool, const POOL_JOB *job);
+
+/* pool_drain
+ *  Waits until all jobs submitted so far are complete. Thread-safe.
+ */
+void pool_drain(ENCODER_POOL *pool);
+
+/* pool_destroy
+ *  Completes all queued jobs, stops the threads and releases the pool.
+ */
+void pool_destroy(ENCODER_POOL *pool);
+
+/////////////////////
+// C++ interface
+/////////////////////
+
+/*
+ * Owns a pool (destroyed with the object) and reports completion through futures.
+ */
+class EncoderPool {
+public:
+	explicit EncoderPool(const POOL_CFG *cfg = NULL);
+	~EncoderPool();
+
+	/* false if the pool couldn't be started */
+	bool ok() const { return pPool != NULL; }
+
+	/* Queues job (see pool_submit). job.pfnDone, if set, is still called before the future becomes ready. A job
+	 * which can't be queued yields a failed result right away.
+	 */
+	future<POOL_RESULT> submit(const POOL_JOB &job);
+
+	/* waits until all jobs submitted so far are complete */
+	void drain();
+
+private:
+	ENCODER_POOL *pPool;
+
+	EncoderPool(const EncoderPool&); // not copyable
+	EncoderPool &operator=(const EncoderPool&);
+};
+
+#endif // __ENCODER_POOL_H_
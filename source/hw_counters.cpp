@@ -0,0 +1,172 @@
+#include "hw_counters.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <atomic>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#ifdef WIN32
+#define HWC_THREAD_LOCAL __declspec(thread)
+#else
+#define HWC_THREAD_LOCAL __thread
+#endif
+
+/* Counter group of a single thread. Only the owning thread writes, hwc_collect reads after all threads are done. */
+struct HW_THREAD {
+	HW_COUNTS counts;
+	int fds[HW_COUNTER_COUNT]; // -1 if the event couldn't be opened
+	int iOpen; // events in the group, in the order of fds
+	double dLast[HW_COUNTER_COUNT]; // scaled values at the previous lap
+	HW_THREAD *pNext; // registry of all threads
+};
+
+static std::atomic<bool> bEnabled(false);
+static bool bUserOnly = false;
+static std::atomic<HW_THREAD*> pThreads(NULL);
+static HWC_THREAD_LOCAL HW_THREAD *pMyThread = NULL;
+
+static const char *counterNames[HW_COUNTER_COUNT] = { "cycles", "instructions", "llc_misses", "branch_misses" };
+
+const char *hwc_counter_name(HW_COUNTER counter)
+{
+	return counterNames[counter];
+}
+
+bool hwc_enabled()
+{
+	return bEnabled;
+}
+
+bool hwc_user_only()
+{
+	return bUserOnly;
+}
+
+#ifdef __linux__
+
+static const unsigned long long eventConfigs[HW_COUNTER_COUNT] = {
+	PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+/* opens one event of the calling thread, group leader if iGroupFd is -1 */
+static int open_event(HW_COUNTER counter, int iGroupFd, bool bExcludeKernel)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = eventConfigs[counter];
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.disabled = iGroupFd == -1; // the leader starts the whole group
+	attr.exclude_kernel = bExcludeKernel;
+	attr.exclude_hv = 1;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, iGroupFd, 0);
+}
+
+int hwc_start()
+{
+	// probe with a cycle counter on the calling thread, kernel time only if we're allowed to
+	int fd = open_event(HW_CYCLES, -1, false);
+	if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+		fd = open_event(HW_CYCLES, -1, true);
+		bUserOnly = fd >= 0;
+	}
+	if (fd < 0) return EXIT_FAILURE;
+	close(fd);
+	bEnabled = true;
+	return EXIT_SUCCESS;
+}
+
+/* reads the group and returns the scaled values of all counters */
+static bool read_group(HW_THREAD *t, double values[HW_COUNTER_COUNT])
+{
+	unsigned long long buf[3 + HW_COUNTER_COUNT]; // nr, time enabled, time running, values
+	ssize_t n = read(t->fds[HW_CYCLES], buf, sizeof(buf));
+	if (n < (ssize_t)(3 * sizeof(unsigned long long)) || buf[0] != (unsigned long long)t->iOpen) return false;
+	double dScale = buf[2] > 0 ? (double)buf[1] / buf[2] : 0.0; // multiplexed if running < enabled
+	int iValue = 0;
+	for (int c = 0; c < HW_COUNTER_COUNT; c++)
+		values[c] = t->fds[c] >= 0 ? buf[3 + iValue++] * dScale : 0.0;
+	return true;
+}
+
+void hwc_thread_start(const char *name, int id)
+{
+	if (!bEnabled || pMyThread != NULL) return;
+	HW_THREAD *t = (HW_THREAD*)calloc(1, sizeof(HW_THREAD));
+	if (t == NULL) return;
+	snprintf(t->counts.name, sizeof(t->counts.name), "%s %i", name, id);
+	t->fds[HW_CYCLES] = open_event(HW_CYCLES, -1, bUserOnly);
+	t->iOpen = t->fds[HW_CYCLES] >= 0 ? 1 : 0;
+	for (int c = HW_CYCLES + 1; c < HW_COUNTER_COUNT; c++) {
+		// an event the CPU doesn't support is left out of the group
+		t->fds[c] = t->iOpen > 0 ? open_event((HW_COUNTER)c, t->fds[HW_CYCLES], bUserOnly) : -1;
+		if (t->fds[c] >= 0) t->iOpen++;
+	}
+	if (t->iOpen > 0) {
+		ioctl(t->fds[HW_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(t->fds[HW_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+
+	t->pNext = pThreads.load();
+	while (!pThreads.compare_exchange_weak(t->pNext, t)) {}
+	pMyThread = t;
+}
+
+void hwc_thread_stop()
+{
+	HW_THREAD *t = pMyThread;
+	if (t == NULL) return;
+	for (int c = 0; c < HW_COUNTER_COUNT; c++) {
+		if (t->fds[c] >= 0) close(t->fds[c]);
+		t->fds[c] = -1;
+	}
+	t->iOpen = 0;
+	pMyThread = NULL;
+}
+
+void hwc_lap(int stage)
+{
+	HW_THREAD *t = pMyThread;
+	if (t == NULL || t->iOpen == 0) return;
+	double values[HW_COUNTER_COUNT];
+	if (!read_group(t, values)) return;
+	for (int c = 0; c < HW_COUNTER_COUNT; c++) {
+		if (stage < HW_STAGE_COUNT && values[c] > t->dLast[c])
+			t->counts.llCount[stage][c] += (unsigned long long)(values[c] - t->dLast[c]);
+		t->dLast[c] = values[c];
+	}
+}
+
+#else
+
+int hwc_start()
+{
+	errno = ENOSYS;
+	return EXIT_FAILURE;
+}
+
+void hwc_thread_start(const char *name, int id) {}
+void hwc_thread_stop() {}
+void hwc_lap(int stage) {}
+
+#endif // __linux__
+
+void hwc_add_samples(unsigned long long n)
+{
+	if (pMyThread != NULL) pMyThread->counts.llSamples += n;
+}
+
+void hwc_collect(vector<HW_COUNTS> &threads)
+{
+	threads.clear();
+	for (HW_THREAD *t = pThreads.load(); t != NULL; t = t->pNext)
+		threads.insert(threads.begin(), t->counts); // registry is in reverse order of registration
+}
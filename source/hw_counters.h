@@ -0,0 +1,93 @@
+#ifndef __HW_COUNTERS_H_
+#define __HW_COUNTERS_H_
+
+#include <vector>
+
+using namespace std;
+
+/////////////////////
+// hardware performance counters per stage
+/////////////////////
+
+/*
+ * Every thread opens a perf_event_open group of its own (cycles, instructions, LLC misses, branch misses) which
+ * counts only that thread. hwc_lap reads the whole group with a single read() and attributes everything since the
+ * previous lap to a stage, so the stage boundaries are the points where the run report takes its timestamps anyway
+ * (see report_stage). Counts are scaled if the kernel had to multiplex the group. Linux only.
+ */
+
+typedef enum {
+	HW_STAGE_PARSE = 0,
+	HW_STAGE_CONVERT, // reading and deinterleaving/converting PCM data
+	HW_STAGE_ENCODE,
+	HW_STAGE_WRITE, // including the tag frame
+	HW_STAGE_COUNT
+} HW_STAGE;
+#define HW_STAGE_NONE HW_STAGE_COUNT // lap which isn't attributed to any stage (waits, claiming jobs)
+
+typedef enum {
+	HW_CYCLES = 0,
+	HW_INSTRUCTIONS,
+	HW_LLC_MISSES,
+	HW_BRANCH_MISSES,
+	HW_COUNTER_COUNT
+} HW_COUNTER;
+
+/* Events counted by one thread (or summed over threads). */
+typedef struct {
+	char name[32];
+	unsigned long long llCount[HW_STAGE_COUNT][HW_COUNTER_COUNT];
+	unsigned long long llSamples; // PCM samples (per channel) encoded
+} HW_COUNTS;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* hwc_start
+ *  Checks that the hardware events can be opened and enables counting for all threads calling hwc_thread_start
+ *  afterwards. Kernel time is excluded if perf_event_paranoid doesn't allow counting it. Sets errno on failure.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int hwc_start();
+
+/* hwc_enabled
+ *  Returns true if hwc_start has succeeded.
+ */
+bool hwc_enabled();
+
+/* hwc_user_only
+ *  Returns true if only user space events are counted.
+ */
+bool hwc_user_only();
+
+/* hwc_thread_start, hwc_thread_stop
+ *  Open and close the counter group of the calling thread, which is named "name id" in the report. Do nothing
+ *  unless counting has been started.
+ */
+void hwc_thread_start(const char *name, int id);
+void hwc_thread_stop();
+
+/* hwc_lap
+ *  Attributes the events of the calling thread since its previous lap to stage (HW_STAGE_NONE to drop them).
+ */
+void hwc_lap(int stage);
+
+/* hwc_add_samples
+ *  Counts n encoded samples for the calling thread.
+ */
+void hwc_add_samples(unsigned long long n);
+
+/* hwc_collect
+ *  Returns the counts of all threads which have called hwc_thread_start. Call after they have finished.
+ */
+void hwc_collect(vector<HW_COUNTS> &threads);
+
+/* hwc_counter_name
+ *  Returns the name of a counter ("cycles", "instructions", "llc_misses", "branch_misses").
+ */
+const char *hwc_counter_name(HW_COUNTER counter);
+
+#endif // __HW_COUNTERS_H_
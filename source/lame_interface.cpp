@@ -1,38 +1,88 @@
 #include "lame_interface.h"
+#include "segment.h"
+#include "trace.h"
+#include "metrics.h"
 
-static pthread_mutex_t mutFilesFinished = PTHREAD_MUTEX_INITIALIZER;
+JOB_RESOURCES::~JOB_RESOURCES()
+{
+	if (gfp != NULL) lame_close(gfp);
+	if (bInputOpen) input_close(&in);
+	if (hdr != &fmt) delete hdr;
+}
+
+/* counts encoded samples for the live metrics and the hardware counters */
+static void count_encoded(lame_global_flags *gfp, const int numSamples)
+{
+	hwc_add_samples(numSamples);
+	if (metrics_slot() == NULL) return;
+	metrics_count(METRIC_SAMPLES_ENCODED, numSamples);
+	int iSampleRate = lame_get_in_samplerate(gfp);
+	if (iSampleRate > 0) metrics_count(METRIC_AUDIO_US_ENCODED, numSamples * 1000000ULL / iSampleRate);
+}
 
 int encode_to_file(lame_global_flags *gfp, const FMT_DATA *hdr, const short *leftPcm, const short *rightPcm,
-	const int iDataSize, const char *filename)
+	const unsigned int iDataSize, const char *filename, WORKER_ARENA *arena, const OUTPUT_CFG *outCfg,
+	FILE_TIMING *timing)
 {
+	TRACE_SCOPE("encode_to_file");
+	WORKER_ARENA localArena;
+	if (arena == NULL) arena = &localArena;
 	int numSamples = iDataSize / hdr->wBlockAlign;
 
 	int mp3BufferSize = numSamples * 5 / 4 + 7200; // worst case estimate
-	unsigned char *mp3Buffer = new unsigned char[mp3BufferSize];
+	unsigned char *mp3Buffer = arena_reserve(&arena->mp3, mp3BufferSize);
 
 	// call to lame_encode_buffer
-	int mp3size = lame_encode_buffer(gfp, (short*)leftPcm, (short*)rightPcm, numSamples, mp3Buffer, mp3BufferSize);
+	double t = report_now();
+	int mp3size;
+	{
+		TRACE_SCOPE("lame_encode_buffer");
+		mp3size = lame_encode_buffer(gfp, (short*)leftPcm, (short*)rightPcm, numSamples, mp3Buffer, mp3BufferSize);
+	}
+	t = report_stage(timing, STAGE_ENCODE, t);
+	count_encoded(gfp, numSamples);
 	if (!(mp3size > 0)) {
-		delete[] mp3Buffer;
 		cerr << "No data was encoded by lame_encode_buffer. Return code: " << mp3size << endl;
 		return EXIT_FAILURE;
 	}
 
 	// write to file
-	FILE *out = fopen(filename, "wb+");
-	fwrite((void*)mp3Buffer, sizeof(unsigned char), mp3size, out);
+	MP3_OUTPUT out;
+	ENCODE_PARAMS params;
+	encoder_params(gfp, &params);
+	if (EXIT_SUCCESS != output_open(&out, filename, outCfg, predict_mp3_size(hdr, iDataSize, &params))) {
+		cerr << "Unable to open output file " << filename << endl;
+		return EXIT_FAILURE;
+	}
+	output_write(&out, mp3Buffer, mp3size);
+	t = report_stage(timing, STAGE_WRITE, t);
 
 	// call to lame_encode_flush
-	int flushSize = lame_encode_flush(gfp, mp3Buffer, mp3BufferSize);
+	int flushSize;
+	{
+		TRACE_SCOPE("lame_encode_flush");
+		flushSize = lame_encode_flush(gfp, mp3Buffer, mp3BufferSize);
+	}
+	t = report_stage(timing, STAGE_ENCODE, t);
 
 	// write flushed buffers to file
-	fwrite((void*)mp3Buffer, sizeof(unsigned char), flushSize, out);
+	output_write(&out, mp3Buffer, flushSize);
+	t = report_stage(timing, STAGE_WRITE, t);
 
-	// call to lame_mp3_tags_fid (might be omitted)
-	lame_mp3_tags_fid(gfp, out);
+	// write the LAME tag frame (if enabled)
+	write_tag_frame(gfp, &out);
+	t = report_stage(timing, STAGE_TAG, t);
 
-	fclose(out);
-	delete[] mp3Buffer;
+	if (timing != NULL) {
+		timing->llOutBytes = output_size(&out);
+		timing->llOutHash = output_checksum(&out);
+	}
+	TRACE_SCOPE("close output");
+	if (EXIT_SUCCESS != output_close(&out)) {
+		cerr << "Unable to write output file " << filename << endl;
+		return EXIT_FAILURE;
+	}
+	report_stage(timing, STAGE_WRITE, t);
 
 #ifdef __VERBOSE_
 	cout << "Wrote " << mp3size + flushSize << " bytes." << endl;
@@ -40,79 +90,397 @@ int encode_to_file(lame_global_flags *gfp, const FMT_DATA *hdr, const short *lef
 	return EXIT_SUCCESS;
 }
 
+int encode_pcm_block(lame_global_flags *gfp, const PCM_CONVERTER *conv, const unsigned char *pRaw, void *pLeft,
+	void *pRight, const int numSamples, unsigned char *mp3Buffer, const int mp3BufferSize)
+{
+	count_encoded(gfp, numSamples);
+
+	// convert into the buffers if the raw data can't be handed to LAME directly
+	const void *pL = pRaw, *pR = NULL;
+	if (conv->convert != NULL) {
+		conv->convert(pRaw, pLeft, pRight, numSamples);
+		pL = pLeft;
+		if (conv->iChannels == 2) pR = pRight;
+		hwc_lap(HW_STAGE_CONVERT);
+	}
+
+	switch (conv->output) {
+	case PCM_OUT_S16:
+		return lame_encode_buffer(gfp, (const short*)pL, (const short*)pR, numSamples, mp3Buffer, mp3BufferSize);
+	case PCM_OUT_S16_INTERLEAVED:
+		return lame_encode_buffer_interleaved(gfp, (short*)pL, numSamples, mp3Buffer, mp3BufferSize);
+	case PCM_OUT_S32:
+		return lame_encode_buffer_int(gfp, (const int*)pL, (const int*)pR, numSamples, mp3Buffer, mp3BufferSize);
+	case PCM_OUT_F32:
+		return lame_encode_buffer_ieee_float(gfp, (const float*)pL, (const float*)pR, numSamples, mp3Buffer,
+			mp3BufferSize);
+	case PCM_OUT_F32_INTERLEAVED:
+		return lame_encode_buffer_interleaved_ieee_float(gfp, (const float*)pL, numSamples, mp3Buffer, mp3BufferSize);
+	}
+	return -1;
+}
+
+int encode_stream(lame_global_flags *gfp, const FMT_DATA *hdr, WAV_INPUT *in, const unsigned int iDataSize,
+	MP3_OUTPUT *out, WORKER_ARENA *arena, FILE_TIMING *timing, PCM_HASH *pHash)
+{
+	TRACE_SCOPE("encode_stream");
+	WORKER_ARENA localArena;
+	if (arena == NULL) arena = &localArena;
+	PCM_CONVERTER conv;
+	if (EXIT_SUCCESS != pcm_get_converter(hdr, PCM_ISA_AUTO, &conv)) {
+		cerr << "Unsupported PCM format." << endl;
+		return EXIT_FAILURE;
+	}
+
+	const int mp3BufferSize = PCM_BLOCK_SAMPLES * 5 / 4 + 7200; // worst case estimate for one block
+	unsigned char *pRaw = arena_reserve(&arena->raw, PCM_BLOCK_SAMPLES * conv.iBytesPerFrame);
+	unsigned char *pLeft = arena_reserve(&arena->left, PCM_BLOCK_SAMPLES * conv.iOutBytesPerSample);
+	unsigned char *pRight = conv.iChannels == 2 ?
+		arena_reserve(&arena->right, PCM_BLOCK_SAMPLES * conv.iOutBytesPerSample) : NULL;
+	unsigned char *mp3Buffer = arena_reserve(&arena->mp3, mp3BufferSize);
+
+	double t = report_now();
+	unsigned int iBytesLeft = iDataSize;
+	unsigned int iBytesWritten = 0;
+	int numSamples;
+	while ((numSamples = read_pcm_block(in, hdr, pRaw, PCM_BLOCK_SAMPLES, iBytesLeft)) > 0) {
+		if (pHash != NULL) pcm_hash_update(pHash, pRaw, numSamples * hdr->wBlockAlign);
+		t = report_stage(timing, STAGE_READ, t);
+		// encode this block and append whatever frames are complete
+		int mp3size;
+		{
+			TRACE_SCOPE("encode block");
+			mp3size = encode_pcm_block(gfp, &conv, pRaw, pLeft, pRight, numSamples, mp3Buffer, mp3BufferSize);
+		}
+		t = report_stage(timing, STAGE_ENCODE, t);
+		if (mp3size < 0) {
+			cerr << "Encoding error in lame_encode_buffer. Return code: " << mp3size << endl;
+			break;
+		}
+		output_write(out, mp3Buffer, mp3size);
+		iBytesWritten += mp3size;
+		t = report_stage(timing, STAGE_WRITE, t);
+	}
+	if (numSamples != 0) // read or encoding error
+		return EXIT_FAILURE;
+	t = report_stage(timing, STAGE_READ, t); // end of data
+
+	// call to lame_encode_flush and write remaining frames
+	int flushSize;
+	{
+		TRACE_SCOPE("lame_encode_flush");
+		flushSize = lame_encode_flush(gfp, mp3Buffer, mp3BufferSize);
+	}
+	t = report_stage(timing, STAGE_ENCODE, t);
+	output_write(out, mp3Buffer, flushSize);
+	iBytesWritten += flushSize;
+	t = report_stage(timing, STAGE_WRITE, t);
+
+	// write the LAME tag frame (if enabled)
+	write_tag_frame(gfp, out);
+	report_stage(timing, STAGE_TAG, t);
+
+	if (timing != NULL) {
+		timing->llOutBytes = output_size(out);
+		timing->llOutHash = output_checksum(out);
+	}
+	if (iBytesWritten == 0) {
+		cerr << "No data was encoded." << endl;
+		return EXIT_FAILURE;
+	}
+#ifdef __VERBOSE_
+	cout << "Wrote " << iBytesWritten << " bytes." << endl;
+#endif
+	return EXIT_SUCCESS;
+}
+
+int encode_stream_to_file(lame_global_flags *gfp, const FMT_DATA *hdr, WAV_INPUT *in, const unsigned int iDataSize,
+	const char *filename, WORKER_ARENA *arena, const OUTPUT_CFG *outCfg, FILE_TIMING *timing, PCM_HASH *pHash)
+{
+	TRACE_SCOPE("encode_stream_to_file");
+	double t = report_now();
+	MP3_OUTPUT out;
+	ENCODE_PARAMS params;
+	encoder_params(gfp, &params);
+	if (EXIT_SUCCESS != output_open(&out, filename, outCfg, predict_mp3_size(hdr, iDataSize, &params))) {
+		cerr << "Unable to open output file " << filename << endl;
+		return EXIT_FAILURE;
+	}
+	report_stage(timing, STAGE_WRITE, t);
+
+	int ret = encode_stream(gfp, hdr, in, iDataSize, &out, arena, timing, pHash);
+
+	t = report_now();
+	TRACE_SCOPE("close output");
+	if (EXIT_SUCCESS != output_close(&out) && ret == EXIT_SUCCESS) {
+		cerr << "Unable to write output file " << filename << endl;
+		ret = EXIT_FAILURE;
+	}
+	report_stage(timing, STAGE_WRITE, t);
+	return ret;
+}
+
+int claim_next_file(ENC_WRK_ARGS *args)
+{
+	// the cursor only grows, so indices beyond the list simply mean there's no more work
+	int iFileIdx = args->pCursor->iNext.fetch_add(1, std::memory_order_relaxed);
+	if (args->pFeed != NULL) return feed_wait(args->pFeed, iFileIdx) ? iFileIdx : -1;
+	return iFileIdx < args->iNumFiles ? iFileIdx : -1;
+}
+
+const char *job_file_name(const ENC_WRK_ARGS *args, int iFileIdx)
+{
+	return args->pFeed != NULL ? feed_name(args->pFeed, iFileIdx) : args->pFilenames->at(iFileIdx).c_str();
+}
+
+void init_thread_input_cfg(const INPUT_CFG *shared, ARENA_BUFFER *blockBuffer, INPUT_RING *ring, INPUT_CFG *cfg)
+{
+	*cfg = *shared;
+	if (cfg->uBlockSize == 0) cfg->uBlockSize = INPUT_DEFAULT_BLOCK_SIZE;
+	cfg->pRing = input_ring_reserve(ring, cfg);
+	if (cfg->backend == INPUT_URING && cfg->pRing == NULL) cfg->backend = INPUT_PREAD; // io_uring unavailable
+	if (cfg->backend == INPUT_PREAD)
+		cfg->pBlockBuffer = arena_reserve(blockBuffer, cfg->uBlockSize);
+}
+
+void init_thread_output_cfg(const OUTPUT_CFG *shared, ARENA_BUFFER *blockBuffers, OUTPUT_RING *ring,
+	OUTPUT_CFG *cfg)
+{
+	if (shared != NULL)
+		*cfg = *shared;
+	else
+		output_default_cfg(cfg);
+	if (cfg->uBlockSize == 0) cfg->uBlockSize = OUTPUT_DEFAULT_BLOCK_SIZE;
+	if (cfg->uQueueDepth < 2) cfg->uQueueDepth = OUTPUT_DEFAULT_QUEUE_DEPTH; // the depth of the ring
+	cfg->pRing = output_ring_reserve(ring, cfg);
+	if (cfg->backend == OUTPUT_URING && cfg->pRing == NULL) cfg->backend = OUTPUT_WRITE; // io_uring unavailable
+	if (cfg->backend != OUTPUT_STDIO)
+		cfg->pBuffers = arena_reserve(blockBuffers, (size_t)cfg->uQueueDepth * cfg->uBlockSize);
+}
+
+unsigned long long predict_mp3_size(const FMT_DATA *hdr, const unsigned int iDataSize, const ENCODE_PARAMS *params)
+{
+	if (hdr->wBlockAlign == 0 || hdr->dwSamplesPerSec == 0) return 0;
+	// CBR: duration times bitrate, plus the encoder delay, padding to whole frames and the tag frame
+	unsigned long long llSamples = iDataSize / hdr->wBlockAlign + 3 * 1152;
+	unsigned long long llBitrate = params != NULL ? params->iBitrate : ENC_BITRATE;
+	return llSamples * llBitrate * 125 / hdr->dwSamplesPerSec + 1024;
+}
+
+void write_tag_frame(lame_global_flags *gfp, MP3_OUTPUT *out)
+{
+	TRACE_SCOPE("write tag");
+	unsigned char tag[2880]; // largest possible MP3 frame
+	size_t uTagSize = lame_get_lametag_frame(gfp, tag, sizeof(tag));
+	if (uTagSize > 0 && uTagSize <= sizeof(tag)) output_write_at(out, tag, uTagSize, 0);
+}
+
+void encode_default_params(ENCODE_PARAMS *params)
+{
+	params->iBitrate = ENC_BITRATE;
+	params->iQuality = ENC_QUALITY;
+}
+
+void encoder_params(const lame_global_flags *gfp, ENCODE_PARAMS *params)
+{
+	params->iBitrate = lame_get_brate(gfp);
+	params->iQuality = lame_get_quality(gfp);
+}
+
+lame_global_flags *create_encoder(const FMT_DATA *hdr, const unsigned int iDataSize, const bool bNoReservoir,
+	const ENCODE_PARAMS *params)
+{
+	TRACE_SCOPE("create_encoder");
+	// init encoding params
+	lame_global_flags *gfp = lame_init();
+	if (gfp == NULL) return NULL;
+	ENCODE_PARAMS defaultParams;
+	if (params == NULL) {
+		encode_default_params(&defaultParams);
+		params = &defaultParams;
+	}
+	lame_set_brate(gfp, params->iBitrate); // increase bitrate
+	lame_set_quality(gfp, params->iQuality); // increase quality level
+	lame_set_bWriteVbrTag(gfp, 0);
+	if (bNoReservoir) lame_set_disable_reservoir(gfp, 1);
+
+	lame_set_in_samplerate(gfp, hdr->dwSamplesPerSec);
+	lame_set_num_channels(gfp, hdr->wChannels);
+	lame_set_num_samples(gfp, iDataSize / hdr->wBlockAlign);
+	// check params
+	if (lame_init_params(gfp) != 0) {
+		lame_close(gfp);
+		return NULL;
+	}
+	return gfp;
+}
+
 void *complete_encode_worker(void* arg)
 {
 	int ret;
 	ENC_WRK_ARGS *args = (ENC_WRK_ARGS*)arg; // parse argument struct
+	if (EXIT_SUCCESS != topology_bind_thread(args->iCpu, args->iNode))
+		printf("Warning: Unable to pin worker %i to CPU %i.\n", args->iThreadId, args->iCpu);
+
+	// buffers of this thread, recycled for all of its jobs
+	WORKER_ARENA arena;
+	INPUT_RING inputRing;
+	INPUT_CFG inputCfg;
+	init_thread_input_cfg(args->pInputCfg, &arena.input, &inputRing, &inputCfg);
+	OUTPUT_RING outputRing;
+	OUTPUT_CFG outputCfg;
+	init_thread_output_cfg(args->pOutputCfg, &arena.output, &outputRing, &outputCfg);
+	ENCODER_CACHE encoders;
+	TRACE_THREAD_NAME("worker", args->iThreadId);
+	metrics_register_thread("worker", args->iThreadId);
+	hwc_thread_start("worker", args->iThreadId);
+	const double tThreadStart = report_now();
+	double tJob = 0.0; // start of the current job, 0 before the first one
+	string sMyFile, sMyFileOut; // names of the current job, reusing their memory
 
 	while (true) {
+		// everything since the start of the previous job counts as busy time
+		double tNow = report_now();
+		if (tJob > 0.0) args->report.dBusy += tNow - tJob;
+		tJob = tNow;
+		metrics_busy_end();
+		if (args->pAdapt != NULL && adapt_gate(args->pAdapt, args->iThreadId))
+			tJob = report_now(); // parked time is idle time
 #ifdef __VERBOSE_
 		cout << "Checking for work\n";
 #endif
 		// determine which file to process next
-		bool bFoundWork = false;
-		int iFileIdx = -1;
-
-		pthread_mutex_lock(&mutFilesFinished);
-		for (int i = 0; i < args->iNumFiles; i++) {
-			if (!args->pbFilesFinished[i]) {
-				args->pbFilesFinished[i] = true; // mark as being worked on
-				iFileIdx = i;
-				bFoundWork = true;
-				break;
-			}
-		}
-		pthread_mutex_unlock(&mutFilesFinished);
+		int iFileIdx = claim_next_file(args);
 
-		if (!bFoundWork) {// done yet?
+		if (iFileIdx < 0) {// done yet?
+			if (args->pAdapt != NULL) adapt_release(args->pAdapt); // the parked threads find no work either
+			args->uBufferAllocs = arena_allocations(&arena);
+			args->cacheStats = encoders.stats;
+			args->report.dWall = report_now() - tThreadStart;
+			hwc_thread_stop();
+#ifdef __VERBOSE_
+			printf("[:%i] %u buffer allocations, %lu bytes\n", args->iThreadId, args->uBufferAllocs,
+				(unsigned long)arena_bytes(&arena));
+#endif
 			return NULL; // break
 		}
-		string sMyFile = args->pFilenames->at(iFileIdx);
-		string sMyFileOut = sMyFile.substr(0, sMyFile.length() - 3) + "mp3";
+		if (args->pFeed != NULL) tJob = report_now(); // waiting for files to arrive is idle time
+		metrics_busy_begin();
+		if (args->pSegPlan != NULL) {
+			iFileIdx = process_work_item(args, iFileIdx, &arena, &inputCfg, &outputCfg);
+			if (iFileIdx < 0) continue; // segment has been encoded
+		}
+		sMyFile.assign(job_file_name(args, iFileIdx));
+		output_file_name(&outputCfg, sMyFile, sMyFileOut);
+		metrics_count(METRIC_JOBS_STARTED);
+		MANIFEST_ENTRY input;
+		if (args->pManifest != NULL) manifest_stat(sMyFile.c_str(), &input);
 
-		// start working
-		FMT_DATA *hdr = NULL;
+		// start working, everything in job is released when it goes out of scope
+		TRACE_SCOPE_DETAIL("job", sMyFile.c_str());
+		JOB_RESOURCES job;
 		short *leftPcm = NULL, *rightPcm = NULL;
-		// init encoding params
-		lame_global_flags *gfp = lame_init();
-		lame_set_brate(gfp, 192); // increase bitrate
-		lame_set_quality(gfp, 3); // increase quality level
-		lame_set_bWriteVbrTag(gfp, 0);
+		FILE_TIMING timing;
+		report_init_file(&timing, tJob);
 
 		// parse wave file
 #ifdef __VERBOSE_
 		printf("Parsing %s ...\n", sMyFile.c_str());
 #endif
-		int iDataSize = -1;
-		ret = read_wave(sMyFile.c_str(), hdr, leftPcm, rightPcm, iDataSize);
+		unsigned int iDataSize = 0;
+		ret = open_wave(sMyFile.c_str(), &inputCfg, &job.in, job.hdr, iDataSize);
+		job.bInputOpen = ret == EXIT_SUCCESS;
+		double t = report_stage(&timing, STAGE_PARSE, tJob);
+		PCM_HASH pcmHash;
+		PCM_HASH *pHash = NULL;
+		if (args->pStore != NULL) {
+			pcm_hash_init(&pcmHash);
+			pHash = &pcmHash;
+		}
+		bool bLookup = pHash != NULL; // the hash is known before encoding, so the store can be asked
+		if (ret == EXIT_SUCCESS && !args->bStreaming) {
+			// whole-file mode: convert all samples into the arena first
+			size_t uSamples = iDataSize / job.hdr->wBlockAlign;
+			leftPcm = (short*)arena_reserve(&arena.left, uSamples * sizeof(short));
+			if (job.hdr->wChannels > 1) rightPcm = (short*)arena_reserve(&arena.right, uSamples * sizeof(short));
+			void *pRaw = arena_reserve(&arena.raw, PCM_BLOCK_SAMPLES * job.hdr->wBlockAlign);
+			TRACE_SCOPE("read pcm");
+			ret = read_pcm_s16(&job.in, job.hdr, leftPcm, rightPcm, iDataSize, pRaw, pHash);
+			t = report_stage(&timing, STAGE_READ, t);
+		} else if (ret == EXIT_SUCCESS && pHash != NULL) {
+			// streaming mode: read the input twice only if the store may have it, otherwise hash while encoding
+			bLookup = store_has_format(args->pStore, job.hdr, iDataSize);
+			if (bLookup) {
+				void *pRaw = arena_reserve(&arena.raw, PCM_BLOCK_SAMPLES * job.hdr->wBlockAlign);
+				ret = hash_pcm_data(&job.in, job.hdr, iDataSize, pRaw, pHash);
+				t = report_stage(&timing, STAGE_READ, t);
+			}
+		}
 		if (ret != EXIT_SUCCESS) {
 			printf("Error in file %s. Skipping.\n", sMyFile.c_str());
+			metrics_count(METRIC_JOBS_FAILED);
 			continue; // see if there's more to do
 		}
 
-		lame_set_num_channels(gfp, hdr->wChannels);
-		lame_set_num_samples(gfp, iDataSize / hdr->wBlockAlign);
-		// check params
-		ret = lame_init_params(gfp);
-		if (ret != 0) {
+		// identical PCM data in the same format has been encoded before (or is being encoded right now)
+		string sKey;
+		if (bLookup) {
+			sKey = store_key(args->pStore, job.hdr, iDataSize, pcm_hash_final(pHash));
+			if (store_fetch(args->pStore, sKey, sMyFileOut.c_str(), timing.llOutBytes,
+				args->pManifest != NULL ? &timing.llOutHash : NULL)) {
+				report_stage(&timing, STAGE_WRITE, t);
+				printf("[:%i][ok] .... %s (cached)\n", args->iThreadId, sMyFile.c_str());
+				++args->iProcessedFiles;
+				report_add_file(&args->report, &timing, iDataSize,
+					(double)(iDataSize / job.hdr->wBlockAlign) / job.hdr->dwSamplesPerSec);
+				manifest_record(args->pManifest, sMyFile.c_str(), &input, timing.llOutBytes, timing.llOutHash);
+				metrics_job_done(timing.dLatency);
+				continue;
+			}
+		}
+
+		if (args->bReuseEncoders)
+			job.gfp = enc_cache_acquire(&encoders, job.hdr, iDataSize, NULL);
+		else
+			job.gfp = create_encoder(job.hdr, iDataSize, false, NULL);
+		report_stage(&timing, STAGE_ENCODE, t);
+		if (job.gfp == NULL) {
 			cerr << "Invalid encoding parameters! Skipping file." << endl;
+			if (bLookup) store_release(args->pStore, sKey, sMyFileOut.c_str(), false);
+			metrics_count(METRIC_JOBS_FAILED);
 			continue;
 		}
 
 		// encode to mp3
-		ret = encode_to_file(gfp, hdr, leftPcm, rightPcm, iDataSize, sMyFileOut.c_str());
+		if (args->bStreaming)
+			ret = encode_stream_to_file(job.gfp, job.hdr, &job.in, iDataSize, sMyFileOut.c_str(), &arena, &outputCfg,
+				&timing, bLookup ? NULL : pHash);
+		else
+			ret = encode_to_file(job.gfp, job.hdr, leftPcm, rightPcm, iDataSize, sMyFileOut.c_str(), &arena,
+				&outputCfg, &timing);
+		if (bLookup)
+			store_release(args->pStore, sKey, sMyFileOut.c_str(), ret == EXIT_SUCCESS);
+		else if (pHash != NULL && ret == EXIT_SUCCESS) // hashed while encoding
+			store_add(args->pStore, store_key(args->pStore, job.hdr, iDataSize, pcm_hash_final(pHash)),
+				sMyFileOut.c_str());
 		if (ret != EXIT_SUCCESS) {
 			cerr << "Unable to encode mp3: " << sMyFileOut.c_str() << endl;
+			metrics_count(METRIC_JOBS_FAILED);
 			continue;
 		}
 
 		printf("[:%i][ok] .... %s\n", args->iThreadId, sMyFile.c_str());
 		++args->iProcessedFiles;
+		report_add_file(&args->report, &timing, iDataSize,
+			(double)(iDataSize / job.hdr->wBlockAlign) / job.hdr->dwSamplesPerSec);
+		manifest_record(args->pManifest, sMyFile.c_str(), &input, timing.llOutBytes, timing.llOutHash);
+		metrics_job_done(timing.dLatency);
 
-		lame_close(gfp);
-		if (leftPcm != NULL) delete[] leftPcm;
-		if (rightPcm != NULL) delete[] rightPcm;
-		if (hdr != NULL) delete hdr;
+		// the encoder has been flushed completely and can serve the next job with the same parameters
+		if (args->bReuseEncoders) {
+			enc_cache_release(&encoders, job.hdr, NULL, job.gfp, true);
+			job.gfp = NULL;
+		}
 	}
 
 	pthread_exit((void*)0);
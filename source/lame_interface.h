@@ -5,23 +5,93 @@
 #include <sstream>
 #include "lame.h"
 #include "wave.h"
+#include "pcm_convert.h"
 #include "pthread.h"
+#include "lf_queue.h"
+#include "arena.h"
+#include "encoder_cache.h"
+#include "mp3_output.h"
+#include "report.h"
+#include "dir_scan.h"
+#include "manifest.h"
+#include "output_store.h"
+#include "topology.h"
+#include "adaptive.h"
 
 using namespace std;
 
+#define ENC_BITRATE 192 // CBR bitrate in kbit/s
+#define ENC_QUALITY 3 // LAME quality level (0 best, 9 fastest)
+
+/* Encoding parameters which can be chosen per encoder (see create_encoder). */
+struct ENCODE_PARAMS {
+	int iBitrate; // CBR bitrate in kbit/s
+	int iQuality; // LAME quality level (0 best, 9 fastest)
+};
+
+/* Work items of the segmented mode (segment.h) */
+struct SEG_PLAN;
+
 /////////////////////
 // interface structs for POSIX worker routine calls
 /////////////////////
 
+/*
+ * Claim cursor shared by all threads working on the same job list. Threads claim the next file by atomically
+ * incrementing iNext, so dispatching a job is a single fetch-and-add instead of a locked scan. The padding keeps
+ * the heavily contended cursor on a cache line of its own.
+ */
+typedef struct {
+	char pad0[LF_CACHE_LINE];
+	std::atomic<int> iNext;
+	char pad1[LF_CACHE_LINE];
+} JOB_CURSOR;
+
+/*
+ * Resources of a single job. They are released by the destructor, so every exit path of a job (including
+ * skipping an invalid file) cleans up after itself. hdr initially points to fmt, so read_wave_header stores the
+ * header there instead of allocating one; a header allocated elsewhere is deleted.
+ */
+struct JOB_RESOURCES {
+	FMT_DATA *hdr;
+	FMT_DATA fmt;
+	WAV_INPUT in;
+	bool bInputOpen;
+	lame_global_flags *gfp;
+
+	JOB_RESOURCES() : hdr(&fmt), bInputOpen(false), gfp(NULL) {}
+	~JOB_RESOURCES();
+
+private:
+	JOB_RESOURCES(const JOB_RESOURCES&); // not copyable
+	JOB_RESOURCES &operator=(const JOB_RESOURCES&);
+};
+
 /*
  * POSIX-conforming argument struct for worker routine 'complete_encode_worker'.
  */
 typedef struct {
 	vector<string> *pFilenames;
-	bool *pbFilesFinished;
+	FILE_FEED *pFeed; // job list which is still growing while the directory is scanned, replaces pFilenames and
+	                  // iNumFiles unless NULL
+	JOB_CURSOR *pCursor; // shared claim cursor into pFilenames or pFeed
 	int iNumFiles;
 	int iThreadId;
 	int iProcessedFiles;
+	bool bStreaming; // encode block-wise with constant memory instead of loading whole files
+	const INPUT_CFG *pInputCfg; // input backend used for reading WAV files
+	const OUTPUT_CFG *pOutputCfg; // output backend used for writing MP3 files (defaults if NULL)
+	SEG_PLAN *pSegPlan; // segmented mode: the cursor claims work items of this plan instead of files, else NULL
+	unsigned int uBufferAllocs; // buffer allocations made by this thread (see arena.h)
+	bool bReuseEncoders; // keep initialized encoders for following jobs (see encoder_cache.h)
+	ENC_CACHE_STATS cacheStats; // filled in when the thread exits
+	THREAD_REPORT report; // timings of the files converted by this thread (see report.h)
+	MANIFEST *pManifest; // converted files are recorded here in incremental mode, else NULL
+	OUTPUT_STORE *pStore; // outputs of identical inputs are shared through this store, else NULL
+	int iCpu; // CPU the thread pins itself to before allocating its buffers, -1: not pinned (see topology.h)
+	int iNode; // NUMA node of the thread's buffers, -1: any
+	ADAPT_CTRL *pAdapt; // parks the thread while the controller doesn't need it, NULL: always active (see adaptive.h)
+	char pad[LF_CACHE_LINE]; // keeps the counters of neighbouring threads on separate cache lines
 } ENC_WRK_ARGS;
 
 /////////////////////
@@ -31,11 +101,110 @@ typedef struct {
 /* encode_to_file
  *  Main encoding routine which reads input information from gfp and hdr as well as one or two PCM buffers,
  *  encodes it to MP3 and directly stores the MP3 data in the file given by filename.
- *  Calls lame_encode_buffer, lame_encode_flush, and lame_mp3_tags_fid internally for a complete conversion
- *  process.
+ *  Calls lame_encode_buffer, lame_encode_flush, and write_tag_frame internally for a complete conversion
+ *  process. The MP3 buffer is taken from arena (a temporary one is used if arena is NULL), the file is written
+ *  through the output layer configured by outCfg (defaults if NULL). The time spent in each stage is added to
+ *  timing unless it is NULL.
  */
 int encode_to_file(lame_global_flags *gfp, const FMT_DATA *hdr, const short *leftPcm, const short *rightPcm,
-	const int iDataSize, const char *filename);
+	const unsigned int iDataSize, const char *filename, WORKER_ARENA *arena, const OUTPUT_CFG *outCfg,
+	FILE_TIMING *timing);
+
+/* encode_pcm_block
+ *  Converts numSamples raw PCM frames with the kernels selected in conv (using pLeft/pRight as conversion
+ *  buffers, each large enough for numSamples samples of conv->iOutBytesPerSample bytes) and passes them to
+ *  the LAME entry point matching conv->output, so that 16 bit and float data is encoded without any copy.
+ *
+ *  Return value:
+ *    number of MP3 bytes written to mp3Buffer, negative LAME error code on failure
+ */
+int encode_pcm_block(lame_global_flags *gfp, const PCM_CONVERTER *conv, const unsigned char *pRaw, void *pLeft,
+	void *pRight, const int numSamples, unsigned char *mp3Buffer, const int mp3BufferSize);
+
+/* encode_stream_to_file
+ *  Streaming counterpart to encode_to_file. Reads the 'data' chunk of an input stream which has been opened by
+ *  open_wave in blocks of PCM_BLOCK_SAMPLES samples, feeds each block to encode_pcm_block and appends the
+ *  resulting MP3 frames to the file given by filename as they are produced. Memory usage is constant and
+ *  independent of the input length. All buffers are taken from arena (a temporary one is used if arena is NULL),
+ *  the file is written through the output layer configured by outCfg (defaults if NULL). The time spent in each
+ *  stage is added to timing unless it is NULL. Every block read is added to pHash unless it is NULL (see
+ *  hash_pcm_data), so the output cache gets the hash of a streamed input without reading it twice.
+ */
+int encode_stream_to_file(lame_global_flags *gfp, const FMT_DATA *hdr, WAV_INPUT *in, const unsigned int iDataSize,
+	const char *filename, WORKER_ARENA *arena, const OUTPUT_CFG *outCfg, FILE_TIMING *timing, PCM_HASH *pHash);
+
+/* encode_stream
+ *  Does the work of encode_stream_to_file, appending the MP3 data to out, which has been opened by the caller and
+ *  is left open (an output file as well as a sink, see output_open_sink). Write errors are reported by
+ *  output_close.
+ */
+int encode_stream(lame_global_flags *gfp, const FMT_DATA *hdr, WAV_INPUT *in, const unsigned int iDataSize,
+	MP3_OUTPUT *out, WORKER_ARENA *arena, FILE_TIMING *timing, PCM_HASH *pHash);
+
+/* claim_next_file
+ *  Claims the next file of the job list described by args which is not yet processed by any thread.
+ *  Lock-free and safe to call from several threads concurrently. With a feed, waits until the scanner has found
+ *  another file or the scan is complete.
+ *
+ *  Return value:
+ *    index of the claimed file, -1 if there is no more work
+ */
+int claim_next_file(ENC_WRK_ARGS *args);
+
+/* job_file_name
+ *  Returns the path of the WAV file with index iFileIdx in the job list described by args.
+ */
+const char *job_file_name(const ENC_WRK_ARGS *args, int iFileIdx);
+
+/* init_thread_input_cfg
+ *  Copies the shared input configuration into cfg for use by a single thread, which reads all its files through
+ *  blockBuffer and (uring backend) ring instead of setting up a new block buffer or ring for each of them.
+ */
+void init_thread_input_cfg(const INPUT_CFG *shared, ARENA_BUFFER *blockBuffer, INPUT_RING *ring, INPUT_CFG *cfg);
+
+/* init_thread_output_cfg
+ *  Copies the shared output configuration (defaults if shared is NULL) into cfg for use by a single thread, which
+ *  writes all its files through blockBuffers and (uring backend) ring instead of setting up new write blocks or a
+ *  new ring for each of them.
+ */
+void init_thread_output_cfg(const OUTPUT_CFG *shared, ARENA_BUFFER *blockBuffers, OUTPUT_RING *ring,
+	OUTPUT_CFG *cfg);
+
+/* predict_mp3_size
+ *  Estimates the size of the MP3 file encoded with the encoding parameters params (the program's if NULL) from
+ *  input described by hdr and iDataSize (used for preallocating the output file).
+ *
+ *  Return value:
+ *    expected size in bytes, 0 if unknown
+ */
+unsigned long long predict_mp3_size(const FMT_DATA *hdr, const unsigned int iDataSize, const ENCODE_PARAMS *params);
+
+/* write_tag_frame
+ *  Writes the LAME tag frame of a completely flushed encoder over the first frame of out. Does nothing if the
+ *  encoder doesn't write a tag (as with the program's CBR settings).
+ */
+void write_tag_frame(lame_global_flags *gfp, MP3_OUTPUT *out);
+
+/* encode_default_params
+ *  Fills params with the program's encoding parameters (ENC_BITRATE, ENC_QUALITY).
+ */
+void encode_default_params(ENCODE_PARAMS *params);
+
+/* encoder_params
+ *  Fills params with the encoding parameters of the encoder gfp.
+ */
+void encoder_params(const lame_global_flags *gfp, ENCODE_PARAMS *params);
+
+/* create_encoder
+ *  Creates a LAME encoder with the encoding parameters params (the program's if NULL) for input described by hdr
+ *  and iDataSize and calls lame_init_params. With bNoReservoir, the bit reservoir is disabled so that every frame
+ *  can be decoded on its own (required for stitching segments, see segment.h).
+ *
+ *  Return value:
+ *    initialized encoder (release with lame_close), NULL if the parameters are invalid
+ */
+lame_global_flags *create_encoder(const FMT_DATA *hdr, const unsigned int iDataSize, const bool bNoReservoir,
+	const ENCODE_PARAMS *params);
 
 /////////////////////
 // threading worker routines conforming to POSIX interface
@@ -46,6 +215,9 @@ int encode_to_file(lame_global_flags *gfp, const FMT_DATA *hdr, const short *lef
  *  are already worked upon, and some additional info via a ENC_WRK_ARGS struct.
  *  As long as there are still unprocessed filenames, this routine will fetch the next free filename, mark it as
  *  processed, and execute the complete conversion from reading .wav to writing .mp3.
+ *  In segmented mode, the fetched work item may also be a segment of a long file (process_work_item).
+ *  All buffers come from a WORKER_ARENA owned by the thread, so after the first few files no more memory is
+ *  allocated for PCM and MP3 data. With bReuseEncoders, encoders come from an ENCODER_CACHE owned by the thread.
  */
 void *complete_encode_worker(void* arg);
 
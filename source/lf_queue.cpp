@@ -0,0 +1,113 @@
+#include "lf_queue.h"
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+void lfq_init(LF_QUEUE *q, size_t uCapacity)
+{
+	size_t size = 2;
+	while (size < uCapacity) size <<= 1;
+
+	q->pCells = new LF_CELL[size];
+	for (size_t i = 0; i < size; i++) {
+		q->pCells[i].seq.store(i, memory_order_relaxed);
+		q->pCells[i].pData = NULL;
+	}
+	q->mask = size - 1;
+	q->enqPos.store(0, memory_order_relaxed);
+	q->deqPos.store(0, memory_order_relaxed);
+}
+
+void lfq_destroy(LF_QUEUE *q)
+{
+	delete[] q->pCells;
+	q->pCells = NULL;
+}
+
+bool lfq_push(LF_QUEUE *q, void *pData)
+{
+	size_t pos = q->enqPos.load(memory_order_relaxed);
+	for (;;) {
+		LF_CELL *cell = &q->pCells[pos & q->mask];
+		size_t seq = cell->seq.load(memory_order_acquire);
+		ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+		if (diff == 0) { // slot is free, try to claim it
+			if (q->enqPos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+				cell->pData = pData;
+				cell->seq.store(pos + 1, memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false; // full
+		} else {
+			pos = q->enqPos.load(memory_order_relaxed);
+		}
+	}
+}
+
+bool lfq_pop(LF_QUEUE *q, void **ppData)
+{
+	size_t pos = q->deqPos.load(memory_order_relaxed);
+	for (;;) {
+		LF_CELL *cell = &q->pCells[pos & q->mask];
+		size_t seq = cell->seq.load(memory_order_acquire);
+		ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+		if (diff == 0) { // slot is filled, try to claim it
+			if (q->deqPos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+				*ppData = cell->pData;
+				cell->seq.store(pos + q->mask + 1, memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false; // empty
+		} else {
+			pos = q->deqPos.load(memory_order_relaxed);
+		}
+	}
+}
+
+/* Waits a little longer on each call: busy spinning first, then yielding, then sleeping up to 1ms. */
+static void backoff(int &iRound)
+{
+	if (iRound < 64) {
+		// busy wait, the other side is most likely just about to finish
+	} else if (iRound < 128) {
+		sched_yield();
+	} else {
+#ifdef WIN32
+		Sleep(1);
+#else
+		usleep(iRound < 256 ? 50 : 1000);
+#endif
+	}
+	if (iRound < 1024) iRound++;
+}
+
+void lfq_push_wait(LF_QUEUE *q, void *pData)
+{
+	int iRound = 0;
+	while (!lfq_push(q, pData))
+		backoff(iRound);
+}
+
+void *lfq_pop_wait(LF_QUEUE *q)
+{
+	int iRound = 0;
+	void *pData;
+	while (!lfq_pop(q, &pData))
+		backoff(iRound);
+	return pData;
+}
+
+size_t lfq_size(LF_QUEUE *q)
+{
+	size_t enq = q->enqPos.load(memory_order_relaxed);
+	size_t deq = q->deqPos.load(memory_order_relaxed);
+	return enq > deq ? enq - deq : 0;
+}
@@ -0,0 +1,66 @@
+#ifndef __LF_QUEUE_H_
+#define __LF_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+
+/////////////////////
+// bounded lock-free queue
+/////////////////////
+
+#define LF_CACHE_LINE 64
+
+/* One slot of the queue. seq tells producers and consumers whether the slot is free or filled
+ * for the current lap around the ring.
+ */
+typedef struct {
+	std::atomic<size_t> seq;
+	void *pData;
+} LF_CELL;
+
+/* Bounded multi-producer/multi-consumer FIFO queue of pointers (D. Vyukov's array based design).
+ * Push and pop never take a lock; a full queue rejects pushes, which provides backpressure between
+ * pipeline stages. The enqueue and dequeue positions live on separate cache lines.
+ */
+typedef struct {
+	LF_CELL *pCells;
+	size_t mask;
+	char pad0[LF_CACHE_LINE];
+	std::atomic<size_t> enqPos;
+	char pad1[LF_CACHE_LINE];
+	std::atomic<size_t> deqPos;
+	char pad2[LF_CACHE_LINE];
+} LF_QUEUE;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* lfq_init
+ *  Initializes an empty queue holding at least uCapacity elements (rounded up to a power of two).
+ */
+void lfq_init(LF_QUEUE *q, size_t uCapacity);
+
+/* lfq_destroy
+ *  Releases the queue memory. The queue must not be used concurrently.
+ */
+void lfq_destroy(LF_QUEUE *q);
+
+/* lfq_push / lfq_pop
+ *  Non-blocking push and pop. Return false if the queue is full or empty, respectively.
+ */
+bool lfq_push(LF_QUEUE *q, void *pData);
+bool lfq_pop(LF_QUEUE *q, void **ppData);
+
+/* lfq_push_wait / lfq_pop_wait
+ *  Blocking variants which back off (spin, yield, then sleep) while the queue is full or empty.
+ */
+void lfq_push_wait(LF_QUEUE *q, void *pData);
+void *lfq_pop_wait(LF_QUEUE *q);
+
+/* lfq_size
+ *  Approximate number of queued elements (exact if there are no concurrent operations).
+ */
+size_t lfq_size(LF_QUEUE *q);
+
+#endif // __LF_QUEUE_H_
@@ -1,153 +1,593 @@
 #include <iostream>
-#include <list>
+#include <errno.h>
 #include <string>
 #include <vector>
-#include <ctime>
-#include "dirent.h"	/* this is used to get cross-platform directory listings without Boost. */
 
 #include "lame_interface.h"
-
-#ifdef WIN32
-#define PATHSEP "\\"
-#else
-#define PATHSEP "/"
-#endif
+#include "pipeline.h"
+#include "scheduler.h"
+#include "segment.h"
+#include "trace.h"
+#include "metrics.h"
+#include "watch.h"
+#include "pipe_stream.h"
+#include "topology.h"
+#include "adaptive.h"
 
 using namespace std;
 
-/* Used for filtering filename extensions. Returns true if 'fullString' ends with
- * 'subString', otherwise false.
- */
-bool string_ends_with(const string &fullString, const string &subString)
+/* Starts scanning dirname for .wav files, exits if the directory can't be read. */
+static DIR_SCAN *start_scan(const char *dirname, const SCAN_CFG *cfg, FILE_FEED *feed)
 {
-	if (subString.length() > fullString.length()) return false;
-	else {
-		// lowercase conversion
-		string fullString_l = fullString;
-		for (unsigned int i = 0; i < fullString_l.length(); i++) {
-			if ('A' <= fullString_l[i] && fullString_l[i] <= 'Z')
-				fullString_l[i] = fullString_l[i] - ('Z' - 'z');
-		}
-		string subString_l = subString;
-		for (unsigned int i = 0; i < subString_l.length(); i++) {
-			if ('A' <= subString_l[i] && subString_l[i] <= 'Z')
-				subString_l[i] = subString_l[i] - ('Z' - 'z');
-		}
-		return (fullString_l.compare(fullString_l.length() - subString_l.length(), subString_l.length(),
-			subString_l) == 0);
+	DIR_SCAN *scan = scan_start(dirname, cfg, feed);
+	if (scan == NULL) {
+		cerr << "FATAL: Unable to parse directory." << endl;
+		exit(EXIT_FAILURE);
 	}
+	return scan;
 }
 
-/* Parse a directory given by dirname and return a list of
- * filenames and subfolders within this directory. 
- */
-list<string> parse_directory(const char *dirname)
+/* Starts watching dirname for arriving .wav files (after scanning it), exits if that's not possible. */
+static DIR_WATCH *start_watch(const char *dirname, const SCAN_CFG *cfg, FILE_FEED *feed, int iDebounceMs)
 {
-	DIR *dir;
-	dirent *ent;
-	list<string> dirEntries;
-
-	if ((dir = opendir(dirname)) != NULL) {
-		// list directory
-		while ((ent = readdir(dir)) != NULL) {
-			dirEntries.push_back(string(ent->d_name));
-		}
-		closedir(dir);
-	} else {
-		cerr << "FATAL: Unable to parse directory." << endl;
+	DIR_WATCH *watch = watch_start(dirname, cfg, feed, iDebounceMs);
+	if (watch == NULL) {
+		cerr << "FATAL: Unable to watch directory." << endl;
 		exit(EXIT_FAILURE);
 	}
+	return watch;
+}
 
-	return dirEntries;
+/* Scanner filter of the incremental mode, leaves out files which haven't changed since they were converted. */
+typedef struct {
+	MANIFEST *pManifest;
+	const OUTPUT_CFG *pOutputCfg;
+} SKIP_CTX;
+
+static bool skip_unchanged(const char *pcPath, void *ctx)
+{
+	const SKIP_CTX *skip = (const SKIP_CTX*)ctx;
+	string sOut;
+	output_file_name(skip->pOutputCfg, pcPath, sOut);
+	return manifest_unchanged(skip->pManifest, pcPath, sOut.c_str());
+}
+
+/* Gauge of the work items not yet claimed by any thread. */
+static double jobs_queued(void *ctx)
+{
+	const ENC_WRK_ARGS *args = (const ENC_WRK_ARGS*)ctx;
+	int iTotal = args->pFeed != NULL ? feed_count(args->pFeed) : args->iNumFiles;
+	int iLeft = iTotal - args->pCursor->iNext.load(std::memory_order_relaxed);
+	return iLeft > 0 ? iLeft : 0;
 }
 
 int main(int argc, char **argv)
 {
-	int NUM_THREADS = 4;
+	int NUM_THREADS = 0; // 0: as many as the available CPUs and the CPU quota allow (topology.h)
+	PIN_MODE pin = PIN_NONE;
+	bool bStreaming = true;
+	bool bPipeline = false;
+	INPUT_CFG inputCfg;
+	input_default_cfg(&inputCfg);
+	OUTPUT_CFG outputCfg;
+	output_default_cfg(&outputCfg);
+	PIPELINE_CFG pipelineCfg;
+	pipeline_default_cfg(&pipelineCfg);
+	SCHED_POLICY schedPolicy = SCHED_DEFAULT_POLICY;
+	double dSegmentSeconds = 0.0; // 0: don't split files
+	bool bReuseEncoders = false;
+	const char *pcReportFile = NULL; // JSON run report
+	const char *pcMetrics = NULL; // live metrics endpoint
+	bool bHwCounters = false;
+	bool bRecursive = false;
+	const char *pcOutDir = NULL; // root of the mirrored output tree
+	const char *pcManifest = NULL; // incremental mode
+	const char *pcCache = NULL; // content-addressed output cache
+	bool bWatch = false; // keep running and convert files as they arrive
+	bool bAdapt = false; // the number of active workers follows the load
+	int iDebounceMs = WATCH_DEFAULT_DEBOUNCE_MS;
+#ifdef __TRACE_
+	const char *pcTraceFile = NULL; // Chrome trace-event timeline
+#endif
 	if (argc < 2) {
-		cerr << "Usage: " << argv[0] << " PATH [-nN]" << endl;
-		cerr << "   PATH   required. Program looks here for .WAV files to convert to .MP3." << endl;
-		cerr << "   [-nN]  optional. If specified, N threads will be used." << endl;
+		cerr << "Usage: " << argv[0] << " PATH [-nN] [-w] [-iBACKEND] [-bN] [-p[R[,W]]] [-sPOLICY] [-c[S]] [-H] [-r] [-oBACKEND]" <<
+			" [-dMODE] [-jFILE] [-mSPEC] [-e] [-R]" <<
+			" [--out DIR] [--manifest FILE] [--cache DIR] [--watch] [--debounce MS] [--pin MODE] [--adapt] [--trace FILE]" <<
+			endl;
+		cerr << "   PATH   required. Program looks here for .WAV files to convert to .MP3. With '-', a WAV stream is" <<
+			endl;
+		cerr << "          read from standard input and the MP3 stream written to standard output (no options)." <<
+			endl;
+		cerr << "   [-nN]  optional. If specified, N threads will be used (default: one per available CPU, capped by" <<
+			endl;
+		cerr << "          the cgroup CPU quota)." << endl;
+		cerr << "   [-w]   optional. Load whole files into memory before encoding instead of streaming them." << endl;
+		cerr << "   [-iBACKEND] optional. Input backend: stdio, pread (default), mmap or uring." << endl;
+		cerr << "   [-bN]  optional. Read block size in KB for the pread, uring and stdio backends." << endl;
+		cerr << "   [-p[R[,W]]] optional. Pipelined mode with R reader and W writer threads besides the N encoder" << endl;
+		cerr << "          threads (default " << PIPELINE_DEFAULT_READERS << "," << PIPELINE_DEFAULT_WRITERS << "). Not" << endl;
+		cerr << "          together with -w, -c, -r or --cache." << endl;
+		cerr << "   [-sPOLICY] optional. Job order: lpt (longest first, default), spt (shortest first) or fifo." << endl;
+		cerr << "   [-c[S]] optional. Split files longer than S seconds (default " << SEG_DEFAULT_SECONDS <<
+			") into segments" << endl;
+		cerr << "          which are encoded in parallel." << endl;
+		cerr << "   [-H]   optional. Back large work buffers with huge pages." << endl;
+		cerr << "   [-r]   optional. Reuse initialized encoders for files with the same format." << endl;
+		cerr << "   [-oBACKEND] optional. Output backend: stdio, write (default) or uring." << endl;
+		cerr << "   [-dMODE] optional. Durability: none (default), file (fsync every file) or group[N] (sync every" << endl;
+		cerr << "          N files, default " << OUTPUT_DEFAULT_GROUP_SIZE << ")." << endl;
+		cerr << "   [-jFILE] optional. Write the run report as JSON to FILE." << endl;
+		cerr << "   [-mSPEC] optional. Serve live metrics in Prometheus format on 127.0.0.1:SPEC if SPEC is a port," <<
+			endl;
+		cerr << "          otherwise on the Unix socket SPEC." << endl;
+		cerr << "   [-e]   optional. Count hardware events (cycles, instructions, LLC and branch misses) per stage." <<
+			endl;
+		cerr << "   [-R]   optional. Look for .WAV files in all subdirectories of PATH as well." << endl;
+		cerr << "   [--out DIR] optional. Write the .MP3 files to DIR, mirroring the directory tree below PATH, instead" <<
+			endl;
+		cerr << "          of next to the .WAV files." << endl;
+		cerr << "   [--manifest FILE] optional. Incremental mode: skip files which are unchanged since they were" << endl;
+		cerr << "          converted with the same parameters according to FILE, and record converted files there." <<
+			endl;
+		cerr << "   [--cache DIR] optional. Keep the MP3 files in the content-addressed cache DIR and copy them" << endl;
+		cerr << "          (reflink where supported) instead of encoding inputs with the same PCM data again." << endl;
+		cerr << "   [--watch] optional. Keep running after the files in PATH are converted and convert new .WAV files" <<
+			endl;
+		cerr << "          as they are written or moved there, until interrupted." << endl;
+		cerr << "   [--debounce MS] optional. Watch mode: wait until a new file hasn't changed for MS milliseconds" <<
+			endl;
+		cerr << "          (default " << WATCH_DEFAULT_DEBOUNCE_MS << ")." << endl;
+		cerr << "   [--pin MODE] optional. Pin the workers to CPUs: none (default), cpu (physical cores first, then" <<
+			endl;
+		cerr << "          their SMT siblings) or core (physical cores only). Buffers are placed on the worker's NUMA" <<
+			endl;
+		cerr << "          node." << endl;
+		cerr << "   [--adapt] optional. Start " << ADAPT_MAX_FACTOR << " times the default number of threads, of which" <<
+			endl;
+		cerr << "          only the default is active at first, and follow the load (not with -n or -p, Linux only)." <<
+			endl;
+		cerr << "   [--trace FILE] optional. Write a Chrome trace-event timeline to FILE (requires a build with" << endl;
+		cerr << "          tracing, see trace.h)." << endl;
 		return EXIT_FAILURE;
 	}
+	if (0 == strcmp(argv[1], "-")) {
+		// standard output carries the MP3 stream, so nothing else may be printed there
+		if (argc > 2) {
+			cerr << "FATAL: " << argv[2] << " is not supported when converting standard input." << endl;
+			return EXIT_FAILURE;
+		}
+		return encode_pipe(stdin, stdout, NULL);
+	}
 	cout << "LAME version: " << get_lame_version() << endl;
 
 	// check for optional arguments
-	if (argc == 3) {
+	for (int iArg = 2; iArg < argc; iArg++) {
 		// check for '-n' option
-		if (0 == strncmp(argv[2], "-n", 2)) {
-			char *pcNumThreads = &argv[2][2]; // crop first two characters ('-n')
+		if (0 == strncmp(argv[iArg], "-n", 2)) {
+			char *pcNumThreads = &argv[iArg][2]; // crop first two characters ('-n')
 			if (0 != atoi(pcNumThreads)) {
 				NUM_THREADS = atoi(pcNumThreads);
 				cout << "Using " << NUM_THREADS << " threads." << endl;
 			} else {
-				cout << "Warning: -n argument not valid. Defaulting to " << NUM_THREADS << " threads." << endl;
+				cout << "Warning: -n argument not valid. Sizing the thread count automatically." << endl;
+			}
+		} else if (0 == strcmp(argv[iArg], "-w")) {
+			bStreaming = false;
+			cout << "Using whole-file mode." << endl;
+		} else if (0 == strncmp(argv[iArg], "-i", 2)) {
+			if (EXIT_SUCCESS == input_backend_from_name(&argv[iArg][2], inputCfg.backend)) {
+				cout << "Using " << input_backend_name(inputCfg.backend) << " input backend." << endl;
+			} else {
+				cout << "Warning: -i argument not valid. Defaulting to " << input_backend_name(inputCfg.backend) <<
+					" input backend." << endl;
+			}
+		} else if (0 == strncmp(argv[iArg], "-b", 2)) {
+			if (0 < atoi(&argv[iArg][2])) {
+				inputCfg.uBlockSize = atoi(&argv[iArg][2]) * 1024;
+			} else {
+				cout << "Warning: -b argument not valid. Defaulting to " << inputCfg.uBlockSize / 1024 << " KB." << endl;
+			}
+		} else if (0 == strncmp(argv[iArg], "-p", 2)) {
+			bPipeline = true;
+			int iReaders = pipelineCfg.iReaders, iWriters = pipelineCfg.iWriters;
+			if (argv[iArg][2] != '\0' && (sscanf(&argv[iArg][2], "%d,%d", &iReaders, &iWriters) < 1 ||
+				iReaders < 1 || iWriters < 1)) {
+				cout << "Warning: -p argument not valid. Defaulting to " << pipelineCfg.iReaders << " readers and " <<
+					pipelineCfg.iWriters << " writers." << endl;
+			} else {
+				pipelineCfg.iReaders = iReaders;
+				pipelineCfg.iWriters = iWriters;
+			}
+			cout << "Using pipelined mode with " << pipelineCfg.iReaders << " reader and " << pipelineCfg.iWriters <<
+				" writer threads." << endl;
+		} else if (0 == strncmp(argv[iArg], "-s", 2)) {
+			if (EXIT_SUCCESS == sched_policy_from_name(&argv[iArg][2], schedPolicy)) {
+				cout << "Using " << sched_policy_name(schedPolicy) << " scheduling." << endl;
+			} else {
+				cout << "Warning: -s argument not valid. Defaulting to " << sched_policy_name(schedPolicy) <<
+					" scheduling." << endl;
+			}
+		} else if (0 == strncmp(argv[iArg], "-c", 2)) {
+			dSegmentSeconds = SEG_DEFAULT_SECONDS;
+			if (argv[iArg][2] != '\0') {
+				if (0 < atof(&argv[iArg][2])) {
+					dSegmentSeconds = atof(&argv[iArg][2]);
+				} else {
+					cout << "Warning: -c argument not valid. Defaulting to " << dSegmentSeconds << "s." << endl;
+				}
+			}
+			cout << "Splitting long files into segments of " << dSegmentSeconds << "s." << endl;
+		} else if (0 == strcmp(argv[iArg], "-H")) {
+			arena_set_huge_pages(true);
+			cout << "Using huge pages for work buffers." << endl;
+		} else if (0 == strcmp(argv[iArg], "-r")) {
+			bReuseEncoders = true;
+			cout << "Reusing encoders." << endl;
+		} else if (0 == strncmp(argv[iArg], "-o", 2)) {
+			if (EXIT_SUCCESS == output_backend_from_name(&argv[iArg][2], outputCfg.backend)) {
+				cout << "Using " << output_backend_name(outputCfg.backend) << " output backend." << endl;
+			} else {
+				cout << "Warning: -o argument not valid. Defaulting to " << output_backend_name(outputCfg.backend) <<
+					" output backend." << endl;
+			}
+		} else if (0 == strncmp(argv[iArg], "-d", 2)) {
+			if (EXIT_SUCCESS != output_sync_from_name(&argv[iArg][2], &outputCfg)) {
+				cout << "Warning: -d argument not valid. Defaulting to none." << endl;
+				outputCfg.sync = SYNC_NONE;
+			} else if (outputCfg.sync == SYNC_FILE) {
+				cout << "Syncing every output file." << endl;
+			} else if (outputCfg.sync == SYNC_GROUP) {
+				cout << "Syncing output files in groups of " << outputCfg.uGroupSize << "." << endl;
+			}
+		} else if (0 == strncmp(argv[iArg], "-j", 2)) {
+			if (0 == strcmp(&argv[iArg][2], "-")) {
+				// standard output carries the log
+				cerr << "FATAL: -j requires a file name, the report can't be written to standard output." << endl;
+				return EXIT_FAILURE;
+			} else if (argv[iArg][2] != '\0') {
+				pcReportFile = &argv[iArg][2];
+			} else {
+				cout << "Warning: -j requires a file name." << endl;
 			}
-			
+		} else if (0 == strncmp(argv[iArg], "-m", 2)) {
+			if (argv[iArg][2] != '\0')
+				pcMetrics = &argv[iArg][2];
+			else
+				cout << "Warning: -m requires a port or socket path." << endl;
+		} else if (0 == strcmp(argv[iArg], "-e")) {
+			bHwCounters = true;
+		} else if (0 == strcmp(argv[iArg], "-R")) {
+			bRecursive = true;
+			cout << "Scanning subdirectories." << endl;
+		} else if (0 == strcmp(argv[iArg], "--out")) {
+			if (iArg + 1 < argc) {
+				pcOutDir = argv[++iArg];
+				cout << "Writing MP3 files to " << pcOutDir << "." << endl;
+			} else {
+				cout << "Warning: --out requires a directory." << endl;
+			}
+		} else if (0 == strcmp(argv[iArg], "--manifest")) {
+			if (iArg + 1 < argc) {
+				pcManifest = argv[++iArg];
+			} else {
+				cout << "Warning: --manifest requires a file name." << endl;
+			}
+		} else if (0 == strcmp(argv[iArg], "--cache")) {
+			if (iArg + 1 < argc) {
+				pcCache = argv[++iArg];
+			} else {
+				cout << "Warning: --cache requires a directory." << endl;
+			}
+		} else if (0 == strcmp(argv[iArg], "--watch")) {
+			bWatch = true;
+		} else if (0 == strcmp(argv[iArg], "--adapt")) {
+			bAdapt = true;
+		} else if (0 == strcmp(argv[iArg], "--debounce")) {
+			if (iArg + 1 < argc && atoi(argv[iArg + 1]) >= 0) {
+				iDebounceMs = atoi(argv[++iArg]);
+			} else {
+				cout << "Warning: --debounce requires a number of milliseconds. Defaulting to " << iDebounceMs <<
+					"." << endl;
+			}
+		} else if (0 == strcmp(argv[iArg], "--pin")) {
+			if (iArg + 1 < argc && EXIT_SUCCESS == pin_mode_from_name(argv[iArg + 1], pin)) {
+				iArg++;
+				cout << "Pinning workers to " << pin_mode_name(pin) << "s." << endl;
+			} else {
+				cout << "Warning: --pin requires none, cpu or core. Not pinning workers." << endl;
+			}
+		} else if (0 == strcmp(argv[iArg], "--trace")) {
+			if (iArg + 1 < argc) {
+				iArg++;
+#ifdef __TRACE_
+				pcTraceFile = argv[iArg];
+				cout << "Tracing to " << pcTraceFile << "." << endl;
+#else
+				cout << "Warning: Tracing has not been compiled in (make trace). Ignoring --trace." << endl;
+#endif
+			} else {
+				cout << "Warning: --trace requires a file name." << endl;
+			}
+		} else {
+			cout << "Warning: Ignoring unknown argument " << argv[iArg] << endl;
+		}
+	}
+
+	// size the worker pool by the CPUs this process may use
+	CPU_TOPOLOGY topology;
+	if (EXIT_SUCCESS != topology_detect(&topology) && (pin != PIN_NONE || NUM_THREADS == 0))
+		cout << "Warning: Unable to determine the available CPUs." << endl;
+	// with --adapt, the number of active workers follows the load, starting at the default
+	if (bAdapt && NUM_THREADS != 0) {
+		cerr << "FATAL: --adapt can't be combined with -n." << endl;
+		return EXIT_FAILURE;
+	}
+	const bool bAdaptive = bAdapt && !bPipeline && adapt_available();
+	if (bAdapt && !bPipeline && !bAdaptive)
+		cout << "Warning: --adapt is not available on this system, the number of threads is fixed." << endl;
+	int iActiveThreads = NUM_THREADS;
+	if (NUM_THREADS == 0) {
+		iActiveThreads = NUM_THREADS = topology_default_threads(&topology, pin);
+		if (bAdaptive) {
+			NUM_THREADS *= ADAPT_MAX_FACTOR;
+			cout << "Using " << iActiveThreads << " of up to " << NUM_THREADS << " threads, adapting to the load (";
+		} else {
+			cout << "Using " << NUM_THREADS << " threads (";
+		}
+		cout << topology.cpus.size() << " CPUs on " << topology.iCores << " cores and " << topology.iNodes <<
+			" NUMA node" << (topology.iNodes > 1 ? "s" : "");
+		if (topology.dQuota > 0.0) cout << ", CPU quota " << topology.dQuota;
+		cout << ")." << endl;
+	}
+
+	if (bPipeline) {
+		// the pipeline always streams with a new encoder per file and writes complete files
+		const char *pcConflict = !bStreaming ? "-w" : bReuseEncoders ? "-r" : dSegmentSeconds > 0 ? "-c" :
+			pcCache != NULL ? "--cache" : bAdapt ? "--adapt" : NULL;
+		if (pcConflict != NULL) {
+			cerr << "FATAL: " << pcConflict << " is not supported in pipelined mode (-p)." << endl;
+			return EXIT_FAILURE;
 		}
 	}
+	if (bWatch) {
+		// files are handed out as they arrive, the complete list is never known
+		if (dSegmentSeconds > 0) {
+			cout << "Warning: Segmented encoding is not supported in watch mode." << endl;
+			dSegmentSeconds = 0;
+		}
+		if (schedPolicy != SCHEDULE_FIFO) {
+			cout << "Watch mode converts files in the order they arrive." << endl;
+			schedPolicy = SCHEDULE_FIFO;
+		}
+		setvbuf(stdout, NULL, _IOLBF, 0); // the log of a long-running process should be current
+	}
+	if (pcOutDir != NULL) {
+		if (EXIT_SUCCESS != make_directories(pcOutDir)) {
+			cerr << "FATAL: Unable to create output directory." << endl;
+			exit(EXIT_FAILURE);
+		}
+		outputCfg.pcInDir = argv[1];
+		outputCfg.pcOutDir = pcOutDir;
+	}
 
-	// parse directory
-	list<string> files = parse_directory(argv[1]);
+	// incremental mode and output cache: everything which influences the MP3 data of an unchanged input is part of
+	// the parameters
+	char params[256];
+	snprintf(params, sizeof(params), "lame %s b%d q%d %s%s c%g", get_lame_version(), ENC_BITRATE, ENC_QUALITY,
+		bStreaming ? "stream" : "whole", bReuseEncoders ? " reuse" : "", dSegmentSeconds);
+	MANIFEST manifest;
+	MANIFEST *pManifest = NULL;
+	SKIP_CTX skipCtx = { &manifest, &outputCfg };
+	if (pcManifest != NULL) {
+		if (EXIT_SUCCESS == manifest_open(&manifest, pcManifest, params)) {
+			pManifest = &manifest;
+			cout << "Skipping unchanged files according to " << pcManifest << "." << endl;
+		} else {
+			cout << "Warning: Converting all files." << endl;
+		}
+	}
+	OUTPUT_STORE store;
+	OUTPUT_STORE *pStore = NULL;
+	if (pcCache != NULL) {
+		if (EXIT_SUCCESS == store_open(&store, pcCache, params)) {
+			pStore = &store;
+			cout << "Sharing outputs of identical inputs through " << pcCache << "." << endl;
+		} else {
+			cout << "Warning: Encoding without output cache." << endl;
+		}
+	}
+
+	// parse directory with a scanner thread per worker (recursive scans only). In FIFO order the workers start on
+	// the first files while the scan is still running, job ordering and segmenting need the complete list.
+	SCAN_CFG scanCfg;
+	scanCfg.iThreads = iActiveThreads;
+	scanCfg.bRecursive = bRecursive;
+	scanCfg.pcOutDir = pcOutDir;
+	scanCfg.bKeepOpen = false;
+	scanCfg.pfnSkip = pManifest != NULL ? skip_unchanged : NULL;
+	scanCfg.pSkipCtx = &skipCtx;
+	FILE_FEED feed;
+	feed_init(&feed);
+	const bool bStreamJobs = schedPolicy == SCHEDULE_FIFO && dSegmentSeconds <= 0;
+	DIR_SCAN *scan = NULL;
+	DIR_WATCH *watch = NULL;
 	vector<string> wavFiles;
-	for (list<string>::iterator it = files.begin(); it != files.end(); it++) {
-		// check if it's a wave file and add path
-		if (string_ends_with(*it, string(".wav"))) {
-			wavFiles.push_back(string(argv[1]) + string(PATHSEP) + *it);
+	int numFiles = 0;
+	if (!bStreamJobs) {
+		scan_finish(start_scan(argv[1], &scanCfg, &feed));
+		numFiles = feed_count(&feed);
+		wavFiles.reserve(numFiles);
+		for (int i = 0; i < numFiles; i++) wavFiles.push_back(feed_name(&feed, i));
+
+		cout << "Found " << numFiles << " .wav file(s) in directory." << endl;
+		if (pManifest != NULL) cout << "Skipped " << pManifest->iSkipped << " unchanged file(s)." << endl;
+		if (!(numFiles>0)) {
+			if (pManifest != NULL) manifest_close(pManifest);
+			if (pStore != NULL) store_close(pStore);
+			feed_destroy(&feed);
+			return EXIT_SUCCESS;
 		}
 	}
-	int numFiles = wavFiles.size();
 
-	cout << "Found " << numFiles << " .wav file(s) in directory." << endl;
-	if (!(numFiles>0)) return EXIT_SUCCESS;
+	// probe headers, reject invalid files and order the remaining ones by estimated cost
+	vector<JOB_PROBE> probes;
+	schedule_jobs(wavFiles, schedPolicy, &inputCfg, iActiveThreads, dSegmentSeconds > 0 ? &probes : NULL);
 
-	// initialize pbFilesFinished array which contains true for all files which are currently already converted
-	bool *pbFilesFinished = new bool[numFiles];
-	for (int i = 0; i < numFiles; i++) pbFilesFinished[i] = false;
+	// split long files into segments which are handed out like separate jobs
+	SEG_PLAN segPlan;
+	segPlan.pFiles = NULL;
+	segPlan.iNumSegFiles = 0;
+	int iNumJobs = wavFiles.size();
+	if (dSegmentSeconds > 0) {
+		int iSplit = plan_segments(wavFiles, probes, dSegmentSeconds, &outputCfg, &segPlan);
+		iNumJobs = segPlan.items.size();
+		cout << "Split " << iSplit << " file(s) into " << iNumJobs - ((int)wavFiles.size() - iSplit) <<
+			" segments." << endl;
+	}
+
+	// initialize claim cursor which points to the next file that's not yet being converted
+	JOB_CURSOR cursor;
+	cursor.iNext = 0;
 
 
 	// initialize threads array and argument arrays
 	pthread_t *threads = new pthread_t[NUM_THREADS];
-	ENC_WRK_ARGS *threadArgs = (ENC_WRK_ARGS*)malloc(NUM_THREADS * sizeof(ENC_WRK_ARGS));
+	ENC_WRK_ARGS *threadArgs = new ENC_WRK_ARGS[NUM_THREADS];
 	for (int i = 0; i < NUM_THREADS; i++) {
-		threadArgs[i].iNumFiles = numFiles;
+		threadArgs[i].iNumFiles = iNumJobs;
 		threadArgs[i].pFilenames = &wavFiles;
-		threadArgs[i].pbFilesFinished = pbFilesFinished;
+		threadArgs[i].pFeed = bStreamJobs ? &feed : NULL;
+		threadArgs[i].pManifest = pManifest;
+		threadArgs[i].pStore = pStore;
+		threadArgs[i].pCursor = &cursor;
 		threadArgs[i].iThreadId = i;
 		threadArgs[i].iProcessedFiles = 0;
+		threadArgs[i].bStreaming = bStreaming;
+		threadArgs[i].pInputCfg = &inputCfg;
+		threadArgs[i].pOutputCfg = &outputCfg;
+		threadArgs[i].pSegPlan = dSegmentSeconds > 0 ? &segPlan : NULL;
+		threadArgs[i].uBufferAllocs = 0;
+		threadArgs[i].bReuseEncoders = bReuseEncoders;
+		threadArgs[i].iCpu = topology_placement(&topology, pin, i, threadArgs[i].iNode);
+		threadArgs[i].pAdapt = NULL;
+		memset(&threadArgs[i].cacheStats, 0, sizeof(ENC_CACHE_STATS));
+		threadArgs[i].report.dBusy = 0.0;
+		threadArgs[i].report.dWall = 0.0;
 	}
 
-	// timestamp
-	clock_t tBegin = clock();
+#ifdef __TRACE_
+	if (pcTraceFile != NULL) trace_start();
+#endif
+	if (bHwCounters) {
+		if (EXIT_SUCCESS == hwc_start())
+			cout << "Counting hardware events" << (hwc_user_only() ? " (user space only)." : ".") << endl;
+		else
+			cout << "Warning: Hardware counters are not available (" << strerror(errno) << ")." << endl;
+	}
+	if (pcMetrics != NULL) {
+		if (EXIT_SUCCESS == metrics_start(pcMetrics)) {
+			cout << "Serving metrics on " << pcMetrics << "." << endl;
+			metrics_add_gauge("jobs_queued", "Work items not yet claimed by a thread", jobs_queued, &threadArgs[0]);
+		} else {
+			cout << "Warning: Unable to serve metrics on " << pcMetrics << "." << endl;
+		}
+	}
 
-	// create worker threads
-	for (int i = 0; i < NUM_THREADS; i++) {
-		pthread_create(&threads[i], NULL, complete_encode_worker, (void*)&threadArgs[i]);
+	// timestamp (monotonic wall clock, clock() would sum up the CPU time of all threads)
+	double tBegin = report_now();
+	ADAPT_CTRL *pAdapt = NULL;
+	if (bAdaptive) {
+		double dCpus = topology.dQuota > 0.0 && topology.dQuota < topology.cpus.size() ? topology.dQuota :
+			(double)topology.cpus.size();
+		pAdapt = adapt_start(NUM_THREADS, iActiveThreads, dCpus);
+		if (pAdapt == NULL)
+			cout << "Warning: Unable to start the concurrency controller, all threads are active." << endl;
+		for (int i = 0; i < NUM_THREADS; i++) threadArgs[i].pAdapt = pAdapt;
+	}
+	if (bWatch) {
+		watch = start_watch(argv[1], &scanCfg, &feed, iDebounceMs);
+		cout << "Watching " << argv[1] << " for new .wav files, interrupt to stop." << endl;
+	} else if (bStreamJobs) {
+		scan = start_scan(argv[1], &scanCfg, &feed);
 	}
 
-	// synchronize / join threads
-	for (int i = 0; i < NUM_THREADS; i++) {
-		int ret = pthread_join(threads[i], NULL);
-		if (ret != 0) {
-			cerr << "A POSIX thread error occured." << endl;
+	if (bPipeline) {
+		// reader, encoder and writer pools connected by queues
+		run_pipeline(&pipelineCfg, threadArgs, NUM_THREADS);
+	} else {
+		// create worker threads
+		for (int i = 0; i < NUM_THREADS; i++) {
+			pthread_create(&threads[i], NULL, complete_encode_worker, (void*)&threadArgs[i]);
+		}
+
+		// synchronize / join threads
+		for (int i = 0; i < NUM_THREADS; i++) {
+			int ret = pthread_join(threads[i], NULL);
+			if (ret != 0) {
+				cerr << "A POSIX thread error occured." << endl;
+			}
 		}
 	}
+	if (pAdapt != NULL) adapt_stop(pAdapt);
+	if (scan != NULL || watch != NULL) {
+		if (scan != NULL) scan_finish(scan);
+		if (watch != NULL) watch_finish(watch);
+		numFiles = feed_count(&feed);
+		cout << "Found " << numFiles << " .wav file(s) in directory." << endl;
+		if (pManifest != NULL) cout << "Skipped " << pManifest->iSkipped << " unchanged file(s)." << endl;
+	}
+	output_finish(&outputCfg); // sync the last group
+	if (pManifest != NULL && EXIT_SUCCESS != manifest_close(pManifest))
+		cerr << "Unable to update manifest " << pcManifest << endl;
+	metrics_remove_gauge(&threadArgs[0]);
+	metrics_stop();
 
 	// timestamp
-	clock_t tEnd = clock();
+	double tEnd = report_now();
 
 	// write statistics
 	int iProcessedTotal = 0;
+	ENC_CACHE_STATS cacheStats;
+	memset(&cacheStats, 0, sizeof(cacheStats));
 	for (int i = 0; i < NUM_THREADS; i++) {
 		cout << "Thread " << i << " processed " << threadArgs[i].iProcessedFiles << " files." << endl;
 		iProcessedTotal += threadArgs[i].iProcessedFiles;
+		enc_cache_add_stats(&cacheStats, &threadArgs[i].cacheStats);
+	}
+	if (bReuseEncoders && cacheStats.uHits + cacheStats.uMisses > 0) {
+		printf("Encoder cache: %u hits, %u misses (%.1f%% hit rate), %.3fs spent in initialization, "
+			"about %.3fs saved.\n", cacheStats.uHits, cacheStats.uMisses,
+			100.0 * cacheStats.uHits / (cacheStats.uHits + cacheStats.uMisses), cacheStats.dInitSeconds,
+			cacheStats.dSavedSeconds);
+	}
+
+	if (pStore != NULL) {
+		cout << "Output cache: " << pStore->iHits << " output(s) reused, " << pStore->iAdded << " added." << endl;
+		store_close(pStore);
 	}
 
 	cout << "Converted " << iProcessedTotal << " out of " << numFiles << " files in total in " <<
-		double(tEnd-tBegin) / CLOCKS_PER_SEC << "s." << endl;
+		tEnd - tBegin << "s." << endl;
+
+#ifdef __TRACE_
+	if (pcTraceFile != NULL && EXIT_SUCCESS != trace_write(pcTraceFile))
+		cerr << "Unable to write trace " << pcTraceFile << endl;
+#endif
+
+	// wall-clock report over all threads
+	vector<const THREAD_REPORT*> threadReports;
+	for (int i = 0; i < NUM_THREADS; i++) threadReports.push_back(&threadArgs[i].report);
+	RUN_REPORT report;
+	build_run_report(threadReports.data(), NUM_THREADS, tEnd - tBegin, &report);
+	if (pAdapt != NULL) adapt_finish(pAdapt, &report);
+	print_run_report(&report);
+	if (pcReportFile != NULL && EXIT_SUCCESS != write_run_report_json(&report, pcReportFile))
+		cerr << "Unable to write run report " << pcReportFile << endl;
 
 	delete[] threads;
 	delete[] threadArgs;
+	free_segment_plan(&segPlan);
+	feed_destroy(&feed);
 
 	cout << "Done." << endl;
 	if (iProcessedTotal > numFiles)
@@ -0,0 +1,368 @@
+#include "manifest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#endif
+
+unsigned long long manifest_hash(const void *pData, size_t n, unsigned long long llHash)
+{
+	const unsigned char *p = (const unsigned char*)pData;
+	for (size_t i = 0; i < n; i++) {
+		llHash ^= p[i];
+		llHash *= 0x100000001b3ULL;
+	}
+	return llHash;
+}
+
+static unsigned long long path_key(const char *pcPath, size_t uLen)
+{
+	return manifest_hash(pcPath, uLen, MANIFEST_HASH_INIT);
+}
+
+static unsigned long long log_check(const MANIFEST_ENTRY *entry, const char *pcPath, size_t uLen)
+{
+	return manifest_hash(pcPath, uLen, manifest_hash(entry, sizeof(MANIFEST_ENTRY), MANIFEST_HASH_INIT));
+}
+
+/* order of the base and the log: by key, then by path */
+static int compare_key(unsigned long long llKeyA, const char *pcA, size_t uLenA, unsigned long long llKeyB,
+	const char *pcB, size_t uLenB)
+{
+	if (llKeyA != llKeyB) return llKeyA < llKeyB ? -1 : 1;
+	int c = memcmp(pcA, pcB, uLenA < uLenB ? uLenA : uLenB);
+	if (c != 0) return c;
+	return uLenA < uLenB ? -1 : uLenA > uLenB ? 1 : 0;
+}
+
+struct UpdateOrder {
+	bool operator()(const MANIFEST_UPDATE &a, const MANIFEST_UPDATE &b) const {
+		return compare_key(a.llKey, a.sPath.data(), a.sPath.size(), b.llKey, b.sPath.data(), b.sPath.size()) < 0;
+	}
+};
+struct SamePath {
+	bool operator()(const MANIFEST_UPDATE &a, const MANIFEST_UPDATE &b) const {
+		return a.llKey == b.llKey && a.sPath == b.sPath;
+	}
+};
+
+/* sorts log records and keeps only the newest record of every path */
+static void sort_log(vector<MANIFEST_UPDATE> &log)
+{
+	// reversed, so that the newest record comes first among equal ones and survives unique
+	reverse(log.begin(), log.end());
+	stable_sort(log.begin(), log.end(), UpdateOrder());
+	log.erase(unique(log.begin(), log.end(), SamePath()), log.end());
+}
+
+#ifndef WIN32
+
+void manifest_stat(const char *pcIn, MANIFEST_ENTRY *entry)
+{
+	struct stat st;
+	memset(entry, 0, sizeof(MANIFEST_ENTRY));
+	if (0 != stat(pcIn, &st)) {
+		entry->llInMtime = -1;
+		return;
+	}
+	entry->llInSize = st.st_size;
+#ifdef __APPLE__
+	entry->llInMtime = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+	entry->llInMtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+}
+
+/* checks the base and returns the size of the file up to the end of the valid log records */
+static size_t load_manifest(MANIFEST *m, size_t uFileSize)
+{
+	if (uFileSize < sizeof(MANIFEST_HEADER)) return 0;
+	const MANIFEST_HEADER *hdr = (const MANIFEST_HEADER*)m->pMap;
+	if (0 != memcmp(hdr->magic, MANIFEST_MAGIC, sizeof(hdr->magic))) return 0;
+	if (hdr->uCount > (uFileSize - sizeof(MANIFEST_HEADER)) / sizeof(MANIFEST_RECORD)) return 0;
+	size_t uBaseEnd = sizeof(MANIFEST_HEADER) + hdr->uCount * sizeof(MANIFEST_RECORD);
+	if (hdr->uStringBytes > uFileSize - uBaseEnd) return 0;
+	m->pRecords = (const MANIFEST_RECORD*)(m->pMap + sizeof(MANIFEST_HEADER));
+	m->uCount = hdr->uCount;
+	m->pStrings = (const char*)m->pMap + uBaseEnd;
+	uBaseEnd += hdr->uStringBytes;
+
+	// log of earlier runs, up to the first incomplete or damaged record
+	size_t uPos = uBaseEnd;
+	while (uFileSize - uPos >= sizeof(MANIFEST_LOG_RECORD)) {
+		MANIFEST_LOG_RECORD rec;
+		memcpy(&rec, m->pMap + uPos, sizeof(rec));
+		const char *pcPath = (const char*)m->pMap + uPos + sizeof(rec);
+		if (rec.uMagic != MANIFEST_LOG_MAGIC || rec.uPathLen > uFileSize - uPos - sizeof(rec) ||
+			rec.llCheck != log_check(&rec.entry, pcPath, rec.uPathLen)) break;
+		MANIFEST_UPDATE update;
+		update.sPath.assign(pcPath, rec.uPathLen);
+		update.llKey = path_key(pcPath, rec.uPathLen);
+		update.entry = rec.entry;
+		m->log.push_back(update);
+		uPos += sizeof(rec) + rec.uPathLen;
+	}
+	sort_log(m->log);
+	return uPos;
+}
+
+int manifest_open(MANIFEST *m, const char *pcFile, const char *pcParams)
+{
+	m->sFile = pcFile;
+	m->pMap = NULL;
+	m->uMapSize = 0;
+	m->pRecords = NULL;
+	m->uCount = 0;
+	m->pStrings = NULL;
+	m->llParams = manifest_hash(pcParams, strlen(pcParams), MANIFEST_HASH_INIT);
+	m->iSkipped = 0;
+	pthread_mutex_init(&m->mutex, NULL);
+
+	m->fd = open(pcFile, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	if (m->fd < 0) {
+		printf("Unable to open manifest %s (%s).\n", pcFile, strerror(errno));
+		manifest_close(m);
+		return EXIT_FAILURE;
+	}
+	if (0 != flock(m->fd, LOCK_EX | LOCK_NB)) {
+		printf("Manifest %s is in use by another process.\n", pcFile);
+		close(m->fd);
+		m->fd = -1;
+		manifest_close(m);
+		return EXIT_FAILURE;
+	}
+
+	struct stat st;
+	size_t uValid = 0;
+	if (0 == fstat(m->fd, &st) && st.st_size > 0) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, m->fd, 0);
+		if (p != MAP_FAILED) {
+			m->pMap = (const unsigned char*)p;
+			m->uMapSize = st.st_size;
+			madvise(p, st.st_size, MADV_RANDOM); // lookups only touch the pages on their search path
+			uValid = load_manifest(m, st.st_size);
+		}
+		if (uValid == 0) {
+			printf("Manifest %s is damaged, starting over.\n", pcFile);
+			if (m->pMap != NULL) munmap((void*)m->pMap, m->uMapSize);
+			m->pMap = NULL;
+		}
+	}
+	bool bOk;
+	if (uValid == 0) {
+		// new (or unusable) manifest: empty base
+		MANIFEST_HEADER hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+		bOk = 0 == ftruncate(m->fd, 0) && write(m->fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr);
+	} else {
+		// drop a record torn by a crash, so that new records follow the last complete one
+		bOk = uValid == (size_t)st.st_size || 0 == ftruncate(m->fd, uValid);
+	}
+	if (!bOk) {
+		printf("Unable to write manifest %s (%s).\n", pcFile, strerror(errno));
+		close(m->fd);
+		m->fd = -1;
+		manifest_close(m);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* looks up the newest entry of a path */
+static const MANIFEST_ENTRY *find_entry(const MANIFEST *m, const char *pcPath)
+{
+	size_t uLen = strlen(pcPath);
+	unsigned long long llKey = path_key(pcPath, uLen);
+	// the log of earlier runs is newer than the base
+	size_t lo = 0, hi = m->log.size();
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const MANIFEST_UPDATE &u = m->log[mid];
+		int c = compare_key(u.llKey, u.sPath.data(), u.sPath.size(), llKey, pcPath, uLen);
+		if (c == 0) return &u.entry;
+		if (c < 0) lo = mid + 1; else hi = mid;
+	}
+	lo = 0;
+	hi = m->uCount;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const MANIFEST_RECORD *r = &m->pRecords[mid];
+		int c = compare_key(r->llKey, m->pStrings + r->uPathOffset, r->uPathLen, llKey, pcPath, uLen);
+		if (c == 0) return &r->entry;
+		if (c < 0) lo = mid + 1; else hi = mid;
+	}
+	return NULL;
+}
+
+bool manifest_unchanged(MANIFEST *m, const char *pcIn, const char *pcOut)
+{
+	const MANIFEST_ENTRY *known = find_entry(m, pcIn);
+	if (known == NULL || known->llParams != m->llParams) return false;
+	MANIFEST_ENTRY now;
+	manifest_stat(pcIn, &now);
+	if (now.llInMtime < 0 || now.llInMtime != known->llInMtime || now.llInSize != known->llInSize) return false;
+	struct stat st;
+	if (0 != stat(pcOut, &st) || (unsigned long long)st.st_size != known->llOutSize) return false;
+	m->iSkipped++;
+	return true;
+}
+
+void manifest_record(MANIFEST *m, const char *pcIn, const MANIFEST_ENTRY *input, unsigned long long llOutSize,
+	unsigned long long llOutHash)
+{
+	if (m == NULL || input->llInMtime < 0) return;
+	MANIFEST_UPDATE update;
+	update.sPath = pcIn;
+	update.llKey = path_key(update.sPath.data(), update.sPath.size());
+	update.entry = *input;
+	update.entry.llParams = m->llParams;
+	update.entry.llOutSize = llOutSize;
+	update.entry.llOutHash = llOutHash;
+
+	// record and path in a single write, which O_APPEND places at the end of the file as a whole
+	MANIFEST_LOG_RECORD rec;
+	rec.uMagic = MANIFEST_LOG_MAGIC;
+	rec.uPathLen = (unsigned int)update.sPath.size();
+	rec.entry = update.entry;
+	rec.llCheck = log_check(&rec.entry, update.sPath.data(), update.sPath.size());
+	string sBuffer((const char*)&rec, sizeof(rec));
+	sBuffer += update.sPath;
+
+	pthread_mutex_lock(&m->mutex);
+	if (write(m->fd, sBuffer.data(), sBuffer.size()) != (ssize_t)sBuffer.size())
+		printf("Unable to update manifest %s (%s).\n", m->sFile.c_str(), strerror(errno));
+	m->updates.push_back(update);
+	pthread_mutex_unlock(&m->mutex);
+}
+
+/* merges base and log into a new sorted base in sFile.tmp and renames it over the manifest */
+static int compact_manifest(MANIFEST *m, vector<MANIFEST_UPDATE> &log)
+{
+	string sTmp = m->sFile + ".tmp";
+	FILE *f = fopen(sTmp.c_str(), "wb");
+	if (f == NULL) return EXIT_FAILURE;
+
+	// pass 1: order of the merged records (index into the base, or ~index into the log)
+	vector<long long> merged;
+	merged.reserve(m->uCount + log.size());
+	unsigned long long uStringBytes = 0;
+	size_t b = 0, l = 0;
+	while (b < m->uCount || l < log.size()) {
+		int c;
+		if (b == m->uCount) c = 1;
+		else if (l == log.size()) c = -1;
+		else {
+			const MANIFEST_RECORD *r = &m->pRecords[b];
+			c = compare_key(r->llKey, m->pStrings + r->uPathOffset, r->uPathLen, log[l].llKey, log[l].sPath.data(),
+				log[l].sPath.size());
+		}
+		if (c < 0) {
+			uStringBytes += m->pRecords[b].uPathLen;
+			merged.push_back((long long)b++);
+		} else {
+			if (c == 0) b++; // replaced by the log
+			uStringBytes += log[l].sPath.size();
+			merged.push_back(~(long long)l++);
+		}
+	}
+
+	// pass 2: header, records, strings
+	MANIFEST_HEADER hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+	hdr.uCount = merged.size();
+	hdr.uStringBytes = uStringBytes;
+	bool bOk = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+	unsigned long long uOffset = 0;
+	for (size_t i = 0; i < merged.size() && bOk; i++) {
+		MANIFEST_RECORD rec;
+		if (merged[i] >= 0) {
+			rec = m->pRecords[merged[i]];
+		} else {
+			const MANIFEST_UPDATE &u = log[~merged[i]];
+			memset(&rec, 0, sizeof(rec));
+			rec.llKey = u.llKey;
+			rec.uPathLen = (unsigned int)u.sPath.size();
+			rec.entry = u.entry;
+		}
+		rec.uPathOffset = uOffset;
+		uOffset += rec.uPathLen;
+		bOk = fwrite(&rec, sizeof(rec), 1, f) == 1;
+	}
+	for (size_t i = 0; i < merged.size() && bOk; i++) {
+		if (merged[i] >= 0) {
+			const MANIFEST_RECORD *r = &m->pRecords[merged[i]];
+			bOk = fwrite(m->pStrings + r->uPathOffset, 1, r->uPathLen, f) == r->uPathLen;
+		} else {
+			const string &s = log[~merged[i]].sPath;
+			bOk = fwrite(s.data(), 1, s.size(), f) == s.size();
+		}
+	}
+	bOk = fflush(f) == 0 && bOk;
+	bOk = fsync(fileno(f)) == 0 && bOk; // the new base must be complete before it replaces the old one
+	fclose(f);
+	if (!bOk || 0 != rename(sTmp.c_str(), m->sFile.c_str())) {
+		remove(sTmp.c_str());
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+int manifest_close(MANIFEST *m)
+{
+	int ret = EXIT_SUCCESS;
+	if (m->fd >= 0) {
+		// all records not yet in the base, newest first
+		vector<MANIFEST_UPDATE> log(m->log);
+		log.insert(log.end(), m->updates.begin(), m->updates.end());
+		sort_log(log);
+		if (!log.empty() && log.size() * MANIFEST_COMPACT_RATIO >= m->uCount) {
+			ret = compact_manifest(m, log);
+			if (ret != EXIT_SUCCESS) printf("Unable to compact manifest %s.\n", m->sFile.c_str());
+		}
+		close(m->fd); // releases the lock
+		m->fd = -1;
+	}
+	if (m->pMap != NULL) munmap((void*)m->pMap, m->uMapSize);
+	m->pMap = NULL;
+	pthread_mutex_destroy(&m->mutex);
+	return ret;
+}
+
+#else
+
+void manifest_stat(const char *pcIn, MANIFEST_ENTRY *entry)
+{
+	memset(entry, 0, sizeof(MANIFEST_ENTRY));
+	entry->llInMtime = -1;
+}
+
+int manifest_open(MANIFEST *m, const char *pcFile, const char *pcParams)
+{
+	m->fd = -1;
+	m->pMap = NULL;
+	pthread_mutex_init(&m->mutex, NULL);
+	printf("Manifests are not supported on this platform.\n");
+	return EXIT_FAILURE;
+}
+
+int manifest_close(MANIFEST *m)
+{
+	pthread_mutex_destroy(&m->mutex);
+	return EXIT_SUCCESS;
+}
+
+bool manifest_unchanged(MANIFEST *m, const char *pcIn, const char *pcOut) { return false; }
+void manifest_record(MANIFEST *m, const char *pcIn, const MANIFEST_ENTRY *input, unsigned long long llOutSize,
+	unsigned long long llOutHash) {}
+
+#endif // WIN32
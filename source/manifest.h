@@ -0,0 +1,135 @@
+#ifndef __MANIFEST_H_
+#define __MANIFEST_H_
+
+#include <atomic>
+#include <vector>
+#include <string>
+#include "pthread.h"
+
+using namespace std;
+
+/////////////////////
+// persistent manifest of converted files for incremental runs
+/////////////////////
+
+/*
+ * The manifest file consists of a sorted base and an append-only log:
+ *
+ *   MANIFEST_HEADER | uCount MANIFEST_RECORDs sorted by (path hash, path) | path strings | log records...
+ *
+ * The base is memory-mapped and searched in place, so opening a manifest of 10M entries costs a single mmap and
+ * looking up a path touches only the pages on its binary search path. Every converted file is appended as a log
+ * record (MANIFEST_LOG_RECORD followed by the path) with one write() on an O_APPEND descriptor, which lets all
+ * workers update the manifest concurrently without rewriting it. Log records carry a checksum; a record torn by a
+ * crash is cut off when the manifest is opened the next time. Once the log has grown beyond 1/MANIFEST_COMPACT_RATIO
+ * of the base, manifest_close merges both into a new sorted base, written to a temporary file and renamed over
+ * the old one. The whole file is locked with flock while a run uses it. POSIX only.
+ */
+
+#define MANIFEST_MAGIC "LPMANIF1"
+#define MANIFEST_LOG_MAGIC 0x52474f4c // "LOGR"
+#define MANIFEST_COMPACT_RATIO 8
+
+/* What the manifest knows about one converted file. */
+typedef struct {
+	unsigned long long llInSize;
+	long long llInMtime; // nanoseconds since the epoch, -1 if the input couldn't be stat'ed
+	unsigned long long llParams; // hash of the encoding parameters (manifest_open)
+	unsigned long long llOutSize;
+	unsigned long long llOutHash; // see output_checksum, 0 if unknown
+} MANIFEST_ENTRY;
+
+/* On-disk layouts (native byte order) */
+typedef struct {
+	char magic[8];
+	unsigned long long uCount; // records in the base
+	unsigned long long uStringBytes; // size of the string area following the records
+	unsigned long long uReserved;
+} MANIFEST_HEADER;
+
+typedef struct {
+	unsigned long long llKey; // hash of the path
+	unsigned long long uPathOffset; // into the string area
+	unsigned int uPathLen;
+	unsigned int uReserved;
+	MANIFEST_ENTRY entry;
+} MANIFEST_RECORD;
+
+typedef struct {
+	unsigned int uMagic; // MANIFEST_LOG_MAGIC
+	unsigned int uPathLen; // bytes of the path following the record
+	MANIFEST_ENTRY entry;
+	unsigned long long llCheck; // hash over entry and path
+} MANIFEST_LOG_RECORD;
+
+/* A log record held in memory. */
+typedef struct {
+	unsigned long long llKey;
+	string sPath;
+	MANIFEST_ENTRY entry;
+} MANIFEST_UPDATE;
+
+/* An opened manifest. */
+typedef struct {
+	string sFile;
+	int fd; // locked, O_APPEND
+	const unsigned char *pMap; // base and the log found when opening
+	size_t uMapSize;
+	const MANIFEST_RECORD *pRecords;
+	unsigned long long uCount;
+	const char *pStrings;
+	unsigned long long llParams;
+	vector<MANIFEST_UPDATE> log; // log records of earlier runs, sorted, newest record per path only
+	pthread_mutex_t mutex; // protects the following member and serializes appends
+	vector<MANIFEST_UPDATE> updates; // records appended by this run
+	std::atomic<int> iSkipped; // files found unchanged by manifest_unchanged
+} MANIFEST;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* manifest_open
+ *  Opens (or creates) the manifest pcFile for a run with the encoding parameters described by pcParams (any string
+ *  which changes whenever the output of an unchanged input would change). Prints the reason on failure, m must not
+ *  be used (or closed) then.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int manifest_open(MANIFEST *m, const char *pcFile, const char *pcParams);
+
+/* manifest_close
+ *  Compacts the manifest if its log has grown large enough, unlocks and closes it.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE if compacting failed (the log is kept then, so nothing is lost)
+ */
+int manifest_close(MANIFEST *m);
+
+/* manifest_stat
+ *  Fills in the input size and modification time of entry from pcIn (llInMtime is -1 on failure).
+ */
+void manifest_stat(const char *pcIn, MANIFEST_ENTRY *entry);
+
+/* manifest_unchanged
+ *  Returns true if pcIn is recorded with its current size and modification time and the parameters of this run,
+ *  and its output pcOut still exists with the recorded size. Such files are counted in m->iSkipped. Thread-safe.
+ */
+bool manifest_unchanged(MANIFEST *m, const char *pcIn, const char *pcOut);
+
+/* manifest_record
+ *  Records that pcIn has been converted into an output of llOutSize bytes with checksum llOutHash. input holds
+ *  the size and modification time of pcIn taken before it was read (manifest_stat). Does nothing if m is NULL or
+ *  the input couldn't be stat'ed. Thread-safe.
+ */
+void manifest_record(MANIFEST *m, const char *pcIn, const MANIFEST_ENTRY *input, unsigned long long llOutSize,
+	unsigned long long llOutHash);
+
+/* manifest_hash
+ *  64 bit FNV-1a hash of n bytes, continuing from llHash (start with MANIFEST_HASH_INIT).
+ */
+#define MANIFEST_HASH_INIT 0xcbf29ce484222325ULL
+unsigned long long manifest_hash(const void *pData, size_t n, unsigned long long llHash);
+
+#endif // __MANIFEST_H_
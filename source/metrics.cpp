@@ -0,0 +1,356 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include "pthread.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+using namespace std;
+
+#ifdef WIN32
+#define METRICS_THREAD_LOCAL __declspec(thread)
+#else
+#define METRICS_THREAD_LOCAL __thread
+#endif
+
+typedef struct {
+	string name, help;
+	METRICS_GAUGE_FN fn;
+	void *ctx;
+} METRICS_GAUGE;
+
+static METRICS_SLOT *pSlots = NULL; // METRICS_MAX_SLOTS, allocated by metrics_enable
+static std::atomic<int> iSlotsUsed(0);
+static METRICS_THREAD_LOCAL METRICS_SLOT *pMySlot = NULL;
+static pthread_mutex_t gaugeLock = PTHREAD_MUTEX_INITIALIZER; // registration is rare, only scrapes contend
+static vector<METRICS_GAUGE> gauges;
+static unsigned long long llStartNs;
+static int iListenFd = -1;
+static string sSocketPath;
+static std::atomic<bool> bStop(false);
+static bool bServing = false; // serverThread is running
+static pthread_t serverThread;
+
+static unsigned long long now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+METRICS_SLOT *metrics_slot()
+{
+	return pMySlot;
+}
+
+void metrics_register_thread(const char *name, int id)
+{
+	if (pSlots == NULL) return;
+	int i = iSlotsUsed.fetch_add(1);
+	if (i >= METRICS_MAX_SLOTS) return; // not counted
+	METRICS_SLOT *slot = &pSlots[i];
+	snprintf(slot->name, sizeof(slot->name), "%s %i", name, id);
+	slot->llRegistered.store(now_ns(), std::memory_order_release); // publishes the name
+	pMySlot = slot;
+}
+
+void metrics_busy_begin()
+{
+	if (pMySlot != NULL) pMySlot->llBusySince.store(now_ns(), std::memory_order_relaxed);
+}
+
+void metrics_busy_end()
+{
+	if (pMySlot == NULL) return;
+	unsigned long long llSince = pMySlot->llBusySince.load(std::memory_order_relaxed);
+	if (llSince == 0) return;
+	pMySlot->llBusySince.store(0, std::memory_order_relaxed);
+	metrics_count(METRIC_BUSY_NS, now_ns() - llSince);
+}
+
+void metrics_job_done(double dSeconds)
+{
+	static const double bounds[METRICS_JOB_BUCKETS] = METRICS_BUCKET_BOUNDS;
+	if (pMySlot == NULL) return;
+	int b = 0;
+	while (b < METRICS_JOB_BUCKETS && dSeconds > bounds[b]) b++;
+	std::atomic<unsigned long long> &bucket = pMySlot->jobBuckets[b];
+	bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	unsigned long long llSum = pMySlot->llJobNsSum.load(std::memory_order_relaxed);
+	pMySlot->llJobNsSum.store(llSum + (unsigned long long)(dSeconds * 1e9), std::memory_order_relaxed);
+	metrics_count(METRIC_JOBS_DONE);
+}
+
+void metrics_add_gauge(const char *name, const char *help, METRICS_GAUGE_FN fn, void *ctx)
+{
+	if (pSlots == NULL) return;
+	METRICS_GAUGE g;
+	g.name = name;
+	g.help = help;
+	g.fn = fn;
+	g.ctx = ctx;
+	pthread_mutex_lock(&gaugeLock);
+	gauges.push_back(g);
+	pthread_mutex_unlock(&gaugeLock);
+}
+
+void metrics_remove_gauge(void *ctx)
+{
+	pthread_mutex_lock(&gaugeLock);
+	for (size_t i = gauges.size(); i-- > 0; )
+		if (gauges[i].ctx == ctx) gauges.erase(gauges.begin() + i);
+	pthread_mutex_unlock(&gaugeLock);
+}
+
+void metrics_enable()
+{
+	if (pSlots != NULL) return;
+	pSlots = new METRICS_SLOT[METRICS_MAX_SLOTS](); // value-initialized: all counters 0, names empty
+	llStartNs = now_ns();
+}
+
+unsigned long long metrics_total(METRIC_COUNTER counter)
+{
+	if (pSlots == NULL) return 0;
+	const int iSlots = iSlotsUsed.load() < METRICS_MAX_SLOTS ? iSlotsUsed.load() : METRICS_MAX_SLOTS;
+	unsigned long long llTotal = 0;
+	for (int i = 0; i < iSlots; i++) llTotal += pSlots[i].counters[counter].load(std::memory_order_relaxed);
+	return llTotal;
+}
+
+/////////////////////
+// scraping
+/////////////////////
+
+static const char *counterNames[METRIC_COUNT][2] = {
+	{ "jobs_started_total", "Jobs (files) started" },
+	{ "jobs_done_total", "Jobs converted successfully" },
+	{ "jobs_failed_total", "Jobs skipped because of errors" },
+	{ "read_bytes_total", "PCM bytes read from input files" },
+	{ "written_bytes_total", "Bytes written to output files" },
+	{ "encoded_samples_total", "PCM samples (per channel) encoded" },
+	{ "encoded_audio_seconds_total", "Seconds of audio encoded" },
+	{ "busy_seconds_total", "Time spent working on jobs, all threads" }
+};
+
+static unsigned long long load(const std::atomic<unsigned long long> &v)
+{
+	return v.load(std::memory_order_relaxed);
+}
+
+/* busy time of a slot including its current busy period */
+static double slot_busy_seconds(const METRICS_SLOT *slot, unsigned long long llNow)
+{
+	unsigned long long llBusy = load(slot->counters[METRIC_BUSY_NS]);
+	unsigned long long llSince = load(slot->llBusySince);
+	if (llSince != 0 && llNow > llSince) llBusy += llNow - llSince;
+	return llBusy / 1e9;
+}
+
+static void format_metrics(string &out)
+{
+	char line[256];
+	const unsigned long long llNow = now_ns();
+	const int iSlots = iSlotsUsed.load() < METRICS_MAX_SLOTS ? iSlotsUsed.load() : METRICS_MAX_SLOTS;
+
+	// sum up the thread-local counters
+	unsigned long long totals[METRIC_COUNT] = { 0 };
+	unsigned long long buckets[METRICS_JOB_BUCKETS + 1] = { 0 };
+	unsigned long long llJobNs = 0;
+	double dBusy = 0.0;
+	for (int i = 0; i < iSlots; i++) {
+		const METRICS_SLOT *slot = &pSlots[i];
+		for (int c = 0; c < METRIC_COUNT; c++) totals[c] += load(slot->counters[c]);
+		for (int b = 0; b <= METRICS_JOB_BUCKETS; b++) buckets[b] += load(slot->jobBuckets[b]);
+		llJobNs += load(slot->llJobNsSum);
+		dBusy += slot_busy_seconds(slot, llNow);
+	}
+
+	for (int c = 0; c < METRIC_COUNT; c++) {
+		double dValue = (double)totals[c];
+		if (c == METRIC_AUDIO_US_ENCODED) dValue /= 1e6;
+		if (c == METRIC_BUSY_NS) dValue = dBusy;
+		snprintf(line, sizeof(line), "# HELP lame_pthread_%s %s\n# TYPE lame_pthread_%s counter\n"
+			"lame_pthread_%s %.15g\n", counterNames[c][0], counterNames[c][1], counterNames[c][0],
+			counterNames[c][0], dValue);
+		out += line;
+	}
+
+	long long llInFlight = (long long)totals[METRIC_JOBS_STARTED] - totals[METRIC_JOBS_DONE] -
+		totals[METRIC_JOBS_FAILED];
+	snprintf(line, sizeof(line), "# HELP lame_pthread_jobs_in_flight Jobs being converted\n"
+		"# TYPE lame_pthread_jobs_in_flight gauge\nlame_pthread_jobs_in_flight %lld\n",
+		llInFlight > 0 ? llInFlight : 0);
+	out += line;
+
+	const double dUptime = (llNow - llStartNs) / 1e9;
+	snprintf(line, sizeof(line), "# HELP lame_pthread_encode_speed Seconds of audio encoded per second of wall "
+		"time since start\n# TYPE lame_pthread_encode_speed gauge\nlame_pthread_encode_speed %.6g\n",
+		dUptime > 0 ? totals[METRIC_AUDIO_US_ENCODED] / 1e6 / dUptime : 0.0);
+	out += line;
+
+	// job duration histogram
+	static const double bounds[METRICS_JOB_BUCKETS] = METRICS_BUCKET_BOUNDS;
+	out += "# HELP lame_pthread_job_duration_seconds Wall time per converted job\n"
+		"# TYPE lame_pthread_job_duration_seconds histogram\n";
+	unsigned long long llCumulative = 0;
+	for (int b = 0; b <= METRICS_JOB_BUCKETS; b++) {
+		llCumulative += buckets[b];
+		if (b < METRICS_JOB_BUCKETS)
+			snprintf(line, sizeof(line), "lame_pthread_job_duration_seconds_bucket{le=\"%g\"} %llu\n", bounds[b],
+				llCumulative);
+		else
+			snprintf(line, sizeof(line), "lame_pthread_job_duration_seconds_bucket{le=\"+Inf\"} %llu\n",
+				llCumulative);
+		out += line;
+	}
+	snprintf(line, sizeof(line), "lame_pthread_job_duration_seconds_sum %.9g\n"
+		"lame_pthread_job_duration_seconds_count %llu\n", llJobNs / 1e9, llCumulative);
+	out += line;
+
+	// per-thread utilization since the thread was registered
+	out += "# HELP lame_pthread_thread_utilization Busy fraction of each thread since its start\n"
+		"# TYPE lame_pthread_thread_utilization gauge\n";
+	for (int i = 0; i < iSlots; i++) {
+		const METRICS_SLOT *slot = &pSlots[i];
+		unsigned long long llRegistered = slot->llRegistered.load(std::memory_order_acquire);
+		if (llRegistered == 0) continue; // being registered right now
+		double dLife = (llNow - llRegistered) / 1e9;
+		snprintf(line, sizeof(line), "lame_pthread_thread_utilization{thread=\"%s\"} %.4f\n", slot->name,
+			dLife > 0 ? slot_busy_seconds(slot, llNow) / dLife : 0.0);
+		out += line;
+	}
+
+	// callbacks
+	pthread_mutex_lock(&gaugeLock);
+	for (size_t i = 0; i < gauges.size(); i++) {
+		const METRICS_GAUGE *g = &gauges[i];
+		snprintf(line, sizeof(line), "# HELP lame_pthread_%s %s\n# TYPE lame_pthread_%s gauge\n"
+			"lame_pthread_%s %.15g\n", g->name.c_str(), g->help.c_str(), g->name.c_str(), g->name.c_str(),
+			g->fn(g->ctx));
+		out += line;
+	}
+	pthread_mutex_unlock(&gaugeLock);
+}
+
+#ifndef WIN32
+static void serve_client(int fd)
+{
+	// the request itself doesn't matter, every path returns the metrics
+	char request[1024];
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	if (poll(&pfd, 1, 1000) > 0) {
+		ssize_t n = read(fd, request, sizeof(request));
+		(void)n;
+	}
+
+	string body;
+	format_metrics(body);
+	char header[160];
+	snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)body.size());
+	string response = string(header) + body;
+	const char *p = response.data();
+	size_t left = response.size();
+	while (left > 0) {
+		ssize_t n = write(fd, p, left);
+		if (n <= 0) break;
+		p += n;
+		left -= n;
+	}
+	close(fd);
+}
+
+static void *server_thread(void *arg)
+{
+	(void)arg;
+	while (!bStop.load()) {
+		struct pollfd pfd = { iListenFd, POLLIN, 0 };
+		if (poll(&pfd, 1, 200) <= 0) continue; // wake up regularly to check for bStop
+		int fd = accept(iListenFd, NULL, NULL);
+		if (fd >= 0) serve_client(fd);
+	}
+	return NULL;
+}
+#endif
+
+int metrics_start(const char *spec)
+{
+#ifdef WIN32
+	(void)spec;
+	cerr << "Metrics endpoint is not supported on Windows." << endl;
+	return EXIT_FAILURE;
+#else
+	char *pcEnd;
+	long lPort = strtol(spec, &pcEnd, 10);
+	if (*spec != '\0' && *pcEnd == '\0') {
+		if (lPort <= 0 || lPort > 65535) return EXIT_FAILURE;
+		iListenFd = socket(AF_INET, SOCK_STREAM, 0);
+		if (iListenFd < 0) return EXIT_FAILURE;
+		int iOn = 1;
+		setsockopt(iListenFd, SOL_SOCKET, SO_REUSEADDR, &iOn, sizeof(iOn));
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((unsigned short)lPort);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // never exposed beyond the host
+		if (0 != bind(iListenFd, (struct sockaddr*)&addr, sizeof(addr))) {
+			close(iListenFd);
+			iListenFd = -1;
+			return EXIT_FAILURE;
+		}
+	} else {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(spec) == 0 || strlen(spec) >= sizeof(addr.sun_path)) return EXIT_FAILURE;
+		strcpy(addr.sun_path, spec);
+		iListenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (iListenFd < 0) return EXIT_FAILURE;
+		unlink(spec);
+		if (0 != bind(iListenFd, (struct sockaddr*)&addr, sizeof(addr))) {
+			close(iListenFd);
+			iListenFd = -1;
+			return EXIT_FAILURE;
+		}
+		sSocketPath = spec;
+	}
+	if (0 != listen(iListenFd, 16)) {
+		metrics_stop();
+		return EXIT_FAILURE;
+	}
+
+	metrics_enable();
+	bStop = false;
+	if (0 != pthread_create(&serverThread, NULL, server_thread, NULL)) {
+		metrics_stop();
+		return EXIT_FAILURE;
+	}
+	bServing = true;
+	return EXIT_SUCCESS;
+#endif
+}
+
+void metrics_stop()
+{
+#ifndef WIN32
+	if (bServing && !bStop.exchange(true)) pthread_join(serverThread, NULL);
+	bServing = false;
+	if (iListenFd >= 0) close(iListenFd);
+	iListenFd = -1;
+	if (!sSocketPath.empty()) unlink(sSocketPath.c_str());
+	sSocketPath.clear();
+#endif
+	// slots stay allocated, threads which are still registered keep counting into them
+}
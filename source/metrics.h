@@ -0,0 +1,126 @@
+#ifndef __METRICS_H_
+#define __METRICS_H_
+
+#include <atomic>
+#include "lf_queue.h"
+
+/////////////////////
+// live metrics in Prometheus text format
+/////////////////////
+
+/*
+ * Every thread counts into a METRICS_SLOT of its own, which only it writes (a relaxed load and store, no
+ * read-modify-write and no shared cache lines). The counters are summed up lazily by the server thread whenever
+ * the endpoint is scraped, so scraping never contends with the encoding threads. Gauges which aren't owned by a
+ * thread (jobs queued, queue depths) are registered as callbacks and evaluated at scrape time as well.
+ *
+ * The endpoint answers every request on a TCP port of 127.0.0.1 or a Unix socket with the current metrics
+ * (HTTP/1.0, so both Prometheus and curl --unix-socket work). Linux only.
+ */
+
+typedef enum {
+	METRIC_JOBS_STARTED = 0,
+	METRIC_JOBS_DONE,
+	METRIC_JOBS_FAILED,
+	METRIC_BYTES_READ,
+	METRIC_BYTES_WRITTEN,
+	METRIC_SAMPLES_ENCODED, // per channel
+	METRIC_AUDIO_US_ENCODED, // microseconds of audio
+	METRIC_BUSY_NS, // completed busy periods
+	METRIC_COUNT
+} METRIC_COUNTER;
+
+/* Upper bounds (seconds) of the job duration histogram buckets, the last bucket is +Inf. */
+#define METRICS_JOB_BUCKETS 10
+#define METRICS_BUCKET_BOUNDS { 0.01, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 10.0, 60.0, 300.0 }
+
+#define METRICS_MAX_SLOTS 1024
+
+/* Counters of a single thread. */
+struct METRICS_SLOT {
+	std::atomic<unsigned long long> counters[METRIC_COUNT];
+	std::atomic<unsigned long long> jobBuckets[METRICS_JOB_BUCKETS + 1];
+	std::atomic<unsigned long long> llJobNsSum;
+	std::atomic<unsigned long long> llBusySince; // ns timestamp of the current busy period, 0 while idle
+	std::atomic<unsigned long long> llRegistered; // ns timestamp of metrics_register_thread, 0 until named
+	char name[32];
+	char pad[LF_CACHE_LINE];
+};
+
+/* Gauge evaluated at scrape time. */
+typedef double (*METRICS_GAUGE_FN)(void *ctx);
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* metrics_start
+ *  Starts the endpoint given by spec: a port number for HTTP on 127.0.0.1, anything else is taken as the path
+ *  of a Unix socket (which is replaced if it exists). Enables counting (see metrics_enable).
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int metrics_start(const char *spec);
+
+/* metrics_enable
+ *  Enables counting without serving the metrics, e.g. for a consumer within the process (see metrics_total).
+ *  Threads registered before counting has been enabled aren't counted.
+ */
+void metrics_enable();
+
+/* metrics_total
+ *  Returns a counter summed over all threads, 0 unless counting is enabled. Like a scrape, this only reads the
+ *  slots and can be called at any time from any thread.
+ */
+unsigned long long metrics_total(METRIC_COUNTER counter);
+
+/* metrics_stop
+ *  Stops the endpoint (call after all counting threads have finished).
+ */
+void metrics_stop();
+
+/* metrics_register_thread
+ *  Assigns a slot named "name id" to the calling thread. Does nothing unless counting is enabled.
+ */
+void metrics_register_thread(const char *name, int id);
+
+/* metrics_add_gauge
+ *  Registers a gauge reported as lame_pthread_<name>, which stays valid until metrics_remove_gauge with the same
+ *  ctx is called.
+ */
+void metrics_add_gauge(const char *name, const char *help, METRICS_GAUGE_FN fn, void *ctx);
+
+/* metrics_remove_gauge
+ *  Unregisters all gauges with context ctx.
+ */
+void metrics_remove_gauge(void *ctx);
+
+/* metrics_slot
+ *  Returns the slot of the calling thread, NULL if it has none.
+ */
+METRICS_SLOT *metrics_slot();
+
+/* metrics_count
+ *  Adds n to a counter of the calling thread.
+ */
+static inline void metrics_count(METRIC_COUNTER counter, unsigned long long n = 1)
+{
+	METRICS_SLOT *slot = metrics_slot();
+	if (slot == NULL) return;
+	std::atomic<unsigned long long> &c = slot->counters[counter];
+	c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/* metrics_busy_begin, metrics_busy_end
+ *  Mark the start and end of a busy period of the calling thread (used for the utilization).
+ */
+void metrics_busy_begin();
+void metrics_busy_end();
+
+/* metrics_job_done
+ *  Counts a successfully finished job which took dSeconds.
+ */
+void metrics_job_done(double dSeconds);
+
+#endif // __METRICS_H_
@@ -0,0 +1,460 @@
+#include "mp3_output.h"
+#include "uring.h"
+#include "trace.h"
+#include "metrics.h"
+#include "manifest.h"
+#include <iostream>
+#include <atomic>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+void output_default_cfg(OUTPUT_CFG *cfg)
+{
+	cfg->backend = OUTPUT_DEFAULT_BACKEND;
+	cfg->uBlockSize = OUTPUT_DEFAULT_BLOCK_SIZE;
+	cfg->uQueueDepth = OUTPUT_DEFAULT_QUEUE_DEPTH;
+	cfg->sync = SYNC_NONE;
+	cfg->uGroupSize = OUTPUT_DEFAULT_GROUP_SIZE;
+	cfg->pBuffers = NULL;
+	cfg->pRing = NULL;
+	cfg->pcInDir = NULL;
+	cfg->pcOutDir = NULL;
+}
+
+void output_file_name(const OUTPUT_CFG *cfg, const string &sIn, string &sOut)
+{
+	const size_t uStem = sIn.length() - 3; // up to the extension
+	size_t uRoot = 0;
+	if (cfg != NULL && cfg->pcOutDir != NULL && cfg->pcInDir != NULL) {
+		uRoot = strlen(cfg->pcInDir);
+		if (uRoot > uStem || 0 != sIn.compare(0, uRoot, cfg->pcInDir)) uRoot = 0; // not part of the mirrored tree
+	}
+	sOut.assign(uRoot > 0 ? cfg->pcOutDir : "");
+	sOut.append(sIn, uRoot, uStem - uRoot);
+	sOut.append("mp3");
+}
+
+static const char *backendNames[] = { "stdio", "write", "uring", "sink" };
+
+int output_backend_from_name(const char *name, OUTPUT_BACKEND &backend)
+{
+	for (int i = 0; i < (int)(sizeof(backendNames) / sizeof(backendNames[0])); i++) {
+		if (0 == strcmp(name, backendNames[i])) {
+			if (i == OUTPUT_SINK) return EXIT_FAILURE; // only for output_open_sink
+#ifdef WIN32
+			if (i != OUTPUT_STDIO) return EXIT_FAILURE;
+#endif
+			backend = (OUTPUT_BACKEND)i;
+			return EXIT_SUCCESS;
+		}
+	}
+	return EXIT_FAILURE;
+}
+
+const char *output_backend_name(OUTPUT_BACKEND backend)
+{
+	return backendNames[backend];
+}
+
+int output_sync_from_name(const char *name, OUTPUT_CFG *cfg)
+{
+	if (0 == strcmp(name, "none")) {
+		cfg->sync = SYNC_NONE;
+	} else if (0 == strcmp(name, "file")) {
+		cfg->sync = SYNC_FILE;
+	} else if (0 == strncmp(name, "group", 5)) {
+		if (name[5] != '\0' && atoi(&name[5]) <= 0) return EXIT_FAILURE;
+		cfg->sync = SYNC_GROUP;
+		if (name[5] != '\0') cfg->uGroupSize = atoi(&name[5]);
+	} else {
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* files closed since the last group sync, shared by all writers */
+static std::atomic<unsigned int> uGroupPending(0);
+
+#ifndef WIN32
+/* writes n bytes at llOffset, continuing after short writes */
+static bool pwrite_all(int fd, const unsigned char *p, size_t n, unsigned long long llOffset)
+{
+	while (n > 0) {
+		ssize_t done = pwrite(fd, p, n, llOffset);
+		if (done <= 0) return false;
+		p += done;
+		n -= done;
+		llOffset += done;
+	}
+	return true;
+}
+#endif
+
+/////////////////////
+// io_uring writer: blocks are written asynchronously while the next one is filled
+/////////////////////
+
+#ifdef HAVE_IO_URING
+struct URING_WRITER {
+	URING ring;
+	unsigned int uDepth;
+	unsigned long long *pllSlotOffset; // file offset of the block written from each slot
+	unsigned int *puSlotLen; // bytes to write from each slot
+	bool *pbSlotBusy; // write in flight
+	unsigned int uInFlight;
+};
+
+static void uring_writer_destroy(URING_WRITER *w)
+{
+	uring_teardown(&w->ring);
+	delete[] w->pllSlotOffset;
+	delete[] w->puSlotLen;
+	delete[] w->pbSlotBusy;
+	delete w;
+}
+
+static URING_WRITER *uring_writer_create(unsigned int uDepth)
+{
+	URING ring;
+	if (EXIT_SUCCESS != uring_setup(&ring, uDepth)) {
+		static bool bWarned = false;
+		if (!bWarned) {
+			bWarned = true;
+			cerr << "WARNING: io_uring not available, falling back to write." << endl;
+		}
+		return NULL;
+	}
+	URING_WRITER *w = new URING_WRITER;
+	w->ring = ring;
+	w->uDepth = uDepth;
+	w->pllSlotOffset = new unsigned long long[uDepth];
+	w->puSlotLen = new unsigned int[uDepth];
+	w->pbSlotBusy = new bool[uDepth];
+	for (unsigned int i = 0; i < uDepth; i++) w->pbSlotBusy[i] = false;
+	w->uInFlight = 0;
+	return w;
+}
+
+/* collects all available completions, waiting for at least one if bWait is set */
+static void uring_writer_reap(MP3_OUTPUT *out, bool bWait)
+{
+	URING_WRITER *w = out->pRing;
+	if (bWait && w->uInFlight > 0) {
+		TRACE_SCOPE("wait uring write");
+		uring_enter(&w->ring, 0, 1);
+	}
+	unsigned long long llSlot;
+	int iResult;
+	while (uring_pop_cqe(&w->ring, llSlot, iResult)) {
+		w->pbSlotBusy[llSlot] = false;
+		w->uInFlight--;
+		if (iResult < 0) {
+			out->bError = true;
+		} else if ((unsigned int)iResult < w->puSlotLen[llSlot]) {
+			const unsigned char *block = out->pBuffers + (size_t)llSlot * out->uBlockSize;
+			if (!pwrite_all(out->fd, block + iResult, w->puSlotLen[llSlot] - iResult,
+				w->pllSlotOffset[llSlot] + iResult))
+				out->bError = true;
+		}
+	}
+}
+
+static void uring_writer_drain(MP3_OUTPUT *out)
+{
+	while (out->pRing->uInFlight > 0)
+		uring_writer_reap(out, true);
+}
+#else
+struct URING_WRITER { int unused; };
+#endif
+
+OUTPUT_RING::~OUTPUT_RING()
+{
+#ifdef HAVE_IO_URING
+	if (pWriter != NULL) uring_writer_destroy(pWriter);
+#endif
+}
+
+URING_WRITER *output_ring_reserve(OUTPUT_RING *ring, const OUTPUT_CFG *cfg)
+{
+#ifdef HAVE_IO_URING
+	if (cfg->backend == OUTPUT_URING && ring->pWriter == NULL)
+		ring->pWriter = uring_writer_create(cfg->uQueueDepth >= 2 ? cfg->uQueueDepth : OUTPUT_DEFAULT_QUEUE_DEPTH);
+	return cfg->backend == OUTPUT_URING ? ring->pWriter : NULL;
+#else
+	return NULL;
+#endif
+}
+
+/////////////////////
+// generic interface
+/////////////////////
+
+int output_open(MP3_OUTPUT *out, const char *filename, const OUTPUT_CFG *cfg, unsigned long long llExpectedSize)
+{
+	OUTPUT_CFG defaultCfg;
+	if (cfg == NULL) {
+		output_default_cfg(&defaultCfg);
+		cfg = &defaultCfg;
+	}
+	memset(out, 0, sizeof(MP3_OUTPUT));
+	out->fd = -1;
+	out->backend = cfg->backend;
+	out->sync = cfg->sync;
+	out->uGroupSize = cfg->uGroupSize > 0 ? cfg->uGroupSize : OUTPUT_DEFAULT_GROUP_SIZE;
+	out->uBlockSize = cfg->uBlockSize > 0 ? cfg->uBlockSize : OUTPUT_DEFAULT_BLOCK_SIZE;
+	out->llHash = MANIFEST_HASH_INIT;
+
+	if (out->backend == OUTPUT_STDIO) {
+		out->pFile = fopen(filename, "wb+");
+		if (out->pFile == NULL) return EXIT_FAILURE;
+		setvbuf(out->pFile, NULL, _IOFBF, out->uBlockSize);
+		return EXIT_SUCCESS;
+	}
+
+#ifndef WIN32
+	out->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out->fd < 0) return EXIT_FAILURE;
+#ifdef __linux__
+	// reserve the expected size in one extent instead of growing the file block by block
+	if (llExpectedSize > 0 && 0 == fallocate(out->fd, 0, 0, llExpectedSize))
+		out->llPrealloc = llExpectedSize;
+#endif
+
+	out->uDepth = 1;
+#ifdef HAVE_IO_URING
+	if (out->backend == OUTPUT_URING) {
+		out->bOwnRing = cfg->pRing == NULL;
+		out->pRing = out->bOwnRing ?
+			uring_writer_create(cfg->uQueueDepth >= 2 ? cfg->uQueueDepth : OUTPUT_DEFAULT_QUEUE_DEPTH) : cfg->pRing;
+		if (out->pRing != NULL) out->uDepth = out->pRing->uDepth;
+	}
+#endif
+	if (out->pRing == NULL) out->backend = OUTPUT_WRITE;
+	out->bOwnBuffers = cfg->pBuffers == NULL;
+	out->pBuffers = out->bOwnBuffers ? new unsigned char[(size_t)out->uDepth * out->uBlockSize] : cfg->pBuffers;
+	return EXIT_SUCCESS;
+#else
+	return EXIT_FAILURE;
+#endif
+}
+
+#ifndef WIN32
+/* writes the current block and starts a new one */
+static void output_flush_block(MP3_OUTPUT *out)
+{
+	if (out->uFill == 0) return;
+	TRACE_SCOPE("write block");
+	unsigned char *block = out->pBuffers + (size_t)out->uSlot * out->uBlockSize;
+#ifdef HAVE_IO_URING
+	if (out->pRing != NULL) {
+		URING_WRITER *w = out->pRing;
+		struct io_uring_sqe *sqe = uring_next_sqe(&w->ring);
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = out->fd;
+		sqe->addr = (unsigned long long)block;
+		sqe->len = out->uFill;
+		sqe->off = out->llBlockOffset;
+		sqe->user_data = out->uSlot;
+		uring_commit_sqe(&w->ring);
+		w->pllSlotOffset[out->uSlot] = out->llBlockOffset;
+		w->puSlotLen[out->uSlot] = out->uFill;
+		w->pbSlotBusy[out->uSlot] = true;
+		w->uInFlight++;
+		if (uring_enter(&w->ring, 1, 0) < 0) out->bError = true;
+
+		// continue with the next slot as soon as its previous write has completed
+		out->uSlot = (out->uSlot + 1) % out->uDepth;
+		uring_writer_reap(out, false);
+		while (w->pbSlotBusy[out->uSlot] && !out->bError)
+			uring_writer_reap(out, true);
+	} else
+#endif
+	if (!pwrite_all(out->fd, block, out->uFill, out->llBlockOffset)) {
+		out->bError = true;
+	}
+	out->llBlockOffset += out->uFill;
+	out->uFill = 0;
+}
+#endif
+
+void output_open_sink(MP3_OUTPUT *out, const MP3_SINK *sink)
+{
+	memset(out, 0, sizeof(MP3_OUTPUT));
+	out->fd = -1;
+	out->backend = OUTPUT_SINK;
+	out->sync = SYNC_NONE;
+	out->sink = *sink;
+	out->llHash = MANIFEST_HASH_INIT;
+}
+
+int output_write(MP3_OUTPUT *out, const void *pData, size_t n)
+{
+	if (out->bError) return EXIT_FAILURE;
+	metrics_count(METRIC_BYTES_WRITTEN, n);
+	out->llHash = manifest_hash(pData, n, out->llHash);
+	if (out->backend == OUTPUT_SINK) {
+		if (out->sink.pfnWrite != NULL)
+			out->bError = EXIT_SUCCESS != out->sink.pfnWrite(pData, n, out->sink.pCtx);
+		else if (out->llBlockOffset + n <= out->sink.uCapacity)
+			memcpy(out->sink.pBuffer + out->llBlockOffset, pData, n);
+		else
+			out->bError = true; // buffer too small
+		if (!out->bError) out->llBlockOffset += n;
+		return out->bError ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	if (out->backend == OUTPUT_STDIO) {
+		if (fwrite(pData, 1, n, out->pFile) != n) out->bError = true;
+		return out->bError ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+#ifndef WIN32
+	const unsigned char *p = (const unsigned char*)pData;
+	while (n > 0) {
+		size_t chunk = out->uBlockSize - out->uFill;
+		if (chunk > n) chunk = n;
+		memcpy(out->pBuffers + (size_t)out->uSlot * out->uBlockSize + out->uFill, p, chunk);
+		out->uFill += (unsigned int)chunk;
+		p += chunk;
+		n -= chunk;
+		if (out->uFill == out->uBlockSize) output_flush_block(out);
+	}
+#endif
+	return out->bError ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int output_write_at(MP3_OUTPUT *out, const void *pData, size_t n, unsigned long long llOffset)
+{
+	if (out->bError) return EXIT_FAILURE;
+	if (llOffset + n > output_size(out)) return EXIT_FAILURE;
+	if (out->backend == OUTPUT_SINK) {
+		if (out->sink.pfnWrite != NULL) return EXIT_FAILURE; // passed on already
+		out->bOverwritten = true;
+		memcpy(out->sink.pBuffer + llOffset, pData, n);
+		return EXIT_SUCCESS;
+	}
+	out->bOverwritten = true;
+	if (out->backend == OUTPUT_STDIO) {
+		long long llEnd = (long long)output_size(out);
+#ifdef WIN32
+		_fseeki64(out->pFile, llOffset, SEEK_SET);
+		if (fwrite(pData, 1, n, out->pFile) != n) out->bError = true;
+		_fseeki64(out->pFile, llEnd, SEEK_SET);
+#else
+		fseeko(out->pFile, llOffset, SEEK_SET);
+		if (fwrite(pData, 1, n, out->pFile) != n) out->bError = true;
+		fseeko(out->pFile, llEnd, SEEK_SET);
+#endif
+		return out->bError ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+#ifndef WIN32
+	// part within the block still being filled
+	const unsigned char *p = (const unsigned char*)pData;
+	if (llOffset + n > out->llBlockOffset) {
+		size_t uSkip = llOffset > out->llBlockOffset ? 0 : (size_t)(out->llBlockOffset - llOffset);
+		unsigned long long llStart = llOffset + uSkip;
+		memcpy(out->pBuffers + (size_t)out->uSlot * out->uBlockSize + (llStart - out->llBlockOffset), p + uSkip,
+			n - uSkip);
+		n = uSkip;
+	}
+	// part which has already been handed to the kernel
+	if (n > 0) {
+#ifdef HAVE_IO_URING
+		if (out->pRing != NULL) uring_writer_drain(out); // don't race with writes in flight
+#endif
+		if (!pwrite_all(out->fd, p, n, llOffset)) out->bError = true;
+	}
+#endif
+	return out->bError ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+unsigned long long output_checksum(const MP3_OUTPUT *out)
+{
+	return out->bOverwritten ? 0 : out->llHash;
+}
+
+unsigned long long output_size(const MP3_OUTPUT *out)
+{
+	if (out->backend == OUTPUT_STDIO) {
+#ifdef WIN32
+		return out->pFile != NULL ? _ftelli64(out->pFile) : 0;
+#else
+		return out->pFile != NULL ? ftello(out->pFile) : 0;
+#endif
+	}
+	return out->llBlockOffset + out->uFill;
+}
+
+/* sync the file system after every uGroupSize files */
+static void output_group_sync(int fd, unsigned int uGroupSize)
+{
+	if (uGroupPending.fetch_add(1) + 1 < uGroupSize) return;
+	uGroupPending.store(0);
+	TRACE_SCOPE("group sync");
+#ifdef __linux__
+	syncfs(fd);
+#else
+	fsync(fd);
+#endif
+}
+
+int output_close(MP3_OUTPUT *out)
+{
+	if (out->pFile != NULL) {
+		if (fflush(out->pFile) != 0) out->bError = true;
+		if (out->sync != SYNC_NONE) {
+#ifdef WIN32
+			_commit(_fileno(out->pFile)); // no file system wide sync available, so groups sync every file
+#else
+			if (out->sync == SYNC_FILE)
+				fsync(fileno(out->pFile));
+			else
+				output_group_sync(fileno(out->pFile), out->uGroupSize);
+#endif
+		}
+		fclose(out->pFile);
+		out->pFile = NULL;
+	}
+#ifndef WIN32
+	if (out->fd >= 0) {
+		output_flush_block(out);
+#ifdef HAVE_IO_URING
+		if (out->pRing != NULL) {
+			uring_writer_drain(out); // a shared ring must be idle for the next output
+			if (out->bOwnRing) uring_writer_destroy(out->pRing);
+			out->pRing = NULL;
+			out->bOwnRing = false;
+		}
+#endif
+		// give back what has been preallocated but not used
+		if (out->llPrealloc > out->llBlockOffset && ftruncate(out->fd, out->llBlockOffset) != 0)
+			out->bError = true;
+		if (out->sync == SYNC_FILE) {
+			TRACE_SCOPE("fsync");
+			fsync(out->fd);
+		}
+		else if (out->sync == SYNC_GROUP)
+			output_group_sync(out->fd, out->uGroupSize);
+		close(out->fd);
+		out->fd = -1;
+	}
+#endif
+	if (out->bOwnBuffers) delete[] out->pBuffers;
+	out->pBuffers = NULL;
+	out->bOwnBuffers = false;
+	return out->bError ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void output_finish(const OUTPUT_CFG *cfg)
+{
+	if (cfg->sync != SYNC_GROUP || uGroupPending.exchange(0) == 0) return;
+#ifndef WIN32
+	sync();
+#endif
+}
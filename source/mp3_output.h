@@ -0,0 +1,224 @@
+#ifndef __MP3_OUTPUT_H_
+#define __MP3_OUTPUT_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+using namespace std;
+
+/////////////////////
+// output layer for the encoded MP3 files
+/////////////////////
+
+/*
+ * Backends for writing output files:
+ *   OUTPUT_STDIO  buffered FILE* writes (the only backend on Windows)
+ *   OUTPUT_WRITE  preallocated file, written in large blocks with pwrite
+ *   OUTPUT_URING  like OUTPUT_WRITE, but up to uQueueDepth block writes are kept in flight via io_uring while the
+ *                 next block is being filled (falls back to OUTPUT_WRITE if unavailable)
+ *   OUTPUT_SINK   a caller-supplied memory buffer or write callback instead of a file (output_open_sink, not
+ *                 selectable with -o)
+ */
+typedef enum {
+	OUTPUT_STDIO = 0,
+	OUTPUT_WRITE,
+	OUTPUT_URING,
+	OUTPUT_SINK
+} OUTPUT_BACKEND;
+
+/*
+ * Durability of the written files:
+ *   SYNC_NONE   leave writeback to the kernel
+ *   SYNC_FILE   fsync every file before closing it
+ *   SYNC_GROUP  sync the file system once every uGroupSize files (and once at the end), which amortizes the
+ *               metadata syncs over many files
+ */
+typedef enum {
+	SYNC_NONE = 0,
+	SYNC_FILE,
+	SYNC_GROUP
+} OUTPUT_SYNC;
+
+#ifdef WIN32
+#define OUTPUT_DEFAULT_BACKEND OUTPUT_STDIO
+#else
+#define OUTPUT_DEFAULT_BACKEND OUTPUT_WRITE
+#endif
+#define OUTPUT_DEFAULT_BLOCK_SIZE (1024 * 1024) // bytes per write request
+#define OUTPUT_DEFAULT_QUEUE_DEPTH 2 // io_uring writes in flight
+#define OUTPUT_DEFAULT_GROUP_SIZE 64 // files per group sync
+
+/* Opaque io_uring writer state (see mp3_output.cpp) */
+struct URING_WRITER;
+
+/* Output configuration which is shared by all writers. */
+typedef struct {
+	OUTPUT_BACKEND backend;
+	unsigned int uBlockSize; // size of a single write request in bytes (multiple of 4096)
+	unsigned int uQueueDepth; // number of block writes kept in flight (io_uring only)
+	OUTPUT_SYNC sync;
+	unsigned int uGroupSize; // SYNC_GROUP only
+	unsigned char *pBuffers; // optional caller-owned buffers of uQueueDepth * uBlockSize bytes, which lets a thread
+	                         // reuse them for all its outputs; NULL to allocate per output
+	URING_WRITER *pRing; // optional caller-owned io_uring writer (uring only, see OUTPUT_RING), which lets a thread
+	                     // reuse one ring for all its outputs; NULL to set one up per output
+	const char *pcInDir; // input directory whose tree is mirrored below pcOutDir
+	const char *pcOutDir; // NULL: MP3 files are written next to their WAV files
+} OUTPUT_CFG;
+
+/* Destination of an OUTPUT_SINK output: the data is either copied into pBuffer, which fails once uCapacity bytes
+ * are exceeded, or (if pfnWrite is set) passed to pfnWrite chunk by chunk in file order. pfnWrite returns
+ * EXIT_SUCCESS or EXIT_FAILURE, the latter fails the output.
+ */
+typedef struct {
+	unsigned char *pBuffer;
+	size_t uCapacity;
+	int (*pfnWrite)(const void *pData, size_t n, void *pCtx);
+	void *pCtx; // passed to pfnWrite
+} MP3_SINK;
+
+/* io_uring writer of a thread, set up by output_ring_reserve on first use and closed by the destructor. Only one
+ * output at a time may use it.
+ */
+struct OUTPUT_RING {
+	URING_WRITER *pWriter;
+
+	OUTPUT_RING() : pWriter(NULL) {}
+	~OUTPUT_RING();
+
+private:
+	OUTPUT_RING(const OUTPUT_RING&); // not copyable
+	OUTPUT_RING &operator=(const OUTPUT_RING&);
+};
+
+/* An opened output file. Data is collected in blocks which are written at block-aligned file offsets. */
+typedef struct {
+	OUTPUT_BACKEND backend;
+	OUTPUT_SYNC sync;
+	unsigned int uGroupSize;
+	FILE *pFile; // OUTPUT_STDIO
+	int fd; // OUTPUT_WRITE, OUTPUT_URING
+	unsigned char *pBuffers; // uDepth blocks
+	bool bOwnBuffers; // pBuffers has been allocated by output_open
+	unsigned int uBlockSize;
+	unsigned int uDepth;
+	unsigned int uSlot; // block currently being filled
+	unsigned int uFill; // bytes in the current block
+	unsigned long long llBlockOffset; // file offset of the current block
+	unsigned long long llPrealloc; // bytes reserved by fallocate
+	URING_WRITER *pRing; // OUTPUT_URING
+	bool bOwnRing; // OUTPUT_URING: pRing has been set up by output_open
+	bool bError;
+	unsigned long long llHash; // checksum of the data appended so far (see output_checksum)
+	bool bOverwritten; // output_write_at has changed data which is already part of llHash
+	MP3_SINK sink; // OUTPUT_SINK
+} MP3_OUTPUT;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* output_default_cfg
+ *  Fills cfg with the platform default backend, block size, queue depth and no syncing.
+ */
+void output_default_cfg(OUTPUT_CFG *cfg);
+
+/* output_backend_from_name
+ *  Parses a backend name ("stdio", "write", "uring") as given on the command line.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE for unknown or unsupported backends
+ */
+int output_backend_from_name(const char *name, OUTPUT_BACKEND &backend);
+
+/* output_backend_name
+ *  Returns the printable name of a backend.
+ */
+const char *output_backend_name(OUTPUT_BACKEND backend);
+
+/* output_sync_from_name
+ *  Parses a durability mode as given on the command line: "none", "file" or "group" optionally followed by
+ *  the group size (e.g. "group32").
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE for unknown modes
+ */
+int output_sync_from_name(const char *name, OUTPUT_CFG *cfg);
+
+/* output_file_name
+ *  Stores the name of the MP3 file for the WAV file sIn in sOut: the same path with the extension .mp3, or the
+ *  corresponding path below cfg->pcOutDir if sIn lies below cfg->pcInDir. Reuses the memory of sOut, so a thread
+ *  can keep one string for all of its files.
+ */
+void output_file_name(const OUTPUT_CFG *cfg, const string &sIn, string &sOut);
+
+/* output_ring_reserve
+ *  Sets up the io_uring writer of ring for outputs opened with cfg unless that has been done before.
+ *
+ *  Return value:
+ *    writer to be stored in OUTPUT_CFG::pRing, NULL if cfg doesn't select the uring backend or io_uring is
+ *    unavailable
+ */
+URING_WRITER *output_ring_reserve(OUTPUT_RING *ring, const OUTPUT_CFG *cfg);
+
+/* output_open
+ *  Creates (or truncates) filename for writing with the backend given by cfg (defaults if cfg is NULL). If
+ *  llExpectedSize is not 0, that much space is preallocated so that concurrent writers don't fragment the file
+ *  system; output_close trims the file to the size actually written.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int output_open(MP3_OUTPUT *out, const char *filename, const OUTPUT_CFG *cfg, unsigned long long llExpectedSize);
+
+/* output_open_sink
+ *  Opens an output which writes to sink instead of a file (see MP3_SINK). Nothing is buffered, data reaches the
+ *  sink as it is written.
+ */
+void output_open_sink(MP3_OUTPUT *out, const MP3_SINK *sink);
+
+/* output_write
+ *  Appends n bytes to the file.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE on I/O errors (also for all following writes)
+ */
+int output_write(MP3_OUTPUT *out, const void *pData, size_t n);
+
+/* output_write_at
+ *  Overwrites n bytes at file offset llOffset with pData, which must lie within the data already appended
+ *  (e.g. for the LAME tag frame at offset 0). Fails for sinks with a write callback.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE on I/O errors
+ */
+int output_write_at(MP3_OUTPUT *out, const void *pData, size_t n, unsigned long long llOffset);
+
+/* output_checksum
+ *  Returns the 64 bit FNV-1a hash of the file contents (see manifest_hash), computed while the data is appended.
+ *  Valid after output_close as well. 0 (unknown) if output_write_at has overwritten part of the file.
+ */
+unsigned long long output_checksum(const MP3_OUTPUT *out);
+
+/* output_size
+ *  Returns the number of bytes appended so far.
+ */
+unsigned long long output_size(const MP3_OUTPUT *out);
+
+/* output_close
+ *  Writes all pending data, trims preallocated space, applies the durability mode and closes the file.
+ *  Safe to call on a closed output.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE if any write failed
+ */
+int output_close(MP3_OUTPUT *out);
+
+/* output_finish
+ *  Syncs the files written since the last group sync (SYNC_GROUP only). Call once after all outputs are closed.
+ */
+void output_finish(const OUTPUT_CFG *cfg);
+
+#endif // __MP3_OUTPUT_H_
@@ -0,0 +1,241 @@
+#include "output_store.h"
+#include "manifest.h"
+#include "dir_scan.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#endif
+
+#define STORE_COPY_BUFFER (64 * 1024)
+
+/* hash of everything besides the PCM data which determines the MP3 data */
+static unsigned long long format_hash(const OUTPUT_STORE *store, const FMT_DATA *hdr, unsigned int iDataSize)
+{
+	unsigned long long llFormat = manifest_hash(&store->llParams, sizeof(store->llParams), MANIFEST_HASH_INIT);
+	llFormat = manifest_hash(&iDataSize, sizeof(iDataSize), llFormat);
+	llFormat = manifest_hash(&hdr->wFmtTag, sizeof(hdr->wFmtTag), llFormat);
+	llFormat = manifest_hash(&hdr->wChannels, sizeof(hdr->wChannels), llFormat);
+	llFormat = manifest_hash(&hdr->dwSamplesPerSec, sizeof(hdr->dwSamplesPerSec), llFormat);
+	llFormat = manifest_hash(&hdr->wBlockAlign, sizeof(hdr->wBlockAlign), llFormat);
+	llFormat = manifest_hash(&hdr->wBitsPerSample, sizeof(hdr->wBitsPerSample), llFormat);
+	return llFormat;
+}
+
+string store_key(const OUTPUT_STORE *store, const FMT_DATA *hdr, unsigned int iDataSize,
+	unsigned long long llPcmHash)
+{
+	char key[40];
+	snprintf(key, sizeof(key), "%016llx-%016llx", llPcmHash, format_hash(store, hdr, iDataSize));
+	return key;
+}
+
+#ifndef WIN32
+
+/* path of the entry for sKey, fanned out over 256 subdirectories by the first byte of the key */
+static string entry_dir(const OUTPUT_STORE *store, const string &sKey)
+{
+	return store->sDir + "/" + sKey.substr(0, 2);
+}
+
+static string entry_path(const OUTPUT_STORE *store, const string &sKey)
+{
+	return entry_dir(store, sKey) + "/" + sKey + ".mp3";
+}
+
+/* path of the marker which tells that an entry with the format part of sKey exists (see store_has_format) */
+static string format_path(const OUTPUT_STORE *store, const string &sKey)
+{
+	string sFormat = sKey.substr(sKey.find('-') + 1);
+	return store->sDir + "/" + sFormat.substr(0, 2) + "/" + sFormat + ".fmt";
+}
+
+static int copy_data(int src, int dst)
+{
+	char *pBuffer = new char[STORE_COPY_BUFFER];
+	int ret = EXIT_SUCCESS;
+	ssize_t got;
+	while ((got = read(src, pBuffer, STORE_COPY_BUFFER)) > 0) {
+		if (write(dst, pBuffer, got) != got) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+	if (got < 0) ret = EXIT_FAILURE;
+	delete[] pBuffer;
+	return ret;
+}
+
+/* Computes the checksum of the contents of src (see output_checksum) without moving its file offset. */
+static int hash_data(int src, unsigned long long &llHash)
+{
+	char *pBuffer = new char[STORE_COPY_BUFFER];
+	unsigned long long llOffset = 0;
+	ssize_t got;
+	llHash = MANIFEST_HASH_INIT;
+	while ((got = pread(src, pBuffer, STORE_COPY_BUFFER, llOffset)) > 0) {
+		llHash = manifest_hash(pBuffer, got, llHash);
+		llOffset += got;
+	}
+	delete[] pBuffer;
+	return got < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Creates pcDst with the contents of pcSrc, which must not exist yet: as a reflink if the file system supports it
+ * (an independent copy sharing the data blocks), else as a copy. Never as a hard link, which would let an output
+ * rewritten in place modify the store entry. Returns the size of pcSrc in llSize and, if pllHash isn't NULL, its
+ * checksum in *pllHash.
+ */
+static int clone_file(const char *pcSrc, const char *pcDst, unsigned long long &llSize,
+	unsigned long long *pllHash)
+{
+	int src = open(pcSrc, O_RDONLY | O_CLOEXEC);
+	if (src < 0) return EXIT_FAILURE;
+	struct stat st;
+	if (0 != fstat(src, &st) || (pllHash != NULL && EXIT_SUCCESS != hash_data(src, *pllHash))) {
+		close(src);
+		return EXIT_FAILURE;
+	}
+	llSize = st.st_size;
+
+	int dst;
+#ifdef FICLONE
+	dst = open(pcDst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (dst >= 0 && 0 == ioctl(dst, FICLONE, src)) {
+		close(dst);
+		close(src);
+		return EXIT_SUCCESS;
+	}
+	if (dst >= 0) {
+		close(dst);
+		unlink(pcDst);
+	}
+#endif
+
+	// no reflinks on this file system (or a different one)
+	dst = open(pcDst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	int ret = dst >= 0 ? copy_data(src, dst) : EXIT_FAILURE;
+	if (dst >= 0 && 0 != close(dst)) ret = EXIT_FAILURE;
+	if (ret != EXIT_SUCCESS && dst >= 0) unlink(pcDst);
+	close(src);
+	return ret;
+}
+
+int store_open(OUTPUT_STORE *store, const char *pcDir, const char *pcParams)
+{
+	store->sDir = pcDir;
+	store->llParams = manifest_hash(pcParams, strlen(pcParams), MANIFEST_HASH_INIT);
+	store->iHits = 0;
+	store->iAdded = 0;
+	if (EXIT_SUCCESS != make_directories(pcDir) || 0 != access(pcDir, W_OK | X_OK)) {
+		printf("Unable to use output cache %s (%s).\n", pcDir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&store->mutex, NULL);
+	pthread_cond_init(&store->cond, NULL);
+	return EXIT_SUCCESS;
+}
+
+void store_close(OUTPUT_STORE *store)
+{
+	pthread_cond_destroy(&store->cond);
+	pthread_mutex_destroy(&store->mutex);
+}
+
+bool store_has_format(const OUTPUT_STORE *store, const FMT_DATA *hdr, unsigned int iDataSize)
+{
+	// the marker only depends on the format part of the key, any PCM hash will do
+	return 0 == access(format_path(store, store_key(store, hdr, iDataSize, 0)).c_str(), F_OK);
+}
+
+bool store_fetch(OUTPUT_STORE *store, const string &sKey, const char *pcOut, unsigned long long &llOutSize,
+	unsigned long long *pllOutHash)
+{
+	TRACE_SCOPE("store fetch");
+	pthread_mutex_lock(&store->mutex);
+	while (store->pending.count(sKey) > 0)
+		pthread_cond_wait(&store->cond, &store->mutex);
+	store->pending.insert(sKey);
+	pthread_mutex_unlock(&store->mutex);
+
+	unlink(pcOut);
+	if (EXIT_SUCCESS != clone_file(entry_path(store, sKey).c_str(), pcOut, llOutSize, pllOutHash))
+		return false; // miss, the key stays claimed until the caller has encoded pcOut
+
+	store->iHits++;
+	store_release(store, sKey, pcOut, false);
+	return true;
+}
+
+/* creates the directory of path if it doesn't exist yet */
+static bool make_parent(const string &sPath)
+{
+	return 0 == mkdir(sPath.substr(0, sPath.rfind('/')).c_str(), 0777) || errno == EEXIST;
+}
+
+void store_add(OUTPUT_STORE *store, const string &sKey, const char *pcOut)
+{
+	// publish by rename, so other runs sharing the store never see a partial entry
+	TRACE_SCOPE("store add");
+	string sEntry = entry_path(store, sKey), sFormat = format_path(store, sKey);
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".tmp%d", (int)getpid());
+	string sTemp = sEntry + suffix;
+	unsigned long long llSize;
+	if (!make_parent(sEntry) || !make_parent(sFormat)) {
+		printf("Unable to add %s to the output cache (%s).\n", pcOut, strerror(errno));
+		return;
+	}
+	unlink(sTemp.c_str()); // left over by a crashed run
+	if (EXIT_SUCCESS == clone_file(pcOut, sTemp.c_str(), llSize, NULL) &&
+		0 == rename(sTemp.c_str(), sEntry.c_str())) {
+		store->iAdded++;
+		int fd = open(sFormat.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+		if (fd >= 0) close(fd);
+	} else {
+		unlink(sTemp.c_str());
+	}
+}
+
+void store_release(OUTPUT_STORE *store, const string &sKey, const char *pcOut, bool bEncoded)
+{
+	if (bEncoded) store_add(store, sKey, pcOut);
+
+	pthread_mutex_lock(&store->mutex);
+	store->pending.erase(sKey);
+	pthread_cond_broadcast(&store->cond);
+	pthread_mutex_unlock(&store->mutex);
+}
+
+#else // WIN32
+
+int store_open(OUTPUT_STORE *store, const char *pcDir, const char *pcParams)
+{
+	printf("Output caches are not supported on this platform.\n");
+	return EXIT_FAILURE;
+}
+
+void store_close(OUTPUT_STORE *store) {}
+bool store_has_format(const OUTPUT_STORE *store, const FMT_DATA *hdr, unsigned int iDataSize)
+{
+	return false;
+}
+bool store_fetch(OUTPUT_STORE *store, const string &sKey, const char *pcOut, unsigned long long &llOutSize,
+	unsigned long long *pllOutHash)
+{
+	return false;
+}
+void store_add(OUTPUT_STORE *store, const string &sKey, const char *pcOut) {}
+void store_release(OUTPUT_STORE *store, const string &sKey, const char *pcOut, bool bEncoded) {}
+
+#endif // WIN32
@@ -0,0 +1,99 @@
+#ifndef __OUTPUT_STORE_H_
+#define __OUTPUT_STORE_H_
+
+#include <atomic>
+#include <set>
+#include <string>
+#include "pthread.h"
+#include "wave.h"
+
+using namespace std;
+
+/////////////////////
+// content-addressed store of MP3 outputs
+/////////////////////
+
+/*
+ * Inputs with byte-identical PCM data (the same jingle or silence under different names) encode to identical MP3
+ * files. Workers hash the PCM data while reading it (see pcm_hash_update) and look up the hash, combined with the
+ * format and the encoding parameters, in a store directory:
+ *
+ *   DIR/ab/abcdef0123456789-0123456789abcdef.mp3
+ *
+ * On a hit the stored MP3 file is cloned into place (reflink where the file system supports it, else a copy, never a
+ * hard link, so rewriting an output can't touch the store) instead of encoding the input again. On a miss the
+ * worker encodes as usual and adds its output to the store. Workers which hit the same key while it is being
+ * encoded wait for that encode instead of repeating it. Entries are added by rename, so several runs can share a
+ * store. POSIX only.
+ *
+ * Streaming workers only know the hash after the last block has been encoded. They hash the input up front (a
+ * second read) only if the store has an entry with the same format and data size (store_has_format), which is a
+ * precondition for a hit; all other inputs are hashed while they are encoded and added afterwards (store_add).
+ */
+
+/* An opened store. */
+typedef struct {
+	string sDir;
+	unsigned long long llParams; // hash of the encoding parameters (store_open)
+	pthread_mutex_t mutex; // protects pending
+	pthread_cond_t cond; // signalled when a key is released
+	set<string> pending; // keys claimed by a worker which is encoding (or fetching) them
+	std::atomic<int> iHits; // outputs taken from the store
+	std::atomic<int> iAdded; // outputs added to the store
+} OUTPUT_STORE;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* store_open
+ *  Opens (or creates) the store directory pcDir for a run with the encoding parameters described by pcParams (see
+ *  manifest_open). Prints the reason on failure, store must not be used (or closed) then.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int store_open(OUTPUT_STORE *store, const char *pcDir, const char *pcParams);
+
+/* store_close
+ *  Releases the store. No key may be claimed anymore.
+ */
+void store_close(OUTPUT_STORE *store);
+
+/* store_key
+ *  Returns the key of an input with format hdr and iDataSize bytes of PCM data hashing to llPcmHash.
+ */
+string store_key(const OUTPUT_STORE *store, const FMT_DATA *hdr, unsigned int iDataSize,
+	unsigned long long llPcmHash);
+
+/* store_has_format
+ *  Tells whether the store has an entry for an input with format hdr and iDataSize bytes of PCM data, whatever
+ *  the data. Thread-safe.
+ */
+bool store_has_format(const OUTPUT_STORE *store, const FMT_DATA *hdr, unsigned int iDataSize);
+
+/* store_fetch
+ *  Claims sKey, waiting while another worker holds it, and clones the stored output into pcOut. On a miss the
+ *  caller keeps the claim and must pass it on to store_release after encoding pcOut. pcOut is removed in either
+ *  case. Thread-safe.
+ *
+ *  Return value:
+ *    true if pcOut has been taken from the store (its size is stored in llOutSize and, unless pllOutHash is NULL,
+ *    its checksum, see output_checksum, in *pllOutHash, which reads the file once more), false on a miss
+ */
+bool store_fetch(OUTPUT_STORE *store, const string &sKey, const char *pcOut, unsigned long long &llOutSize,
+	unsigned long long *pllOutHash);
+
+/* store_add
+ *  Adds the encoded output pcOut to the store under sKey without claiming the key, for inputs whose hash is only
+ *  known after encoding. Thread-safe.
+ */
+void store_add(OUTPUT_STORE *store, const string &sKey, const char *pcOut);
+
+/* store_release
+ *  Releases a key claimed by store_fetch, adding pcOut to the store first if bEncoded is set. Workers waiting for
+ *  the key fetch the new entry then, or encode the input themselves if the encode failed. Thread-safe.
+ */
+void store_release(OUTPUT_STORE *store, const string &sKey, const char *pcOut, bool bEncoded);
+
+#endif // __OUTPUT_STORE_H_
@@ -0,0 +1,361 @@
+#include "pcm_convert.h"
+#include <cmath>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PCM_HAVE_X86
+#define PCM_TARGET_SSE2 __attribute__((target("sse2")))
+#define PCM_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#define PCM_HAVE_X86
+#define PCM_TARGET_SSE2
+#define PCM_TARGET_AVX2
+#endif
+
+/////////////////////
+// scalar sample decoding, specialized per input format
+/////////////////////
+
+template <PCM_FORMAT FMT> struct PcmSample;
+
+template <> struct PcmSample<PCM_U8> {
+	enum { BYTES = 1 };
+	static inline short toS16(const unsigned char *p) { return (short)((p[0] - 128) << 8); }
+};
+template <> struct PcmSample<PCM_S16> {
+	enum { BYTES = 2 };
+	static inline short toS16(const unsigned char *p) { return (short)(p[0] | (p[1] << 8)); }
+};
+template <> struct PcmSample<PCM_S24> {
+	enum { BYTES = 3 };
+	static inline short toS16(const unsigned char *p) { return (short)(p[1] | (p[2] << 8)); }
+	static inline int toS32(const unsigned char *p) {
+		return (int)(((unsigned int)p[0] << 8) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 24));
+	}
+};
+template <> struct PcmSample<PCM_S32> {
+	enum { BYTES = 4 };
+	static inline short toS16(const unsigned char *p) { return (short)(p[2] | (p[3] << 8)); }
+	static inline int toS32(const unsigned char *p) {
+		return (int)((unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) |
+			((unsigned int)p[3] << 24));
+	}
+};
+template <> struct PcmSample<PCM_F32> {
+	enum { BYTES = 4 };
+	static inline short toS16(const unsigned char *p) {
+		float f;
+		memcpy(&f, p, sizeof(float));
+		f *= 32767.0f;
+		if (f > 32767.0f) f = 32767.0f;
+		if (f < -32768.0f) f = -32768.0f;
+		return (short)lrintf(f);
+	}
+};
+
+/////////////////////
+// scalar kernels (reference implementations and tails of the vector kernels)
+/////////////////////
+
+/* any format -> separate short L/R buffers */
+template <PCM_FORMAT FMT, int CH>
+static void to_s16_planar_scalar(const unsigned char *src, void *dstL, void *dstR, int numSamples)
+{
+	short *l = (short*)dstL, *r = (short*)dstR;
+	for (int i = 0; i < numSamples; i++, src += CH * PcmSample<FMT>::BYTES) {
+		l[i] = PcmSample<FMT>::toS16(src);
+		if (CH == 2) r[i] = PcmSample<FMT>::toS16(src + PcmSample<FMT>::BYTES);
+	}
+}
+
+/* unsigned 8 bit -> signed 16 bit, keeping the (interleaved) layout */
+template <int CH>
+static void u8_to_s16_scalar(const unsigned char *src, void *dstL, void *, int numSamples)
+{
+	short *d = (short*)dstL;
+	for (int i = 0; i < numSamples * CH; i++)
+		d[i] = PcmSample<PCM_U8>::toS16(src + i);
+}
+
+/* 24 or 32 bit -> separate full scale int L/R buffers */
+template <PCM_FORMAT FMT, int CH>
+static void to_s32_planar_scalar(const unsigned char *src, void *dstL, void *dstR, int numSamples)
+{
+	int *l = (int*)dstL, *r = (int*)dstR;
+	for (int i = 0; i < numSamples; i++, src += CH * PcmSample<FMT>::BYTES) {
+		l[i] = PcmSample<FMT>::toS32(src);
+		if (CH == 2) r[i] = PcmSample<FMT>::toS32(src + PcmSample<FMT>::BYTES);
+	}
+}
+
+#ifdef PCM_HAVE_X86
+/////////////////////
+// SSE2 kernels
+/////////////////////
+
+PCM_TARGET_SSE2
+static void s16_deinterleave_sse2(const unsigned char *src, void *dstL, void *dstR, int numSamples)
+{
+	const short *s = (const short*)src;
+	short *l = (short*)dstL, *r = (short*)dstR;
+	int i = 0;
+	for (; i + 8 <= numSamples; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(s + 2 * i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(s + 2 * i + 8));
+		__m128i la = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16), lb = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+		__m128i ra = _mm_srai_epi32(a, 16), rb = _mm_srai_epi32(b, 16);
+		_mm_storeu_si128((__m128i*)(l + i), _mm_packs_epi32(la, lb));
+		_mm_storeu_si128((__m128i*)(r + i), _mm_packs_epi32(ra, rb));
+	}
+	to_s16_planar_scalar<PCM_S16, 2>(src + 4 * i, l + i, r + i, numSamples - i);
+}
+
+template <int CH>
+PCM_TARGET_SSE2
+static void u8_to_s16_sse2(const unsigned char *src, void *dstL, void *dstR, int numSamples)
+{
+	short *d = (short*)dstL;
+	const int n = numSamples * CH;
+	const __m128i bias = _mm_set1_epi8((char)0x80), zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		// (x ^ 0x80) placed into the high byte equals (x - 128) << 8
+		__m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + i)), bias);
+		_mm_storeu_si128((__m128i*)(d + i), _mm_unpacklo_epi8(zero, x));
+		_mm_storeu_si128((__m128i*)(d + i + 8), _mm_unpackhi_epi8(zero, x));
+	}
+	u8_to_s16_scalar<1>(src + i, d + i, dstR, n - i);
+}
+
+PCM_TARGET_SSE2
+static void s32_deinterleave_sse2(const unsigned char *src, void *dstL, void *dstR, int numSamples)
+{
+	const float *s = (const float*)src; // bitwise shuffles only
+	int *l = (int*)dstL, *r = (int*)dstR;
+	int i = 0;
+	for (; i + 4 <= numSamples; i += 4) {
+		__m128 a = _mm_loadu_ps(s + 2 * i), b = _mm_loadu_ps(s + 2 * i + 4);
+		_mm_storeu_ps((float*)(l + i), _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps((float*)(r + i), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	to_s32_planar_scalar<PCM_S32, 2>(src + 8 * i, l + i, r + i, numSamples - i);
+}
+
+/////////////////////
+// AVX2 kernels
+/////////////////////
+
+PCM_TARGET_AVX2
+static void s16_deinterleave_avx2(const unsigned char *src, void *dstL, void *dstR, int numSamples)
+{
+	const short *s = (const short*)src;
+	short *l = (short*)dstL, *r = (short*)dstR;
+	int i = 0;
+	for (; i + 16 <= numSamples; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(s + 2 * i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(s + 2 * i + 16));
+		__m256i la = _mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16);
+		__m256i lb = _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16);
+		__m256i ra = _mm256_srai_epi32(a, 16), rb = _mm256_srai_epi32(b, 16);
+		// packs works per 128 bit lane, so restore the sample order afterwards
+		_mm256_storeu_si256((__m256i*)(l + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(la, lb), 0xD8));
+		_mm256_storeu_si256((__m256i*)(r + i), _mm256_permute4x64_epi64(_mm256_packs_epi32(ra, rb), 0xD8));
+	}
+	s16_deinterleave_sse2(src + 4 * i, l + i, r + i, numSamples - i);
+}
+
+template <int CH>
+PCM_TARGET_AVX2
+static void u8_to_s16_avx2(const unsigned char *src, void *dstL, void *dstR, int numSamples)
+{
+	short *d = (short*)dstL;
+	const int n = numSamples * CH;
+	const __m256i bias = _mm256_set1_epi16(128);
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i)));
+		_mm256_storeu_si256((__m256i*)(d + i), _mm256_slli_epi16(_mm256_sub_epi16(x, bias), 8));
+	}
+	u8_to_s16_scalar<1>(src + i, d + i, dstR, n - i);
+}
+
+template <int CH>
+PCM_TARGET_AVX2
+static void s24_to_s32_avx2(const unsigned char *src, void *dstL, void *dstR, int numSamples)
+{
+	int *l = (int*)dstL, *r = (int*)dstR;
+	const int n = numSamples * CH; // number of sample values
+	// expand 4 packed 24 bit values per lane into the upper 3 bytes of 32 bit integers
+	const __m256i shuf = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+		-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	const __m256i deinterleave = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	int i = 0;
+	// the second 16 byte load reads 4 bytes beyond the 8 values, so keep some slack to the end
+	for (; i + 10 <= n; i += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i*)(src + 3 * i));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(src + 3 * i + 12));
+		__m256i v = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), shuf);
+		if (CH == 1) {
+			_mm256_storeu_si256((__m256i*)(l + i), v);
+		} else {
+			v = _mm256_permutevar8x32_epi32(v, deinterleave);
+			_mm_storeu_si128((__m128i*)(l + i / 2), _mm256_castsi256_si128(v));
+			_mm_storeu_si128((__m128i*)(r + i / 2), _mm256_extracti128_si256(v, 1));
+		}
+	}
+	to_s32_planar_scalar<PCM_S24, CH>(src + 3 * i, l + i / CH, CH == 2 ? r + i / CH : r, (n - i) / CH);
+}
+
+PCM_TARGET_AVX2
+static void s32_deinterleave_avx2(const unsigned char *src, void *dstL, void *dstR, int numSamples)
+{
+	const int *s = (const int*)src;
+	int *l = (int*)dstL, *r = (int*)dstR;
+	const __m256i deinterleave = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	int i = 0;
+	for (; i + 4 <= numSamples; i += 4) {
+		__m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)(s + 2 * i)), deinterleave);
+		_mm_storeu_si128((__m128i*)(l + i), _mm256_castsi256_si128(v));
+		_mm_storeu_si128((__m128i*)(r + i), _mm256_extracti128_si256(v, 1));
+	}
+	to_s32_planar_scalar<PCM_S32, 2>(src + 8 * i, l + i, r + i, numSamples - i);
+}
+#endif // PCM_HAVE_X86
+
+/////////////////////
+// runtime dispatch
+/////////////////////
+
+static PCM_ISA detect_isa()
+{
+#if defined(PCM_HAVE_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int nIds = info[0];
+	__cpuid(info, 1);
+	bool bSse2 = (info[3] & (1 << 26)) != 0;
+	bool bOsAvx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+	if (nIds >= 7 && bOsAvx) {
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5)) return PCM_ISA_AVX2;
+	}
+	return bSse2 ? PCM_ISA_SSE2 : PCM_ISA_SCALAR;
+#elif defined(PCM_HAVE_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return PCM_ISA_AVX2;
+	if (__builtin_cpu_supports("sse2")) return PCM_ISA_SSE2;
+	return PCM_ISA_SCALAR;
+#else
+	return PCM_ISA_SCALAR;
+#endif
+}
+
+PCM_ISA pcm_cpu_isa()
+{
+	static PCM_ISA isa = detect_isa(); // thread-safe initialization
+	return isa;
+}
+
+const char *pcm_isa_name(PCM_ISA isa)
+{
+	switch (isa) {
+	case PCM_ISA_SSE2: return "sse2";
+	case PCM_ISA_AVX2: return "avx2";
+	case PCM_ISA_SCALAR: return "scalar";
+	default: return "auto";
+	}
+}
+
+/* picks the fastest of the given kernels which is allowed for isa */
+static PCM_KERNEL pick(PCM_ISA isa, PCM_KERNEL scalar, PCM_KERNEL sse2, PCM_KERNEL avx2)
+{
+	if (isa >= PCM_ISA_AVX2 && avx2 != NULL) return avx2;
+	if (isa >= PCM_ISA_SSE2 && sse2 != NULL) return sse2;
+	return scalar;
+}
+
+#ifdef PCM_HAVE_X86
+#define PCM_SSE2(k) k
+#define PCM_AVX2(k) k
+#else
+#define PCM_SSE2(k) NULL
+#define PCM_AVX2(k) NULL
+#endif
+
+template <int CH>
+static void select_kernels(PCM_FORMAT format, PCM_ISA isa, PCM_CONVERTER *conv)
+{
+	switch (format) {
+	case PCM_U8:
+		conv->output = CH == 2 ? PCM_OUT_S16_INTERLEAVED : PCM_OUT_S16;
+		conv->iOutBytesPerSample = sizeof(short);
+		conv->convert = pick(isa, u8_to_s16_scalar<CH>, PCM_SSE2(u8_to_s16_sse2<CH>), PCM_AVX2(u8_to_s16_avx2<CH>));
+		conv->toS16Planar = to_s16_planar_scalar<PCM_U8, CH>;
+		break;
+	case PCM_S16:
+		// 16 bit data is passed to LAME as it is, no conversion at all
+		conv->output = CH == 2 ? PCM_OUT_S16_INTERLEAVED : PCM_OUT_S16;
+		conv->iOutBytesPerSample = sizeof(short);
+		conv->convert = NULL;
+		conv->toS16Planar = CH == 2 ?
+			pick(isa, to_s16_planar_scalar<PCM_S16, 2>, PCM_SSE2(s16_deinterleave_sse2),
+				PCM_AVX2(s16_deinterleave_avx2)) :
+			to_s16_planar_scalar<PCM_S16, 1>;
+		break;
+	case PCM_S24:
+		conv->output = PCM_OUT_S32;
+		conv->iOutBytesPerSample = sizeof(int);
+		conv->convert = pick(isa, to_s32_planar_scalar<PCM_S24, CH>, NULL, PCM_AVX2(s24_to_s32_avx2<CH>));
+		conv->toS16Planar = to_s16_planar_scalar<PCM_S24, CH>;
+		break;
+	case PCM_S32:
+		conv->output = PCM_OUT_S32;
+		conv->iOutBytesPerSample = sizeof(int);
+		conv->convert = CH == 2 ?
+			pick(isa, to_s32_planar_scalar<PCM_S32, 2>, PCM_SSE2(s32_deinterleave_sse2),
+				PCM_AVX2(s32_deinterleave_avx2)) :
+			NULL; // mono data is already a plain int array
+		conv->toS16Planar = to_s16_planar_scalar<PCM_S32, CH>;
+		break;
+	case PCM_F32:
+		// float data is passed to LAME as it is, no conversion at all
+		conv->output = CH == 2 ? PCM_OUT_F32_INTERLEAVED : PCM_OUT_F32;
+		conv->iOutBytesPerSample = sizeof(float);
+		conv->convert = NULL;
+		conv->toS16Planar = to_s16_planar_scalar<PCM_F32, CH>;
+		break;
+	}
+}
+
+int pcm_get_converter(const FMT_DATA *hdr, PCM_ISA isa, PCM_CONVERTER *conv)
+{
+	if (isa == PCM_ISA_AUTO || isa > pcm_cpu_isa())
+		isa = pcm_cpu_isa();
+
+	if (hdr->wFmtTag == WAVE_FORMAT_IEEE_FLOAT && hdr->wBitsPerSample == 32) {
+		conv->format = PCM_F32;
+	} else if (hdr->wFmtTag == WAVE_FORMAT_PCM) {
+		switch (hdr->wBitsPerSample) {
+		case 8: conv->format = PCM_U8; break;
+		case 16: conv->format = PCM_S16; break;
+		case 24: conv->format = PCM_S24; break;
+		case 32: conv->format = PCM_S32; break;
+		default: return EXIT_FAILURE;
+		}
+	} else {
+		return EXIT_FAILURE;
+	}
+	if (hdr->wChannels != 1 && hdr->wChannels != 2)
+		return EXIT_FAILURE;
+
+	conv->iChannels = hdr->wChannels;
+	conv->iBytesPerFrame = hdr->wBlockAlign;
+	conv->isa = isa;
+	if (conv->iChannels == 2)
+		select_kernels<2>(conv->format, isa, conv);
+	else
+		select_kernels<1>(conv->format, isa, conv);
+	return EXIT_SUCCESS;
+}
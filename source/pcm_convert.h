@@ -0,0 +1,87 @@
+#ifndef __PCM_CONVERT_H_
+#define __PCM_CONVERT_H_
+
+#include "wave.h"
+
+/////////////////////
+// PCM sample conversion
+/////////////////////
+
+/* Input sample formats (container layout of one sample of one channel in the 'data' chunk) */
+typedef enum {
+	PCM_U8 = 0, // unsigned 8 bit integer
+	PCM_S16, // signed 16 bit integer
+	PCM_S24, // signed 24 bit integer, packed into 3 bytes
+	PCM_S32, // signed 32 bit integer
+	PCM_F32 // 32 bit IEEE float, nominal range [-1.0, 1.0]
+} PCM_FORMAT;
+
+/* Instruction set used by the conversion kernels. PCM_ISA_AUTO selects the best one supported
+ * by the CPU at runtime.
+ */
+typedef enum {
+	PCM_ISA_AUTO = -1,
+	PCM_ISA_SCALAR = 0,
+	PCM_ISA_SSE2,
+	PCM_ISA_AVX2
+} PCM_ISA;
+
+/* Buffer layout handed to LAME after conversion. Each layout maps to exactly one LAME entry point:
+ *   PCM_OUT_S16              lame_encode_buffer                          (short L, R)
+ *   PCM_OUT_S16_INTERLEAVED  lame_encode_buffer_interleaved              (short LRLR...)
+ *   PCM_OUT_S32              lame_encode_buffer_int                      (int L, R, full scale)
+ *   PCM_OUT_F32              lame_encode_buffer_ieee_float               (float L, R)
+ *   PCM_OUT_F32_INTERLEAVED  lame_encode_buffer_interleaved_ieee_float   (float LRLR...)
+ * For mono input only the left buffer is used.
+ */
+typedef enum {
+	PCM_OUT_S16 = 0,
+	PCM_OUT_S16_INTERLEAVED,
+	PCM_OUT_S32,
+	PCM_OUT_F32,
+	PCM_OUT_F32_INTERLEAVED
+} PCM_OUTPUT;
+
+/* Conversion kernel: converts numSamples frames of raw 'data' bytes at src into dstL (and dstR
+ * for planar stereo layouts).
+ */
+typedef void (*PCM_KERNEL)(const unsigned char *src, void *dstL, void *dstR, int numSamples);
+
+/* Converter for one input format, as selected by pcm_get_converter. */
+typedef struct {
+	PCM_FORMAT format;
+	int iChannels;
+	int iBytesPerFrame; // bytes per frame (all channels) in the raw data
+	PCM_ISA isa; // instruction set the kernels have been selected for
+	PCM_OUTPUT output; // layout produced by convert, or of the raw data itself if convert is NULL
+	int iOutBytesPerSample; // bytes per sample and channel in the converted buffers
+	PCM_KERNEL convert; // raw data -> output layout; NULL if raw data can be passed to LAME as-is
+	PCM_KERNEL toS16Planar; // raw data -> separate short L/R buffers (whole-file mode)
+} PCM_CONVERTER;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* pcm_cpu_isa
+ *  Returns the best instruction set supported by the CPU (determined once at runtime).
+ */
+PCM_ISA pcm_cpu_isa();
+
+/* pcm_isa_name
+ *  Returns the printable name of an instruction set.
+ */
+const char *pcm_isa_name(PCM_ISA isa);
+
+/* pcm_get_converter
+ *  Selects conversion kernels for the format described by hdr (which must have passed
+ *  check_format_data). The kernels are template instances specialized for the bit depth and
+ *  channel count, so their inner loops contain no per-sample format decisions. If isa is higher
+ *  than what the CPU supports, it is reduced accordingly.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE for unsupported formats
+ */
+int pcm_get_converter(const FMT_DATA *hdr, PCM_ISA isa, PCM_CONVERTER *conv);
+
+#endif // __PCM_CONVERT_H_
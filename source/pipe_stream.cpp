@@ -0,0 +1,115 @@
+#include "pipe_stream.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <signal.h>
+
+#ifdef WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+/* Output side of the pipe: frames pending in the stdio buffer of pOut. */
+typedef struct {
+	FILE *pOut;
+	size_t uPending;
+	bool bBrokenPipe; // the reader has closed its end
+} PIPE_SINK;
+
+/* writes the pending frames to the reader */
+static int flush_frames(PIPE_SINK *frames)
+{
+	frames->uPending = 0;
+	if (fflush(frames->pOut) == 0) return EXIT_SUCCESS;
+	if (errno == EPIPE) frames->bBrokenPipe = true;
+	return EXIT_FAILURE;
+}
+
+/* sink callback: gets whole frames, which are collected until PIPE_FLUSH_BYTES are pending */
+static int write_frames(const void *pData, size_t n, void *pCtx)
+{
+	PIPE_SINK *frames = (PIPE_SINK*)pCtx;
+	if (fwrite(pData, 1, n, frames->pOut) != n) {
+		if (errno == EPIPE) frames->bBrokenPipe = true;
+		return EXIT_FAILURE;
+	}
+	frames->uPending += n;
+	return frames->uPending >= PIPE_FLUSH_BYTES ? flush_frames(frames) : EXIT_SUCCESS;
+}
+
+int encode_pipe(FILE *pIn, FILE *pOut, const ENCODE_PARAMS *params)
+{
+	TRACE_SCOPE("encode_pipe");
+#ifdef WIN32
+	_setmode(_fileno(pIn), _O_BINARY);
+	_setmode(_fileno(pOut), _O_BINARY);
+#else
+	signal(SIGPIPE, SIG_IGN); // a closed pipe fails the write with EPIPE instead
+#endif
+	JOB_RESOURCES res;
+	input_open_stream(&res.in, pIn);
+	res.bInputOpen = true;
+	unsigned long long llDataSize;
+	res.hdr = NULL; // allocated by read_wave_header_stream
+	if (EXIT_SUCCESS != read_wave_header_stream(&res.in, res.hdr, llDataSize))
+		return EXIT_FAILURE;
+	PCM_CONVERTER conv;
+	if (EXIT_SUCCESS != pcm_get_converter(res.hdr, PCM_ISA_AUTO, &conv)) {
+		cerr << "Unsupported PCM format." << endl;
+		return EXIT_FAILURE;
+	}
+	// the length only matters for the tag frame, which a stream can't get anyway
+	res.gfp = create_encoder(res.hdr, llDataSize < WAVE_SIZE_UNKNOWN ? (unsigned int)llDataSize : WAVE_SIZE_UNKNOWN,
+		false, params);
+	if (res.gfp == NULL) {
+		cerr << "Unable to initialize the encoder." << endl;
+		return EXIT_FAILURE;
+	}
+
+	WORKER_ARENA arena;
+	const int mp3BufferSize = PIPE_BLOCK_SAMPLES * 5 / 4 + 7200; // worst case estimate for one block
+	unsigned char *pRaw = arena_reserve(&arena.raw, PIPE_BLOCK_SAMPLES * conv.iBytesPerFrame);
+	unsigned char *pLeft = arena_reserve(&arena.left, PIPE_BLOCK_SAMPLES * conv.iOutBytesPerSample);
+	unsigned char *pRight = conv.iChannels == 2 ?
+		arena_reserve(&arena.right, PIPE_BLOCK_SAMPLES * conv.iOutBytesPerSample) : NULL;
+	unsigned char *mp3Buffer = arena_reserve(&arena.mp3, mp3BufferSize);
+
+	// the stdio buffer holds the pending frames, so it must not write them out on its own
+	PIPE_SINK frames = { pOut, 0, false };
+	setvbuf(pOut, NULL, _IOFBF, PIPE_FLUSH_BYTES + mp3BufferSize);
+	MP3_SINK sink;
+	memset(&sink, 0, sizeof(sink));
+	sink.pfnWrite = write_frames;
+	sink.pCtx = &frames;
+	MP3_OUTPUT out;
+	output_open_sink(&out, &sink);
+
+	unsigned long long llBytesLeft = llDataSize;
+	int numSamples;
+	while ((numSamples = read_pcm_stream_block(&res.in, res.hdr, pRaw, PIPE_BLOCK_SAMPLES, llBytesLeft)) > 0) {
+		int mp3size = encode_pcm_block(res.gfp, &conv, pRaw, pLeft, pRight, numSamples, mp3Buffer, mp3BufferSize);
+		if (mp3size < 0) {
+			cerr << "Encoding error in lame_encode_buffer. Return code: " << mp3size << endl;
+			break;
+		}
+		if (EXIT_SUCCESS != output_write(&out, mp3Buffer, mp3size)) break; // reader has gone away
+	}
+	if (numSamples < 0) cerr << "Unable to read from standard input." << endl;
+	if (numSamples == 0) {
+		if (llBytesLeft != WAVE_STREAM_UNBOUNDED && llBytesLeft >= res.hdr->wBlockAlign)
+			cerr << "Warning: stream ended " << llBytesLeft << " bytes before the end of its 'data' chunk." << endl;
+		int flushSize = lame_encode_flush(res.gfp, mp3Buffer, mp3BufferSize);
+		if (flushSize > 0) output_write(&out, mp3Buffer, flushSize);
+	}
+	bool bWritten = EXIT_SUCCESS == output_close(&out);
+	if (bWritten && !frames.bBrokenPipe) bWritten = EXIT_SUCCESS == flush_frames(&frames);
+	if (frames.bBrokenPipe) {
+		cerr << "Standard output was closed by its reader." << endl;
+		return EXIT_FAILURE;
+	}
+	if (!bWritten) {
+		cerr << "Unable to write to standard output." << endl;
+		return EXIT_FAILURE;
+	}
+	return numSamples == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
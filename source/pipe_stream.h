@@ -0,0 +1,37 @@
+#ifndef __PIPE_STREAM_H_
+#define __PIPE_STREAM_H_
+
+#include "lame_interface.h"
+
+/////////////////////
+// pipe mode: WAV stream on standard input, MP3 stream on standard output
+/////////////////////
+
+/*
+ * With PATH '-', a single WAV stream is read from standard input and the MP3 frames are written to standard
+ * output as soon as they are encoded, so the program can sit in a pipe between a decoder and an uploader without
+ * temporary files. The input is read strictly sequentially (see read_wave_header_stream), so it may be a pipe, and
+ * a 'data' chunk whose length hasn't been filled in by the producer extends to the end of the stream. Memory use
+ * is constant. PIPE_BLOCK_SAMPLES is smaller than PCM_BLOCK_SAMPLES to get the first frames out quickly. The frames
+ * are collected until PIPE_FLUSH_BYTES are pending and then written with a single flush, which always ends on a
+ * frame boundary, so the reader never sees a partial frame waiting for its rest. If the reader goes away, the
+ * encoder stops with an error instead of being killed by SIGPIPE.
+ */
+
+#define PIPE_BLOCK_SAMPLES 2304 // samples (per channel) read and encoded at once: two MP3 frames
+#define PIPE_FLUSH_BYTES 16384 // pending MP3 data which is written out (about a second at 128 kbit/s)
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* encode_pipe
+ *  Encodes the WAV stream pIn into the MP3 stream pOut with the encoding parameters params (the program's if
+ *  NULL). Messages go to stderr only, since pOut is usually stdout. Ignores SIGPIPE for the rest of the process.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int encode_pipe(FILE *pIn, FILE *pOut, const ENCODE_PARAMS *params);
+
+#endif // __PIPE_STREAM_H_
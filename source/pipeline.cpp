@@ -0,0 +1,427 @@
+#include "pipeline.h"
+#include "trace.h"
+#include "metrics.h"
+
+/* State shared by all threads of one run_pipeline call. */
+typedef struct {
+	const PIPELINE_CFG *cfg;
+	ENC_WRK_ARGS *encArgs;
+	int iEncoders;
+	LF_QUEUE readyJobs; // PIPE_JOB* opened by a reader, waiting for an encoder (NULL: no more jobs)
+	LF_QUEUE writeJobs; // PIPE_JOB* being encoded, waiting for a writer (NULL: no more jobs)
+	LF_QUEUE freeJobs; // PIPE_JOB pool, taken by readers and handed back by writers
+	LF_QUEUE *freeBlocks; // PCM_BLOCK pool of each reader
+	LF_QUEUE *freeChunks; // MP3_CHUNK pool of each encoder
+	std::atomic<int> iReadersLeft;
+	std::atomic<int> iEncodersLeft;
+	std::atomic<int> *piProcessed; // files written per encoder
+	pthread_mutex_t reportLock; // serializes writers adding file records to encArgs[].report
+} PIPE_CTX;
+
+/* Argument struct for the pipeline thread routines. */
+typedef struct {
+	PIPE_CTX *ctx;
+	int iId; // index within the thread's pool
+} PIPE_THREAD_ARGS;
+
+#define PCM_BLOCK_BYTES (PCM_BLOCK_SAMPLES * 2 * 4) // stereo, 32 bit
+#define MP3_CHUNK_BYTES (PCM_BLOCK_SAMPLES * 5 / 4 + 7200) // worst case estimate for one block
+
+static void *reader_thread(void *arg)
+{
+	PIPE_THREAD_ARGS *targs = (PIPE_THREAD_ARGS*)arg;
+	PIPE_CTX *ctx = targs->ctx;
+	int iFileIdx;
+
+	// block buffer or ring of the input backend, reused for all files of this reader
+	ARENA_BUFFER inputBuffer;
+	INPUT_RING inputRing;
+	INPUT_CFG inputCfg;
+	init_thread_input_cfg(ctx->encArgs[0].pInputCfg, &inputBuffer, &inputRing, &inputCfg);
+	TRACE_THREAD_NAME("reader", targs->iId);
+	metrics_register_thread("reader", targs->iId);
+	hwc_thread_start("reader", targs->iId);
+
+	while ((iFileIdx = claim_next_file(&ctx->encArgs[0])) >= 0) {
+		double t = report_now();
+		TRACE_SCOPE_DETAIL("read job", job_file_name(&ctx->encArgs[0], iFileIdx));
+		metrics_count(METRIC_JOBS_STARTED);
+		PIPE_JOB *job;
+		{
+			TRACE_SCOPE("wait free job");
+			job = (PIPE_JOB*)lfq_pop_wait(&ctx->freeJobs);
+		}
+		report_init_file(&job->timing, t);
+		job->iFileIdx = iFileIdx;
+		job->sIn.assign(job_file_name(&ctx->encArgs[0], iFileIdx));
+		output_file_name(ctx->encArgs[0].pOutputCfg, job->sIn, job->sOut);
+		job->hdr = &job->fmt;
+		job->gfp = NULL;
+		job->iEncoderId = -1;
+		if (ctx->encArgs[0].pManifest != NULL) manifest_stat(job->sIn.c_str(), &job->input);
+
+		WAV_INPUT in;
+		if (EXIT_SUCCESS != open_wave(job->sIn.c_str(), &inputCfg, &in, job->hdr, job->iDataSize)) {
+			printf("Error in file %s. Skipping.\n", job->sIn.c_str());
+			metrics_count(METRIC_JOBS_FAILED);
+			lfq_push_wait(&ctx->freeJobs, job);
+			continue;
+		}
+		report_stage(&job->timing, STAGE_PARSE, t);
+		lfq_push_wait(&ctx->readyJobs, job);
+
+		// read the data chunk block by block, waiting for blocks to come back if the encoder lags behind
+		unsigned int iBytesLeft = job->iDataSize;
+		const unsigned short wBlockAlign = job->hdr->wBlockAlign;
+		bool bLast = false;
+		while (!bLast) {
+			PCM_BLOCK *blk;
+			{
+				TRACE_SCOPE("wait free block");
+				blk = (PCM_BLOCK*)lfq_pop_wait(&ctx->freeBlocks[targs->iId]);
+			}
+			t = report_now();
+			metrics_busy_begin();
+			hwc_lap(HW_STAGE_NONE);
+			int n = read_pcm_block(&in, job->hdr, blk->pData, PCM_BLOCK_SAMPLES, iBytesLeft);
+			metrics_busy_end();
+			report_stage(&job->timing, STAGE_READ, t);
+			blk->iSamples = n > 0 ? n : 0;
+			blk->bError = n < 0;
+			blk->bLast = bLast = n <= 0 || iBytesLeft < wBlockAlign;
+			if (bLast) input_close(&in);
+			lfq_push_wait(&job->pcmQueue, blk); // job belongs to the encoder and writer after the last block
+		}
+	}
+
+	hwc_thread_stop();
+
+	// the last reader tells all encoders that there are no more jobs
+	if (--ctx->iReadersLeft == 0) {
+		for (int i = 0; i < ctx->iEncoders; i++)
+			lfq_push_wait(&ctx->readyJobs, NULL);
+	}
+	return NULL;
+}
+
+static void *encoder_thread(void *arg)
+{
+	PIPE_THREAD_ARGS *targs = (PIPE_THREAD_ARGS*)arg;
+	PIPE_CTX *ctx = targs->ctx;
+	const ENC_WRK_ARGS *encArgs = &ctx->encArgs[targs->iId];
+	if (EXIT_SUCCESS != topology_bind_thread(encArgs->iCpu, encArgs->iNode))
+		printf("Warning: Unable to pin encoder %i to CPU %i.\n", targs->iId, encArgs->iCpu);
+	unsigned char *pConverted = new unsigned char[PCM_BLOCK_BYTES]; // conversion buffers for both channels
+	THREAD_REPORT *report = &ctx->encArgs[targs->iId].report;
+	const double tThreadStart = report_now();
+	TRACE_THREAD_NAME("encoder", targs->iId);
+	metrics_register_thread("encoder", targs->iId);
+	hwc_thread_start("encoder", targs->iId);
+	PIPE_JOB *job;
+
+	while ((job = (PIPE_JOB*)lfq_pop_wait(&ctx->readyJobs)) != NULL) {
+		TRACE_SCOPE_DETAIL("encode job", job->sIn.c_str());
+		job->iEncoderId = targs->iId;
+		hwc_lap(HW_STAGE_NONE);
+		double t = report_now(), dEncode = 0.0;
+		PCM_CONVERTER conv;
+		bool bFailed = EXIT_SUCCESS != pcm_get_converter(job->hdr, PCM_ISA_AUTO, &conv);
+		if (!bFailed) job->gfp = create_encoder(job->hdr, job->iDataSize, false, NULL);
+		dEncode += report_now() - t;
+		hwc_lap(HW_STAGE_ENCODE);
+		if (job->gfp == NULL) {
+			cerr << "Invalid encoding parameters! Skipping file." << endl;
+			bFailed = true;
+		}
+		lfq_push_wait(&ctx->writeJobs, job);
+
+		unsigned char *pLeft = pConverted, *pRight = pConverted + PCM_BLOCK_BYTES / 2;
+		bool bLast = false;
+		while (!bLast) {
+			PCM_BLOCK *blk;
+			{
+				TRACE_SCOPE("wait pcm block");
+				blk = (PCM_BLOCK*)lfq_pop_wait(&job->pcmQueue);
+			}
+			bLast = blk->bLast;
+			bFailed = bFailed || blk->bError;
+			if (!bFailed && blk->iSamples > 0) {
+				MP3_CHUNK *chunk;
+				{
+					TRACE_SCOPE("wait free chunk");
+					chunk = (MP3_CHUNK*)lfq_pop_wait(&ctx->freeChunks[targs->iId]);
+				}
+				t = report_now();
+				metrics_busy_begin();
+				hwc_lap(HW_STAGE_NONE);
+				{
+					TRACE_SCOPE("encode block");
+					chunk->iBytes = encode_pcm_block(job->gfp, &conv, blk->pData, pLeft, pRight, blk->iSamples,
+						chunk->pData, MP3_CHUNK_BYTES);
+				}
+				metrics_busy_end();
+				hwc_lap(HW_STAGE_ENCODE);
+				dEncode += report_now() - t;
+				chunk->bLast = false;
+				chunk->bError = chunk->iBytes < 0;
+				if (chunk->bError) {
+					cerr << "Encoding error in lame_encode_buffer. Return code: " << chunk->iBytes << endl;
+					chunk->iBytes = 0;
+					bFailed = true;
+				}
+				lfq_push_wait(&job->mp3Queue, chunk);
+			}
+			lfq_push_wait(&ctx->freeBlocks[blk->iOwner], blk); // hand block back to its reader
+		}
+
+		// flush remaining frames into the final chunk
+		MP3_CHUNK *chunk = (MP3_CHUNK*)lfq_pop_wait(&ctx->freeChunks[targs->iId]);
+		t = report_now();
+		metrics_busy_begin();
+		hwc_lap(HW_STAGE_NONE);
+		chunk->iBytes = bFailed ? 0 : lame_encode_flush(job->gfp, chunk->pData, MP3_CHUNK_BYTES);
+		metrics_busy_end();
+		hwc_lap(HW_STAGE_ENCODE);
+		dEncode += report_now() - t;
+		if (chunk->iBytes < 0) {
+			chunk->iBytes = 0;
+			bFailed = true;
+		}
+		job->timing.dStage[STAGE_ENCODE] = dEncode;
+		report->dBusy += dEncode;
+		chunk->bLast = true;
+		chunk->bError = bFailed;
+		lfq_push_wait(&job->mp3Queue, chunk); // job belongs to the writer from now on
+	}
+
+	delete[] pConverted;
+	report->dWall = report_now() - tThreadStart;
+	hwc_thread_stop();
+
+	// the last encoder tells all writers that there are no more jobs
+	if (--ctx->iEncodersLeft == 0) {
+		for (int i = 0; i < ctx->cfg->iWriters; i++)
+			lfq_push_wait(&ctx->writeJobs, NULL);
+	}
+	return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+	PIPE_THREAD_ARGS *targs = (PIPE_THREAD_ARGS*)arg;
+	PIPE_CTX *ctx = targs->ctx;
+	PIPE_JOB *job;
+	TRACE_THREAD_NAME("writer", targs->iId);
+	metrics_register_thread("writer", targs->iId);
+	hwc_thread_start("writer", targs->iId);
+
+	// write blocks and ring of the output backend, reused for all files of this writer
+	ARENA_BUFFER outputBuffers;
+	OUTPUT_RING outputRing;
+	OUTPUT_CFG outputCfg;
+	init_thread_output_cfg(ctx->encArgs[0].pOutputCfg, &outputBuffers, &outputRing, &outputCfg);
+
+	while ((job = (PIPE_JOB*)lfq_pop_wait(&ctx->writeJobs)) != NULL) {
+		TRACE_SCOPE_DETAIL("write job", job->sOut.c_str());
+		hwc_lap(HW_STAGE_NONE);
+		double t = report_now(), dWrite = 0.0;
+		MP3_OUTPUT out;
+		bool bOpen = EXIT_SUCCESS == output_open(&out, job->sOut.c_str(), &outputCfg,
+			predict_mp3_size(job->hdr, job->iDataSize, NULL));
+		bool bFailed = !bOpen;
+		if (bFailed) cerr << "Unable to open output file " << job->sOut << endl;
+		dWrite += report_now() - t;
+		hwc_lap(HW_STAGE_WRITE);
+
+		unsigned int iBytesWritten = 0;
+		bool bLast = false;
+		while (!bLast) {
+			MP3_CHUNK *chunk;
+			{
+				TRACE_SCOPE("wait mp3 chunk");
+				chunk = (MP3_CHUNK*)lfq_pop_wait(&job->mp3Queue);
+			}
+			bLast = chunk->bLast;
+			bFailed = bFailed || chunk->bError;
+			if (!bFailed) {
+				t = report_now();
+				metrics_busy_begin();
+				hwc_lap(HW_STAGE_NONE);
+				bFailed = EXIT_SUCCESS != output_write(&out, chunk->pData, chunk->iBytes);
+				metrics_busy_end();
+				hwc_lap(HW_STAGE_WRITE);
+				iBytesWritten += chunk->iBytes;
+				dWrite += report_now() - t;
+			}
+			lfq_push_wait(&ctx->freeChunks[chunk->iOwner], chunk); // hand chunk back to its encoder
+		}
+
+		if (bOpen) {
+			// write the LAME tag frame (if enabled)
+			t = report_now();
+			hwc_lap(HW_STAGE_NONE);
+			if (!bFailed) write_tag_frame(job->gfp, &out);
+			t = report_stage(&job->timing, STAGE_TAG, t);
+			job->timing.llOutBytes = output_size(&out);
+			job->timing.llOutHash = output_checksum(&out);
+			if (EXIT_SUCCESS != output_close(&out)) bFailed = true;
+			dWrite += report_now() - t;
+			hwc_lap(HW_STAGE_WRITE);
+		}
+		job->timing.dStage[STAGE_WRITE] = dWrite;
+		if (!bFailed && iBytesWritten > 0) {
+			printf("[:%i][ok] .... %s\n", ctx->encArgs[job->iEncoderId].iThreadId, job->sIn.c_str());
+			ctx->piProcessed[job->iEncoderId]++;
+			pthread_mutex_lock(&ctx->reportLock);
+			report_add_file(&ctx->encArgs[job->iEncoderId].report, &job->timing, job->iDataSize,
+				(double)(job->iDataSize / job->hdr->wBlockAlign) / job->hdr->dwSamplesPerSec);
+			pthread_mutex_unlock(&ctx->reportLock);
+			manifest_record(ctx->encArgs[0].pManifest, job->sIn.c_str(), &job->input, job->timing.llOutBytes,
+				job->timing.llOutHash);
+			metrics_job_done(job->timing.dLatency);
+		} else {
+			cerr << "Unable to encode mp3: " << job->sOut << endl;
+			metrics_count(METRIC_JOBS_FAILED);
+		}
+
+		if (job->gfp != NULL) lame_close(job->gfp);
+		lfq_push_wait(&ctx->freeJobs, job); // its queues are empty again
+	}
+	hwc_thread_stop();
+	return NULL;
+}
+
+/* gauges of the job queues between the stages */
+static double ready_jobs_depth(void *ctx)
+{
+	return (double)lfq_size(&((PIPE_CTX*)ctx)->readyJobs);
+}
+
+static double write_jobs_depth(void *ctx)
+{
+	return (double)lfq_size(&((PIPE_CTX*)ctx)->writeJobs);
+}
+
+void pipeline_default_cfg(PIPELINE_CFG *cfg)
+{
+	cfg->iReaders = PIPELINE_DEFAULT_READERS;
+	cfg->iWriters = PIPELINE_DEFAULT_WRITERS;
+	cfg->iQueueDepth = PIPELINE_DEFAULT_QUEUE_DEPTH;
+}
+
+int run_pipeline(const PIPELINE_CFG *cfg, ENC_WRK_ARGS *encArgs, int iEncoders)
+{
+	const int iReaders = cfg->iReaders, iWriters = cfg->iWriters, iDepth = cfg->iQueueDepth;
+	// a job in flight is held by a thread or by one of the PCM blocks or MP3 chunks in its queues, so more jobs
+	// would never be in use at the same time. A reader which finds the pool empty waits for a writer to finish.
+	const int iJobs = (iReaders + iEncoders) * (iDepth + 1) + iWriters;
+	int ret = EXIT_SUCCESS;
+
+	PIPE_CTX ctx;
+	ctx.cfg = cfg;
+	ctx.encArgs = encArgs;
+	ctx.iEncoders = iEncoders;
+	ctx.iReadersLeft = iReaders;
+	ctx.iEncodersLeft = iEncoders;
+	lfq_init(&ctx.readyJobs, iJobs + iEncoders);
+	lfq_init(&ctx.writeJobs, iJobs + iWriters);
+	ctx.piProcessed = new std::atomic<int>[iEncoders];
+	for (int i = 0; i < iEncoders; i++) ctx.piProcessed[i] = 0;
+	pthread_mutex_init(&ctx.reportLock, NULL);
+
+	// job pool, the queues of a job are set up once and reused for all of its files
+	PIPE_JOB *jobs = new PIPE_JOB[iJobs];
+	lfq_init(&ctx.freeJobs, iJobs);
+	for (int i = 0; i < iJobs; i++) {
+		lfq_init(&jobs[i].pcmQueue, iDepth);
+		lfq_init(&jobs[i].mp3Queue, iDepth);
+		lfq_push(&ctx.freeJobs, &jobs[i]);
+	}
+
+	// block and chunk pools, each owned by one reader or encoder
+	ctx.freeBlocks = new LF_QUEUE[iReaders];
+	PCM_BLOCK *blocks = new PCM_BLOCK[iReaders * iDepth];
+	unsigned char *pBlockData = new unsigned char[(size_t)iReaders * iDepth * PCM_BLOCK_BYTES];
+	for (int r = 0; r < iReaders; r++) {
+		lfq_init(&ctx.freeBlocks[r], iDepth);
+		for (int i = 0; i < iDepth; i++) {
+			PCM_BLOCK *blk = &blocks[r * iDepth + i];
+			blk->pData = pBlockData + (size_t)(r * iDepth + i) * PCM_BLOCK_BYTES;
+			blk->iOwner = r;
+			lfq_push(&ctx.freeBlocks[r], blk);
+		}
+	}
+	ctx.freeChunks = new LF_QUEUE[iEncoders];
+	MP3_CHUNK *chunks = new MP3_CHUNK[iEncoders * iDepth];
+	unsigned char *pChunkData = new unsigned char[(size_t)iEncoders * iDepth * MP3_CHUNK_BYTES];
+	for (int e = 0; e < iEncoders; e++) {
+		lfq_init(&ctx.freeChunks[e], iDepth);
+		for (int i = 0; i < iDepth; i++) {
+			MP3_CHUNK *chunk = &chunks[e * iDepth + i];
+			chunk->pData = pChunkData + (size_t)(e * iDepth + i) * MP3_CHUNK_BYTES;
+			chunk->iOwner = e;
+			lfq_push(&ctx.freeChunks[e], chunk);
+		}
+	}
+
+	metrics_add_gauge("ready_jobs_queue_depth", "Opened files waiting for an encoder", ready_jobs_depth, &ctx);
+	metrics_add_gauge("write_jobs_queue_depth", "Files being encoded, waiting for a writer", write_jobs_depth, &ctx);
+
+	// create all three thread pools
+	const int iThreads = iReaders + iEncoders + iWriters;
+	pthread_t *threads = new pthread_t[iThreads];
+	PIPE_THREAD_ARGS *threadArgs = new PIPE_THREAD_ARGS[iThreads];
+	for (int i = 0; i < iThreads; i++) {
+		threadArgs[i].ctx = &ctx;
+		void *(*routine)(void*);
+		if (i < iReaders) {
+			threadArgs[i].iId = i;
+			routine = reader_thread;
+		} else if (i < iReaders + iEncoders) {
+			threadArgs[i].iId = i - iReaders;
+			routine = encoder_thread;
+		} else {
+			threadArgs[i].iId = i - iReaders - iEncoders;
+			routine = writer_thread;
+		}
+		if (0 != pthread_create(&threads[i], NULL, routine, (void*)&threadArgs[i])) {
+			cerr << "FATAL: Unable to create pipeline thread." << endl;
+			exit(EXIT_FAILURE); // remaining threads would wait forever
+		}
+	}
+
+	// synchronize / join threads
+	for (int i = 0; i < iThreads; i++) {
+		if (0 != pthread_join(threads[i], NULL)) {
+			cerr << "A POSIX thread error occured." << endl;
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	for (int e = 0; e < iEncoders; e++)
+		encArgs[e].iProcessedFiles = ctx.piProcessed[e];
+	metrics_remove_gauge(&ctx);
+
+	// cleanup
+	for (int r = 0; r < iReaders; r++) lfq_destroy(&ctx.freeBlocks[r]);
+	for (int e = 0; e < iEncoders; e++) lfq_destroy(&ctx.freeChunks[e]);
+	for (int i = 0; i < iJobs; i++) {
+		lfq_destroy(&jobs[i].pcmQueue);
+		lfq_destroy(&jobs[i].mp3Queue);
+	}
+	lfq_destroy(&ctx.freeJobs);
+	lfq_destroy(&ctx.readyJobs);
+	lfq_destroy(&ctx.writeJobs);
+	delete[] jobs;
+	delete[] ctx.freeBlocks;
+	delete[] ctx.freeChunks;
+	delete[] blocks;
+	delete[] chunks;
+	delete[] pBlockData;
+	delete[] pChunkData;
+	delete[] ctx.piProcessed;
+	pthread_mutex_destroy(&ctx.reportLock);
+	delete[] threads;
+	delete[] threadArgs;
+	return ret;
+}
@@ -0,0 +1,83 @@
+#ifndef __PIPELINE_H_
+#define __PIPELINE_H_
+
+#include "lame_interface.h"
+#include "lf_queue.h"
+
+/////////////////////
+// pipelined execution mode: reader -> encoder -> writer
+/////////////////////
+
+#define PIPELINE_DEFAULT_READERS 2
+#define PIPELINE_DEFAULT_WRITERS 1
+#define PIPELINE_DEFAULT_QUEUE_DEPTH 8 // PCM blocks / MP3 chunks per reader / encoder
+
+/* Configuration of the pipelined mode. The number of encoder threads is given by the number of
+ * ENC_WRK_ARGS passed to run_pipeline.
+ */
+typedef struct {
+	int iReaders; // threads parsing WAV files and reading PCM blocks
+	int iWriters; // threads writing MP3 frames to the output files
+	int iQueueDepth; // blocks each reader (and MP3 chunks each encoder) may have in flight
+} PIPELINE_CFG;
+
+/* Block of raw PCM frames passed from a reader to an encoder. */
+typedef struct {
+	unsigned char *pData; // raw interleaved frames as read from the 'data' chunk
+	int iSamples; // number of frames in pData
+	int iOwner; // reader owning this block (returned to its pool after encoding)
+	bool bLast; // last block of the file
+	bool bError; // reading failed, the file must be discarded
+} PCM_BLOCK;
+
+/* Chunk of MP3 frames passed from an encoder to a writer. */
+typedef struct {
+	unsigned char *pData;
+	int iBytes;
+	int iOwner; // encoder owning this chunk
+	bool bLast; // last chunk of the file (flushed frames)
+	bool bError; // encoding failed, the file must be discarded
+} MP3_CHUNK;
+
+/* A single file travelling through the pipeline. Each job is handled by one reader, one encoder and one
+ * writer at a time, which are connected by the job's bounded block and chunk queues. Jobs come from a pool
+ * which run_pipeline sets up once, and are reused for further files after the writer is done.
+ */
+typedef struct {
+	int iFileIdx;
+	string sIn, sOut;
+	FMT_DATA *hdr; // points to fmt (see read_wave_header)
+	FMT_DATA fmt;
+	unsigned int iDataSize;
+	lame_global_flags *gfp; // created by the encoder, released by the writer after tagging
+	int iEncoderId;
+	LF_QUEUE pcmQueue; // PCM_BLOCK* from reader to encoder
+	LF_QUEUE mp3Queue; // MP3_CHUNK* from encoder to writer
+	FILE_TIMING timing; // each stage adds its own times, the writer completes the record
+	MANIFEST_ENTRY input; // taken by the reader in incremental mode (manifest_stat)
+} PIPE_JOB;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* pipeline_default_cfg
+ *  Fills cfg with the default number of readers, writers and queue depth.
+ */
+void pipeline_default_cfg(PIPELINE_CFG *cfg);
+
+/* run_pipeline
+ *  Converts all files of the job list in encArgs (which is set up like for complete_encode_worker) with
+ *  separate reader, encoder and writer thread pools. Readers claim files and push PCM blocks, iEncoders
+ *  CPU-bound encoder threads turn them into MP3 frames, and writers append the frames to the output files.
+ *  Each job is converted exactly like encode_stream_to_file would do it. All stages are connected by bounded
+ *  lock-free queues, so a slow stage throttles the others instead of buffering without limit.
+ *  Returns after all files are done, with iProcessedFiles and the report of each encoder's ENC_WRK_ARGS filled
+ *  in (files are counted for the encoder which encoded them, busy time only covers encoding).
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE if threads couldn't be created
+ */
+int run_pipeline(const PIPELINE_CFG *cfg, ENC_WRK_ARGS *encArgs, int iEncoders);
+
+#endif // __PIPELINE_H_
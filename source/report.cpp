@@ -0,0 +1,310 @@
+#include "report.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#ifdef WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+double report_now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* hardware counter stage of each report stage */
+static const int hwStages[STAGE_COUNT] = { HW_STAGE_PARSE, HW_STAGE_CONVERT, HW_STAGE_ENCODE, HW_STAGE_WRITE,
+	HW_STAGE_WRITE };
+
+void report_init_file(FILE_TIMING *timing, double dStart)
+{
+	hwc_lap(HW_STAGE_NONE);
+	memset(timing, 0, sizeof(FILE_TIMING));
+	timing->dStart = dStart;
+}
+
+double report_stage(FILE_TIMING *timing, REPORT_STAGE stage, double dSince)
+{
+	double dNow = report_now();
+	if (timing != NULL) timing->dStage[stage] += dNow - dSince;
+	hwc_lap(hwStages[stage]);
+	return dNow;
+}
+
+void report_add_file(THREAD_REPORT *thread, FILE_TIMING *timing, unsigned long long llInBytes,
+	double dAudioSeconds)
+{
+	timing->llInBytes = llInBytes;
+	timing->dAudioSeconds = dAudioSeconds;
+	timing->dLatency = report_now() - timing->dStart;
+	thread->files.push_back(*timing);
+}
+
+static const char *stageNames[STAGE_COUNT] = { "parse", "read", "encode", "write", "tag" };
+
+const char *report_stage_name(REPORT_STAGE stage)
+{
+	return stageNames[stage];
+}
+
+static unsigned long long peak_rss()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return pmc.PeakWorkingSetSize;
+	return 0;
+#else
+	struct rusage usage;
+	if (0 != getrusage(RUSAGE_SELF, &usage)) return 0;
+#ifdef __APPLE__
+	return usage.ru_maxrss; // bytes
+#else
+	return (unsigned long long)usage.ru_maxrss * 1024; // kilobytes
+#endif
+#endif
+}
+
+/* nearest-rank percentile of sorted values */
+static double percentile(const vector<double> &sorted, double dPercent)
+{
+	if (sorted.empty()) return 0.0;
+	size_t uRank = (size_t)(dPercent / 100.0 * sorted.size() + 0.999999);
+	if (uRank < 1) uRank = 1;
+	if (uRank > sorted.size()) uRank = sorted.size();
+	return sorted[uRank - 1];
+}
+
+void build_run_report(const THREAD_REPORT *const *threads, int iThreads, double dWall, RUN_REPORT *report)
+{
+	report->dWall = dWall;
+	report->iFiles = 0;
+	report->iThreads = iThreads;
+	for (int s = 0; s < STAGE_COUNT; s++) report->dStage[s] = 0.0;
+	report->dAudioSeconds = 0.0;
+	report->llInBytes = report->llOutBytes = 0;
+	report->threadBusy.clear();
+	report->threadWall.clear();
+
+	vector<double> latencies;
+	for (int t = 0; t < iThreads; t++) {
+		const THREAD_REPORT *thread = threads[t];
+		for (size_t i = 0; i < thread->files.size(); i++) {
+			const FILE_TIMING *f = &thread->files[i];
+			for (int s = 0; s < STAGE_COUNT; s++) report->dStage[s] += f->dStage[s];
+			report->dAudioSeconds += f->dAudioSeconds;
+			report->llInBytes += f->llInBytes;
+			report->llOutBytes += f->llOutBytes;
+			latencies.push_back(f->dLatency);
+		}
+		report->threadBusy.push_back(thread->dBusy);
+		report->threadWall.push_back(thread->dWall);
+	}
+	report->iFiles = (int)latencies.size();
+
+	sort(latencies.begin(), latencies.end());
+	report->dLatencyP50 = percentile(latencies, 50);
+	report->dLatencyP95 = percentile(latencies, 95);
+	report->dLatencyP99 = percentile(latencies, 99);
+	report->dLatencyMax = latencies.empty() ? 0.0 : latencies.back();
+	report->llPeakRss = peak_rss();
+	report->bAdaptive = false; // filled in by adapt_finish
+	report->iMinWorkers = report->iMaxWorkers = report->iFinalWorkers = iThreads;
+	report->dMeanWorkers = iThreads;
+	report->adaptSteps.clear();
+
+	report->bHwCounters = hwc_enabled();
+	memset(&report->hwTotal, 0, sizeof(HW_COUNTS));
+	report->hwThreads.clear();
+	if (report->bHwCounters) {
+		hwc_collect(report->hwThreads);
+		for (size_t t = 0; t < report->hwThreads.size(); t++) {
+			const HW_COUNTS *thread = &report->hwThreads[t];
+			for (int s = 0; s < HW_STAGE_COUNT; s++)
+				for (int c = 0; c < HW_COUNTER_COUNT; c++)
+					report->hwTotal.llCount[s][c] += thread->llCount[s][c];
+			report->hwTotal.llSamples += thread->llSamples;
+		}
+	}
+}
+
+static const char *hwStageNames[HW_STAGE_COUNT] = { "parse", "convert", "encode", "write" };
+
+/* events of a counter in one stage, or in all stages if iStage is HW_STAGE_COUNT */
+static double hw_sum(const HW_COUNTS *counts, int iStage, HW_COUNTER counter)
+{
+	double dEvents = 0.0;
+	for (int s = 0; s < HW_STAGE_COUNT; s++)
+		if (iStage == HW_STAGE_COUNT || s == iStage) dEvents += counts->llCount[s][counter];
+	return dEvents;
+}
+
+static double hw_ipc(const HW_COUNTS *counts, int iStage)
+{
+	double dCycles = hw_sum(counts, iStage, HW_CYCLES);
+	return dCycles > 0 ? hw_sum(counts, iStage, HW_INSTRUCTIONS) / dCycles : 0.0;
+}
+
+static double hw_per_sample(const HW_COUNTS *counts, int iStage, HW_COUNTER counter)
+{
+	return counts->llSamples > 0 ? hw_sum(counts, iStage, counter) / counts->llSamples : 0.0;
+}
+
+static double per_second(double dValue, double dSeconds)
+{
+	return dSeconds > 0 ? dValue / dSeconds : 0.0;
+}
+
+static double busy_ratio(const RUN_REPORT *report, int t)
+{
+	return report->threadWall[t] > 0 ? report->threadBusy[t] / report->threadWall[t] : 0.0;
+}
+
+void print_run_report(const RUN_REPORT *report)
+{
+	const double dMB = 1024.0 * 1024.0;
+	printf("Wall time: %.3fs for %i files\n", report->dWall, report->iFiles);
+	printf("Stage time (summed over threads):");
+	for (int s = 0; s < STAGE_COUNT; s++)
+		printf(" %s %.3fs%s", stageNames[s], report->dStage[s], s + 1 < STAGE_COUNT ? "," : "\n");
+	printf("File latency: p50 %.3fs, p95 %.3fs, p99 %.3fs, max %.3fs\n", report->dLatencyP50, report->dLatencyP95,
+		report->dLatencyP99, report->dLatencyMax);
+	printf("Throughput: %.1f audio-s/s, %.2f MB/s in, %.2f MB/s out\n",
+		per_second(report->dAudioSeconds, report->dWall), per_second(report->llInBytes / dMB, report->dWall),
+		per_second(report->llOutBytes / dMB, report->dWall));
+	printf("Thread busy:");
+	for (int t = 0; t < report->iThreads; t++)
+		printf(" %.0f%%", 100.0 * busy_ratio(report, t));
+	printf("\n");
+	if (report->bAdaptive) {
+		printf("Active workers: %.1f on average (min %i, max %i, final %i), %i change(s)\n", report->dMeanWorkers,
+			report->iMinWorkers, report->iMaxWorkers, report->iFinalWorkers, (int)report->adaptSteps.size());
+		for (size_t i = 0; i < report->adaptSteps.size(); i++) {
+			const ADAPT_STEP *step = &report->adaptSteps[i];
+			printf("  %8.1fs %3i -> %-3i %s\n", step->dTime, step->iFrom, step->iTo, step->sReason.c_str());
+		}
+	}
+	if (report->llPeakRss > 0) printf("Peak RSS: %.1f MB\n", report->llPeakRss / dMB);
+
+	if (!report->bHwCounters) return;
+	const HW_COUNTS *total = &report->hwTotal;
+	printf("Hardware counters (%s, %llu samples):\n", hwc_user_only() ? "user space only" : "user and kernel",
+		total->llSamples);
+	printf("  %-8s %14s %14s %6s %18s %18s\n", "stage", "cycles", "instructions", "IPC", "LLC miss/sample",
+		"branch miss/sample");
+	for (int s = 0; s <= HW_STAGE_COUNT; s++) {
+		printf("  %-8s %14.0f %14.0f %6.2f %18.4f %18.4f\n", s < HW_STAGE_COUNT ? hwStageNames[s] : "total",
+			hw_sum(total, s, HW_CYCLES), hw_sum(total, s, HW_INSTRUCTIONS), hw_ipc(total, s),
+			hw_per_sample(total, s, HW_LLC_MISSES), hw_per_sample(total, s, HW_BRANCH_MISSES));
+	}
+	printf("Thread IPC:");
+	for (size_t t = 0; t < report->hwThreads.size(); t++)
+		printf(" %s %.2f%s", report->hwThreads[t].name, hw_ipc(&report->hwThreads[t], HW_STAGE_COUNT),
+			t + 1 < report->hwThreads.size() ? "," : "");
+	printf("\n");
+}
+
+/* writes the counters of one stage (or all stages) as a JSON object */
+static void write_hw_counts_json(FILE *f, const HW_COUNTS *counts, int iStage)
+{
+	fprintf(f, "{");
+	for (int c = 0; c < HW_COUNTER_COUNT; c++)
+		fprintf(f, "\"%s\": %.0f, ", hwc_counter_name((HW_COUNTER)c), hw_sum(counts, iStage, (HW_COUNTER)c));
+	fprintf(f, "\"ipc\": %.4f, \"llc_misses_per_sample\": %.6f, \"branch_misses_per_sample\": %.6f}",
+		hw_ipc(counts, iStage), hw_per_sample(counts, iStage, HW_LLC_MISSES),
+		hw_per_sample(counts, iStage, HW_BRANCH_MISSES));
+}
+
+/* writes s as a JSON string literal */
+static void write_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s != '\0'; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+int write_run_report_json(const RUN_REPORT *report, const char *filename)
+{
+	FILE *f = fopen(filename, "w");
+	if (f == NULL) return EXIT_FAILURE;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"wall_seconds\": %.6f,\n", report->dWall);
+	fprintf(f, "  \"files\": %i,\n", report->iFiles);
+	fprintf(f, "  \"threads\": %i,\n", report->iThreads);
+	fprintf(f, "  \"stage_seconds\": {");
+	for (int s = 0; s < STAGE_COUNT; s++)
+		fprintf(f, "\"%s\": %.6f%s", stageNames[s], report->dStage[s], s + 1 < STAGE_COUNT ? ", " : "},\n");
+	fprintf(f, "  \"latency_seconds\": {\"p50\": %.6f, \"p95\": %.6f, \"p99\": %.6f, \"max\": %.6f},\n",
+		report->dLatencyP50, report->dLatencyP95, report->dLatencyP99, report->dLatencyMax);
+	fprintf(f, "  \"audio_seconds\": %.3f,\n", report->dAudioSeconds);
+	fprintf(f, "  \"input_bytes\": %llu,\n", report->llInBytes);
+	fprintf(f, "  \"output_bytes\": %llu,\n", report->llOutBytes);
+	fprintf(f, "  \"audio_seconds_per_second\": %.3f,\n", per_second(report->dAudioSeconds, report->dWall));
+	fprintf(f, "  \"input_mb_per_second\": %.3f,\n", per_second(report->llInBytes / (1024.0 * 1024.0),
+		report->dWall));
+	fprintf(f, "  \"output_mb_per_second\": %.3f,\n", per_second(report->llOutBytes / (1024.0 * 1024.0),
+		report->dWall));
+	fprintf(f, "  \"thread_stats\": [");
+	for (int t = 0; t < report->iThreads; t++) {
+		fprintf(f, "%s\n    {\"busy_seconds\": %.6f, \"wall_seconds\": %.6f, \"busy_ratio\": %.4f}",
+			t > 0 ? "," : "", report->threadBusy[t], report->threadWall[t], busy_ratio(report, t));
+	}
+	fprintf(f, "\n  ],\n");
+	if (report->bAdaptive) {
+		fprintf(f, "  \"adaptive_workers\": {\n");
+		fprintf(f, "    \"mean\": %.3f, \"min\": %i, \"max\": %i, \"final\": %i,\n", report->dMeanWorkers,
+			report->iMinWorkers, report->iMaxWorkers, report->iFinalWorkers);
+		fprintf(f, "    \"steps\": [");
+		for (size_t i = 0; i < report->adaptSteps.size(); i++) {
+			const ADAPT_STEP *step = &report->adaptSteps[i];
+			fprintf(f, "%s\n      {\"seconds\": %.3f, \"from\": %i, \"to\": %i, \"audio_seconds_per_second\": %.3f, "
+				"\"cpus\": %.3f, \"run_queue\": %.3f, \"blocked_ratio\": %.4f, \"reason\": ", i > 0 ? "," : "",
+				step->dTime, step->iFrom, step->iTo, step->dRate, step->dCpus, step->dRunQueue, step->dBlocked);
+			write_json_string(f, step->sReason.c_str());
+			fprintf(f, "}");
+		}
+		fprintf(f, "\n    ]\n  },\n");
+	}
+	fprintf(f, "  \"peak_rss_bytes\": %llu%s\n", report->llPeakRss, report->bHwCounters ? "," : "");
+	if (report->bHwCounters) {
+		fprintf(f, "  \"hw_counters\": {\n");
+		fprintf(f, "    \"user_only\": %s,\n", hwc_user_only() ? "true" : "false");
+		fprintf(f, "    \"samples\": %llu,\n", report->hwTotal.llSamples);
+		fprintf(f, "    \"stages\": {");
+		for (int s = 0; s < HW_STAGE_COUNT; s++) {
+			fprintf(f, "%s\n      \"%s\": ", s > 0 ? "," : "", hwStageNames[s]);
+			write_hw_counts_json(f, &report->hwTotal, s);
+		}
+		fprintf(f, "\n    },\n");
+		fprintf(f, "    \"total\": ");
+		write_hw_counts_json(f, &report->hwTotal, HW_STAGE_COUNT);
+		fprintf(f, ",\n    \"threads\": [");
+		for (size_t t = 0; t < report->hwThreads.size(); t++) {
+			fprintf(f, "%s\n      {\"name\": ", t > 0 ? "," : "");
+			write_json_string(f, report->hwThreads[t].name);
+			fprintf(f, ", \"samples\": %llu, \"counts\": ", report->hwThreads[t].llSamples);
+			write_hw_counts_json(f, &report->hwThreads[t], HW_STAGE_COUNT);
+			fprintf(f, "}");
+		}
+		fprintf(f, "\n    ]\n  }\n");
+	}
+	fprintf(f, "}\n");
+
+	bool bOk = !ferror(f);
+	bOk = 0 == fclose(f) && bOk;
+	return bOk ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,141 @@
+#ifndef __REPORT_H_
+#define __REPORT_H_
+
+#include <vector>
+#include <string>
+#include "hw_counters.h"
+
+using namespace std;
+
+/////////////////////
+// wall-clock run report
+/////////////////////
+
+/*
+ * Every thread records the time each converted file spends in the stages below plus its own busy time. All
+ * times are taken from a monotonic wall clock, so unlike clock() (which sums up the CPU time of all threads) they
+ * don't grow with the number of threads. At the end of a run, build_run_report combines the records of all
+ * threads into totals, latency percentiles and throughput figures.
+ */
+
+/* Stages of a single conversion:
+ *   STAGE_PARSE   opening the input and parsing the WAV header
+ *   STAGE_READ    reading PCM data
+ *   STAGE_ENCODE  creating the encoder, converting samples and encoding (including the final flush)
+ *   STAGE_WRITE   opening, writing and closing the output file
+ *   STAGE_TAG     writing the LAME tag frame
+ */
+typedef enum {
+	STAGE_PARSE = 0,
+	STAGE_READ,
+	STAGE_ENCODE,
+	STAGE_WRITE,
+	STAGE_TAG,
+	STAGE_COUNT
+} REPORT_STAGE;
+
+/* Timing record of a single converted file. */
+typedef struct {
+	double dStage[STAGE_COUNT]; // seconds spent in each stage (summed over all segments of a segmented file)
+	double dStart; // report_now() when the file was claimed
+	double dLatency; // seconds from claiming the file until its output was closed
+	double dAudioSeconds; // duration of the input
+	unsigned long long llInBytes; // size of the 'data' chunk
+	unsigned long long llOutBytes; // size of the MP3 file, set by whoever closes it
+	unsigned long long llOutHash; // output_checksum of the MP3 file, set along with llOutBytes
+} FILE_TIMING;
+
+/* Records of a single thread. */
+typedef struct {
+	vector<FILE_TIMING> files; // files completed by this thread
+	double dBusy; // seconds spent working on jobs
+	double dWall; // seconds from thread start to exit
+} THREAD_REPORT;
+
+/* Change of the number of active workers made by the concurrency controller (see adaptive.h). */
+typedef struct {
+	double dTime; // seconds since the start of the run
+	int iFrom, iTo; // active workers before and after
+	double dRate; // audio seconds encoded per second in the interval which led to the decision
+	double dCpus; // CPUs used by the process in that interval
+	double dRunQueue; // workers waiting for a CPU on average
+	double dBlocked; // share of the active workers blocked (I/O wait)
+	string sReason;
+} ADAPT_STEP;
+
+/* Summary of a whole run. */
+typedef struct {
+	double dWall; // seconds from the first job until all threads are done
+	int iFiles; // converted files
+	int iThreads;
+	double dStage[STAGE_COUNT]; // total seconds per stage
+	double dLatencyP50, dLatencyP95, dLatencyP99, dLatencyMax; // per-file latency in seconds
+	double dAudioSeconds;
+	unsigned long long llInBytes, llOutBytes;
+	vector<double> threadBusy, threadWall; // per thread
+	unsigned long long llPeakRss; // peak resident set size of the process in bytes, 0 if unknown
+	bool bHwCounters; // hardware counters have been collected
+	HW_COUNTS hwTotal; // summed over all threads
+	vector<HW_COUNTS> hwThreads;
+	bool bAdaptive; // the number of active workers has been adapted during the run
+	int iMinWorkers, iMaxWorkers, iFinalWorkers; // active workers
+	double dMeanWorkers; // time-weighted average of the active workers
+	vector<ADAPT_STEP> adaptSteps;
+} RUN_REPORT;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* report_now
+ *  Returns the monotonic wall clock in seconds (arbitrary epoch).
+ */
+double report_now();
+
+/* report_init_file
+ *  Clears all stage times of timing and sets its start time to dStart. Hardware events of the calling thread up to
+ *  now aren't attributed to any stage.
+ */
+void report_init_file(FILE_TIMING *timing, double dStart);
+
+/* report_stage
+ *  Adds the time since dSince to the given stage of timing (if timing is not NULL), so that consecutive stages can
+ *  be timed with one clock read each:  t = report_stage(timing, STAGE_READ, t);
+ *  If hardware counters are enabled, the events since the previous lap are attributed to the stage as well.
+ *
+ *  Return value:
+ *    current time (report_now)
+ */
+double report_stage(FILE_TIMING *timing, REPORT_STAGE stage, double dSince);
+
+/* report_add_file
+ *  Completes timing with the input size and duration of the file and its latency (ending now) and appends it to
+ *  the records of thread.
+ */
+void report_add_file(THREAD_REPORT *thread, FILE_TIMING *timing, unsigned long long llInBytes,
+	double dAudioSeconds);
+
+/* report_stage_name
+ *  Returns the printable name of a stage.
+ */
+const char *report_stage_name(REPORT_STAGE stage);
+
+/* build_run_report
+ *  Summarizes the records of iThreads threads of a run which took dWall seconds into report.
+ */
+void build_run_report(const THREAD_REPORT *const *threads, int iThreads, double dWall, RUN_REPORT *report);
+
+/* print_run_report
+ *  Prints the report in human readable form to stdout.
+ */
+void print_run_report(const RUN_REPORT *report);
+
+/* write_run_report_json
+ *  Writes the report as a single JSON object to filename.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int write_run_report_json(const RUN_REPORT *report, const char *filename);
+
+#endif // __REPORT_H_
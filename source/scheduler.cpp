@@ -0,0 +1,123 @@
+#include "scheduler.h"
+#include <algorithm>
+#include <atomic>
+#include "pthread.h"
+
+static const char *policyNames[] = { "fifo", "lpt", "spt" };
+
+int sched_policy_from_name(const char *name, SCHED_POLICY &policy)
+{
+	for (int i = 0; i < (int)(sizeof(policyNames) / sizeof(policyNames[0])); i++) {
+		if (0 == strcmp(name, policyNames[i])) {
+			policy = (SCHED_POLICY)i;
+			return EXIT_SUCCESS;
+		}
+	}
+	return EXIT_FAILURE;
+}
+
+const char *sched_policy_name(SCHED_POLICY policy)
+{
+	return policyNames[policy];
+}
+
+double estimate_job_cost(const FMT_DATA *hdr, unsigned int iDataSize)
+{
+	double dSamples = (double)(iDataSize / hdr->wBlockAlign);
+	return dSamples * hdr->wChannels + SCHED_FILE_OVERHEAD;
+}
+
+/* Argument struct for the probe threads. */
+typedef struct {
+	const vector<string> *pFiles;
+	const INPUT_CFG *pCfg;
+	JOB_PROBE *pProbes;
+	bool *pbValid;
+	std::atomic<int> *piNext;
+} PROBE_ARGS;
+
+static void *probe_worker(void *arg)
+{
+	PROBE_ARGS *args = (PROBE_ARGS*)arg;
+	const int iNumFiles = (int)args->pFiles->size();
+	int i;
+	while ((i = args->piNext->fetch_add(1, std::memory_order_relaxed)) < iNumFiles) {
+		JOB_PROBE *probe = &args->pProbes[i];
+		args->pbValid[i] = EXIT_SUCCESS == probe_wave(args->pFiles->at(i).c_str(), args->pCfg, probe->fmt,
+			probe->iDataSize);
+		if (args->pbValid[i]) {
+			probe->uSamples = probe->iDataSize / probe->fmt.wBlockAlign;
+			probe->dCost = estimate_job_cost(&probe->fmt, probe->iDataSize);
+		}
+	}
+	return NULL;
+}
+
+/* sort helpers, comparing indices into a probe array */
+struct LongerJobFirst {
+	const JOB_PROBE *pProbes;
+	bool operator()(int a, int b) const { return pProbes[a].dCost > pProbes[b].dCost; }
+};
+struct ShorterJobFirst {
+	const JOB_PROBE *pProbes;
+	bool operator()(int a, int b) const { return pProbes[a].dCost < pProbes[b].dCost; }
+};
+
+int schedule_jobs(vector<string> &files, SCHED_POLICY policy, const INPUT_CFG *cfg, int iThreads,
+	vector<JOB_PROBE> *probes)
+{
+	if (files.empty() || (policy == SCHEDULE_FIFO && probes == NULL)) return 0;
+
+	const int iNumFiles = (int)files.size();
+	JOB_PROBE *pProbes = new JOB_PROBE[iNumFiles];
+	bool *pbValid = new bool[iNumFiles];
+	std::atomic<int> iNext(0);
+
+	// probe all headers in parallel
+	PROBE_ARGS args = { &files, cfg, pProbes, pbValid, &iNext };
+	if (iThreads > iNumFiles) iThreads = iNumFiles;
+	if (iThreads < 1) iThreads = 1;
+	pthread_t *threads = new pthread_t[iThreads];
+	int iCreated = 0;
+	for (int i = 1; i < iThreads; i++) { // the calling thread is the first prober
+		if (0 == pthread_create(&threads[iCreated], NULL, probe_worker, (void*)&args)) iCreated++;
+	}
+	probe_worker((void*)&args);
+	for (int i = 0; i < iCreated; i++) pthread_join(threads[i], NULL);
+	delete[] threads;
+
+	// reject invalid files and reorder the remaining ones
+	vector<int> order;
+	int iRejected = 0;
+	for (int i = 0; i < iNumFiles; i++) {
+		if (pbValid[i]) {
+			order.push_back(i);
+		} else {
+			printf("Error in file %s. Skipping.\n", files[i].c_str());
+			iRejected++;
+		}
+	}
+	if (policy == SCHEDULE_LPT) {
+		LongerJobFirst cmp = { pProbes };
+		stable_sort(order.begin(), order.end(), cmp);
+	} else if (policy == SCHEDULE_SPT) {
+		ShorterJobFirst cmp = { pProbes };
+		stable_sort(order.begin(), order.end(), cmp);
+	}
+
+	vector<string> sorted;
+	sorted.reserve(order.size());
+	if (probes != NULL) {
+		probes->clear();
+		probes->reserve(order.size());
+	}
+	for (size_t i = 0; i < order.size(); i++) {
+		sorted.push_back(files[order[i]]);
+		if (probes != NULL) probes->push_back(pProbes[order[i]]);
+	}
+	files.swap(sorted);
+
+	delete[] pProbes;
+	delete[] pbValid;
+	return iRejected;
+}
@@ -0,0 +1,74 @@
+#ifndef __SCHEDULER_H_
+#define __SCHEDULER_H_
+
+#include <vector>
+#include <string>
+#include "wave.h"
+
+using namespace std;
+
+/////////////////////
+// cost-aware job ordering
+/////////////////////
+
+/* Order in which jobs are handed out to the workers:
+ *   SCHEDULE_FIFO  directory order, no probing at all
+ *   SCHEDULE_LPT   longest processing time first; minimizes the makespan of mixed-length batches since
+ *                 long files start early and short ones fill the gaps at the end
+ *   SCHEDULE_SPT   shortest processing time first; first results become available as early as possible
+ */
+typedef enum {
+	SCHEDULE_FIFO = 0,
+	SCHEDULE_LPT,
+	SCHEDULE_SPT
+} SCHED_POLICY;
+
+#define SCHED_DEFAULT_POLICY SCHEDULE_LPT
+
+/* Fixed per-file cost (encoder setup, opening files, tagging) in units of encoded sample values. */
+#define SCHED_FILE_OVERHEAD 20000
+
+/* Header information of a single job, obtained by the probe pass. */
+typedef struct {
+	FMT_DATA fmt;
+	unsigned int iDataSize;
+	unsigned int uSamples; // samples per channel
+	double dCost; // estimated encoding cost
+} JOB_PROBE;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* sched_policy_from_name
+ *  Parses a policy name ("fifo", "lpt", "spt") as given on the command line.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE for unknown policies
+ */
+int sched_policy_from_name(const char *name, SCHED_POLICY &policy);
+
+/* sched_policy_name
+ *  Returns the printable name of a policy.
+ */
+const char *sched_policy_name(SCHED_POLICY policy);
+
+/* estimate_job_cost
+ *  Estimates the encoding cost of a file from its header: proportional to the number of sample values
+ *  (samples times channels) plus a fixed per-file overhead.
+ */
+double estimate_job_cost(const FMT_DATA *hdr, unsigned int iDataSize);
+
+/* schedule_jobs
+ *  Probes the headers of all files with iThreads threads in parallel (probe_wave, no PCM data is read),
+ *  removes files with invalid headers from the list and reorders the remaining ones according to policy.
+ *  If probes is not NULL, it receives the probe results in the new order. With SCHEDULE_FIFO the order is kept,
+ *  and unless probe results are requested nothing is probed and the list is left untouched.
+ *
+ *  Return value:
+ *    number of rejected files
+ */
+int schedule_jobs(vector<string> &files, SCHED_POLICY policy, const INPUT_CFG *cfg, int iThreads,
+	vector<JOB_PROBE> *probes);
+
+#endif // __SCHEDULER_H_
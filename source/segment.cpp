@@ -0,0 +1,303 @@
+#include "segment.h"
+#include "trace.h"
+#include "metrics.h"
+
+static bool is_mpeg1_samplerate(unsigned int uSampleRate)
+{
+	return uSampleRate == 32000 || uSampleRate == 44100 || uSampleRate == 48000;
+}
+
+int plan_segments(const vector<string> &files, const vector<JOB_PROBE> &probes, double dSegmentSeconds,
+	const OUTPUT_CFG *outCfg, SEG_PLAN *plan)
+{
+	// determine the number of segments per file first, so that the shared file states can be allocated at once
+	vector<unsigned int> segments(files.size(), 1);
+	vector<unsigned int> frames(files.size(), 0);
+	int iSplit = 0;
+	for (size_t i = 0; i < files.size(); i++) {
+		const JOB_PROBE *probe = &probes[i];
+		if (!is_mpeg1_samplerate(probe->fmt.dwSamplesPerSec)) continue; // different frame size or resampling
+		unsigned int uSegFrames = (unsigned int)(dSegmentSeconds * probe->fmt.dwSamplesPerSec / SEG_FRAME_SAMPLES);
+		if (uSegFrames < 1) uSegFrames = 1;
+		frames[i] = (probe->uSamples + SEG_FRAME_SAMPLES - 1) / SEG_FRAME_SAMPLES;
+		segments[i] = (frames[i] + uSegFrames - 1) / uSegFrames;
+		if (segments[i] > 1) iSplit++;
+	}
+
+	plan->items.clear();
+	plan->iNumSegFiles = iSplit;
+	plan->pFiles = iSplit > 0 ? new SEG_FILE[iSplit] : NULL;
+
+	int iSegFile = 0;
+	for (size_t i = 0; i < files.size(); i++) {
+		SEG_ITEM item;
+		item.iFileIdx = (int)i;
+		item.iSegFile = -1;
+		item.iSegment = 0;
+		item.uFirstFrame = 0;
+		item.uEndFrame = 0;
+		if (segments[i] <= 1) {
+			plan->items.push_back(item);
+			continue;
+		}
+
+		SEG_FILE *file = &plan->pFiles[iSegFile];
+		file->sIn = files[i];
+		output_file_name(outCfg, files[i], file->sOut);
+		file->iSegments = segments[i];
+		pthread_mutex_init(&file->mutex, NULL);
+		file->segFrames.resize(segments[i]);
+		file->bSegDone.assign(segments[i], false);
+		file->iNextToWrite = 0;
+		file->iSegmentsDone = 0;
+		file->bOutOpen = false;
+		file->llExpectedSize = predict_mp3_size(&probes[i].fmt, probes[i].iDataSize, NULL);
+		file->bFailed = false;
+		file->llBytesWritten = 0;
+		file->bStarted = false;
+		report_init_file(&file->timing, 0.0);
+		file->iDataSize = probes[i].iDataSize;
+		file->dAudioSeconds = (double)probes[i].uSamples / probes[i].fmt.dwSamplesPerSec;
+
+		// spread the frames evenly, the last segment also receives everything the final flush produces
+		unsigned int uPerSegment = (frames[i] + segments[i] - 1) / segments[i];
+		item.iSegFile = iSegFile++;
+		for (unsigned int s = 0; s < segments[i]; s++) {
+			item.iSegment = s;
+			item.uFirstFrame = s * uPerSegment;
+			item.uEndFrame = s + 1 < segments[i] ? (s + 1) * uPerSegment : frames[i];
+			plan->items.push_back(item);
+		}
+	}
+	return iSplit;
+}
+
+void free_segment_plan(SEG_PLAN *plan)
+{
+	for (int i = 0; i < plan->iNumSegFiles; i++) {
+		pthread_mutex_destroy(&plan->pFiles[i].mutex);
+		if (plan->pFiles[i].bOutOpen) output_close(&plan->pFiles[i].out);
+	}
+	delete[] plan->pFiles;
+	plan->pFiles = NULL;
+	plan->iNumSegFiles = 0;
+	plan->items.clear();
+}
+
+int mp3_frame_size(const unsigned char *p, size_t len)
+{
+	static const int bitratesV1[16] = { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 };
+	static const int bitratesV2[16] = { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 };
+	static const int sampleRates[3] = { 44100, 48000, 32000 };
+
+	if (len < 4 || p[0] != 0xFF || (p[1] & 0xE0) != 0xE0) return 0; // no frame sync
+	int iVersion = (p[1] >> 3) & 3; // 3: MPEG-1, 2: MPEG-2, 0: MPEG-2.5
+	int iLayer = (p[1] >> 1) & 3; // 1: Layer III
+	int iBitrate = p[2] >> 4;
+	int iSampleRate = (p[2] >> 2) & 3;
+	int iPadding = (p[2] >> 1) & 1;
+	if (iVersion == 1 || iLayer != 1 || iSampleRate == 3) return 0;
+
+	if (iVersion == 3) {
+		if (bitratesV1[iBitrate] == 0) return 0;
+		return 144 * bitratesV1[iBitrate] * 1000 / sampleRates[iSampleRate] + iPadding;
+	}
+	if (bitratesV2[iBitrate] == 0) return 0;
+	int iRate = sampleRates[iSampleRate] >> (iVersion == 2 ? 1 : 2);
+	return 72 * bitratesV2[iBitrate] * 1000 / iRate + iPadding;
+}
+
+/* Encodes a segment of file into frames, which receives exactly the frames [uFirstFrame, uEndFrame) of the
+ * sequential encode (including everything up to the end of the stream for the last segment).
+ */
+static int encode_segment(const SEG_ITEM *item, const SEG_FILE *file, WORKER_ARENA *arena,
+	const INPUT_CFG *cfg, vector<unsigned char> &frames, FILE_TIMING *timing)
+{
+	TRACE_SCOPE_DETAIL("encode segment", file->sIn.c_str());
+	JOB_RESOURCES job;
+	unsigned int iDataSize = 0;
+	job.bInputOpen = EXIT_SUCCESS == open_wave(file->sIn.c_str(), cfg, &job.in, job.hdr, iDataSize);
+	double t = report_stage(timing, STAGE_PARSE, timing->dStart);
+	if (!job.bInputOpen) {
+		cerr << "Unable to open segment " << item->iSegment << " of " << file->sIn << endl;
+		return EXIT_FAILURE;
+	}
+	const FMT_DATA *hdr = job.hdr;
+	PCM_CONVERTER conv;
+	if (EXIT_SUCCESS != pcm_get_converter(hdr, PCM_ISA_AUTO, &conv))
+		return EXIT_FAILURE;
+	job.gfp = create_encoder(hdr, iDataSize, true, NULL);
+	if (job.gfp == NULL || lame_get_framesize(job.gfp) != SEG_FRAME_SAMPLES) {
+		cerr << "Invalid encoding parameters for segmented encoding of " << file->sIn << endl;
+		return EXIT_FAILURE;
+	}
+
+	// read from the start of the priming region up to the end of the post-roll region
+	const bool bLast = item->iSegment == file->iSegments - 1;
+	const unsigned long long llSamples = iDataSize / hdr->wBlockAlign;
+	const unsigned int uStartFrame = item->uFirstFrame > SEG_PRIMING_FRAMES ?
+		item->uFirstFrame - SEG_PRIMING_FRAMES : 0;
+	const unsigned long long llStart = (unsigned long long)uStartFrame * SEG_FRAME_SAMPLES;
+	unsigned long long llEnd = (unsigned long long)(item->uEndFrame + SEG_POSTROLL_FRAMES) * SEG_FRAME_SAMPLES;
+	if (bLast || llEnd > llSamples) llEnd = llSamples;
+	t = report_stage(timing, STAGE_ENCODE, t);
+	input_seek(&job.in, job.in.llPos + llStart * hdr->wBlockAlign);
+	unsigned int iBytesLeft = (unsigned int)((llEnd - llStart) * hdr->wBlockAlign);
+
+	const int mp3BufferSize = PCM_BLOCK_SAMPLES * 5 / 4 + 7200; // worst case estimate for one block
+	unsigned char *pRaw = arena_reserve(&arena->raw, PCM_BLOCK_SAMPLES * conv.iBytesPerFrame);
+	unsigned char *pLeft = arena_reserve(&arena->left, PCM_BLOCK_SAMPLES * conv.iOutBytesPerSample);
+	unsigned char *pRight = conv.iChannels == 2 ?
+		arena_reserve(&arena->right, PCM_BLOCK_SAMPLES * conv.iOutBytesPerSample) : NULL;
+	unsigned char *mp3Buffer = arena_reserve(&arena->mp3, mp3BufferSize);
+	vector<unsigned char> encoded;
+
+	int numSamples;
+	while ((numSamples = read_pcm_block(&job.in, hdr, pRaw, PCM_BLOCK_SAMPLES, iBytesLeft)) > 0) {
+		t = report_stage(timing, STAGE_READ, t);
+		int mp3size;
+		{
+			TRACE_SCOPE("encode block");
+			mp3size = encode_pcm_block(job.gfp, &conv, pRaw, pLeft, pRight, numSamples, mp3Buffer, mp3BufferSize);
+		}
+		t = report_stage(timing, STAGE_ENCODE, t);
+		if (mp3size < 0) {
+			cerr << "Encoding error in lame_encode_buffer. Return code: " << mp3size << endl;
+			numSamples = -1;
+			break;
+		}
+		encoded.insert(encoded.end(), mp3Buffer, mp3Buffer + mp3size);
+	}
+	if (numSamples == 0) {
+		t = report_stage(timing, STAGE_READ, t); // end of data
+		int flushSize = lame_encode_flush(job.gfp, mp3Buffer, mp3BufferSize);
+		if (flushSize > 0) encoded.insert(encoded.end(), mp3Buffer, mp3Buffer + flushSize);
+		report_stage(timing, STAGE_ENCODE, t);
+	}
+	if (numSamples != 0) return EXIT_FAILURE;
+
+	// locate the frames of this segment, the encoder's first frame corresponds to frame uStartFrame
+	size_t pos = 0;
+	while (pos < encoded.size() && 0 == mp3_frame_size(&encoded[pos], encoded.size() - pos))
+		pos++; // skip leading tags
+	size_t keepBegin = item->uFirstFrame == 0 ? 0 : pos, keepEnd = pos;
+	unsigned int uFrame = uStartFrame;
+	while (uFrame < item->uEndFrame || bLast) {
+		int iFrameSize = mp3_frame_size(encoded.data() + pos, encoded.size() - pos);
+		if (iFrameSize == 0 || pos + iFrameSize > encoded.size()) break;
+		pos += iFrameSize;
+		uFrame++;
+		if (uFrame == item->uFirstFrame) keepBegin = pos;
+		if (uFrame <= item->uEndFrame) keepEnd = pos;
+	}
+	if (uFrame < item->uEndFrame) {
+		cerr << "Segment " << item->iSegment << " of " << file->sIn << " is incomplete." << endl;
+		return EXIT_FAILURE;
+	}
+	if (bLast) keepEnd = encoded.size(); // keep trailing frames and tags
+	frames.assign(encoded.begin() + keepBegin, encoded.begin() + keepEnd);
+	return EXIT_SUCCESS;
+}
+
+/* Hands the frames of a finished segment to its file and appends all segments which are now complete in
+ * order. Whichever thread finishes the last segment closes the file.
+ */
+static void commit_segment(ENC_WRK_ARGS *args, SEG_FILE *file, int iSegment, vector<unsigned char> &frames,
+	bool bOk, const OUTPUT_CFG *outCfg, const FILE_TIMING *timing)
+{
+	TRACE_SCOPE("commit segment");
+	{
+		TRACE_SCOPE("lock segment file");
+		pthread_mutex_lock(&file->mutex);
+	}
+	double t = report_now();
+	if (bOk)
+		file->segFrames[iSegment].swap(frames);
+	else
+		file->bFailed = true;
+	for (int s = 0; s < STAGE_COUNT; s++) file->timing.dStage[s] += timing->dStage[s];
+	if (file->timing.dStart == 0.0 || timing->dStart < file->timing.dStart) file->timing.dStart = timing->dStart;
+	file->bSegDone[iSegment] = true;
+	file->iSegmentsDone++;
+
+	while (file->iNextToWrite < file->iSegments && file->bSegDone[file->iNextToWrite]) {
+		vector<unsigned char> &seg = file->segFrames[file->iNextToWrite];
+		if (!file->bFailed && !seg.empty()) {
+			if (!file->bOutOpen) {
+				// the file outlives this job, so it can't use the thread's write buffers or ring
+				OUTPUT_CFG fileCfg = *outCfg;
+				fileCfg.pBuffers = NULL;
+				fileCfg.pRing = NULL;
+				file->bOutOpen = EXIT_SUCCESS == output_open(&file->out, file->sOut.c_str(), &fileCfg,
+					file->llExpectedSize);
+			}
+			if (!file->bOutOpen || EXIT_SUCCESS != output_write(&file->out, &seg[0], seg.size())) {
+				cerr << "Unable to write output file " << file->sOut << endl;
+				file->bFailed = true;
+			} else {
+				file->llBytesWritten += seg.size();
+			}
+		}
+		vector<unsigned char>().swap(seg); // release the buffer right away
+		file->iNextToWrite++;
+	}
+
+	const bool bFinished = file->iSegmentsDone == file->iSegments;
+	if (bFinished && file->bOutOpen) {
+		if (EXIT_SUCCESS != output_close(&file->out) && !file->bFailed) {
+			cerr << "Unable to write output file " << file->sOut << endl;
+			file->bFailed = true;
+		}
+		file->bOutOpen = false;
+	}
+	report_stage(&file->timing, STAGE_WRITE, t);
+	const bool bFailed = file->bFailed;
+	pthread_mutex_unlock(&file->mutex);
+
+	if (bFinished) {
+		if (bFailed) {
+			cerr << "Unable to encode mp3: " << file->sOut.c_str() << endl;
+			metrics_count(METRIC_JOBS_FAILED);
+		} else {
+#ifdef __VERBOSE_
+			cout << "Wrote " << file->llBytesWritten << " bytes in " << file->iSegments << " segments." << endl;
+#endif
+			printf("[:%i][ok] .... %s\n", args->iThreadId, file->sIn.c_str());
+			++args->iProcessedFiles;
+			file->timing.llOutBytes = file->llBytesWritten;
+			file->timing.llOutHash = output_checksum(&file->out);
+			report_add_file(&args->report, &file->timing, file->iDataSize, file->dAudioSeconds);
+			manifest_record(args->pManifest, file->sIn.c_str(), &file->input, file->timing.llOutBytes,
+				file->timing.llOutHash);
+			metrics_job_done(file->timing.dLatency);
+		}
+	}
+}
+
+int process_work_item(ENC_WRK_ARGS *args, int iItemIdx, WORKER_ARENA *arena, const INPUT_CFG *cfg,
+	const OUTPUT_CFG *outCfg)
+{
+	const double tStart = report_now();
+	const SEG_ITEM *item = &args->pSegPlan->items[iItemIdx];
+	if (item->iSegFile < 0) return item->iFileIdx;
+
+	SEG_FILE *file = &args->pSegPlan->pFiles[item->iSegFile];
+	pthread_mutex_lock(&file->mutex);
+	bool bFailed = file->bFailed;
+	bool bFirst = !file->bStarted;
+	file->bStarted = true;
+	if (bFirst && args->pManifest != NULL) manifest_stat(file->sIn.c_str(), &file->input);
+	pthread_mutex_unlock(&file->mutex);
+	if (bFirst) metrics_count(METRIC_JOBS_STARTED);
+
+#ifdef __VERBOSE_
+	printf("Encoding segment %i of %s ...\n", item->iSegment, file->sIn.c_str());
+#endif
+	// don't bother encoding the rest of a file which can't be completed anyway
+	vector<unsigned char> frames;
+	FILE_TIMING timing;
+	report_init_file(&timing, tStart);
+	bool bOk = !bFailed && EXIT_SUCCESS == encode_segment(item, file, arena, cfg, frames, &timing);
+	commit_segment(args, file, item->iSegment, frames, bOk, outCfg, &timing);
+	return -1;
+}
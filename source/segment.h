@@ -0,0 +1,106 @@
+#ifndef __SEGMENT_H_
+#define __SEGMENT_H_
+
+#include "lame_interface.h"
+#include "scheduler.h"
+
+/////////////////////
+// segment-parallel encoding of long files
+/////////////////////
+
+/*
+ * A long 'data' chunk is split into segments which start and end on MP3 frame boundaries. Each segment is
+ * encoded by its own LAME instance with the bit reservoir disabled, so every frame is self-contained and frames
+ * of different encoders can be concatenated. An encoder starts SEG_PRIMING_FRAMES frames before its segment and
+ * keeps reading SEG_POSTROLL_FRAMES frames beyond it, so the MDCT overlap and the psychoacoustic model are in the
+ * same state as in a sequential encode at both edges. Since every encoder starts on a frame boundary, its n-th
+ * output frame corresponds to the same input as frame (start / frame size + n) of a sequential encode; the frames
+ * outside the segment are dropped and the remaining ones are appended to the output file in segment order,
+ * which results in a single gapless stream.
+ */
+
+#define SEG_DEFAULT_SECONDS 60 // segment length if -c is given without a value
+#define SEG_FRAME_SAMPLES 1152 // samples per frame for MPEG-1 Layer III (32, 44.1 and 48 kHz)
+#define SEG_PRIMING_FRAMES 4 // frames encoded and dropped before each segment
+#define SEG_POSTROLL_FRAMES 2 // frames read beyond the end of each segment
+
+/* Shared state of a file which is encoded in several segments. Finished segments are buffered here until all
+ * preceding segments have been written.
+ */
+typedef struct {
+	string sIn, sOut;
+	int iSegments;
+	pthread_mutex_t mutex; // protects all following members
+	vector< vector<unsigned char> > segFrames; // stitched frames of finished but not yet written segments
+	vector<bool> bSegDone;
+	int iNextToWrite; // next segment to append to the output file
+	int iSegmentsDone;
+	MP3_OUTPUT out; // opened by whichever thread writes the first segment, with buffers of its own
+	bool bOutOpen;
+	unsigned long long llExpectedSize; // for preallocating the output file
+	bool bFailed;
+	unsigned long long llBytesWritten;
+	bool bStarted; // a segment has been claimed
+	MANIFEST_ENTRY input; // taken when the first segment was claimed in incremental mode (manifest_stat)
+	FILE_TIMING timing; // stage times of all segments, started when the first segment was claimed
+	unsigned int iDataSize; // size of the 'data' chunk
+	double dAudioSeconds;
+} SEG_FILE;
+
+/* A single unit of work handed out by the claim cursor in segmented mode. */
+struct SEG_ITEM {
+	int iFileIdx; // index into ENC_WRK_ARGS::pFilenames
+	int iSegFile; // index into SEG_PLAN::pFiles, -1 if the file is encoded as a whole
+	int iSegment;
+	unsigned int uFirstFrame, uEndFrame; // output frames [uFirstFrame, uEndFrame) belong to this segment
+};
+
+/* Work items for a job list, in the order given by the scheduler. */
+struct SEG_PLAN {
+	vector<SEG_ITEM> items;
+	SEG_FILE *pFiles; // files split into segments
+	int iNumSegFiles;
+};
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* plan_segments
+ *  Builds the work items for the (scheduled) job list files with its probe results, writing to the MP3 files given
+ *  by outCfg (see output_file_name). Files longer than
+ *  dSegmentSeconds are split into segments of about that length, all other files and files with a sample rate
+ *  that isn't encoded as MPEG-1 become a single item. Release the plan with free_segment_plan.
+ *
+ *  Return value:
+ *    number of files which have been split
+ */
+int plan_segments(const vector<string> &files, const vector<JOB_PROBE> &probes, double dSegmentSeconds,
+	const OUTPUT_CFG *outCfg, SEG_PLAN *plan);
+
+/* free_segment_plan
+ *  Releases all resources of a plan created by plan_segments.
+ */
+void free_segment_plan(SEG_PLAN *plan);
+
+/* mp3_frame_size
+ *  Parses the MPEG audio frame header at p.
+ *
+ *  Return value:
+ *    length of the frame in bytes, 0 if p doesn't point to a valid Layer III header
+ */
+int mp3_frame_size(const unsigned char *p, size_t len);
+
+/* process_work_item
+ *  Handles the work item iItemIdx of args->pSegPlan. Segments are encoded with the buffers of arena, reading
+ *  the input as configured by cfg, and committed to their output file (written as configured by outCfg) right
+ *  away; the thread writing the last segment of a file closes it and counts it as processed.
+ *
+ *  Return value:
+ *    index of the file in args->pFilenames if the item is a whole file which still has to be encoded by the
+ *    caller, -1 if the item has been handled
+ */
+int process_work_item(ENC_WRK_ARGS *args, int iItemIdx, WORKER_ARENA *arena, const INPUT_CFG *cfg,
+	const OUTPUT_CFG *outCfg);
+
+#endif // __SEGMENT_H_
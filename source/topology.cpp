@@ -0,0 +1,254 @@
+#include "topology.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#include <pthread.h>
+#endif
+
+static const char *pinNames[] = { "none", "cpu", "core" };
+
+int pin_mode_from_name(const char *name, PIN_MODE &pin)
+{
+	for (int i = 0; i < (int)(sizeof(pinNames) / sizeof(pinNames[0])); i++) {
+		if (0 == strcmp(name, pinNames[i])) {
+			pin = (PIN_MODE)i;
+			return EXIT_SUCCESS;
+		}
+	}
+	return EXIT_FAILURE;
+}
+
+const char *pin_mode_name(PIN_MODE pin)
+{
+	return pinNames[pin];
+}
+
+/* every CPU on its own core and node, used where the topology can't be read */
+static void fallback_topology(CPU_TOPOLOGY *topo, int iCpus)
+{
+	topo->cpus.clear();
+	topo->nodes.clear();
+	for (int i = 0; i < iCpus; i++) {
+		topo->cpus.push_back(i);
+		topo->nodes.push_back(0);
+	}
+	topo->iCores = iCpus;
+	topo->iNodes = 1;
+}
+
+#ifdef __linux__
+
+/* reads the first line of pcPath into buf, false if there is none */
+static bool read_line(const char *pcPath, char *buf, size_t uSize)
+{
+	FILE *f = fopen(pcPath, "r");
+	if (f == NULL) return false;
+	bool bRead = NULL != fgets(buf, (int)uSize, f);
+	fclose(f);
+	return bRead;
+}
+
+static int read_cpu_value(int iCpu, const char *pcName, int iDefault)
+{
+	char path[128], buf[32];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", iCpu, pcName);
+	return read_line(path, buf, sizeof(buf)) ? atoi(buf) : iDefault;
+}
+
+/* the node a CPU belongs to is given by a nodeN entry in its sysfs directory */
+static int read_cpu_node(int iCpu)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", iCpu);
+	DIR *dir = opendir(path);
+	if (dir == NULL) return 0;
+	int iNode = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (0 == strncmp(entry->d_name, "node", 4) && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+			iNode = atoi(&entry->d_name[4]);
+			break;
+		}
+	}
+	closedir(dir);
+	return iNode;
+}
+
+/* Smallest quota of the cgroup sDir and its ancestors up to sRoot in CPUs, 0 if none. cgroup v2 keeps the quota in
+ * cpu.max ("max 100000" or "200000 100000"), v1 in cpu.cfs_quota_us (-1 for none) and cpu.cfs_period_us.
+ */
+static double read_quota(const string &sRoot, string sDir, bool bV2)
+{
+	double dQuota = 0.0;
+	while (true) {
+		char buf[64];
+		double dDirQuota = 0.0;
+		if (bV2) {
+			long long llQuota, llPeriod;
+			if (read_line((sDir + "/cpu.max").c_str(), buf, sizeof(buf)) &&
+				2 == sscanf(buf, "%lld %lld", &llQuota, &llPeriod) && llQuota > 0 && llPeriod > 0)
+				dDirQuota = (double)llQuota / llPeriod;
+		} else {
+			long long llQuota = -1, llPeriod = 0;
+			if (read_line((sDir + "/cpu.cfs_quota_us").c_str(), buf, sizeof(buf))) llQuota = atoll(buf);
+			if (read_line((sDir + "/cpu.cfs_period_us").c_str(), buf, sizeof(buf))) llPeriod = atoll(buf);
+			if (llQuota > 0 && llPeriod > 0) dDirQuota = (double)llQuota / llPeriod;
+		}
+		if (dDirQuota > 0.0 && (dQuota == 0.0 || dDirQuota < dQuota)) dQuota = dDirQuota;
+		if (sDir.length() <= sRoot.length()) break;
+		sDir = sDir.substr(0, sDir.rfind('/'));
+	}
+	return dQuota;
+}
+
+/* quota of the process's cgroup (see /proc/self/cgroup), preferring the unified (v2) hierarchy */
+static double read_cgroup_quota()
+{
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (f == NULL) return 0.0;
+	double dQuota = 0.0;
+	char line[1024];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		// hierarchy-ID:controller-list:path
+		char *pcControllers = strchr(line, ':');
+		char *pcPath = pcControllers != NULL ? strchr(pcControllers + 1, ':') : NULL;
+		if (pcPath == NULL) continue;
+		*pcPath++ = '\0';
+		pcControllers++;
+		string sPath = 0 == strcmp(pcPath, "/") ? "" : pcPath;
+		double dFound = 0.0;
+		if (*pcControllers == '\0') {
+			dFound = read_quota("/sys/fs/cgroup", "/sys/fs/cgroup" + sPath, true);
+		} else {
+			string sControllers = string(",") + pcControllers + ",";
+			if (string::npos == sControllers.find(",cpu,")) continue;
+			string sRoot = string("/sys/fs/cgroup/") + pcControllers;
+			DIR *dir = opendir(sRoot.c_str());
+			if (dir == NULL)
+				sRoot = "/sys/fs/cgroup/cpu";
+			else
+				closedir(dir);
+			dFound = read_quota(sRoot, sRoot + sPath, false);
+		}
+		if (dFound > 0.0 && (dQuota == 0.0 || dFound < dQuota)) dQuota = dFound;
+	}
+	fclose(f);
+	return dQuota;
+}
+
+int topology_detect(CPU_TOPOLOGY *topo)
+{
+	topo->dQuota = read_cgroup_quota();
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (0 != sched_getaffinity(0, sizeof(allowed), &allowed) || CPU_COUNT(&allowed) == 0) {
+		unsigned int uCpus = std::thread::hardware_concurrency();
+		fallback_topology(topo, uCpus > 0 ? (int)uCpus : TOPOLOGY_FALLBACK_THREADS);
+		return EXIT_FAILURE;
+	}
+
+	// group the allowed CPUs by physical core, keeping the cores in CPU order
+	typedef struct {
+		int iPackage, iCore, iNode;
+		vector<int> threads;
+	} CORE;
+	vector<CORE> cores;
+	vector<int> nodeIds;
+	for (int iCpu = 0; iCpu < CPU_SETSIZE; iCpu++) {
+		if (!CPU_ISSET(iCpu, &allowed)) continue;
+		int iPackage = read_cpu_value(iCpu, "physical_package_id", -1);
+		int iCore = read_cpu_value(iCpu, "core_id", -1);
+		size_t c = 0;
+		while (c < cores.size() && !(iPackage >= 0 && iCore >= 0 && cores[c].iPackage == iPackage &&
+			cores[c].iCore == iCore))
+			c++;
+		if (c == cores.size()) {
+			CORE core;
+			core.iPackage = iPackage;
+			core.iCore = iCore;
+			core.iNode = read_cpu_node(iCpu);
+			cores.push_back(core);
+			bool bKnown = false;
+			for (size_t n = 0; n < nodeIds.size(); n++) bKnown |= nodeIds[n] == core.iNode;
+			if (!bKnown) nodeIds.push_back(core.iNode);
+		}
+		cores[c].threads.push_back(iCpu);
+	}
+
+	// first threads of all cores, then second threads etc., alternating between the nodes within each round
+	topo->cpus.clear();
+	topo->nodes.clear();
+	for (size_t uRound = 0; topo->cpus.size() < (size_t)CPU_COUNT(&allowed); uRound++) {
+		vector<vector<size_t> > perNode(nodeIds.size());
+		for (size_t c = 0; c < cores.size(); c++) {
+			if (uRound >= cores[c].threads.size()) continue;
+			for (size_t n = 0; n < nodeIds.size(); n++)
+				if (nodeIds[n] == cores[c].iNode) perNode[n].push_back(c);
+		}
+		for (size_t i = 0, uAdded = 1; uAdded > 0; i++) {
+			uAdded = 0;
+			for (size_t n = 0; n < perNode.size(); n++) {
+				if (i >= perNode[n].size()) continue;
+				topo->cpus.push_back(cores[perNode[n][i]].threads[uRound]);
+				topo->nodes.push_back(cores[perNode[n][i]].iNode);
+				uAdded++;
+			}
+		}
+	}
+	topo->iCores = (int)cores.size();
+	topo->iNodes = (int)nodeIds.size();
+	return EXIT_SUCCESS;
+}
+
+int topology_bind_thread(int iCpu, int iNode)
+{
+	arena_set_thread_node(iNode);
+	if (iCpu < 0) return EXIT_SUCCESS;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(iCpu, &set);
+	return 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#else // __linux__
+
+int topology_detect(CPU_TOPOLOGY *topo)
+{
+	topo->dQuota = 0.0;
+	unsigned int uCpus = std::thread::hardware_concurrency();
+	fallback_topology(topo, uCpus > 0 ? (int)uCpus : TOPOLOGY_FALLBACK_THREADS);
+	return uCpus > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int topology_bind_thread(int iCpu, int iNode)
+{
+	return iCpu < 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif // __linux__
+
+int topology_default_threads(const CPU_TOPOLOGY *topo, PIN_MODE pin)
+{
+	int iThreads = pin == PIN_CORES ? topo->iCores : (int)topo->cpus.size();
+	if (topo->dQuota > 0.0 && (int)ceil(topo->dQuota) < iThreads) iThreads = (int)ceil(topo->dQuota);
+	return iThreads > 0 ? iThreads : 1;
+}
+
+int topology_placement(const CPU_TOPOLOGY *topo, PIN_MODE pin, int iThread, int &iNode)
+{
+	iNode = -1;
+	int iCount = pin == PIN_CORES ? topo->iCores : (int)topo->cpus.size();
+	if (pin == PIN_NONE || iCount <= 0) return -1;
+	int idx = iThread % iCount;
+	if (topo->iNodes > 1) iNode = topo->nodes[idx];
+	return topo->cpus[idx];
+}
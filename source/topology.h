@@ -0,0 +1,91 @@
+#ifndef __TOPOLOGY_H_
+#define __TOPOLOGY_H_
+
+#include <vector>
+
+using namespace std;
+
+/////////////////////
+// CPU topology, CPU quota and worker placement
+/////////////////////
+
+/*
+ * The default number of workers follows the CPUs the process may actually use rather than the machine: the
+ * affinity mask (which includes a container's cpuset) limits the CPUs, and a cgroup CPU quota (cpu.max of cgroup
+ * v2, or the CFS quota of cgroup v1) limits how much of them the process gets, so a pod limited to 2 CPUs on a
+ * 64-core host runs 2 workers instead of 64 throttled ones.
+ *
+ * Workers can optionally be pinned:
+ *   PIN_NONE   the kernel places the workers (default)
+ *   PIN_CPUS   one logical CPU per worker; all physical cores get a worker before the SMT siblings do
+ *   PIN_CORES  one physical core per worker, SMT siblings stay idle (which also caps the default thread count)
+ * Consecutive workers alternate between NUMA nodes. A pinned worker on a machine with several nodes allocates its
+ * PCM and MP3 buffers on its own node (arena_set_thread_node), so no buffer is accessed across sockets. Linux only,
+ * elsewhere the machine's CPU count is used and pinning is not available.
+ */
+
+#define TOPOLOGY_FALLBACK_THREADS 4 // if the CPUs can't be determined
+
+typedef enum {
+	PIN_NONE = 0,
+	PIN_CPUS,
+	PIN_CORES
+} PIN_MODE;
+
+/* CPUs available to the process. */
+typedef struct {
+	vector<int> cpus; // allowed logical CPUs in placement order: one per physical core first, then the siblings
+	vector<int> nodes; // NUMA node of each entry of cpus
+	int iCores; // physical cores, i.e. the first iCores entries of cpus are on distinct cores
+	int iNodes; // NUMA nodes with allowed CPUs
+	double dQuota; // CPUs granted by the cgroup CPU quota, 0 if there is none
+} CPU_TOPOLOGY;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* topology_detect
+ *  Determines the CPUs the process may run on, their cores and nodes, and the cgroup CPU quota.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE if the CPUs can't be determined (topo then describes TOPOLOGY_FALLBACK_THREADS
+ *    CPUs without placement information)
+ */
+int topology_detect(CPU_TOPOLOGY *topo);
+
+/* topology_default_threads
+ *  Returns the number of workers which keeps the CPUs available for pin mode busy without oversubscribing them:
+ *  the allowed CPUs (physical cores with PIN_CORES), capped by the CPU quota rounded up.
+ */
+int topology_default_threads(const CPU_TOPOLOGY *topo, PIN_MODE pin);
+
+/* topology_placement
+ *  Returns the CPU worker iThread is pinned to in pin mode (-1 for PIN_NONE) and stores the NUMA node its
+ *  buffers should be placed on in iNode (-1 unless the machine has several nodes).
+ */
+int topology_placement(const CPU_TOPOLOGY *topo, PIN_MODE pin, int iThread, int &iNode);
+
+/* topology_bind_thread
+ *  Pins the calling thread to iCpu (unless it is -1) and places its buffers on iNode (see topology_placement).
+ *  Must be called before the thread allocates its buffers.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE if the thread couldn't be pinned
+ */
+int topology_bind_thread(int iCpu, int iNode);
+
+/* pin_mode_from_name
+ *  Parses a pin mode as given on the command line: "none", "cpu" or "core".
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE for unknown modes
+ */
+int pin_mode_from_name(const char *name, PIN_MODE &pin);
+
+/* pin_mode_name
+ *  Returns the printable name of a pin mode.
+ */
+const char *pin_mode_name(PIN_MODE pin);
+
+#endif // __TOPOLOGY_H_
@@ -0,0 +1,172 @@
+#include "trace.h"
+
+#ifdef __TRACE_
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define HAVE_TSC
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#define TRACE_THREAD_LOCAL __thread
+#else
+#define TRACE_THREAD_LOCAL __thread
+#endif
+
+typedef struct {
+	unsigned long long llBegin, llEnd; // ticks
+	const char *name; // string literal
+	char detail[TRACE_DETAIL_LEN];
+} TRACE_EVENT;
+
+/* Spans of a single thread. Only the owning thread writes, trace_write reads after all threads are done. */
+struct TRACE_RING {
+	TRACE_EVENT events[TRACE_RING_EVENTS];
+	unsigned long long llCount; // spans recorded so far (the ring holds the last TRACE_RING_EVENTS)
+	char threadName[32];
+	int iTid;
+	TRACE_RING *pNext; // registry of all rings
+};
+
+static std::atomic<bool> bTracing(false);
+static std::atomic<TRACE_RING*> pRings(NULL);
+static std::atomic<int> iNextTid(1);
+static unsigned long long llTicks0; // trace_start
+static double dSeconds0;
+static TRACE_THREAD_LOCAL TRACE_RING *pMyRing = NULL;
+
+static inline unsigned long long trace_ticks()
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static double trace_seconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* returns the ring of the calling thread, registering a new one on first use */
+static TRACE_RING *trace_ring()
+{
+	if (pMyRing != NULL) return pMyRing;
+	TRACE_RING *ring = (TRACE_RING*)calloc(1, sizeof(TRACE_RING));
+	if (ring == NULL) return NULL;
+	ring->iTid = iNextTid.fetch_add(1);
+	snprintf(ring->threadName, sizeof(ring->threadName), "thread %i", ring->iTid);
+	ring->pNext = pRings.load();
+	while (!pRings.compare_exchange_weak(ring->pNext, ring)) {}
+	pMyRing = ring;
+	return ring;
+}
+
+TRACE_SPAN::TRACE_SPAN(const char *name, const char *detail) : name(name), detail(detail), llBegin(0)
+{
+	if (bTracing.load(std::memory_order_relaxed)) llBegin = trace_ticks();
+}
+
+TRACE_SPAN::~TRACE_SPAN()
+{
+	if (llBegin == 0) return;
+	unsigned long long llEnd = trace_ticks();
+	TRACE_RING *ring = trace_ring();
+	if (ring == NULL) return;
+	TRACE_EVENT *ev = &ring->events[ring->llCount & (TRACE_RING_EVENTS - 1)];
+	ev->llBegin = llBegin;
+	ev->llEnd = llEnd;
+	ev->name = name;
+	ev->detail[0] = '\0';
+	if (detail != NULL) {
+		// keep the end of long paths, which is the interesting part
+		size_t len = strlen(detail);
+		const char *p = len >= TRACE_DETAIL_LEN ? detail + len - (TRACE_DETAIL_LEN - 1) : detail;
+		strncpy(ev->detail, p, TRACE_DETAIL_LEN - 1);
+		ev->detail[TRACE_DETAIL_LEN - 1] = '\0';
+	}
+	ring->llCount++;
+}
+
+void trace_start()
+{
+	dSeconds0 = trace_seconds();
+	llTicks0 = trace_ticks();
+	bTracing = true;
+}
+
+void trace_set_thread_name(const char *name, int id)
+{
+	TRACE_RING *ring = trace_ring();
+	if (ring != NULL) snprintf(ring->threadName, sizeof(ring->threadName), "%s %i", name, id);
+}
+
+/* writes s as a JSON string */
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+int trace_write(const char *filename)
+{
+	bTracing = false;
+	FILE *f = fopen(filename, "w");
+	if (f == NULL) return EXIT_FAILURE;
+
+	// calibrate the tick rate against the steady clock over the whole run
+	double dTicksPerUs = (trace_ticks() - llTicks0) / ((trace_seconds() - dSeconds0) * 1e6);
+	if (!(dTicksPerUs > 0)) dTicksPerUs = 1.0;
+
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	bool bFirst = true;
+	unsigned long long llDropped = 0;
+	for (TRACE_RING *ring = pRings.load(); ring != NULL; ring = ring->pNext) {
+		fprintf(f, "%s{\"ph\": \"M\", \"pid\": 1, \"tid\": %i, \"name\": \"thread_name\", \"args\": {\"name\": ",
+			bFirst ? "" : ",\n", ring->iTid);
+		json_string(f, ring->threadName);
+		fprintf(f, "}}");
+		bFirst = false;
+
+		unsigned long long llFirst = ring->llCount > TRACE_RING_EVENTS ? ring->llCount - TRACE_RING_EVENTS : 0;
+		llDropped += llFirst;
+		for (unsigned long long i = llFirst; i < ring->llCount; i++) {
+			const TRACE_EVENT *ev = &ring->events[i & (TRACE_RING_EVENTS - 1)];
+			double dTs = ((long long)(ev->llBegin - llTicks0)) / dTicksPerUs;
+			double dDur = (ev->llEnd - ev->llBegin) / dTicksPerUs;
+			fprintf(f, ",\n{\"ph\": \"X\", \"pid\": 1, \"tid\": %i, \"ts\": %.3f, \"dur\": %.3f, \"name\": ",
+				ring->iTid, dTs, dDur);
+			json_string(f, ev->name);
+			if (ev->detail[0] != '\0') {
+				fprintf(f, ", \"args\": {\"detail\": ");
+				json_string(f, ev->detail);
+				fprintf(f, "}");
+			}
+			fprintf(f, "}");
+		}
+	}
+	fprintf(f, "\n]}\n");
+	if (llDropped > 0) printf("Trace: %llu oldest spans have been overwritten.\n", llDropped);
+
+	bool bOk = !ferror(f);
+	bOk = 0 == fclose(f) && bOk;
+	return bOk ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif // __TRACE_
@@ -0,0 +1,75 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+/////////////////////
+// timeline tracing (Chrome trace-event format)
+/////////////////////
+
+/*
+ * Tracepoints are scoped spans: TRACE_SCOPE("name") records the time from its declaration to the end of the
+ * enclosing block. Every thread records its spans into a ring buffer of its own, so recording takes no locks and
+ * shares no cache lines with other threads; if a ring is full, the oldest spans are overwritten. Timestamps are
+ * raw TSC values (steady clock on other architectures), which are converted to microseconds when the trace is
+ * written. Open the written file in chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Tracing is only compiled in with __TRACE_ defined (make trace). Without it, all TRACE_* macros expand to
+ * nothing and the functions below are not even declared, so a regular build contains no tracing code at all.
+ */
+
+#ifdef __TRACE_
+
+#define TRACE_RING_EVENTS (1 << 15) // spans kept per thread (power of two)
+#define TRACE_DETAIL_LEN 40 // characters of a span's detail string (e.g. a file name)
+
+/* Records a span from construction to destruction, if tracing has been started. */
+struct TRACE_SPAN {
+	const char *name;
+	const char *detail;
+	unsigned long long llBegin;
+
+	TRACE_SPAN(const char *name, const char *detail = 0);
+	~TRACE_SPAN();
+
+private:
+	TRACE_SPAN(const TRACE_SPAN&); // not copyable
+	TRACE_SPAN &operator=(const TRACE_SPAN&);
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TRACE_SPAN TRACE_CONCAT(traceSpan, __LINE__)(name)
+#define TRACE_SCOPE_DETAIL(name, detail) TRACE_SPAN TRACE_CONCAT(traceSpan, __LINE__)(name, detail)
+#define TRACE_THREAD_NAME(name, id) trace_set_thread_name(name, id)
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* trace_start
+ *  Enables recording. Call once before any thread to be traced is started.
+ */
+void trace_start();
+
+/* trace_set_thread_name
+ *  Names the calling thread "name id" in the trace.
+ */
+void trace_set_thread_name(const char *name, int id);
+
+/* trace_write
+ *  Writes all recorded spans of all threads as a Chrome trace-event JSON file. Call after all traced threads
+ *  have finished.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int trace_write(const char *filename);
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_DETAIL(name, detail)
+#define TRACE_THREAD_NAME(name, id)
+
+#endif // __TRACE_
+
+#endif // __TRACE_H_
@@ -0,0 +1,91 @@
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+int uring_setup(URING *ring, unsigned int uEntries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(URING));
+	ring->ringFd = (int)syscall(__NR_io_uring_setup, uEntries, &p);
+	if (ring->ringFd < 0) return EXIT_FAILURE;
+
+	ring->sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqLen > ring->sqLen) ring->sqLen = ring->cqLen;
+		ring->cqLen = ring->sqLen;
+	}
+	ring->sqPtr = mmap(NULL, ring->sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd,
+		IORING_OFF_SQ_RING);
+	if (ring->sqPtr == MAP_FAILED) { uring_teardown(ring); return EXIT_FAILURE; }
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cqPtr = ring->sqPtr;
+	else
+		ring->cqPtr = mmap(NULL, ring->cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd,
+			IORING_OFF_CQ_RING);
+	ring->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->ringFd, IORING_OFF_SQES);
+	if (ring->cqPtr == MAP_FAILED || ring->sqes == MAP_FAILED) { uring_teardown(ring); return EXIT_FAILURE; }
+
+	unsigned char *sq = (unsigned char*)ring->sqPtr, *cq = (unsigned char*)ring->cqPtr;
+	ring->sqHead = (unsigned int*)(sq + p.sq_off.head);
+	ring->sqTail = (unsigned int*)(sq + p.sq_off.tail);
+	ring->sqMask = (unsigned int*)(sq + p.sq_off.ring_mask);
+	ring->sqArray = (unsigned int*)(sq + p.sq_off.array);
+	ring->cqHead = (unsigned int*)(cq + p.cq_off.head);
+	ring->cqTail = (unsigned int*)(cq + p.cq_off.tail);
+	ring->cqMask = (unsigned int*)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return EXIT_SUCCESS;
+}
+
+void uring_teardown(URING *ring)
+{
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqesLen);
+	if (ring->cqPtr != NULL && ring->cqPtr != MAP_FAILED && ring->cqPtr != ring->sqPtr)
+		munmap(ring->cqPtr, ring->cqLen);
+	if (ring->sqPtr != NULL && ring->sqPtr != MAP_FAILED) munmap(ring->sqPtr, ring->sqLen);
+	if (ring->ringFd >= 0) close(ring->ringFd);
+	memset(ring, 0, sizeof(URING));
+	ring->ringFd = -1;
+}
+
+struct io_uring_sqe *uring_next_sqe(URING *ring)
+{
+	struct io_uring_sqe *sqe = &ring->sqes[*ring->sqTail & *ring->sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+void uring_commit_sqe(URING *ring)
+{
+	unsigned int tail = *ring->sqTail;
+	unsigned int idx = tail & *ring->sqMask;
+	ring->sqArray[idx] = idx;
+	__atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+int uring_enter(URING *ring, unsigned int toSubmit, unsigned int minComplete)
+{
+	unsigned int flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+	return (int)syscall(__NR_io_uring_enter, ring->ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+bool uring_pop_cqe(URING *ring, unsigned long long &llUserData, int &iResult)
+{
+	unsigned int head = *ring->cqHead;
+	if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) return false;
+	struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+	llUserData = cqe->user_data;
+	iResult = cqe->res;
+	__atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+#endif // HAVE_IO_URING
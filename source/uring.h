@@ -0,0 +1,78 @@
+#ifndef __URING_H_
+#define __URING_H_
+
+#include <stddef.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING
+#endif
+
+/////////////////////
+// minimal io_uring wrapper based on the raw system calls (no liburing required)
+/////////////////////
+
+#ifdef HAVE_IO_URING
+
+/* Submission and completion rings shared with the kernel. */
+typedef struct {
+	int ringFd;
+	unsigned int *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned int *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqPtr, *cqPtr;
+	size_t sqLen, cqLen, sqesLen;
+} URING;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* uring_setup
+ *  Creates a ring with room for uEntries submissions and maps it.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE if io_uring is not supported by the kernel
+ */
+int uring_setup(URING *ring, unsigned int uEntries);
+
+/* uring_teardown
+ *  Unmaps and closes a ring. Outstanding requests must have completed.
+ */
+void uring_teardown(URING *ring);
+
+/* uring_next_sqe
+ *  Returns the cleared submission queue entry at the tail of the ring. The caller fills it in and makes it visible
+ *  to the kernel with uring_commit_sqe. There must be no more than uEntries submissions in flight.
+ */
+struct io_uring_sqe *uring_next_sqe(URING *ring);
+
+/* uring_commit_sqe
+ *  Publishes the entry returned by uring_next_sqe (does not enter the kernel).
+ */
+void uring_commit_sqe(URING *ring);
+
+/* uring_enter
+ *  Submits toSubmit published entries and waits until at least minComplete requests have completed.
+ *
+ *  Return value:
+ *    number of submitted entries, negative on errors
+ */
+int uring_enter(URING *ring, unsigned int toSubmit, unsigned int minComplete);
+
+/* uring_pop_cqe
+ *  Removes the oldest completion from the ring.
+ *
+ *  Return value:
+ *    true if a completion was available (llUserData and iResult are set), false otherwise
+ */
+bool uring_pop_cqe(URING *ring, unsigned long long &llUserData, int &iResult);
+
+#endif // HAVE_IO_URING
+
+#endif // __URING_H_
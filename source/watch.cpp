@@ -0,0 +1,338 @@
+#include "watch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <map>
+#include <sys/stat.h>
+#include "dirent.h"
+#include "trace.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+#define WATCH_FILE_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+struct DIR_WATCH {
+	string sRoot;
+	string sOutDir; // empty: no output tree
+	bool bRecursive;
+	double dDebounce; // seconds
+	bool (*pfnSkip)(const char *pcPath, void *pCtx); // the caller's filter
+	void *pSkipCtx;
+	FILE_FEED *feed;
+	DIR_SCAN *scan; // initial scan
+	int fdNotify;
+	map<int, string> dirs; // watch descriptor -> watched directory, including the trailing separator
+	pthread_mutex_t mutex; // protects pending, which the scanner threads add to
+	map<string, double> pending; // reported files -> time at which they are queued unless reported again
+	int iErrors;
+	pthread_t thread;
+	bool bThread; // thread is running
+};
+
+/* written by the signal handler to wake up the watcher thread */
+static int s_stopPipe[2] = { -1, -1 };
+static struct sigaction s_oldInt, s_oldTerm;
+
+static void watch_signal(int iSignal)
+{
+	char c = (char)iSignal;
+	if (write(s_stopPipe[1], &c, 1) < 0) {} // nothing to be done about it in a signal handler
+}
+
+/* wall clock in seconds, comparable to file modification times */
+static double real_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double modified_at(const struct stat &st)
+{
+	return st.st_mtim.tv_sec + st.st_mtim.tv_nsec * 1e-9;
+}
+
+static void defer_file(DIR_WATCH *watch, const string &sPath, double dDue)
+{
+	pthread_mutex_lock(&watch->mutex);
+	watch->pending[sPath] = dDue;
+	pthread_mutex_unlock(&watch->mutex);
+}
+
+/* Scanner filter of the initial scan: files which have been modified recently are left to the watcher. */
+static bool defer_recent(const char *pcPath, void *pCtx)
+{
+	DIR_WATCH *watch = (DIR_WATCH*)pCtx;
+	struct stat st;
+	if (0 == stat(pcPath, &st) && modified_at(st) + watch->dDebounce > real_now()) {
+		defer_file(watch, pcPath, modified_at(st) + watch->dDebounce);
+		return true;
+	}
+	return watch->pfnSkip != NULL && watch->pfnSkip(pcPath, watch->pSkipCtx);
+}
+
+/* Watches the directory sDir (ending with a separator) and, with -R, all directories below it. With bList, WAV
+ * files which are already in there are reported, which covers files created in a new directory before it was
+ * watched.
+ */
+static void watch_tree(DIR_WATCH *watch, const string &sDir, bool bList)
+{
+	uint32_t uMask = WATCH_FILE_EVENTS | IN_ONLYDIR | (watch->bRecursive ? IN_CREATE : 0);
+	int wd = inotify_add_watch(watch->fdNotify, sDir.c_str(), uMask);
+	if (wd < 0) {
+		printf("Unable to watch directory %s (%s).\n", sDir.c_str(), strerror(errno));
+		if (errno == ENOSPC) printf("Raise fs.inotify.max_user_watches to watch more directories.\n");
+		watch->iErrors++;
+		return;
+	}
+	watch->dirs[wd] = sDir;
+	if (!bList && !watch->bRecursive) return;
+
+	DIR *dir = opendir(sDir.c_str());
+	if (dir == NULL) return; // gone again
+	double dDue = real_now() + watch->dDebounce;
+	dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		const char *name = ent->d_name;
+		if (0 == strcmp(name, ".") || 0 == strcmp(name, "..")) continue;
+		string sPath = sDir + name;
+		bool bDir = ent->d_type == DT_DIR, bFile = ent->d_type == DT_REG;
+		if (ent->d_type == DT_UNKNOWN) {
+			struct stat st;
+			if (0 != lstat(sPath.c_str(), &st)) continue;
+			bDir = S_ISDIR(st.st_mode);
+			bFile = S_ISREG(st.st_mode);
+		}
+		if (bDir && watch->bRecursive)
+			watch_tree(watch, sPath + "/", bList);
+		else if (bFile && bList && is_wav_name(name, strlen(name)))
+			defer_file(watch, sPath, dDue);
+	}
+	closedir(dir);
+}
+
+static void handle_event(DIR_WATCH *watch, const struct inotify_event *ev)
+{
+	if (ev->mask & IN_Q_OVERFLOW) {
+		printf("Warning: Too many file events, some files may have been missed. Raise "
+			"fs.inotify.max_queued_events.\n");
+		watch->iErrors++;
+		return;
+	}
+	map<int, string>::iterator it = watch->dirs.find(ev->wd);
+	if (it == watch->dirs.end()) return;
+	if (ev->mask & IN_IGNORED) {
+		watch->dirs.erase(it); // the directory has been removed
+		return;
+	}
+	if (ev->len == 0) return;
+	string sPath = it->second + ev->name;
+
+	if (ev->mask & IN_ISDIR) {
+		if (watch->bRecursive && (ev->mask & (IN_CREATE | IN_MOVED_TO))) watch_tree(watch, sPath + "/", true);
+		return;
+	}
+	if (!is_wav_name(ev->name, strlen(ev->name))) return;
+	if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+		defer_file(watch, sPath, real_now() + watch->dDebounce);
+	} else if (ev->mask & (IN_MOVED_FROM | IN_DELETE)) {
+		pthread_mutex_lock(&watch->mutex);
+		watch->pending.erase(sPath);
+		pthread_mutex_unlock(&watch->mutex);
+	}
+}
+
+/* Queues all pending files which have settled and returns the number of milliseconds until the next one is due
+ * (-1 if none is pending).
+ */
+static int queue_settled(DIR_WATCH *watch, vector<char> &names)
+{
+	double dNow = real_now();
+	double dNext = -1.0;
+	int iCount = 0;
+	names.clear();
+	pthread_mutex_lock(&watch->mutex);
+	for (map<string, double>::iterator it = watch->pending.begin(); it != watch->pending.end();) {
+		if (it->second > dNow) {
+			if (dNext < 0 || it->second < dNext) dNext = it->second;
+			++it;
+			continue;
+		}
+		struct stat st;
+		if (0 != stat(it->first.c_str(), &st) || !S_ISREG(st.st_mode)) {
+			watch->pending.erase(it++);
+			continue;
+		}
+		if (modified_at(st) + watch->dDebounce > dNow) {
+			// still being written
+			it->second = modified_at(st) + watch->dDebounce;
+			if (dNext < 0 || it->second < dNext) dNext = it->second;
+			++it;
+			continue;
+		}
+		if (watch->pfnSkip == NULL || !watch->pfnSkip(it->first.c_str(), watch->pSkipCtx)) {
+			names.insert(names.end(), it->first.c_str(), it->first.c_str() + it->first.size() + 1);
+			iCount++;
+		}
+		watch->pending.erase(it++);
+	}
+	pthread_mutex_unlock(&watch->mutex);
+
+	if (iCount > 0) {
+		if (!watch->sOutDir.empty()) {
+			// create the output directories of the queued files
+			for (const char *p = names.data(); p < names.data() + names.size(); p += strlen(p) + 1) {
+				string sRel(p + watch->sRoot.size());
+				size_t uSep = sRel.find_last_of('/');
+				string sOut = watch->sOutDir + (uSep == string::npos || uSep == 0 ? "" : sRel.substr(0, uSep));
+				if (EXIT_SUCCESS != make_directories(sOut.c_str())) printf("Unable to create directory %s.\n",
+					sOut.c_str());
+			}
+		}
+		feed_append(watch->feed, names.data(), iCount);
+	}
+	return dNext < 0 ? -1 : (int)((dNext - dNow) * 1000.0) + 1;
+}
+
+static void *watch_thread(void *arg)
+{
+	DIR_WATCH *watch = (DIR_WATCH*)arg;
+	TRACE_THREAD_NAME("watcher", 0);
+	char *pBuffer = new char[WATCH_EVENT_BUFFER];
+	vector<char> names;
+	struct pollfd fds[2];
+	fds[0].fd = watch->fdNotify;
+	fds[0].events = POLLIN;
+	fds[1].fd = s_stopPipe[0];
+	fds[1].events = POLLIN;
+
+	int iTimeout = -1;
+	while (true) {
+		fds[0].revents = fds[1].revents = 0;
+		if (poll(fds, 2, iTimeout) < 0 && errno != EINTR) {
+			printf("Unable to wait for file events (%s).\n", strerror(errno));
+			watch->iErrors++;
+			break;
+		}
+		if (fds[1].revents & POLLIN) break; // stopped
+		if (fds[0].revents & POLLIN) {
+			ssize_t n = read(watch->fdNotify, pBuffer, WATCH_EVENT_BUFFER);
+			for (ssize_t lPos = 0; lPos < n;) {
+				const struct inotify_event *ev = (const struct inotify_event*)(pBuffer + lPos);
+				handle_event(watch, ev);
+				lPos += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+		TRACE_SCOPE("queue arrivals");
+		iTimeout = queue_settled(watch, names);
+	}
+
+	// the workers drain the feed once it's closed, which must not happen before the scan has published everything
+	watch->iErrors += scan_finish(watch->scan);
+	watch->scan = NULL;
+	if (!watch->pending.empty())
+		printf("Stopped watching, %d file(s) still being written are left for the next run.\n",
+			(int)watch->pending.size());
+	feed_close(watch->feed);
+	delete[] pBuffer;
+	return NULL;
+}
+
+DIR_WATCH *watch_start(const char *pcRoot, const SCAN_CFG *cfg, FILE_FEED *feed, int iDebounceMs)
+{
+	DIR_WATCH *watch = new DIR_WATCH;
+	watch->sRoot = pcRoot;
+	if (cfg->pcOutDir != NULL) watch->sOutDir = cfg->pcOutDir;
+	watch->bRecursive = cfg->bRecursive;
+	watch->dDebounce = iDebounceMs / 1000.0;
+	watch->pfnSkip = cfg->pfnSkip;
+	watch->pSkipCtx = cfg->pSkipCtx;
+	watch->feed = feed;
+	watch->scan = NULL;
+	watch->iErrors = 0;
+	pthread_mutex_init(&watch->mutex, NULL);
+
+	// watch before scanning, so that no file falls between the scan and the first event
+	watch->fdNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fdNotify < 0 || 0 != pipe(s_stopPipe)) {
+		printf("Unable to watch %s (%s).\n", pcRoot, strerror(errno));
+		if (watch->fdNotify >= 0) close(watch->fdNotify);
+		pthread_mutex_destroy(&watch->mutex);
+		delete watch;
+		return NULL;
+	}
+	watch_tree(watch, watch->sRoot + "/", false);
+	SCAN_CFG scanCfg = *cfg;
+	scanCfg.bKeepOpen = true;
+	scanCfg.pfnSkip = defer_recent;
+	scanCfg.pSkipCtx = watch;
+	if (watch->dirs.empty() || (watch->scan = scan_start(pcRoot, &scanCfg, feed)) == NULL) {
+		if (!watch->dirs.empty()) printf("Unable to read %s.\n", pcRoot);
+		close(watch->fdNotify);
+		close(s_stopPipe[0]);
+		close(s_stopPipe[1]);
+		pthread_mutex_destroy(&watch->mutex);
+		delete watch;
+		return NULL;
+	}
+
+	// the first signal stops the watcher, the default action of a second one terminates right away
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = watch_signal;
+	sa.sa_flags = SA_RESETHAND | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &s_oldInt);
+	sigaction(SIGTERM, &sa, &s_oldTerm);
+
+	watch->bThread = 0 == pthread_create(&watch->thread, NULL, watch_thread, (void*)watch);
+	if (!watch->bThread) {
+		// convert what the scan finds, like a run without watching
+		printf("Unable to start the watcher thread.\n");
+		watch->iErrors += scan_finish(watch->scan);
+		watch->scan = NULL;
+		feed_close(feed);
+	}
+	return watch;
+}
+
+int watch_finish(DIR_WATCH *watch)
+{
+	if (watch->bThread) pthread_join(watch->thread, NULL);
+	sigaction(SIGINT, &s_oldInt, NULL);
+	sigaction(SIGTERM, &s_oldTerm, NULL);
+	close(watch->fdNotify);
+	close(s_stopPipe[0]);
+	close(s_stopPipe[1]);
+	s_stopPipe[0] = s_stopPipe[1] = -1;
+	int iErrors = watch->iErrors;
+	pthread_mutex_destroy(&watch->mutex);
+	delete watch;
+	return iErrors;
+}
+
+#else // __linux__
+
+struct DIR_WATCH {
+	int iUnused;
+};
+
+DIR_WATCH *watch_start(const char *pcRoot, const SCAN_CFG *cfg, FILE_FEED *feed, int iDebounceMs)
+{
+	printf("Watch mode is not supported on this platform.\n");
+	return NULL;
+}
+
+int watch_finish(DIR_WATCH *watch)
+{
+	return 0;
+}
+
+#endif // __linux__
@@ -0,0 +1,52 @@
+#ifndef __WATCH_H_
+#define __WATCH_H_
+
+#include "dir_scan.h"
+
+/////////////////////
+// watch mode: converting files as they arrive in a spool directory
+/////////////////////
+
+/*
+ * The watcher keeps the FILE_FEED of the workers open and appends WAV files to it as they are completed in the
+ * watched directory (and its subdirectories with -R), so the worker pool stays alive across batches and nothing is
+ * scanned more than once. Files present at startup come from a regular scan (dir_scan.h); after that, inotify
+ * reports files which have been closed after writing (IN_CLOSE_WRITE) or moved into the directory (IN_MOVED_TO).
+ *
+ * Recorders may close and reopen a file several times before it is complete, so a reported file is only handed to
+ * the workers once it hasn't been reported again for the debounce interval and its modification time is at least
+ * that old. Files found by the initial scan which have been modified within the debounce interval are treated as
+ * reported, since they might still be written. The watcher stops on SIGINT or SIGTERM, after which the workers
+ * finish the files which have been queued already; a second signal terminates right away. Linux only.
+ */
+
+#define WATCH_DEFAULT_DEBOUNCE_MS 250
+#define WATCH_EVENT_BUFFER (64 * 1024) // bytes per read from the inotify descriptor
+
+/* Opaque watcher state (see watch.cpp) */
+struct DIR_WATCH;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* watch_start
+ *  Starts watching pcRoot (all its subdirectories as well if cfg->bRecursive is set), starts the initial scan
+ *  with the scanner configuration cfg and a watcher thread which appends arriving WAV files to feed. cfg->pfnSkip
+ *  is applied to arriving files as well. The feed is closed once the watcher has been stopped by a signal and the
+ *  scan is complete. Prints the reason on failure.
+ *
+ *  Return value:
+ *    watcher handle to be passed to watch_finish, NULL if pcRoot can't be watched
+ */
+DIR_WATCH *watch_start(const char *pcRoot, const SCAN_CFG *cfg, FILE_FEED *feed, int iDebounceMs);
+
+/* watch_finish
+ *  Waits until the watcher has been stopped (the feed is closed then) and releases it.
+ *
+ *  Return value:
+ *    number of directories which couldn't be read or watched (see scan_finish)
+ */
+int watch_finish(DIR_WATCH *watch);
+
+#endif // __WATCH_H_
@@ -1,61 +1,98 @@
 #include "wave.h"
+#include "pcm_convert.h"
+#include "trace.h"
+#include "metrics.h"
 
-// function implementations
-int read_wave_header(ifstream &file, FMT_DATA *&hdr, int &iDataSize, int &iDataOffset)
+/* Returns a pointer to the n header bytes at llOffset within the in-memory prefix, re-reading the
+ * prefix at llOffset if the requested range is not covered yet. NULL if the file is too short.
+ */
+static const unsigned char *header_bytes(WAV_INPUT *in, unsigned char *prefix, unsigned long long &llPrefixStart,
+	unsigned int &uPrefixLen, unsigned long long llOffset, unsigned int n)
 {
-	if (!file.is_open()) return EXIT_FAILURE; // check if file is open
-	file.seekg(0, ios::beg); // rewind file
+	if (llOffset < llPrefixStart || llOffset + n > llPrefixStart + uPrefixLen) {
+		long long got = input_read_at(in, prefix, WAVE_HEADER_PREFIX, llOffset);
+		llPrefixStart = llOffset;
+		uPrefixLen = got > 0 ? (unsigned int)got : 0;
+		if (n > uPrefixLen) return NULL;
+	}
+	return prefix + (llOffset - llPrefixStart);
+}
 
+// function implementations
+int read_wave_header(WAV_INPUT *in, FMT_DATA *&hdr, unsigned int &iDataSize, int &iDataOffset)
+{
+	TRACE_SCOPE("parse header");
+	unsigned char prefix[WAVE_HEADER_PREFIX];
+	unsigned long long llPrefixStart = 0;
+	unsigned int uPrefixLen = 0;
+	const unsigned char *p;
 	ANY_CHUNK_HDR chunkHdr;
+	const bool bOwnHdr = hdr == NULL; // otherwise the header is stored in the caller's FMT_DATA
 
 	// read and validate RIFF header first
 	RIFF_HDR rHdr;
-	file.read((char*)&rHdr, sizeof(RIFF_HDR));
+	if (NULL == (p = header_bytes(in, prefix, llPrefixStart, uPrefixLen, 0, sizeof(RIFF_HDR)))) {
+		cerr << "Bad RIFF header!" << endl;
+		return EXIT_FAILURE;
+	}
+	memcpy(&rHdr, p, sizeof(RIFF_HDR));
 	if (EXIT_SUCCESS != check_riff_header(&rHdr))
 		return EXIT_FAILURE;
 
-	// then continue parsing file until we find the 'fmt ' chunk
+	// then continue parsing chunks until we find the 'fmt ' chunk
+	unsigned long long llOffset = sizeof(RIFF_HDR);
 	bool bFoundFmt = false;
-	while (!bFoundFmt && !file.eof()) {
-		file.read((char*)&chunkHdr, sizeof(ANY_CHUNK_HDR));
+	while (NULL != (p = header_bytes(in, prefix, llPrefixStart, uPrefixLen, llOffset, sizeof(ANY_CHUNK_HDR)))) {
+		memcpy(&chunkHdr, p, sizeof(ANY_CHUNK_HDR));
 		if (0 == strncmp(chunkHdr.ID, "fmt ", 4)) {
-			// rewind and parse the complete chunk
-			file.seekg((int)file.tellg()-sizeof(ANY_CHUNK_HDR));
-			
-			hdr = new FMT_DATA;
-			file.read((char*)hdr, sizeof(FMT_DATA));
+			// parse the complete chunk
+			if (NULL == (p = header_bytes(in, prefix, llPrefixStart, uPrefixLen, llOffset, sizeof(FMT_DATA))))
+				break;
+			if (bOwnHdr) hdr = new FMT_DATA;
+			memcpy(hdr, p, sizeof(FMT_DATA));
 			bFoundFmt = true;
-			break;
-		} else {
-			// skip this chunk (i.e. the next chunkSize bytes)
-			file.seekg(chunkHdr.chunkSize, ios::cur);
+			// resolve WAVE_FORMAT_EXTENSIBLE to the actual format given by the SubFormat GUID
+			if (hdr->wFmtTag == WAVE_FORMAT_EXTENSIBLE && chunkHdr.chunkSize >= WAVE_FORMAT_EXTENSIBLE_SIZE) {
+				p = header_bytes(in, prefix, llPrefixStart, uPrefixLen, llOffset,
+					sizeof(ANY_CHUNK_HDR) + WAVE_FORMAT_EXTENSIBLE_SIZE);
+				if (p != NULL)
+					hdr->wFmtTag = p[WAVE_FORMAT_SUBFORMAT_OFFSET] | (p[WAVE_FORMAT_SUBFORMAT_OFFSET + 1] << 8);
+			}
 		}
+		// skip this chunk (i.e. the next chunkSize bytes, padded to an even size)
+		llOffset += sizeof(ANY_CHUNK_HDR) + chunkHdr.chunkSize + (chunkHdr.chunkSize & 1);
+		if (bFoundFmt) break;
 	}
 	if (!bFoundFmt) { // found 'fmt ' at all?
 		cerr << "FATAL: Found no 'fmt ' chunk in file." << endl;
+		return EXIT_FAILURE;
 	} else if (EXIT_SUCCESS != check_format_data(hdr)) { // if so, check settings
-		delete hdr;
+		if (bOwnHdr) {
+			delete hdr;
+			hdr = NULL; // the caller owns hdr only on success
+		}
 		return EXIT_FAILURE;
 	}
 
 	// finally, look for 'data' chunk
 	bool bFoundData = false;
-	while (!bFoundData && !file.eof()) {
-		//printf("Reading chunk at 0x%X:", (int)file.tellg());
-		file.read((char*)&chunkHdr, sizeof(ANY_CHUNK_HDR));
-		//printf("%s\n", string(chunkHdr.ID, 4).c_str());
+	while (NULL != (p = header_bytes(in, prefix, llPrefixStart, uPrefixLen, llOffset, sizeof(ANY_CHUNK_HDR)))) {
+		memcpy(&chunkHdr, p, sizeof(ANY_CHUNK_HDR));
 		if (0 == strncmp(chunkHdr.ID, "data", 4)) {
 			bFoundData = true;
 			iDataSize = chunkHdr.chunkSize;
-			iDataOffset = file.tellg();
+			iDataOffset = (int)(llOffset + sizeof(ANY_CHUNK_HDR));
 			break;
 		} else { // skip chunk
-			file.seekg(chunkHdr.chunkSize, ios::cur);
+			llOffset += sizeof(ANY_CHUNK_HDR) + chunkHdr.chunkSize + (chunkHdr.chunkSize & 1);
 		}
 	}
 	if (!bFoundData) { // found 'data' at all?
 		cerr << "FATAL: Found no 'data' chunk in file." << endl;
-		delete hdr;
+		if (bOwnHdr) {
+			delete hdr;
+			hdr = NULL;
+		}
 		return EXIT_FAILURE;
 	}
 
@@ -64,7 +101,7 @@ int read_wave_header(ifstream &file, FMT_DATA *&hdr, int &iDataSize, int &iDataO
 
 int check_format_data(const FMT_DATA *hdr)
 {
-	if (hdr->wFmtTag != 0x01) {
+	if (hdr->wFmtTag != WAVE_FORMAT_PCM && hdr->wFmtTag != WAVE_FORMAT_IEEE_FLOAT) {
 		cerr << "Bad non-PCM format:" << hdr->wFmtTag << endl;
 		return EXIT_FAILURE;
 	}
@@ -72,11 +109,21 @@ int check_format_data(const FMT_DATA *hdr)
 		cerr << "Bad number of channels (only mono or stereo supported)." << endl;
 		return EXIT_FAILURE;
 	}
-	if (hdr->chunkSize != 16) {
+	if (hdr->wBitsPerSample != 8 && hdr->wBitsPerSample != 16 && hdr->wBitsPerSample != 24 &&
+		hdr->wBitsPerSample != 32) {
+		cerr << "Bad bits per sample: " << hdr->wBitsPerSample << endl;
+		return EXIT_FAILURE;
+	}
+	if (hdr->wFmtTag == WAVE_FORMAT_IEEE_FLOAT && hdr->wBitsPerSample != 32) {
+		cerr << "Bad float format (only 32 bit supported)." << endl;
+		return EXIT_FAILURE;
+	}
+	if (hdr->chunkSize != 16 && hdr->chunkSize != 18 && hdr->chunkSize != WAVE_FORMAT_EXTENSIBLE_SIZE) {
 		cerr << "WARNING: 'fmt ' chunk size seems to be off." << endl;
 	}
 	if (hdr->wBlockAlign != hdr->wBitsPerSample * hdr->wChannels / 8) {
-		cerr << "WARNING: 'fmt ' has strange bytes/bits/channels configuration." << endl;
+		cerr << "Bad 'fmt ' bytes/bits/channels configuration." << endl;
+		return EXIT_FAILURE;
 	}
 	
 	return EXIT_SUCCESS;
@@ -91,32 +138,25 @@ int check_riff_header(const RIFF_HDR *rHdr)
 	return EXIT_FAILURE;
 }
 
-void get_pcm_channels_from_wave(ifstream &file, const FMT_DATA* hdr, short* &leftPcm, short* &rightPcm, const int iDataSize,
-	const int iDataOffset)
+void get_pcm_channels_from_wave(WAV_INPUT *in, const FMT_DATA* hdr, short* &leftPcm, short* &rightPcm,
+	const unsigned int iDataSize, const int iDataOffset)
 {
-	int idx;
+	TRACE_SCOPE("read pcm");
 	int numSamples = iDataSize / hdr->wBlockAlign;
 
 	leftPcm = NULL;
 	rightPcm = NULL;
 
 	// allocate PCM arrays
-	leftPcm = new short[iDataSize / hdr->wChannels / sizeof(short)];
+	leftPcm = new short[numSamples];
 	if (hdr->wChannels > 1)
-		rightPcm = new short[iDataSize / hdr->wChannels / sizeof(short)];
+		rightPcm = new short[numSamples];
 
-	// capture each sample
-	file.seekg(iDataOffset);// set file pointer to beginning of data array
-
-	if (hdr->wChannels == 1) {
-		file.read((char*)leftPcm, hdr->wBlockAlign * numSamples);
-	} else {
-		for (idx = 0; idx < numSamples; idx++) {
-			file.read((char*)&leftPcm[idx], hdr->wBlockAlign / hdr->wChannels);
-			if (hdr->wChannels>1)
-				file.read((char*)&rightPcm[idx], hdr->wBlockAlign / hdr->wChannels);
-		}
-	}
+	// capture each sample, converting one block at a time
+	input_seek(in, iDataOffset); // set read position to beginning of data array
+	unsigned char *pRaw = new unsigned char[PCM_BLOCK_SAMPLES * hdr->wBlockAlign];
+	read_pcm_s16(in, hdr, leftPcm, rightPcm, iDataSize, pRaw, NULL);
+	delete[] pRaw;
 
 	assert(rightPcm == NULL || hdr->wChannels != 1);
 
@@ -125,31 +165,310 @@ void get_pcm_channels_from_wave(ifstream &file, const FMT_DATA* hdr, short* &lef
 #endif
 }
 
-int read_wave(const char *filename, FMT_DATA* &hdr, short* &leftPcm, short* &rightPcm, int &iDataSize)
+int read_wave(const char *filename, const INPUT_CFG *cfg, FMT_DATA* &hdr, short* &leftPcm, short* &rightPcm,
+	unsigned int &iDataSize)
 {
+	TRACE_SCOPE_DETAIL("read_wave", filename);
+	WAV_INPUT in;
+	if (EXIT_SUCCESS != input_open(&in, filename, cfg))
+		return EXIT_FAILURE;
 #ifdef __VERBOSE_
-	streamoff size;
+	cout << "Opened file. Allocating " << in.llFileSize << " bytes." << endl;
 #endif
 
-	ifstream inFile(filename, ios::in | ios::binary);
-	if (inFile.is_open()) {
-		// determine size and allocate buffer
-		inFile.seekg(0, ios::end);
+	// parse file
+	int iDataOffset = 0;
+	if (EXIT_SUCCESS != read_wave_header(&in, hdr, iDataSize, iDataOffset)) {
+		input_close(&in);
+		return EXIT_FAILURE;
+	}
+	get_pcm_channels_from_wave(&in, hdr, leftPcm, rightPcm, iDataSize, iDataOffset);
+	input_close(&in);
+
+	// cleanup and return
+	return EXIT_SUCCESS;
+}
+
+int open_wave(const char *filename, const INPUT_CFG *cfg, WAV_INPUT *in, FMT_DATA* &hdr, unsigned int &iDataSize)
+{
+	TRACE_SCOPE("open_wave");
+	if (EXIT_SUCCESS != input_open(in, filename, cfg))
+		return EXIT_FAILURE;
+
+	if (EXIT_SUCCESS != parse_wave(in, hdr, iDataSize)) {
+		input_close(in);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+int parse_wave(WAV_INPUT *in, FMT_DATA* &hdr, unsigned int &iDataSize)
+{
+	int iDataOffset = 0;
+	if (EXIT_SUCCESS != read_wave_header(in, hdr, iDataSize, iDataOffset))
+		return EXIT_FAILURE;
+	input_seek(in, iDataOffset); // set read position to beginning of data array
+
 #ifdef __VERBOSE_
-		size = inFile.tellg();
-		cout << "Opened file. Allocating " << size << " bytes." << endl;
+	cout << "Opened file for streaming, " << iDataSize << " bytes of PCM data." << endl;
 #endif
+	return EXIT_SUCCESS;
+}
 
-		// parse file
-		int iDataOffset = 0;
-		if (EXIT_SUCCESS != read_wave_header(inFile, hdr, iDataSize, iDataOffset)) {
-			return EXIT_FAILURE;
-		}
-		get_pcm_channels_from_wave(inFile, hdr, leftPcm, rightPcm, iDataSize, iDataOffset);
-		inFile.close();
+int read_pcm_s16(WAV_INPUT *in, const FMT_DATA *hdr, short *leftPcm, short *rightPcm, const unsigned int iDataSize,
+	void *pRaw, PCM_HASH *hash)
+{
+	PCM_CONVERTER conv;
+	if (EXIT_SUCCESS != pcm_get_converter(hdr, PCM_ISA_AUTO, &conv))
+		return EXIT_FAILURE;
 
-		// cleanup and return
+	int numSamples = iDataSize / hdr->wBlockAlign;
+	unsigned int iBytesLeft = iDataSize;
+	for (int idx = 0; idx < numSamples; ) {
+		int n = read_pcm_block(in, hdr, pRaw, PCM_BLOCK_SAMPLES, iBytesLeft);
+		if (n <= 0) return EXIT_FAILURE;
+		if (hash != NULL) pcm_hash_update(hash, pRaw, n * hdr->wBlockAlign);
+		conv.toS16Planar((const unsigned char*)pRaw, &leftPcm[idx], rightPcm != NULL ? &rightPcm[idx] : NULL, n);
+		idx += n;
+	}
+	return EXIT_SUCCESS;
+}
+
+int hash_pcm_data(WAV_INPUT *in, const FMT_DATA *hdr, const unsigned int iDataSize, void *pRaw, PCM_HASH *hash)
+{
+	TRACE_SCOPE("hash pcm");
+	const unsigned long long llStart = in->llPos;
+	if (in->backend == INPUT_MMAP || in->backend == INPUT_MEMORY) {
+		// the data is mapped already, hash it in place: the whole frames which are present, like read_pcm_block
+		unsigned long long llBytes = in->llFileSize > llStart ? in->llFileSize - llStart : 0;
+		if (llBytes > iDataSize) llBytes = iDataSize;
+		pcm_hash_update(hash, in->pMap + llStart, (size_t)(llBytes - llBytes % hdr->wBlockAlign));
 		return EXIT_SUCCESS;
 	}
+
+	unsigned int iBytesLeft = iDataSize;
+	int n;
+	while ((n = read_pcm_block(in, hdr, pRaw, PCM_BLOCK_SAMPLES, iBytesLeft)) > 0)
+		pcm_hash_update(hash, pRaw, n * hdr->wBlockAlign);
+	input_seek(in, llStart);
+	return n < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/////////////////////
+// XXH64
+/////////////////////
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+static inline unsigned long long xxh_rotl(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline unsigned long long xxh_read64(const unsigned char *p)
+{
+	unsigned long long v;
+	memcpy(&v, p, sizeof(v)); // native byte order: hashes are only compared on the same machine
+	return v;
+}
+
+static inline unsigned long long xxh_round(unsigned long long acc, unsigned long long input)
+{
+	acc += input * XXH_PRIME2;
+	return xxh_rotl(acc, 31) * XXH_PRIME1;
+}
+
+static inline unsigned long long xxh_merge(unsigned long long h, unsigned long long acc)
+{
+	h ^= xxh_round(0, acc);
+	return h * XXH_PRIME1 + XXH_PRIME4;
+}
+
+void pcm_hash_init(PCM_HASH *hash)
+{
+	hash->llAcc[0] = XXH_PRIME1 + XXH_PRIME2;
+	hash->llAcc[1] = XXH_PRIME2;
+	hash->llAcc[2] = 0;
+	hash->llAcc[3] = 0 - XXH_PRIME1;
+	hash->uFill = 0;
+	hash->llTotal = 0;
+}
+
+void pcm_hash_update(PCM_HASH *hash, const void *pData, size_t n)
+{
+	const unsigned char *p = (const unsigned char*)pData;
+	hash->llTotal += n;
+	if (hash->uFill > 0) {
+		size_t take = sizeof(hash->buf) - hash->uFill;
+		if (take > n) take = n;
+		memcpy(hash->buf + hash->uFill, p, take);
+		hash->uFill += (unsigned int)take;
+		p += take;
+		n -= take;
+		if (hash->uFill < sizeof(hash->buf)) return;
+		for (int i = 0; i < 4; i++) hash->llAcc[i] = xxh_round(hash->llAcc[i], xxh_read64(hash->buf + 8 * i));
+		hash->uFill = 0;
+	}
+
+	// the four lanes are independent, so their multiplications overlap in the pipeline
+	unsigned long long v0 = hash->llAcc[0], v1 = hash->llAcc[1], v2 = hash->llAcc[2], v3 = hash->llAcc[3];
+	for (; n >= 32; p += 32, n -= 32) {
+		v0 = xxh_round(v0, xxh_read64(p));
+		v1 = xxh_round(v1, xxh_read64(p + 8));
+		v2 = xxh_round(v2, xxh_read64(p + 16));
+		v3 = xxh_round(v3, xxh_read64(p + 24));
+	}
+	hash->llAcc[0] = v0; hash->llAcc[1] = v1; hash->llAcc[2] = v2; hash->llAcc[3] = v3;
+
+	memcpy(hash->buf, p, n);
+	hash->uFill = (unsigned int)n;
+}
+
+unsigned long long pcm_hash_final(const PCM_HASH *hash)
+{
+	unsigned long long h;
+	if (hash->llTotal >= 32) {
+		h = xxh_rotl(hash->llAcc[0], 1) + xxh_rotl(hash->llAcc[1], 7) + xxh_rotl(hash->llAcc[2], 12) +
+			xxh_rotl(hash->llAcc[3], 18);
+		for (int i = 0; i < 4; i++) h = xxh_merge(h, hash->llAcc[i]);
+	} else {
+		h = XXH_PRIME5;
+	}
+	h += hash->llTotal;
+
+	const unsigned char *p = hash->buf;
+	unsigned int n = hash->uFill;
+	for (; n >= 8; p += 8, n -= 8)
+		h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+	if (n >= 4) {
+		unsigned int k;
+		memcpy(&k, p, sizeof(k));
+		h = xxh_rotl(h ^ (k * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+		n -= 4;
+	}
+	for (; n > 0; p++, n--)
+		h = xxh_rotl(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+int read_pcm_block(WAV_INPUT *in, const FMT_DATA *hdr, void *pRaw, const int iMaxSamples, unsigned int &iBytesLeft)
+{
+	int numSamples = iBytesLeft / hdr->wBlockAlign;
+	if (numSamples > iMaxSamples) numSamples = iMaxSamples;
+	if (numSamples <= 0) return 0;
+
+	TRACE_SCOPE("read block");
+	if (input_read(in, pRaw, numSamples * hdr->wBlockAlign) != numSamples * hdr->wBlockAlign) {
+		cerr << "Unexpected end of PCM data." << endl;
+		return -1;
+	}
+
+	iBytesLeft -= numSamples * hdr->wBlockAlign;
+	metrics_count(METRIC_BYTES_READ, numSamples * hdr->wBlockAlign);
+	return numSamples;
+}
+
+int read_wave_header_stream(WAV_INPUT *in, FMT_DATA *&hdr, unsigned long long &llDataSize)
+{
+	TRACE_SCOPE("parse stream header");
+	RIFF_HDR rHdr;
+	if (input_read(in, &rHdr, sizeof(RIFF_HDR)) != sizeof(RIFF_HDR)) {
+		cerr << "Bad RIFF header!" << endl;
+		return EXIT_FAILURE;
+	}
+	if (rHdr.fileLen == 0) rHdr.fileLen = WAVE_SIZE_UNKNOWN; // length not known when the header was written
+	if (EXIT_SUCCESS != check_riff_header(&rHdr))
+		return EXIT_FAILURE;
+
+	// chunks can only be skipped by reading them
+	unsigned char body[WAVE_HEADER_PREFIX];
+	ANY_CHUNK_HDR chunkHdr;
+	hdr = NULL;
+	while (input_read(in, &chunkHdr, sizeof(ANY_CHUNK_HDR)) == sizeof(ANY_CHUNK_HDR)) {
+		if (0 == strncmp(chunkHdr.ID, "data", 4)) {
+			if (hdr == NULL) break;
+			llDataSize = chunkHdr.chunkSize == 0 || chunkHdr.chunkSize == WAVE_SIZE_UNKNOWN ?
+				WAVE_STREAM_UNBOUNDED : chunkHdr.chunkSize;
+			return EXIT_SUCCESS;
+		}
+
+		unsigned long long llSkip = chunkHdr.chunkSize + (chunkHdr.chunkSize & 1);
+		if (0 == strncmp(chunkHdr.ID, "fmt ", 4) && hdr == NULL) {
+			const unsigned int uBody = sizeof(FMT_DATA) - sizeof(ANY_CHUNK_HDR);
+			unsigned int n = chunkHdr.chunkSize < sizeof(body) ? chunkHdr.chunkSize : sizeof(body);
+			if (n < uBody || input_read(in, body, n) != n) break;
+			llSkip -= n;
+			hdr = new FMT_DATA;
+			memcpy(hdr, &chunkHdr, sizeof(ANY_CHUNK_HDR));
+			memcpy((unsigned char*)hdr + sizeof(ANY_CHUNK_HDR), body, uBody);
+			// resolve WAVE_FORMAT_EXTENSIBLE to the actual format given by the SubFormat GUID
+			const unsigned int uSubFormat = WAVE_FORMAT_SUBFORMAT_OFFSET - sizeof(ANY_CHUNK_HDR);
+			if (hdr->wFmtTag == WAVE_FORMAT_EXTENSIBLE && n >= uSubFormat + 2)
+				hdr->wFmtTag = body[uSubFormat] | (body[uSubFormat + 1] << 8);
+			if (EXIT_SUCCESS != check_format_data(hdr)) {
+				delete hdr;
+				hdr = NULL;
+				return EXIT_FAILURE;
+			}
+		}
+		while (llSkip > 0) {
+			size_t n = llSkip < sizeof(body) ? (size_t)llSkip : sizeof(body);
+			if (input_read(in, body, n) != (long long)n) break;
+			llSkip -= n;
+		}
+		if (llSkip > 0) break; // end of stream
+	}
+
+	cerr << "FATAL: Found no " << (hdr == NULL ? "'fmt '" : "'data'") << " chunk in stream." << endl;
+	delete hdr;
+	hdr = NULL;
 	return EXIT_FAILURE;
 }
+
+int read_pcm_stream_block(WAV_INPUT *in, const FMT_DATA *hdr, void *pRaw, const int iMaxSamples,
+	unsigned long long &llBytesLeft)
+{
+	unsigned long long llMaxBytes = (unsigned long long)iMaxSamples * hdr->wBlockAlign;
+	if (llMaxBytes > llBytesLeft) llMaxBytes = llBytesLeft - llBytesLeft % hdr->wBlockAlign;
+	if (llMaxBytes == 0) return 0;
+
+	TRACE_SCOPE("read block");
+	long long got = input_read(in, pRaw, (size_t)llMaxBytes);
+	if (got < 0) return -1;
+	int numSamples = (int)(got / hdr->wBlockAlign); // at the end of the stream, drop a partial frame
+	if (llBytesLeft != WAVE_STREAM_UNBOUNDED) llBytesLeft -= got;
+	metrics_count(METRIC_BYTES_READ, got);
+	return numSamples;
+}
+
+int probe_wave(const char *filename, const INPUT_CFG *cfg, FMT_DATA &fmt, unsigned int &iDataSize)
+{
+	// only the header is read, which isn't worth setting up an io_uring for
+	INPUT_CFG probeCfg;
+	if (cfg != NULL)
+		probeCfg = *cfg;
+	else
+		input_default_cfg(&probeCfg);
+	if (probeCfg.backend == INPUT_URING) probeCfg.backend = INPUT_PREAD;
+
+	WAV_INPUT in;
+	if (EXIT_SUCCESS != input_open(&in, filename, &probeCfg))
+		return EXIT_FAILURE;
+
+	FMT_DATA *hdr = &fmt;
+	int iDataOffset = 0;
+	int ret = read_wave_header(&in, hdr, iDataSize, iDataOffset);
+	input_close(&in);
+	return ret;
+}
@@ -1,14 +1,42 @@
 #ifndef __WAVE_H_
 #define __WAVE_H_
 
-#include <fstream>
 #include <iostream>
 #include <cassert>
 #include <cstring>
 #include <cstdlib>
+#include "wave_input.h"
 
 using namespace std;
 
+/* Number of samples (per channel) which are read and encoded at once in streaming mode.
+ * 8192 stereo 16 bit samples make up a 32 KB PCM block, so the PCM and MP3 block buffers
+ * of a worker stay well within a typical L2 cache regardless of the input file length.
+ */
+#define PCM_BLOCK_SAMPLES 8192
+
+/* Number of bytes at the beginning of a WAV file which are read at once by read_wave_header.
+ * The RIFF header and all chunk headers in front of 'data' are parsed from this in-memory prefix;
+ * only files with very large chunks before 'data' need another read further into the file.
+ */
+#define WAVE_HEADER_PREFIX 4096
+
+/* Values of wFmtTag in the 'fmt ' chunk. For WAVE_FORMAT_EXTENSIBLE, read_wave_header replaces
+ * wFmtTag by the format code of the SubFormat GUID, so everything else only sees PCM or float.
+ */
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+#define WAVE_FORMAT_EXTENSIBLE_SIZE 40 // minimum 'fmt ' chunkSize carrying a SubFormat
+#define WAVE_FORMAT_SUBFORMAT_OFFSET 32 // offset of the SubFormat GUID from the start of the chunk header
+
+/* Producers writing a WAV stream to a pipe don't know its length when they write the header and put 0 or
+ * WAVE_SIZE_UNKNOWN into the RIFF and 'data' sizes. read_wave_header_stream reports such a 'data' chunk as
+ * WAVE_STREAM_UNBOUNDED, i.e. it extends to the end of the stream.
+ */
+#define WAVE_SIZE_UNKNOWN 0xFFFFFFFF
+#define WAVE_STREAM_UNBOUNDED 0xFFFFFFFFFFFFFFFFULL
+
 /* Initial header of WAV file */
 typedef struct {
 	char rID[4]; // "RIFF"
@@ -21,13 +49,13 @@ typedef struct {
  */
 typedef struct {
 	char ID[4]; // "fmt "
-	unsigned int chunkSize; // should be 16
-	unsigned short wFmtTag; // 0x01 for PCM - other modes unsupported
+	unsigned int chunkSize; // 16, or 18/40 for WAVE_FORMAT_IEEE_FLOAT/WAVE_FORMAT_EXTENSIBLE
+	unsigned short wFmtTag; // WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT - other modes unsupported
 	unsigned short wChannels; // number of channels (1 mono, 2 stereo)
 	unsigned int dwSamplesPerSec; // e.g. 44100
 	unsigned int dwBytesPerSec;   // e.g. 4*44100
 	unsigned short wBlockAlign; // bytes per sample (all channels, e.g. 4)
-	unsigned short wBitsPerSample; // bits per sample and channel, e.g. 16
+	unsigned short wBitsPerSample; // bits per sample and channel: 8, 16, 24 or 32
 } FMT_DATA;
 
 /* Chunk header for any chunk type in IFF format
@@ -39,6 +67,14 @@ typedef struct {
 } ANY_CHUNK_HDR;
 
 
+/* State of an incremental hash over raw PCM data (see pcm_hash_update) */
+typedef struct {
+	unsigned long long llAcc[4]; // lane accumulators
+	unsigned char buf[32]; // input not yet consumed by the lanes
+	unsigned int uFill; // bytes in buf
+	unsigned long long llTotal; // bytes hashed
+} PCM_HASH;
+
 /* read_wave
  *  Read a WAV file given by filename, parsing the 44 byte header into hdr (will be allocated),
  *  allocating arrays for left and right (only left for mono input) PCM channels and returning
@@ -48,22 +84,87 @@ typedef struct {
  */
 int read_wave(
 	const char*			filename,			/* file to open */
+	const INPUT_CFG*	cfg,				/* input backend to use (NULL for defaults) */
 	FMT_DATA*			&hdr,				/* stores header info here (will be allocated) */
 	short*				&leftPcm,			/* stores left (or mono) PCM channel here */
 	short*				&rightPcm,			/* stores right PCM channel (stereo only) here */
-	int					&iDataSize			/* size of data array */
+	unsigned int		&iDataSize			/* size of data array */
+);
+
+/* open_wave
+ *  Opens the WAV file given by filename and parses its header (read_wave_header) without reading
+ *  any PCM data. On success, the stream is positioned at the first byte of the 'data' chunk so that
+ *  PCM data can subsequently be fetched block-wise by read_pcm_block. This is the entry point for
+ *  the streaming mode, which keeps memory usage constant regardless of the input length.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int open_wave(
+	const char*			filename,			/* file to open */
+	const INPUT_CFG*	cfg,				/* input backend to use (NULL for defaults) */
+	WAV_INPUT*			in,					/* input which will be opened and left positioned at the data */
+	FMT_DATA*			&hdr,				/* stores header info here (allocated if NULL) */
+	unsigned int		&iDataSize			/* size of data array */
+);
+
+/* parse_wave
+ *  Like open_wave for an input which has been opened already, e.g. a WAV file in memory (input_open_memory).
+ *  The input is left open on failure.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int parse_wave(
+	WAV_INPUT*			in,					/* opened input, will be left positioned at the data */
+	FMT_DATA*			&hdr,				/* stores header info here (allocated if NULL) */
+	unsigned int		&iDataSize			/* size of data array */
+);
+
+/* read_wave_header_stream
+ *  Parses the header of a WAV stream which can only be read sequentially (e.g. standard input, see
+ *  input_open_stream): chunks in front of 'data' are read and skipped instead of seeking over them. On success,
+ *  the stream is positioned at the first byte of the 'data' chunk, whose size is stored in llDataSize
+ *  (WAVE_STREAM_UNBOUNDED if the producer left it open).
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int read_wave_header_stream(
+	WAV_INPUT*			in,					/* input opened for sequential reads */
+	FMT_DATA*			&hdr,				/* stores header info here (will be allocated) */
+	unsigned long long	&llDataSize			/* size of data array or WAVE_STREAM_UNBOUNDED */
+);
+
+/* probe_wave
+ *  Opens the WAV file given by filename, parses and validates its header (read_wave_header) and closes it
+ *  again without reading any PCM data. Used to estimate the encoding cost of a file before scheduling it.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE if the file can't be opened or its header is invalid
+ */
+int probe_wave(
+	const char*			filename,			/* file to probe */
+	const INPUT_CFG*	cfg,				/* input backend to use (NULL for defaults) */
+	FMT_DATA			&fmt,				/* stores a copy of the format info here */
+	unsigned int		&iDataSize			/* size of data array */
 );
 
 /* read_wave_header
- *  Parses the given file stream for the WAV header and 'fmt ' as well as 'data' information.
+ *  Parses the given input for the WAV header and 'fmt ' as well as 'data' information.
+ *  All chunk headers are parsed from an in-memory prefix of WAVE_HEADER_PREFIX bytes, so there
+ *  is no seeking back and forth on the input. The sequential read position is not changed.
+ *  If hdr points to a FMT_DATA on entry (e.g. JOB_RESOURCES::fmt), the header is stored there
+ *  instead of a new one, which is left to the caller on failure as well. open_wave and parse_wave
+ *  pass hdr on.
  *
  *  Return value:
  *    EXIT_SUCCESS or EXIT_FAILURE
  */
 int read_wave_header(
-	ifstream			&file,				/* file stream to parse from (must be opened for reading) */
-	FMT_DATA*			&hdr,				/* stores header info here (will be allocated) */
-	int					&iDataSize,			/* stores size of data array here */
+	WAV_INPUT*			in,					/* input to parse from (must be opened by input_open) */
+	FMT_DATA*			&hdr,				/* stores header info here (allocated if NULL) */
+	unsigned int		&iDataSize,			/* stores size of data array here */
 	int					&iDataOffset		/* stores data offset (first data byte in input file) here */
 );
 
@@ -78,7 +179,8 @@ int check_riff_header(const RIFF_HDR *rHdr);
 int check_format_data(const FMT_DATA *hdr);
 
 /* get_pcm_channels_from_wave
-*  Allocates buffers for left and (if stereo) right PCM channels and parses data from filestream.
+*  Allocates buffers for left and (if stereo) right PCM channels and parses data from the input.
+*  Samples of any supported format are converted to 16 bit.
 *  Header hdr must have been read before.
 *
 *  Return value:
@@ -86,12 +188,89 @@ int check_format_data(const FMT_DATA *hdr);
 *    EXIT_FAILURE  if we probably can't handle that file
 */
 void get_pcm_channels_from_wave(
-	ifstream			&file,				/* file stream to parse from (must be opened for reading) */
+	WAV_INPUT*			in,					/* input to parse from (must be opened by input_open) */
 	const FMT_DATA*		hdr,				/* pointer to format struct that's already been read */
 	short*				&leftPcm,			/* stores left PCM channel here (will be allocated) */
 	short*				&rightPcm,			/* stores right PCM channel here (will be allocated for stereo files)*/
-	const int			iDataSize,			/* size of PCM data array */
+	const unsigned int	iDataSize,			/* size of PCM data array */
 	const int			iDataOffset			/* first PCM array byte in file*/
 );
 
+/* read_pcm_s16
+ *  Reads the complete 'data' chunk from the current stream position (see open_wave) and converts it to
+ *  16 bit planar PCM in the caller-supplied arrays leftPcm and rightPcm (NULL for mono input), which must
+ *  hold iDataSize / wBlockAlign samples each. pRaw is used as scratch buffer and must hold
+ *  PCM_BLOCK_SAMPLES * wBlockAlign bytes. Lets callers keep the PCM arrays across several files.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE on read errors and unsupported formats
+ */
+int read_pcm_s16(
+	WAV_INPUT*			in,					/* input positioned at the data chunk (see open_wave) */
+	const FMT_DATA*		hdr,				/* pointer to format struct that's already been read */
+	short*				leftPcm,			/* stores left (or mono) PCM channel here */
+	short*				rightPcm,			/* stores right PCM channel here (NULL for mono) */
+	const unsigned int	iDataSize,			/* size of PCM data array */
+	void*				pRaw,				/* scratch buffer for raw PCM blocks */
+	PCM_HASH*			hash				/* the raw data is added to this hash unless it is NULL */
+);
+
+/* hash_pcm_data
+ *  Adds the complete 'data' chunk from the current stream position (see open_wave) to hash without converting
+ *  it and seeks back to where it started, so that the data can be encoded afterwards. pRaw is used as scratch
+ *  buffer and must hold PCM_BLOCK_SAMPLES * wBlockAlign bytes. Hashes the same bytes as the blocks of
+ *  read_pcm_block would. Used by the streaming mode if the hash is needed before the first block is encoded.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE on read errors
+ */
+int hash_pcm_data(
+	WAV_INPUT*			in,					/* input positioned at the data chunk (see open_wave) */
+	const FMT_DATA*		hdr,				/* pointer to format struct that's already been read */
+	const unsigned int	iDataSize,			/* size of PCM data array */
+	void*				pRaw,				/* scratch buffer for raw PCM blocks */
+	PCM_HASH*			hash				/* the raw data is added to this hash */
+);
+
+/* pcm_hash_init, pcm_hash_update, pcm_hash_final
+ *  Incremental 64 bit XXH64 hash (seed 0) of a byte stream, which runs at memory speed and gives the same
+ *  result regardless of how the stream is split into updates.
+ */
+void pcm_hash_init(PCM_HASH *hash);
+void pcm_hash_update(PCM_HASH *hash, const void *pData, size_t n);
+unsigned long long pcm_hash_final(const PCM_HASH *hash);
+
+/* read_pcm_block
+ *  Reads the next block of at most iMaxSamples samples (frames) from the current stream position
+ *  into the caller-supplied buffer pRaw, which must hold iMaxSamples * wBlockAlign bytes. Samples
+ *  are left in their raw interleaved format, see pcm_convert.h for converting them.
+ *  iBytesLeft holds the number of 'data' bytes not yet consumed and is decremented accordingly.
+ *
+ *  Return value:
+ *    number of samples (per channel) read, 0 at the end of the data chunk, -1 on read errors
+ */
+int read_pcm_block(
+	WAV_INPUT*			in,					/* input positioned within the data chunk (see open_wave) */
+	const FMT_DATA*		hdr,				/* pointer to format struct that's already been read */
+	void*				pRaw,				/* stores raw PCM data here */
+	const int			iMaxSamples,		/* capacity of pRaw in samples */
+	unsigned int		&iBytesLeft			/* remaining bytes in data chunk (will be decremented) */
+);
+
+/* read_pcm_stream_block
+ *  Counterpart to read_pcm_block for the 'data' chunk of a stream (read_wave_header_stream), which may be
+ *  unbounded or end early: the data ends at the end of the stream as well, and a trailing partial frame is dropped.
+ *
+ *  Return value:
+ *    number of samples (per channel) read, 0 at the end of the data, -1 on read errors
+ */
+int read_pcm_stream_block(
+	WAV_INPUT*			in,					/* input positioned within the data chunk */
+	const FMT_DATA*		hdr,				/* pointer to format struct that's already been read */
+	void*				pRaw,				/* stores raw PCM data here */
+	const int			iMaxSamples,		/* capacity of pRaw in samples */
+	unsigned long long	&llBytesLeft		/* remaining bytes in data chunk (will be decremented unless it is
+											   WAVE_STREAM_UNBOUNDED) */
+);
+
 #endif //__WAVE_H_
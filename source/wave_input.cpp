@@ -0,0 +1,438 @@
+#include "wave_input.h"
+#include <iostream>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+#include "uring.h"
+#include "trace.h"
+
+using namespace std;
+
+void input_default_cfg(INPUT_CFG *cfg)
+{
+	cfg->backend = INPUT_DEFAULT_BACKEND;
+	cfg->uBlockSize = INPUT_DEFAULT_BLOCK_SIZE;
+	cfg->uQueueDepth = INPUT_DEFAULT_QUEUE_DEPTH;
+	cfg->pBlockBuffer = NULL;
+	cfg->pRing = NULL;
+}
+
+static const char *backendNames[] = { "stdio", "pread", "mmap", "uring", "memory" };
+
+int input_backend_from_name(const char *name, INPUT_BACKEND &backend)
+{
+	for (int i = 0; i < (int)(sizeof(backendNames) / sizeof(backendNames[0])); i++) {
+		if (0 == strcmp(name, backendNames[i])) {
+			if (i == INPUT_MEMORY) return EXIT_FAILURE; // only for input_open_memory
+#ifdef WIN32
+			if (i != INPUT_STDIO) return EXIT_FAILURE;
+#endif
+			backend = (INPUT_BACKEND)i;
+			return EXIT_SUCCESS;
+		}
+	}
+	return EXIT_FAILURE;
+}
+
+const char *input_backend_name(INPUT_BACKEND backend)
+{
+	return backendNames[backend];
+}
+
+/////////////////////
+// io_uring reader: keeps uQueueDepth block reads in flight ahead of the consumer
+/////////////////////
+
+#ifdef HAVE_IO_URING
+struct URING_READER {
+	URING ring;
+	unsigned int uDepth;
+	unsigned int uBlockSize;
+	unsigned char *pBuffers; // uDepth blocks
+	unsigned long long *pllSlotOffset; // file offset of each slot
+	int *piSlotResult; // bytes read into each slot (valid once completed)
+	bool *pbSlotDone;
+	unsigned int uHead; // slot currently being consumed
+	unsigned int uHeadCursor; // bytes already consumed from the head slot
+	unsigned int uInFlight;
+	unsigned long long llNextOffset; // file offset of the next block to queue
+	bool bStarted;
+};
+
+static void uring_destroy(URING_READER *r)
+{
+	uring_teardown(&r->ring);
+	delete[] r->pBuffers;
+	delete[] r->pllSlotOffset;
+	delete[] r->piSlotResult;
+	delete[] r->pbSlotDone;
+	delete r;
+}
+
+static URING_READER *uring_create(unsigned int uDepth, unsigned int uBlockSize)
+{
+	URING ring;
+	if (EXIT_SUCCESS != uring_setup(&ring, uDepth)) {
+		static bool bWarned = false;
+		if (!bWarned) {
+			bWarned = true;
+			cerr << "WARNING: io_uring not available, falling back to pread." << endl;
+		}
+		return NULL;
+	}
+
+	URING_READER *r = new URING_READER;
+	memset(r, 0, sizeof(URING_READER));
+	r->ring = ring;
+	r->uDepth = uDepth;
+	r->uBlockSize = uBlockSize;
+	r->pBuffers = new unsigned char[(size_t)uDepth * uBlockSize];
+	r->pllSlotOffset = new unsigned long long[uDepth];
+	r->piSlotResult = new int[uDepth];
+	r->pbSlotDone = new bool[uDepth];
+	return r;
+}
+
+/* queue a read of the next block into slot (does not enter the kernel) */
+static void uring_queue_slot(URING_READER *r, int fd, unsigned int slot)
+{
+	struct io_uring_sqe *sqe = uring_next_sqe(&r->ring);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long)(r->pBuffers + (size_t)slot * r->uBlockSize);
+	sqe->len = r->uBlockSize;
+	sqe->off = r->llNextOffset;
+	sqe->user_data = slot;
+	uring_commit_sqe(&r->ring);
+
+	r->pllSlotOffset[slot] = r->llNextOffset;
+	r->pbSlotDone[slot] = false;
+	r->llNextOffset += r->uBlockSize;
+	r->uInFlight++;
+}
+
+static int uring_submit_and_wait(URING_READER *r, unsigned int toSubmit, unsigned int minComplete)
+{
+	TRACE_SCOPE("wait uring read");
+	return uring_enter(&r->ring, toSubmit, minComplete);
+}
+
+static void uring_reap(URING_READER *r)
+{
+	unsigned long long llSlot;
+	int iResult;
+	while (uring_pop_cqe(&r->ring, llSlot, iResult)) {
+		r->piSlotResult[llSlot] = iResult;
+		r->pbSlotDone[llSlot] = true;
+		r->uInFlight--;
+	}
+}
+
+/* wait for all outstanding reads, e.g. before seeking or closing */
+static void uring_drain(URING_READER *r)
+{
+	while (r->uInFlight > 0) {
+		uring_reap(r);
+		if (r->uInFlight > 0) uring_submit_and_wait(r, 0, 1);
+	}
+}
+
+static void uring_start(URING_READER *r, int fd, unsigned long long llPos, unsigned long long llFileSize)
+{
+	uring_drain(r);
+	r->llNextOffset = llPos;
+	r->uHead = 0;
+	r->uHeadCursor = 0;
+	unsigned int queued = 0;
+	for (unsigned int slot = 0; slot < r->uDepth && r->llNextOffset < llFileSize; slot++, queued++)
+		uring_queue_slot(r, fd, slot);
+	if (queued > 0) uring_submit_and_wait(r, queued, 0);
+	r->bStarted = true;
+}
+
+static long long uring_read(WAV_INPUT *in, unsigned char *dst, size_t n)
+{
+	URING_READER *r = in->pRing;
+	if (!r->bStarted) uring_start(r, in->fd, in->llPos, in->llFileSize);
+
+	size_t done = 0;
+	while (done < n && in->llPos < in->llFileSize) {
+		unsigned int slot = r->uHead;
+		while (!r->pbSlotDone[slot]) {
+			uring_reap(r);
+			if (!r->pbSlotDone[slot] && uring_submit_and_wait(r, 0, 1) < 0) return -1;
+		}
+		int res = r->piSlotResult[slot];
+		if (res < 0) return -1;
+		unsigned char *block = r->pBuffers + (size_t)slot * r->uBlockSize;
+		if ((unsigned int)res < r->uBlockSize && r->pllSlotOffset[slot] + res < in->llFileSize) {
+			// short read in the middle of the file: complete the block synchronously
+			ssize_t more = pread(in->fd, block + res, r->uBlockSize - res, r->pllSlotOffset[slot] + res);
+			if (more < 0) return -1;
+			res += (int)more;
+			r->piSlotResult[slot] = res;
+		}
+
+		size_t avail = res - r->uHeadCursor;
+		size_t chunk = n - done < avail ? n - done : avail;
+		memcpy(dst + done, block + r->uHeadCursor, chunk);
+		done += chunk;
+		r->uHeadCursor += (unsigned int)chunk;
+		in->llPos += chunk;
+
+		if (r->uHeadCursor >= (unsigned int)res) {
+			if (res == 0) break; // end of file
+			// slot consumed: requeue it for the next block and advance
+			if (r->llNextOffset < in->llFileSize) {
+				uring_queue_slot(r, in->fd, slot);
+				uring_submit_and_wait(r, 1, 0);
+			}
+			r->uHead = (r->uHead + 1) % r->uDepth;
+			r->uHeadCursor = 0;
+		}
+	}
+	return (long long)done;
+}
+#else
+struct URING_READER { int unused; };
+#endif
+
+INPUT_RING::~INPUT_RING()
+{
+#ifdef HAVE_IO_URING
+	if (pReader != NULL) uring_destroy(pReader);
+#endif
+}
+
+URING_READER *input_ring_reserve(INPUT_RING *ring, const INPUT_CFG *cfg)
+{
+#ifdef HAVE_IO_URING
+	if (cfg->backend == INPUT_URING && ring->pReader == NULL) {
+		unsigned int depth = cfg->uQueueDepth > 0 ? cfg->uQueueDepth : INPUT_DEFAULT_QUEUE_DEPTH;
+		ring->pReader = uring_create(depth, cfg->uBlockSize > 0 ? cfg->uBlockSize : INPUT_DEFAULT_BLOCK_SIZE);
+	}
+	return cfg->backend == INPUT_URING ? ring->pReader : NULL;
+#else
+	return NULL;
+#endif
+}
+
+/////////////////////
+// generic interface
+/////////////////////
+
+int input_open(WAV_INPUT *in, const char *filename, const INPUT_CFG *cfg)
+{
+	INPUT_CFG defaultCfg;
+	if (cfg == NULL) {
+		input_default_cfg(&defaultCfg);
+		cfg = &defaultCfg;
+	}
+	memset(in, 0, sizeof(WAV_INPUT));
+	in->fd = -1;
+	in->backend = cfg->backend;
+	in->uBlockSize = cfg->uBlockSize > 0 ? cfg->uBlockSize : INPUT_DEFAULT_BLOCK_SIZE;
+
+	if (in->backend == INPUT_STDIO) {
+		in->pFile = fopen(filename, "rb");
+		if (in->pFile == NULL) return EXIT_FAILURE;
+		setvbuf(in->pFile, NULL, _IOFBF, in->uBlockSize);
+#ifdef WIN32
+		_fseeki64(in->pFile, 0, SEEK_END);
+		in->llFileSize = _ftelli64(in->pFile);
+		_fseeki64(in->pFile, 0, SEEK_SET);
+#else
+		fseeko(in->pFile, 0, SEEK_END);
+		in->llFileSize = ftello(in->pFile);
+		fseeko(in->pFile, 0, SEEK_SET);
+#endif
+		return EXIT_SUCCESS;
+	}
+
+#ifndef WIN32
+	in->fd = open(filename, O_RDONLY);
+	if (in->fd < 0) return EXIT_FAILURE;
+	struct stat st;
+	if (fstat(in->fd, &st) != 0) {
+		input_close(in);
+		return EXIT_FAILURE;
+	}
+	in->llFileSize = st.st_size;
+
+	if (in->backend == INPUT_MMAP) {
+		if (in->llFileSize == 0) return EXIT_SUCCESS; // nothing to map
+		void *p = mmap(NULL, in->llFileSize, PROT_READ, MAP_PRIVATE, in->fd, 0);
+		if (p == MAP_FAILED) {
+			input_close(in);
+			return EXIT_FAILURE;
+		}
+		madvise(p, in->llFileSize, MADV_SEQUENTIAL);
+		in->pMap = (unsigned char*)p;
+		return EXIT_SUCCESS;
+	}
+
+#ifdef HAVE_IO_URING
+	if (in->backend == INPUT_URING) {
+		in->bOwnRing = cfg->pRing == NULL;
+		if (in->bOwnRing) {
+			unsigned int depth = cfg->uQueueDepth > 0 ? cfg->uQueueDepth : INPUT_DEFAULT_QUEUE_DEPTH;
+			in->pRing = uring_create(depth, in->uBlockSize);
+		} else {
+			in->pRing = cfg->pRing;
+		}
+		if (in->pRing != NULL) {
+			in->pRing->bStarted = false; // queue reads from the first position read
+			return EXIT_SUCCESS;
+		}
+	}
+#endif
+	in->backend = INPUT_PREAD;
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	in->bOwnBuffer = cfg->pBlockBuffer == NULL;
+	in->pBuffer = in->bOwnBuffer ? new unsigned char[in->uBlockSize] : cfg->pBlockBuffer;
+	return EXIT_SUCCESS;
+#else
+	return EXIT_FAILURE;
+#endif
+}
+
+void input_open_memory(WAV_INPUT *in, const void *pData, size_t uSize)
+{
+	memset(in, 0, sizeof(WAV_INPUT));
+	in->fd = -1;
+	in->backend = INPUT_MEMORY;
+	in->llFileSize = uSize;
+	in->pMap = (unsigned char*)pData; // never written through
+}
+
+void input_open_stream(WAV_INPUT *in, FILE *pFile)
+{
+	memset(in, 0, sizeof(WAV_INPUT));
+	in->fd = -1;
+	in->backend = INPUT_STDIO;
+	in->pFile = pFile;
+	in->bBorrowedFile = true;
+	in->llFileSize = 0xFFFFFFFFFFFFFFFFULL; // unknown
+}
+
+void input_close(WAV_INPUT *in)
+{
+	if (in->pFile != NULL && !in->bBorrowedFile) fclose(in->pFile);
+	in->pFile = NULL;
+#ifndef WIN32
+#ifdef HAVE_IO_URING
+	if (in->pRing != NULL) {
+		uring_drain(in->pRing); // a shared ring must be idle for the next input
+		if (in->bOwnRing) uring_destroy(in->pRing);
+	}
+#endif
+	in->pRing = NULL;
+	in->bOwnRing = false;
+	if (in->pMap != NULL && in->backend == INPUT_MMAP) munmap(in->pMap, in->llFileSize);
+	if (in->fd >= 0) close(in->fd);
+	in->fd = -1;
+#endif
+	in->pMap = NULL;
+	if (in->bOwnBuffer) delete[] in->pBuffer;
+	in->pBuffer = NULL;
+	in->bOwnBuffer = false;
+}
+
+void input_seek(WAV_INPUT *in, unsigned long long llPos)
+{
+	in->llPos = llPos;
+	if (in->backend == INPUT_STDIO) {
+#ifdef WIN32
+		_fseeki64(in->pFile, llPos, SEEK_SET);
+#else
+		fseeko(in->pFile, llPos, SEEK_SET);
+#endif
+	}
+#ifdef HAVE_IO_URING
+	if (in->backend == INPUT_URING) in->pRing->bStarted = false; // requeue from new position on next read
+#endif
+}
+
+long long input_read(WAV_INPUT *in, void *dst, size_t n)
+{
+	unsigned char *out = (unsigned char*)dst;
+	switch (in->backend) {
+	case INPUT_STDIO: {
+		size_t got = fread(out, 1, n, in->pFile);
+		if (got < n && ferror(in->pFile)) return -1;
+		in->llPos += got;
+		return (long long)got;
+	}
+	case INPUT_MMAP:
+	case INPUT_MEMORY: {
+		if (in->llPos >= in->llFileSize) return 0;
+		if (n > in->llFileSize - in->llPos) n = (size_t)(in->llFileSize - in->llPos);
+		memcpy(out, in->pMap + in->llPos, n);
+		in->llPos += n;
+		return (long long)n;
+	}
+#ifndef WIN32
+	case INPUT_PREAD: {
+		size_t done = 0;
+		while (done < n) {
+			if (in->llPos < in->llBufStart || in->llPos >= in->llBufStart + in->uBufLen) {
+				// refill block buffer at the current position
+				ssize_t got = pread(in->fd, in->pBuffer, in->uBlockSize, in->llPos);
+				if (got < 0) return -1;
+				in->llBufStart = in->llPos;
+				in->uBufLen = (unsigned int)got;
+				if (got == 0) break; // end of file
+			}
+			size_t avail = (size_t)(in->llBufStart + in->uBufLen - in->llPos);
+			size_t chunk = n - done < avail ? n - done : avail;
+			memcpy(out + done, in->pBuffer + (in->llPos - in->llBufStart), chunk);
+			done += chunk;
+			in->llPos += chunk;
+		}
+		return (long long)done;
+	}
+#endif
+#ifdef HAVE_IO_URING
+	case INPUT_URING:
+		return uring_read(in, out, n);
+#endif
+	default:
+		return -1;
+	}
+}
+
+long long input_read_at(WAV_INPUT *in, void *dst, size_t n, unsigned long long llOffset)
+{
+	if (llOffset >= in->llFileSize) return 0;
+	if (n > in->llFileSize - llOffset) n = (size_t)(in->llFileSize - llOffset);
+
+	if (in->backend == INPUT_STDIO) {
+		unsigned long long llSavedPos = in->llPos;
+		input_seek(in, llOffset);
+		long long got = input_read(in, dst, n);
+		input_seek(in, llSavedPos);
+		return got;
+	}
+	if (in->backend == INPUT_MMAP || in->backend == INPUT_MEMORY) {
+		memcpy(dst, in->pMap + llOffset, n);
+		return (long long)n;
+	}
+#ifndef WIN32
+	size_t done = 0;
+	while (done < n) {
+		ssize_t got = pread(in->fd, (unsigned char*)dst + done, n - done, llOffset + done);
+		if (got < 0) return -1;
+		if (got == 0) break;
+		done += got;
+	}
+	return (long long)done;
+#else
+	return -1;
+#endif
+}
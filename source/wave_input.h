@@ -0,0 +1,163 @@
+#ifndef __WAVE_INPUT_H_
+#define __WAVE_INPUT_H_
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/////////////////////
+// input backends
+/////////////////////
+
+/* Available input backends. Which one performs best depends on the storage tier:
+ *   INPUT_STDIO  portable buffered FILE* reads (the only backend available on Windows)
+ *   INPUT_PREAD  pread() into a large, configurable buffer; fewest syscalls on NFS
+ *   INPUT_MMAP   mmap() of the whole file with MADV_SEQUENTIAL readahead
+ *   INPUT_URING  io_uring with several block reads queued ahead of the consumer (NVMe)
+ *   INPUT_MEMORY a caller-supplied buffer holding the whole file (input_open_memory, not selectable with -i)
+ */
+typedef enum {
+	INPUT_STDIO = 0,
+	INPUT_PREAD,
+	INPUT_MMAP,
+	INPUT_URING,
+	INPUT_MEMORY
+} INPUT_BACKEND;
+
+#ifdef WIN32
+#define INPUT_DEFAULT_BACKEND INPUT_STDIO
+#else
+#define INPUT_DEFAULT_BACKEND INPUT_PREAD
+#endif
+#define INPUT_DEFAULT_BLOCK_SIZE (1024 * 1024) // bytes per read request
+#define INPUT_DEFAULT_QUEUE_DEPTH 4 // io_uring reads in flight
+
+/* Opaque io_uring reader state (see wave_input.cpp) */
+struct URING_READER;
+
+/* Input configuration which is shared by all workers. */
+typedef struct {
+	INPUT_BACKEND backend;
+	unsigned int uBlockSize; // size of a single read request in bytes (pread, io_uring, stdio buffer)
+	unsigned int uQueueDepth; // number of block reads kept in flight (io_uring only)
+	unsigned char *pBlockBuffer; // optional caller-owned block buffer of uBlockSize bytes (pread only), which
+	                             // lets a thread reuse one buffer for all its inputs; NULL to allocate per input
+	URING_READER *pRing; // optional caller-owned io_uring reader (uring only, see INPUT_RING), which lets a thread
+	                     // reuse one ring for all its inputs; NULL to set one up per input
+} INPUT_CFG;
+
+/* io_uring reader of a thread, set up by input_ring_reserve on first use and closed by the destructor. Only one
+ * input at a time may use it.
+ */
+struct INPUT_RING {
+	URING_READER *pReader;
+
+	INPUT_RING() : pReader(NULL) {}
+	~INPUT_RING();
+
+private:
+	INPUT_RING(const INPUT_RING&); // not copyable
+	INPUT_RING &operator=(const INPUT_RING&);
+};
+
+/* An opened input file. All backends provide sequential reads starting at a position set by
+ * input_seek, as well as positioned reads via input_read_at which don't affect the sequential
+ * position.
+ */
+typedef struct {
+	INPUT_BACKEND backend;
+	unsigned long long llFileSize;
+	unsigned long long llPos; // sequential read position
+	FILE *pFile; // INPUT_STDIO
+	bool bBorrowedFile; // INPUT_STDIO: pFile belongs to the caller (input_open_stream) and is left open
+	int fd; // INPUT_PREAD, INPUT_MMAP, INPUT_URING
+	unsigned char *pBuffer; // INPUT_PREAD: block buffer
+	bool bOwnBuffer; // INPUT_PREAD: pBuffer has been allocated by input_open
+	unsigned long long llBufStart; // INPUT_PREAD: file offset of pBuffer[0]
+	unsigned int uBufLen; // INPUT_PREAD: valid bytes in pBuffer
+	unsigned int uBlockSize;
+	unsigned char *pMap; // INPUT_MMAP: mapping of the whole file, INPUT_MEMORY: the caller's buffer
+	URING_READER *pRing; // INPUT_URING
+	bool bOwnRing; // INPUT_URING: pRing has been set up by input_open
+} WAV_INPUT;
+
+/////////////////////
+// function prototypes
+/////////////////////
+
+/* input_default_cfg
+ *  Fills cfg with the platform default backend, block size and queue depth.
+ */
+void input_default_cfg(INPUT_CFG *cfg);
+
+/* input_backend_from_name
+ *  Parses a backend name ("stdio", "pread", "mmap", "uring") as given on the command line.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE for unknown or unsupported backends
+ */
+int input_backend_from_name(const char *name, INPUT_BACKEND &backend);
+
+/* input_backend_name
+ *  Returns the printable name of a backend.
+ */
+const char *input_backend_name(INPUT_BACKEND backend);
+
+/* input_ring_reserve
+ *  Sets up the io_uring reader of ring for inputs opened with cfg unless that has been done before.
+ *
+ *  Return value:
+ *    reader to be stored in INPUT_CFG::pRing, NULL if cfg doesn't select the uring backend or io_uring is
+ *    unavailable
+ */
+URING_READER *input_ring_reserve(INPUT_RING *ring, const INPUT_CFG *cfg);
+
+/* input_open
+ *  Opens filename for reading with the backend given by cfg (defaults if cfg is NULL).
+ *  If io_uring is unavailable on this kernel, the pread backend is used instead.
+ *
+ *  Return value:
+ *    EXIT_SUCCESS or EXIT_FAILURE
+ */
+int input_open(WAV_INPUT *in, const char *filename, const INPUT_CFG *cfg);
+
+/* input_open_memory
+ *  Opens the uSize bytes at pData as an input. The buffer is not copied and must stay valid (and unchanged) until
+ *  the input is closed.
+ */
+void input_open_memory(WAV_INPUT *in, const void *pData, size_t uSize);
+
+/* input_open_stream
+ *  Opens the stream pFile, e.g. stdin, which may be a pipe, as an input for sequential reads (input_read only).
+ *  The stream is not closed by input_close.
+ */
+void input_open_stream(WAV_INPUT *in, FILE *pFile);
+
+/* input_close
+ *  Closes the file and releases all buffers, mappings and rings (but not the buffer of a memory input or those
+ *  owned by the caller). Safe to call on a closed input.
+ */
+void input_close(WAV_INPUT *in);
+
+/* input_seek
+ *  Sets the position for subsequent sequential reads.
+ */
+void input_seek(WAV_INPUT *in, unsigned long long llPos);
+
+/* input_read
+ *  Sequentially reads up to n bytes into dst and advances the read position.
+ *
+ *  Return value:
+ *    number of bytes read (less than n only at the end of the file), -1 on I/O errors
+ */
+long long input_read(WAV_INPUT *in, void *dst, size_t n);
+
+/* input_read_at
+ *  Reads up to n bytes at file offset llOffset into dst without touching the sequential position.
+ *
+ *  Return value:
+ *    number of bytes read, -1 on I/O errors
+ */
+long long input_read_at(WAV_INPUT *in, void *dst, size_t n, unsigned long long llOffset);
+
+#endif // __WAVE_INPUT_H_